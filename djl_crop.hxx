@@ -5,12 +5,15 @@
 // The list of cameras is not exhaustive by any stretch.
 //
 
+#ifdef _WIN32
 #include <windows.h>
+#include <eh.h>
+#endif
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <limits.h>
 #include <float.h>
-#include <eh.h>
 #include <math.h>
 
 #include <memory>
@@ -29,9 +32,11 @@ class CCropFactor
             const char * pcCamera;
             double       cropFactor;
 
-            CropFactor( const char * camera = 0, double crop = 0.0 ) : pcCamera( camera ), cropFactor( crop ) {}
+            constexpr CropFactor( const char * camera = 0, double crop = 0.0 ) : pcCamera( camera ), cropFactor( crop ) {}
         };
-        
+
+#ifdef GenerateSortedTable // Generate the table, then paste that into Cameras() below
+
         const double width_PhaseOne =       53.9;
         const double height_PhaseOne =      40.4;
         const double width_Fuji_Medium =    43.811610;
@@ -152,9 +157,6 @@ class CCropFactor
 
         CCropFactor()
         {
-
-#ifdef GenerateSortedTable // Generate the table, then paste that into the else section below
-
             // add them all to a vector so they can be sorted.
 
             cameras.push_back( CropFactor( "ADR6410LVW", 7.0 ) );  // just a guess for an HTC droid phone
@@ -441,339 +443,376 @@ class CCropFactor
 
             qsort( cameras.data(), cameras.size(), sizeof( CropFactor ), CameraEntryCompare );
 
-            printf( "            cameras.resize( %Iu );\n", cameras.size() );
+            for ( size_t i = 0; i < cameras.size(); i++ )
+                printf( "            { \"%s\", %lf },\n", cameras[i].pcCamera, cameras[i].cropFactor );
 
-            for ( int i = 0; i < cameras.size(); i++ )
-                printf( "            cameras[%d].pcCamera = \"%s\"; cameras[%d].cropFactor = %lf;\n", i, cameras[i].pcCamera, i, cameras[i].cropFactor );
-
-            for ( int i = 0; i < ( cameras.size() - 1 ); i++ )
+            for ( size_t i = 0; i < ( cameras.size() - 1 ); i++ )
             {
                 int c = strcmp( cameras[i].pcCamera, cameras[i+1].pcCamera );
                 if ( c >= 0 )
                     printf( "bad crop entries %s, %s\n", cameras[i].pcCamera, cameras[i+1].pcCamera );
                 assert( c < 0 );
             }
-        
-#else // the part below is generated by the code above; don't edit manually
-
-            cameras.resize( 281 );
-            cameras[0].pcCamera = "ADR6410LVW"; cameras[0].cropFactor = 7.000000;
-            cameras[1].pcCamera = "AE-1"; cameras[1].cropFactor = 1.000000;
-            cameras[2].pcCamera = "C3000Z"; cameras[2].cropFactor = 7.000000;
-            cameras[3].pcCamera = "C5060WZ"; cameras[3].cropFactor = 4.845086;
-            cameras[4].pcCamera = "C6902"; cameras[4].cropFactor = 5.600000;
-            cameras[5].pcCamera = "COOLPIX P7100"; cameras[5].cropFactor = 4.652324;
-            cameras[6].pcCamera = "CYBERSHOT"; cameras[6].cropFactor = 7.000000;
-            cameras[7].pcCamera = "CanoScan 8800F"; cameras[7].cropFactor = 1.000000;
-            cameras[8].pcCamera = "Canon EOS 10D"; cameras[8].cropFactor = 1.621622;
-            cameras[9].pcCamera = "Canon EOS 1300D"; cameras[9].cropFactor = 1.621622;
-            cameras[10].pcCamera = "Canon EOS 20D"; cameras[10].cropFactor = 1.621622;
-            cameras[11].pcCamera = "Canon EOS 30D"; cameras[11].cropFactor = 1.621622;
-            cameras[12].pcCamera = "Canon EOS 40D"; cameras[12].cropFactor = 1.621622;
-            cameras[13].pcCamera = "Canon EOS 50D"; cameras[13].cropFactor = 1.621622;
-            cameras[14].pcCamera = "Canon EOS 5D"; cameras[14].cropFactor = 1.000000;
-            cameras[15].pcCamera = "Canon EOS 5D Mark II"; cameras[15].cropFactor = 1.000000;
-            cameras[16].pcCamera = "Canon EOS 5D Mark III"; cameras[16].cropFactor = 1.000000;
-            cameras[17].pcCamera = "Canon EOS 5D Mark IV"; cameras[17].cropFactor = 1.000000;
-            cameras[18].pcCamera = "Canon EOS 5DS"; cameras[18].cropFactor = 1.000000;
-            cameras[19].pcCamera = "Canon EOS 5DS R"; cameras[19].cropFactor = 1.000000;
-            cameras[20].pcCamera = "Canon EOS 60D"; cameras[20].cropFactor = 1.621622;
-            cameras[21].pcCamera = "Canon EOS 6D"; cameras[21].cropFactor = 1.000000;
-            cameras[22].pcCamera = "Canon EOS 6D Mark II"; cameras[22].cropFactor = 1.000000;
-            cameras[23].pcCamera = "Canon EOS 700D"; cameras[23].cropFactor = 1.621622;
-            cameras[24].pcCamera = "Canon EOS 70D"; cameras[24].cropFactor = 1.621622;
-            cameras[25].pcCamera = "Canon EOS 77D"; cameras[25].cropFactor = 1.621622;
-            cameras[26].pcCamera = "Canon EOS 7D"; cameras[26].cropFactor = 1.621622;
-            cameras[27].pcCamera = "Canon EOS 7D Mark II"; cameras[27].cropFactor = 1.621622;
-            cameras[28].pcCamera = "Canon EOS 80D"; cameras[28].cropFactor = 1.621622;
-            cameras[29].pcCamera = "Canon EOS 90D"; cameras[29].cropFactor = 1.621622;
-            cameras[30].pcCamera = "Canon EOS D30"; cameras[30].cropFactor = 1.621622;
-            cameras[31].pcCamera = "Canon EOS D60"; cameras[31].cropFactor = 1.621622;
-            cameras[32].pcCamera = "Canon EOS DIGITAL REBEL"; cameras[32].cropFactor = 1.621622;
-            cameras[33].pcCamera = "Canon EOS DIGITAL REBEL XT"; cameras[33].cropFactor = 1.621622;
-            cameras[34].pcCamera = "Canon EOS M"; cameras[34].cropFactor = 1.621622;
-            cameras[35].pcCamera = "Canon EOS M100"; cameras[35].cropFactor = 1.621622;
-            cameras[36].pcCamera = "Canon EOS M2"; cameras[36].cropFactor = 1.621622;
-            cameras[37].pcCamera = "Canon EOS M3"; cameras[37].cropFactor = 1.621622;
-            cameras[38].pcCamera = "Canon EOS M5"; cameras[38].cropFactor = 1.621622;
-            cameras[39].pcCamera = "Canon EOS M50"; cameras[39].cropFactor = 1.621622;
-            cameras[40].pcCamera = "Canon EOS M6"; cameras[40].cropFactor = 1.621622;
-            cameras[41].pcCamera = "Canon EOS M6 Mark II"; cameras[41].cropFactor = 1.621622;
-            cameras[42].pcCamera = "Canon EOS R5"; cameras[42].cropFactor = 1.000000;
-            cameras[43].pcCamera = "Canon EOS REBEL T2i"; cameras[43].cropFactor = 1.621622;
-            cameras[44].pcCamera = "Canon EOS REBEL T3"; cameras[44].cropFactor = 1.621622;
-            cameras[45].pcCamera = "Canon EOS REBEL T3i"; cameras[45].cropFactor = 1.621622;
-            cameras[46].pcCamera = "Canon EOS REBEL T4i"; cameras[46].cropFactor = 1.621622;
-            cameras[47].pcCamera = "Canon EOS REBEL T5"; cameras[47].cropFactor = 1.621622;
-            cameras[48].pcCamera = "Canon EOS REBEL T6"; cameras[48].cropFactor = 1.621622;
-            cameras[49].pcCamera = "Canon EOS RP"; cameras[49].cropFactor = 1.000000;
-            cameras[50].pcCamera = "Canon EOS Rebel T6"; cameras[50].cropFactor = 1.621622;
-            cameras[51].pcCamera = "Canon EOS-1D"; cameras[51].cropFactor = 1.255028;
-            cameras[52].pcCamera = "Canon EOS-1D Mark II"; cameras[52].cropFactor = 1.255028;
-            cameras[53].pcCamera = "Canon EOS-1D Mark II N"; cameras[53].cropFactor = 1.255028;
-            cameras[54].pcCamera = "Canon EOS-1D Mark III"; cameras[54].cropFactor = 1.255028;
-            cameras[55].pcCamera = "Canon EOS-1D Mark IV"; cameras[55].cropFactor = 1.255028;
-            cameras[56].pcCamera = "Canon EOS-1D X"; cameras[56].cropFactor = 1.000000;
-            cameras[57].pcCamera = "Canon EOS-1DS"; cameras[57].cropFactor = 1.000000;
-            cameras[58].pcCamera = "Canon EOS-1Ds Mark II"; cameras[58].cropFactor = 1.000000;
-            cameras[59].pcCamera = "Canon EOS-1Ds Mark III"; cameras[59].cropFactor = 1.000000;
-            cameras[60].pcCamera = "Canon EOS-1Ds Mark IV"; cameras[60].cropFactor = 1.000000;
-            cameras[61].pcCamera = "Canon PowerShot A20"; cameras[61].cropFactor = 5.643778;
-            cameras[62].pcCamera = "Canon PowerShot A430"; cameras[62].cropFactor = 7.211103;
-            cameras[63].pcCamera = "Canon PowerShot A520"; cameras[63].cropFactor = 4.845086;
-            cameras[64].pcCamera = "Canon PowerShot A60"; cameras[64].cropFactor = 6.516057;
-            cameras[65].pcCamera = "Canon PowerShot A610"; cameras[65].cropFactor = 4.845086;
-            cameras[66].pcCamera = "Canon PowerShot A620"; cameras[66].cropFactor = 4.845086;
-            cameras[67].pcCamera = "Canon PowerShot A80"; cameras[67].cropFactor = 4.845086;
-            cameras[68].pcCamera = "Canon PowerShot A85"; cameras[68].cropFactor = 6.516057;
-            cameras[69].pcCamera = "Canon PowerShot G5"; cameras[69].cropFactor = 4.845086;
-            cameras[70].pcCamera = "Canon PowerShot G5 X Mark II"; cameras[70].cropFactor = 2.727273;
-            cameras[71].pcCamera = "Canon PowerShot G7 X"; cameras[71].cropFactor = 2.727273;
-            cameras[72].pcCamera = "Canon PowerShot G7 X Mark II"; cameras[72].cropFactor = 2.727273;
-            cameras[73].pcCamera = "Canon PowerShot G9"; cameras[73].cropFactor = 4.652324;
-            cameras[74].pcCamera = "Canon PowerShot G9 X Mark II"; cameras[74].cropFactor = 2.727273;
-            cameras[75].pcCamera = "Canon PowerShot S100"; cameras[75].cropFactor = 4.652324;
-            cameras[76].pcCamera = "Canon PowerShot S2 IS"; cameras[76].cropFactor = 6.015934;
-            cameras[77].pcCamera = "Canon PowerShot S200"; cameras[77].cropFactor = 4.652324;
-            cameras[78].pcCamera = "Canon PowerShot S70"; cameras[78].cropFactor = 4.845086;
-            cameras[79].pcCamera = "Canon PowerShot S95"; cameras[79].cropFactor = 4.652324;
-            cameras[80].pcCamera = "Canon PowerShot SD10"; cameras[80].cropFactor = 6.025991;
-            cameras[81].pcCamera = "Canon PowerShot SD1100 IS"; cameras[81].cropFactor = 6.015934;
-            cameras[82].pcCamera = "Canon PowerShot SD450"; cameras[82].cropFactor = 6.015934;
-            cameras[83].pcCamera = "Canon PowerShot SD550"; cameras[83].cropFactor = 4.845086;
-            cameras[84].pcCamera = "Canon PowerShot SD780 IS"; cameras[84].cropFactor = 5.643778;
-            cameras[85].pcCamera = "Canon PowerShot SD790 IS"; cameras[85].cropFactor = 5.643778;
-            cameras[86].pcCamera = "Canon PowerShot SX110 IS"; cameras[86].cropFactor = 6.015934;
-            cameras[87].pcCamera = "Canon PowerShot SX530 HS"; cameras[87].cropFactor = 5.643778;
-            cameras[88].pcCamera = "Canon PowerShot SX600 HS"; cameras[88].cropFactor = 5.643778;
-            cameras[89].pcCamera = "Canon VIXIA HF10"; cameras[89].cropFactor = 7.611984;
-            cameras[90].pcCamera = "DC-S1R"; cameras[90].cropFactor = 1.000000;
-            cameras[91].pcCamera = "DC-ZS200"; cameras[91].cropFactor = 2.727273;
-            cameras[92].pcCamera = "DC210 Zoom (V03.10)"; cameras[92].cropFactor = 6.591501;
-            cameras[93].pcCamera = "DCR-TRV30"; cameras[93].cropFactor = 10.816654;
-            cameras[94].pcCamera = "DMC-CM1"; cameras[94].cropFactor = 2.727273;
-            cameras[95].pcCamera = "DMC-FS3"; cameras[95].cropFactor = 6.025991;
-            cameras[96].pcCamera = "DMC-FX8"; cameras[96].cropFactor = 6.025991;
-            cameras[97].pcCamera = "DMC-FZ5"; cameras[97].cropFactor = 6.015934;
-            cameras[98].pcCamera = "DMC-G3"; cameras[98].cropFactor = 1.999381;
-            cameras[99].pcCamera = "DMC-GF1"; cameras[99].cropFactor = 1.999381;
-            cameras[100].pcCamera = "DMC-GF2"; cameras[100].cropFactor = 1.999381;
-            cameras[101].pcCamera = "DMC-GM1"; cameras[101].cropFactor = 1.999381;
-            cameras[102].pcCamera = "DMC-GX7"; cameras[102].cropFactor = 1.999381;
-            cameras[103].pcCamera = "DMC-LX100"; cameras[103].cropFactor = 1.999381;
-            cameras[104].pcCamera = "DMC-TS2"; cameras[104].cropFactor = 5.692976;
-            cameras[105].pcCamera = "DMC-TS3"; cameras[105].cropFactor = 5.692976;
-            cameras[106].pcCamera = "DMC-ZS1"; cameras[106].cropFactor = 6.025991;
-            cameras[107].pcCamera = "DMC-ZS100"; cameras[107].cropFactor = 2.727273;
-            cameras[108].pcCamera = "DMC-ZS7"; cameras[108].cropFactor = 5.692976;
-            cameras[109].pcCamera = "DSC-N1"; cameras[109].cropFactor = 4.845086;
-            cameras[110].pcCamera = "DSC-P52"; cameras[110].cropFactor = 6.516057;
-            cameras[111].pcCamera = "DSC-RX1"; cameras[111].cropFactor = 1.000000;
-            cameras[112].pcCamera = "DSC-RX100"; cameras[112].cropFactor = 2.727273;
-            cameras[113].pcCamera = "DSC-W120"; cameras[113].cropFactor = 6.015934;
-            cameras[114].pcCamera = "DSC-W560"; cameras[114].cropFactor = 5.600000;
-            cameras[115].pcCamera = "DSC-W80"; cameras[115].cropFactor = 6.025991;
-            cameras[116].pcCamera = "DSC-W800"; cameras[116].cropFactor = 5.643778;
-            cameras[117].pcCamera = "DSC-WX1"; cameras[117].cropFactor = 5.623000;
-            cameras[118].pcCamera = "DSC-WX300"; cameras[118].cropFactor = 5.643778;
-            cameras[119].pcCamera = "DV 5700"; cameras[119].cropFactor = 7.000000;
-            cameras[120].pcCamera = "DiMAGE 7"; cameras[120].cropFactor = 3.900000;
-            cameras[121].pcCamera = "Digital Link"; cameras[121].cropFactor = 1.000000;
-            cameras[122].pcCamera = "E-M10MarkII"; cameras[122].cropFactor = 1.999381;
-            cameras[123].pcCamera = "E-PM2"; cameras[123].cropFactor = 1.999381;
-            cameras[124].pcCamera = "E3100"; cameras[124].cropFactor = 6.516057;
-            cameras[125].pcCamera = "E5200"; cameras[125].cropFactor = 4.845086;
-            cameras[126].pcCamera = "E5400"; cameras[126].cropFactor = 4.845086;
-            cameras[127].pcCamera = "E6653"; cameras[127].cropFactor = 5.600000;
-            cameras[128].pcCamera = "E990"; cameras[128].cropFactor = 4.845086;
-            cameras[129].pcCamera = "EOS 5D Mark II"; cameras[129].cropFactor = 1.000000;
-            cameras[130].pcCamera = "EX1"; cameras[130].cropFactor = 5.748494;
-            cameras[131].pcCamera = "Electro 35 GSN"; cameras[131].cropFactor = 1.000000;
-            cameras[132].pcCamera = "Epson Stylus NX420"; cameras[132].cropFactor = 1.000000;
-            cameras[133].pcCamera = "FinePix F900EXR"; cameras[133].cropFactor = 5.326000;
-            cameras[134].pcCamera = "FinePix S3Pro"; cameras[134].cropFactor = 1.529400;
-            cameras[135].pcCamera = "FinePix4900ZOOM"; cameras[135].cropFactor = 4.652324;
-            cameras[136].pcCamera = "FinePixS2Pro"; cameras[136].cropFactor = 1.529400;
-            cameras[137].pcCamera = "FrontRow Wear"; cameras[137].cropFactor = 5.080000;
-            cameras[138].pcCamera = "G8141"; cameras[138].cropFactor = 5.643778;
-            cameras[139].pcCamera = "GFX 100"; cameras[139].cropFactor = 0.790048;
-            cameras[140].pcCamera = "GFX 50R"; cameras[140].cropFactor = 0.790048;
-            cameras[141].pcCamera = "GFX 50S"; cameras[141].cropFactor = 0.790048;
-            cameras[142].pcCamera = "GFX100S"; cameras[142].cropFactor = 0.790048;
-            cameras[143].pcCamera = "GR II"; cameras[143].cropFactor = 1.529400;
-            cameras[144].pcCamera = "H1A1000"; cameras[144].cropFactor = 7.000000;
-            cameras[145].pcCamera = "H8166"; cameras[145].cropFactor = 5.692976;
-            cameras[146].pcCamera = "HD7"; cameras[146].cropFactor = 5.692976;
-            cameras[147].pcCamera = "HDR-SR1"; cameras[147].cropFactor = 7.211103;
-            cameras[148].pcCamera = "HERO6 Black"; cameras[148].cropFactor = 5.643778;
-            cameras[149].pcCamera = "HP PhotoSmart C945 (V01.60)"; cameras[149].cropFactor = 1.000000;
-            cameras[150].pcCamera = "HP Scanjet 4800"; cameras[150].cropFactor = 1.000000;
-            cameras[151].pcCamera = "HTC Touch Diamond P370"; cameras[151].cropFactor = 10.000000;
-            cameras[152].pcCamera = "HTC Touch Diamond P3700"; cameras[152].cropFactor = 10.000000;
-            cameras[153].pcCamera = "HTC-8900"; cameras[153].cropFactor = 7.680000;
-            cameras[154].pcCamera = "Hewlett-Packard PSC 750 Scanner"; cameras[154].cropFactor = 1.000000;
-            cameras[155].pcCamera = "ILCE-7"; cameras[155].cropFactor = 1.000000;
-            cameras[156].pcCamera = "ILCE-7M3"; cameras[156].cropFactor = 1.000000;
-            cameras[157].pcCamera = "ILCE-7RM2"; cameras[157].cropFactor = 1.000000;
-            cameras[158].pcCamera = "ILCE-7S"; cameras[158].cropFactor = 1.000000;
-            cameras[159].pcCamera = "KODAK DC240 ZOOM DIGITAL CAMERA"; cameras[159].cropFactor = 6.591501;
-            cameras[160].pcCamera = "KODAK EASYSHARE V1003 ZOOM DIGITAL CAMERA"; cameras[160].cropFactor = 4.845086;
-            cameras[161].pcCamera = "KODAK V530 ZOOM DIGITAL CAMERA"; cameras[161].cropFactor = 4.241825;
-            cameras[162].pcCamera = "Kodak CLAS Digital Film Scanner / HR200"; cameras[162].cropFactor = 1.000000;
-            cameras[163].pcCamera = "L16"; cameras[163].cropFactor = 1.000000;
-            cameras[164].pcCamera = "LEICA M MONOCHROM (Typ 246)"; cameras[164].cropFactor = 1.000000;
-            cameras[165].pcCamera = "LEICA M10"; cameras[165].cropFactor = 1.000000;
-            cameras[166].pcCamera = "LEICA Q (Typ 116)"; cameras[166].cropFactor = 1.000000;
-            cameras[167].pcCamera = "LEICA Q2"; cameras[167].cropFactor = 1.000000;
-            cameras[168].pcCamera = "LEICA Q2 MONO"; cameras[168].cropFactor = 1.000000;
-            cameras[169].pcCamera = "LEICA SL (Typ 601)"; cameras[169].cropFactor = 1.000000;
-            cameras[170].pcCamera = "LEICA SL2-S"; cameras[170].cropFactor = 1.000000;
-            cameras[171].pcCamera = "LEICA X-U (Typ 113)"; cameras[171].cropFactor = 1.529400;
-            cameras[172].pcCamera = "LS-5000"; cameras[172].cropFactor = 1.000000;
-            cameras[173].pcCamera = "LS-9000"; cameras[173].cropFactor = 1.000000;
-            cameras[174].pcCamera = "Lumia 1020"; cameras[174].cropFactor = 4.113183;
-            cameras[175].pcCamera = "Lumia 520"; cameras[175].cropFactor = 7.680000;
-            cameras[176].pcCamera = "Lumia 830"; cameras[176].cropFactor = 7.680000;
-            cameras[177].pcCamera = "Lumia 920"; cameras[177].cropFactor = 7.680000;
-            cameras[178].pcCamera = "Lumia 950"; cameras[178].cropFactor = 5.623000;
-            cameras[179].pcCamera = "Lumia 950 XL"; cameras[179].cropFactor = 5.623000;
-            cameras[180].pcCamera = "MHS-PM1"; cameras[180].cropFactor = 6.015934;
-            cameras[181].pcCamera = "MX880 series"; cameras[181].cropFactor = 1.000000;
-            cameras[182].pcCamera = "NEX-3N"; cameras[182].cropFactor = 1.529400;
-            cameras[183].pcCamera = "NEX-5N"; cameras[183].cropFactor = 1.529400;
-            cameras[184].pcCamera = "NIKON D100"; cameras[184].cropFactor = 1.527854;
-            cameras[185].pcCamera = "NIKON D300"; cameras[185].cropFactor = 1.527854;
-            cameras[186].pcCamera = "NIKON D3100"; cameras[186].cropFactor = 1.527854;
-            cameras[187].pcCamera = "NIKON D3400"; cameras[187].cropFactor = 1.527854;
-            cameras[188].pcCamera = "NIKON D4"; cameras[188].cropFactor = 1.000000;
-            cameras[189].pcCamera = "NIKON D40"; cameras[189].cropFactor = 1.527854;
-            cameras[190].pcCamera = "NIKON D5100"; cameras[190].cropFactor = 1.527854;
-            cameras[191].pcCamera = "NIKON D5200"; cameras[191].cropFactor = 1.527854;
-            cameras[192].pcCamera = "NIKON D600"; cameras[192].cropFactor = 1.000000;
-            cameras[193].pcCamera = "NIKON D610"; cameras[193].cropFactor = 1.000000;
-            cameras[194].pcCamera = "NIKON D70"; cameras[194].cropFactor = 1.527854;
-            cameras[195].pcCamera = "NIKON D700"; cameras[195].cropFactor = 1.000000;
-            cameras[196].pcCamera = "NIKON D70s"; cameras[196].cropFactor = 1.527854;
-            cameras[197].pcCamera = "NIKON D80"; cameras[197].cropFactor = 1.527854;
-            cameras[198].pcCamera = "NIKON D800"; cameras[198].cropFactor = 1.000000;
-            cameras[199].pcCamera = "NIKON D810"; cameras[199].cropFactor = 1.000000;
-            cameras[200].pcCamera = "NIKON Z 6"; cameras[200].cropFactor = 1.000000;
-            cameras[201].pcCamera = "NIKON Z 7_2"; cameras[201].cropFactor = 1.000000;
-            cameras[202].pcCamera = "Nexus 7"; cameras[202].cropFactor = 9.440000;
-            cameras[203].pcCamera = "Nexus 9"; cameras[203].cropFactor = 10.816654;
-            cameras[204].pcCamera = "Nikon SUPER COOLSCAN 5000 ED"; cameras[204].cropFactor = 1.000000;
-            cameras[205].pcCamera = "OpticFilm 8100"; cameras[205].cropFactor = 1.000000;
-            cameras[206].pcCamera = "P 65+"; cameras[206].cropFactor = 0.642319;
-            cameras[207].pcCamera = "PENTAX K-3 Mark III"; cameras[207].cropFactor = 1.529400;
-            cameras[208].pcCamera = "PENTAX K-r"; cameras[208].cropFactor = 1.529400;
-            cameras[209].pcCamera = "PENTAX K10D"; cameras[209].cropFactor = 1.529400;
-            cameras[210].pcCamera = "PM23300"; cameras[210].cropFactor = 7.680000;
-            cameras[211].pcCamera = "Panasonic DMC-GF2"; cameras[211].cropFactor = 1.999381;
-            cameras[212].pcCamera = "Perfection V30/V300"; cameras[212].cropFactor = 1.000000;
-            cameras[213].pcCamera = "Perfection V39"; cameras[213].cropFactor = 1.000000;
-            cameras[214].pcCamera = "PowerShot S95"; cameras[214].cropFactor = 4.652324;
-            cameras[215].pcCamera = "QCAM-AA"; cameras[215].cropFactor = 7.680000;
-            cameras[216].pcCamera = "QSS-32_33"; cameras[216].cropFactor = 1.000000;
-            cameras[217].pcCamera = "RICOH GR III"; cameras[217].cropFactor = 1.529400;
-            cameras[218].pcCamera = "RICOH GR IIIx"; cameras[218].cropFactor = 1.529400;
-            cameras[219].pcCamera = "RICOH THETA S"; cameras[219].cropFactor = 5.615385;
-            cameras[220].pcCamera = "RICOH THETA Z1"; cameras[220].cropFactor = 5.615385;
-            cameras[221].pcCamera = "SGH-I917"; cameras[221].cropFactor = 7.680000;
-            cameras[222].pcCamera = "SGH-i937"; cameras[222].cropFactor = 7.680000;
-            cameras[223].pcCamera = "SIGMA fp L"; cameras[223].cropFactor = 1.000000;
-            cameras[224].pcCamera = "SM-G930F"; cameras[224].cropFactor = 9.614803;
-            cameras[225].pcCamera = "SM-G965U1"; cameras[225].cropFactor = 9.614803;
-            cameras[226].pcCamera = "SM-G975F"; cameras[226].cropFactor = 9.614803;
-            cameras[227].pcCamera = "SM-T700"; cameras[227].cropFactor = 9.614803;
-            cameras[228].pcCamera = "SM-T713"; cameras[228].cropFactor = 9.614803;
-            cameras[229].pcCamera = "SPH-L710"; cameras[229].cropFactor = 7.680000;
-            cameras[230].pcCamera = "ScanJet 8200"; cameras[230].cropFactor = 1.000000;
-            cameras[231].pcCamera = "Sinarback eVolution 75, Sinar p3 / f3"; cameras[231].cropFactor = 1.000000;
-            cameras[232].pcCamera = "TS3100 series"; cameras[232].cropFactor = 1.000000;
-            cameras[233].pcCamera = "USB 2.0 Camera"; cameras[233].cropFactor = 7.000000;
-            cameras[234].pcCamera = "VAIO Camera Capture Utility"; cameras[234].cropFactor = 1.000000;
-            cameras[235].pcCamera = "X-A7"; cameras[235].cropFactor = 1.529400;
-            cameras[236].pcCamera = "X-E3"; cameras[236].cropFactor = 1.529400;
-            cameras[237].pcCamera = "X-M1"; cameras[237].cropFactor = 1.529400;
-            cameras[238].pcCamera = "X-Pro1"; cameras[238].cropFactor = 1.529400;
-            cameras[239].pcCamera = "X-Pro2"; cameras[239].cropFactor = 1.529400;
-            cameras[240].pcCamera = "X-S10"; cameras[240].cropFactor = 1.529400;
-            cameras[241].pcCamera = "X-T2"; cameras[241].cropFactor = 1.529400;
-            cameras[242].pcCamera = "X-U (Typ 113)"; cameras[242].cropFactor = 1.529400;
-            cameras[243].pcCamera = "X100F"; cameras[243].cropFactor = 1.529400;
-            cameras[244].pcCamera = "X100S"; cameras[244].cropFactor = 1.529400;
-            cameras[245].pcCamera = "X100T"; cameras[245].cropFactor = 1.529400;
-            cameras[246].pcCamera = "X100V"; cameras[246].cropFactor = 1.529400;
-            cameras[247].pcCamera = "X1D II 50C"; cameras[247].cropFactor = 0.790048;
-            cameras[248].pcCamera = "XP-420"; cameras[248].cropFactor = 1.000000;
-            cameras[249].pcCamera = "XP-420 Series"; cameras[249].cropFactor = 1.000000;
-            cameras[250].pcCamera = "XZ-1"; cameras[250].cropFactor = 4.414995;
-            cameras[251].pcCamera = "ZN5"; cameras[251].cropFactor = 7.000000;
-            cameras[252].pcCamera = "iPAQ rx3000"; cameras[252].cropFactor = 9.000000;
-            cameras[253].pcCamera = "iPad (6th generation)"; cameras[253].cropFactor = 7.611984;
-            cameras[254].pcCamera = "iPad mini (5th generation)"; cameras[254].cropFactor = 7.611984;
-            cameras[255].pcCamera = "iPad mini 2"; cameras[255].cropFactor = 7.611984;
-            cameras[256].pcCamera = "iPhone"; cameras[256].cropFactor = 7.611984;
-            cameras[257].pcCamera = "iPhone 11"; cameras[257].cropFactor = 7.000000;
-            cameras[258].pcCamera = "iPhone 11 Pro"; cameras[258].cropFactor = 7.000000;
-            cameras[259].pcCamera = "iPhone 12"; cameras[259].cropFactor = 7.000000;
-            cameras[260].pcCamera = "iPhone 12 Pro"; cameras[260].cropFactor = 7.000000;
-            cameras[261].pcCamera = "iPhone 12 Pro Max"; cameras[261].cropFactor = 7.000000;
-            cameras[262].pcCamera = "iPhone 3"; cameras[262].cropFactor = 7.611984;
-            cameras[263].pcCamera = "iPhone 3G"; cameras[263].cropFactor = 7.611984;
-            cameras[264].pcCamera = "iPhone 3GS"; cameras[264].cropFactor = 7.611984;
-            cameras[265].pcCamera = "iPhone 4"; cameras[265].cropFactor = 7.611984;
-            cameras[266].pcCamera = "iPhone 4S"; cameras[266].cropFactor = 7.611984;
-            cameras[267].pcCamera = "iPhone 5"; cameras[267].cropFactor = 7.611984;
-            cameras[268].pcCamera = "iPhone 5s"; cameras[268].cropFactor = 7.611984;
-            cameras[269].pcCamera = "iPhone 6"; cameras[269].cropFactor = 7.611984;
-            cameras[270].pcCamera = "iPhone 6s"; cameras[270].cropFactor = 7.611984;
-            cameras[271].pcCamera = "iPhone 7"; cameras[271].cropFactor = 7.611984;
-            cameras[272].pcCamera = "iPhone 8"; cameras[272].cropFactor = 7.611984;
-            cameras[273].pcCamera = "iPhone 8 Plus"; cameras[273].cropFactor = 7.611984;
-            cameras[274].pcCamera = "iPhone X"; cameras[274].cropFactor = 7.611984;
-            cameras[275].pcCamera = "iPhone XR"; cameras[275].cropFactor = 7.611984;
-            cameras[276].pcCamera = "iPhone XS"; cameras[276].cropFactor = 7.611984;
-            cameras[277].pcCamera = "iPhone XS Max"; cameras[277].cropFactor = 7.611984;
-            cameras[278].pcCamera = "iPod touch"; cameras[278].cropFactor = 7.611984;
-            cameras[279].pcCamera = "id313"; cameras[279].cropFactor = 5.692976;
-            cameras[280].pcCamera = "u1030SW,S1030SW"; cameras[280].cropFactor = 5.692976;
+        } //CCropFactor
 
-#endif
+#endif // GenerateSortedTable
 
-            //tracer.Trace( "initialized CropFactor object\n" );
-        } //CCropFactor
-    
-        double GetCropFactor( char * pcCameraModel )
+    private:
+
+        // Sorted by strcmp. Generated by the code above; don't edit manually.
+        // It's constant-initialized, so no CCropFactor instance or lookup ever builds it at runtime.
+
+        static const CropFactor * Cameras( size_t & count )
+        {
+            static constexpr CropFactor cameras[] =
+            {
+            { "ADR6410LVW", 7.000000 },
+            { "AE-1", 1.000000 },
+            { "C3000Z", 7.000000 },
+            { "C5060WZ", 4.845086 },
+            { "C6902", 5.600000 },
+            { "COOLPIX P7100", 4.652324 },
+            { "CYBERSHOT", 7.000000 },
+            { "CanoScan 8800F", 1.000000 },
+            { "Canon EOS 10D", 1.621622 },
+            { "Canon EOS 1300D", 1.621622 },
+            { "Canon EOS 20D", 1.621622 },
+            { "Canon EOS 30D", 1.621622 },
+            { "Canon EOS 40D", 1.621622 },
+            { "Canon EOS 50D", 1.621622 },
+            { "Canon EOS 5D", 1.000000 },
+            { "Canon EOS 5D Mark II", 1.000000 },
+            { "Canon EOS 5D Mark III", 1.000000 },
+            { "Canon EOS 5D Mark IV", 1.000000 },
+            { "Canon EOS 5DS", 1.000000 },
+            { "Canon EOS 5DS R", 1.000000 },
+            { "Canon EOS 60D", 1.621622 },
+            { "Canon EOS 6D", 1.000000 },
+            { "Canon EOS 6D Mark II", 1.000000 },
+            { "Canon EOS 700D", 1.621622 },
+            { "Canon EOS 70D", 1.621622 },
+            { "Canon EOS 77D", 1.621622 },
+            { "Canon EOS 7D", 1.621622 },
+            { "Canon EOS 7D Mark II", 1.621622 },
+            { "Canon EOS 80D", 1.621622 },
+            { "Canon EOS 90D", 1.621622 },
+            { "Canon EOS D30", 1.621622 },
+            { "Canon EOS D60", 1.621622 },
+            { "Canon EOS DIGITAL REBEL", 1.621622 },
+            { "Canon EOS DIGITAL REBEL XT", 1.621622 },
+            { "Canon EOS M", 1.621622 },
+            { "Canon EOS M100", 1.621622 },
+            { "Canon EOS M2", 1.621622 },
+            { "Canon EOS M3", 1.621622 },
+            { "Canon EOS M5", 1.621622 },
+            { "Canon EOS M50", 1.621622 },
+            { "Canon EOS M6", 1.621622 },
+            { "Canon EOS M6 Mark II", 1.621622 },
+            { "Canon EOS R5", 1.000000 },
+            { "Canon EOS REBEL T2i", 1.621622 },
+            { "Canon EOS REBEL T3", 1.621622 },
+            { "Canon EOS REBEL T3i", 1.621622 },
+            { "Canon EOS REBEL T4i", 1.621622 },
+            { "Canon EOS REBEL T5", 1.621622 },
+            { "Canon EOS REBEL T6", 1.621622 },
+            { "Canon EOS RP", 1.000000 },
+            { "Canon EOS Rebel T6", 1.621622 },
+            { "Canon EOS-1D", 1.255028 },
+            { "Canon EOS-1D Mark II", 1.255028 },
+            { "Canon EOS-1D Mark II N", 1.255028 },
+            { "Canon EOS-1D Mark III", 1.255028 },
+            { "Canon EOS-1D Mark IV", 1.255028 },
+            { "Canon EOS-1D X", 1.000000 },
+            { "Canon EOS-1DS", 1.000000 },
+            { "Canon EOS-1Ds Mark II", 1.000000 },
+            { "Canon EOS-1Ds Mark III", 1.000000 },
+            { "Canon EOS-1Ds Mark IV", 1.000000 },
+            { "Canon PowerShot A20", 5.643778 },
+            { "Canon PowerShot A430", 7.211103 },
+            { "Canon PowerShot A520", 4.845086 },
+            { "Canon PowerShot A60", 6.516057 },
+            { "Canon PowerShot A610", 4.845086 },
+            { "Canon PowerShot A620", 4.845086 },
+            { "Canon PowerShot A80", 4.845086 },
+            { "Canon PowerShot A85", 6.516057 },
+            { "Canon PowerShot G5", 4.845086 },
+            { "Canon PowerShot G5 X Mark II", 2.727273 },
+            { "Canon PowerShot G7 X", 2.727273 },
+            { "Canon PowerShot G7 X Mark II", 2.727273 },
+            { "Canon PowerShot G9", 4.652324 },
+            { "Canon PowerShot G9 X Mark II", 2.727273 },
+            { "Canon PowerShot S100", 4.652324 },
+            { "Canon PowerShot S2 IS", 6.015934 },
+            { "Canon PowerShot S200", 4.652324 },
+            { "Canon PowerShot S70", 4.845086 },
+            { "Canon PowerShot S95", 4.652324 },
+            { "Canon PowerShot SD10", 6.025991 },
+            { "Canon PowerShot SD1100 IS", 6.015934 },
+            { "Canon PowerShot SD450", 6.015934 },
+            { "Canon PowerShot SD550", 4.845086 },
+            { "Canon PowerShot SD780 IS", 5.643778 },
+            { "Canon PowerShot SD790 IS", 5.643778 },
+            { "Canon PowerShot SX110 IS", 6.015934 },
+            { "Canon PowerShot SX530 HS", 5.643778 },
+            { "Canon PowerShot SX600 HS", 5.643778 },
+            { "Canon VIXIA HF10", 7.611984 },
+            { "DC-S1R", 1.000000 },
+            { "DC-ZS200", 2.727273 },
+            { "DC210 Zoom (V03.10)", 6.591501 },
+            { "DCR-TRV30", 10.816654 },
+            { "DMC-CM1", 2.727273 },
+            { "DMC-FS3", 6.025991 },
+            { "DMC-FX8", 6.025991 },
+            { "DMC-FZ5", 6.015934 },
+            { "DMC-G3", 1.999381 },
+            { "DMC-GF1", 1.999381 },
+            { "DMC-GF2", 1.999381 },
+            { "DMC-GM1", 1.999381 },
+            { "DMC-GX7", 1.999381 },
+            { "DMC-LX100", 1.999381 },
+            { "DMC-TS2", 5.692976 },
+            { "DMC-TS3", 5.692976 },
+            { "DMC-ZS1", 6.025991 },
+            { "DMC-ZS100", 2.727273 },
+            { "DMC-ZS7", 5.692976 },
+            { "DSC-N1", 4.845086 },
+            { "DSC-P52", 6.516057 },
+            { "DSC-RX1", 1.000000 },
+            { "DSC-RX100", 2.727273 },
+            { "DSC-W120", 6.015934 },
+            { "DSC-W560", 5.600000 },
+            { "DSC-W80", 6.025991 },
+            { "DSC-W800", 5.643778 },
+            { "DSC-WX1", 5.623000 },
+            { "DSC-WX300", 5.643778 },
+            { "DV 5700", 7.000000 },
+            { "DiMAGE 7", 3.900000 },
+            { "Digital Link", 1.000000 },
+            { "E-M10MarkII", 1.999381 },
+            { "E-PM2", 1.999381 },
+            { "E3100", 6.516057 },
+            { "E5200", 4.845086 },
+            { "E5400", 4.845086 },
+            { "E6653", 5.600000 },
+            { "E990", 4.845086 },
+            { "EOS 5D Mark II", 1.000000 },
+            { "EX1", 5.748494 },
+            { "Electro 35 GSN", 1.000000 },
+            { "Epson Stylus NX420", 1.000000 },
+            { "FinePix F900EXR", 5.326000 },
+            { "FinePix S3Pro", 1.529400 },
+            { "FinePix4900ZOOM", 4.652324 },
+            { "FinePixS2Pro", 1.529400 },
+            { "FrontRow Wear", 5.080000 },
+            { "G8141", 5.643778 },
+            { "GFX 100", 0.790048 },
+            { "GFX 50R", 0.790048 },
+            { "GFX 50S", 0.790048 },
+            { "GFX100S", 0.790048 },
+            { "GR II", 1.529400 },
+            { "H1A1000", 7.000000 },
+            { "H8166", 5.692976 },
+            { "HD7", 5.692976 },
+            { "HDR-SR1", 7.211103 },
+            { "HERO6 Black", 5.643778 },
+            { "HP PhotoSmart C945 (V01.60)", 1.000000 },
+            { "HP Scanjet 4800", 1.000000 },
+            { "HTC Touch Diamond P370", 10.000000 },
+            { "HTC Touch Diamond P3700", 10.000000 },
+            { "HTC-8900", 7.680000 },
+            { "Hewlett-Packard PSC 750 Scanner", 1.000000 },
+            { "ILCE-7", 1.000000 },
+            { "ILCE-7M3", 1.000000 },
+            { "ILCE-7RM2", 1.000000 },
+            { "ILCE-7S", 1.000000 },
+            { "KODAK DC240 ZOOM DIGITAL CAMERA", 6.591501 },
+            { "KODAK EASYSHARE V1003 ZOOM DIGITAL CAMERA", 4.845086 },
+            { "KODAK V530 ZOOM DIGITAL CAMERA", 4.241825 },
+            { "Kodak CLAS Digital Film Scanner / HR200", 1.000000 },
+            { "L16", 1.000000 },
+            { "LEICA M MONOCHROM (Typ 246)", 1.000000 },
+            { "LEICA M10", 1.000000 },
+            { "LEICA Q (Typ 116)", 1.000000 },
+            { "LEICA Q2", 1.000000 },
+            { "LEICA Q2 MONO", 1.000000 },
+            { "LEICA SL (Typ 601)", 1.000000 },
+            { "LEICA SL2-S", 1.000000 },
+            { "LEICA X-U (Typ 113)", 1.529400 },
+            { "LS-5000", 1.000000 },
+            { "LS-9000", 1.000000 },
+            { "Lumia 1020", 4.113183 },
+            { "Lumia 520", 7.680000 },
+            { "Lumia 830", 7.680000 },
+            { "Lumia 920", 7.680000 },
+            { "Lumia 950", 5.623000 },
+            { "Lumia 950 XL", 5.623000 },
+            { "MHS-PM1", 6.015934 },
+            { "MX880 series", 1.000000 },
+            { "NEX-3N", 1.529400 },
+            { "NEX-5N", 1.529400 },
+            { "NIKON D100", 1.527854 },
+            { "NIKON D300", 1.527854 },
+            { "NIKON D3100", 1.527854 },
+            { "NIKON D3400", 1.527854 },
+            { "NIKON D4", 1.000000 },
+            { "NIKON D40", 1.527854 },
+            { "NIKON D5100", 1.527854 },
+            { "NIKON D5200", 1.527854 },
+            { "NIKON D600", 1.000000 },
+            { "NIKON D610", 1.000000 },
+            { "NIKON D70", 1.527854 },
+            { "NIKON D700", 1.000000 },
+            { "NIKON D70s", 1.527854 },
+            { "NIKON D80", 1.527854 },
+            { "NIKON D800", 1.000000 },
+            { "NIKON D810", 1.000000 },
+            { "NIKON Z 6", 1.000000 },
+            { "NIKON Z 7_2", 1.000000 },
+            { "Nexus 7", 9.440000 },
+            { "Nexus 9", 10.816654 },
+            { "Nikon SUPER COOLSCAN 5000 ED", 1.000000 },
+            { "OpticFilm 8100", 1.000000 },
+            { "P 65+", 0.642319 },
+            { "PENTAX K-3 Mark III", 1.529400 },
+            { "PENTAX K-r", 1.529400 },
+            { "PENTAX K10D", 1.529400 },
+            { "PM23300", 7.680000 },
+            { "Panasonic DMC-GF2", 1.999381 },
+            { "Perfection V30/V300", 1.000000 },
+            { "Perfection V39", 1.000000 },
+            { "PowerShot S95", 4.652324 },
+            { "QCAM-AA", 7.680000 },
+            { "QSS-32_33", 1.000000 },
+            { "RICOH GR III", 1.529400 },
+            { "RICOH GR IIIx", 1.529400 },
+            { "RICOH THETA S", 5.615385 },
+            { "RICOH THETA Z1", 5.615385 },
+            { "SGH-I917", 7.680000 },
+            { "SGH-i937", 7.680000 },
+            { "SIGMA fp L", 1.000000 },
+            { "SM-G930F", 9.614803 },
+            { "SM-G965U1", 9.614803 },
+            { "SM-G975F", 9.614803 },
+            { "SM-T700", 9.614803 },
+            { "SM-T713", 9.614803 },
+            { "SPH-L710", 7.680000 },
+            { "ScanJet 8200", 1.000000 },
+            { "Sinarback eVolution 75, Sinar p3 / f3", 1.000000 },
+            { "TS3100 series", 1.000000 },
+            { "USB 2.0 Camera", 7.000000 },
+            { "VAIO Camera Capture Utility", 1.000000 },
+            { "X-A7", 1.529400 },
+            { "X-E3", 1.529400 },
+            { "X-M1", 1.529400 },
+            { "X-Pro1", 1.529400 },
+            { "X-Pro2", 1.529400 },
+            { "X-S10", 1.529400 },
+            { "X-T2", 1.529400 },
+            { "X-U (Typ 113)", 1.529400 },
+            { "X100F", 1.529400 },
+            { "X100S", 1.529400 },
+            { "X100T", 1.529400 },
+            { "X100V", 1.529400 },
+            { "X1D II 50C", 0.790048 },
+            { "XP-420", 1.000000 },
+            { "XP-420 Series", 1.000000 },
+            { "XZ-1", 4.414995 },
+            { "ZN5", 7.000000 },
+            { "iPAQ rx3000", 9.000000 },
+            { "iPad (6th generation)", 7.611984 },
+            { "iPad mini (5th generation)", 7.611984 },
+            { "iPad mini 2", 7.611984 },
+            { "iPhone", 7.611984 },
+            { "iPhone 11", 7.000000 },
+            { "iPhone 11 Pro", 7.000000 },
+            { "iPhone 12", 7.000000 },
+            { "iPhone 12 Pro", 7.000000 },
+            { "iPhone 12 Pro Max", 7.000000 },
+            { "iPhone 3", 7.611984 },
+            { "iPhone 3G", 7.611984 },
+            { "iPhone 3GS", 7.611984 },
+            { "iPhone 4", 7.611984 },
+            { "iPhone 4S", 7.611984 },
+            { "iPhone 5", 7.611984 },
+            { "iPhone 5s", 7.611984 },
+            { "iPhone 6", 7.611984 },
+            { "iPhone 6s", 7.611984 },
+            { "iPhone 7", 7.611984 },
+            { "iPhone 8", 7.611984 },
+            { "iPhone 8 Plus", 7.611984 },
+            { "iPhone X", 7.611984 },
+            { "iPhone XR", 7.611984 },
+            { "iPhone XS", 7.611984 },
+            { "iPhone XS Max", 7.611984 },
+            { "iPod touch", 7.611984 },
+            { "id313", 5.692976 },
+            { "u1030SW,S1030SW", 5.692976 },
+            };
+
+            count = _countof( cameras );
+            return cameras;
+        } //Cameras
+
+        static int CompareModel( const char * pcEntry, const char * pcPrefix, size_t prefixLen, const char * pcModel )
+        {
+            // strcmp( pcEntry, pcPrefix + pcModel ) without building the concatenated string
+
+            if ( 0 != prefixLen )
+            {
+                int c = strncmp( pcEntry, pcPrefix, prefixLen );
+                if ( 0 != c )
+                    return c;
+
+                pcEntry += prefixLen;
+            }
+
+            // most probes differ in the first character; skip the call for those
+
+            if ( *pcEntry != *pcModel )
+                return (int) (unsigned char) *pcEntry - (int) (unsigned char) *pcModel;
+
+            return strcmp( pcEntry, pcModel );
+        } //CompareModel
+
+        static const CropFactor * Find( const char * pcPrefix, const char * pcModel )
+        {
+            size_t count;
+            const CropFactor * pCameras = Cameras( count );
+            size_t prefixLen = strlen( pcPrefix );
+            size_t lo = 0;
+            size_t hi = count;
+
+            while ( lo < hi )
+            {
+                size_t mid = lo + ( hi - lo ) / 2;
+                int c = CompareModel( pCameras[ mid ].pcCamera, pcPrefix, prefixLen, pcModel );
+
+                if ( 0 == c )
+                    return pCameras + mid;
+
+                if ( c < 0 )
+                    lo = mid + 1;
+                else
+                    hi = mid;
+            }
+
+            return NULL;
+        } //Find
+
+    public:
+
+        static double GetCropFactor( const char * pcCameraModel )
         {
-            CropFactor search = { pcCameraModel, 0.0 };
             double result = DBL_MAX;
+            const CropFactor * pFactor = Find( "", pcCameraModel );
         
-            CropFactor * pFactor = (CropFactor *) bsearch( &search, cameras.data(), cameras.size(), sizeof( CropFactor ), CameraEntryCompare );
-        
-            if ( 0 != pFactor )
+            // LibRaw strips "Canon " from the start of Canon camera models
+
+            if ( NULL == pFactor && 0 != *pcCameraModel )
+                pFactor = Find( "Canon ", pcCameraModel );
+
+            if ( NULL != pFactor )
                 result = pFactor->cropFactor;
-            else
-            {
-                if ( 0 != *pcCameraModel )
-                {
-                    char acAddCanon[ 100 ];
-                    size_t l = strlen( pcCameraModel );
-                    if ( ( l - 7 ) < _countof( acAddCanon ) )
-                    {
-                        // LibRaw strips "Canon " from the start of Canon camera models
-
-                        strcpy( acAddCanon, "Canon " );
-                        strcpy( acAddCanon + 6, pcCameraModel );
-                        CropFactor search2 = { acAddCanon, 0.0 };
-
-                        pFactor = (CropFactor *) bsearch( &search2, cameras.data(), cameras.size(), sizeof( CropFactor ), CameraEntryCompare );
-        
-                        if ( 0 != pFactor )
-                            result = pFactor->cropFactor;
-                    }
-                }
-            }
 
             //tracer.Trace( "crop factor lookup for %s: %lf\n", pcCameraModel, result );
 
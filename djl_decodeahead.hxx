@@ -0,0 +1,401 @@
+#pragma once
+
+//
+// Decodes the images next to the one being shown on background threads, so moving to them only
+// has to upload pixels rather than decode a file. Decoded images are kept in a cache bounded by bytes.
+//
+// Usage:
+//     CDecodeAhead decodeAhead( decoder, 512 * 1024 * 1024 );
+//     shared_ptr<CDecodedImage> image = decodeAhead.Take( path, stamp ); // NULL on a miss
+//     decodeAhead.Schedule( index, count, direction, [&] ( size_t i ) { return paths[ i ]; } );
+//
+// Cached and in-flight images are identified by path, and a cached image is only used if the file's stamp
+// matches, so inserting, removing, or reordering paths in the list doesn't invalidate anything. Indexes are only
+// used to pick which paths are near the current one.
+//
+// The decoder is called on the worker threads and must be safe to call from several at once.
+// Nothing here is platform-specific; the decoder supplies the codec.
+//
+
+#include <memory>
+#include <vector>
+#include <string>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <climits>
+
+#include "djltrace.hxx"
+
+using namespace std;
+
+// Pixels ready to hand to the display: 32bpp premultiplied BGRA, already oriented
+
+struct CDecodedImage
+{
+    unsigned int width;
+    unsigned int height;
+    unsigned int stride;
+    unsigned int fullWidth;  // the image's size; larger than width x height if it was decoded reduced
+    unsigned int fullHeight;
+    bool reduced;            // a larger version is available for zooming in
+    ULONGLONG stamp;         // the file's last-write time when decoding started; 0 if unknown
+    unique_ptr<BYTE[]> pixels;
+
+    CDecodedImage() : width( 0 ), height( 0 ), stride( 0 ), fullWidth( 0 ), fullHeight( 0 ), reduced( false ), stamp( 0 ) {}
+
+    size_t Bytes() const { return (size_t) stride * height; }
+};
+
+class CImageDecoder
+{
+    public:
+        virtual ~CImageDecoder() {}
+
+        // Called once on each worker thread before and after it decodes anything
+
+        virtual void ThreadStart() {}
+        virtual void ThreadEnd() {}
+
+        // Fill image from pwcPath. Return false if the file can't or shouldn't be decoded ahead of time.
+
+        virtual bool Decode( const WCHAR * pwcPath, CDecodedImage & image ) = 0;
+};
+
+class CDecodeAhead
+{
+    public:
+        static const int DirectionPrevious = -1;
+        static const int DirectionNext = 1;
+
+    private:
+        struct Entry
+        {
+            wstring path;
+            shared_ptr<CDecodedImage> image; // NULL if decoding failed, so it isn't retried
+            ULONGLONG lastUse;
+        };
+
+        struct Job
+        {
+            size_t index;               // where path was in the list when it was wanted; only for tracing
+            wstring path;
+        };
+
+        CImageDecoder & decoder;
+        size_t budget;                  // bytes of pixels kept, including the image being shown
+        int ahead;                      // images decoded in the direction of travel; one is kept behind
+
+        std::mutex mtx;
+        std::condition_variable cvWork; // jobs were queued or the object is going away
+        std::condition_variable cvIdle; // a decode finished
+        vector<thread> workers;
+        bool stopping;
+
+        // Everything below is only touched while holding mtx
+
+        wstring currentPath;            // the image being shown
+        vector<Job> wanted;             // highest priority first
+        vector<Job> inFlight;
+        vector<Entry> cache;
+        size_t bytes;
+        ULONGLONG clock;
+
+        ULONGLONG hits;
+        ULONGLONG misses;
+        ULONGLONG decoded;
+        ULONGLONG wasted;               // decodes that finished after the user moved away from them
+
+        int Priority( const wstring & path )
+        {
+            // 0 for the image being shown, 1.. for the wanted list in order, INT_MAX for anything stale
+
+            if ( path == currentPath )
+                return 0;
+
+            for ( size_t i = 0; i < wanted.size(); i++ )
+                if ( path == wanted[ i ].path )
+                    return (int) i + 1;
+
+            return INT_MAX;
+        } //Priority
+
+        Entry * Find( const wstring & path )
+        {
+            for ( size_t i = 0; i < cache.size(); i++ )
+                if ( path == cache[ i ].path )
+                    return & cache[ i ];
+
+            return NULL;
+        } //Find
+
+        void Evict( size_t i )
+        {
+            if ( cache[ i ].image )
+                bytes -= cache[ i ].image->Bytes();
+
+            cache.erase( cache.begin() + i );
+        } //Evict
+
+        bool EvictOne( int belowPriority )
+        {
+            // Evict the lowest-priority entry whose priority is worse than belowPriority. Stale entries go first,
+            // oldest first. Returns false if nothing qualifies.
+
+            size_t victim = cache.size();
+            int victimPriority = belowPriority;
+            ULONGLONG victimUse = 0;
+
+            for ( size_t i = 0; i < cache.size(); i++ )
+            {
+                int p = Priority( cache[ i ].path );
+
+                if ( p > victimPriority || ( p == victimPriority && victim != cache.size() && cache[ i ].lastUse < victimUse ) )
+                {
+                    victim = i;
+                    victimPriority = p;
+                    victimUse = cache[ i ].lastUse;
+                }
+            }
+
+            if ( victim == cache.size() )
+                return false;
+
+            Evict( victim );
+            return true;
+        } //EvictOne
+
+        bool NextJob( Job & job )
+        {
+            // The first wanted image that isn't cached or being decoded, if there's room for it
+
+            while ( bytes >= budget )
+            {
+                if ( !EvictOne( (int) wanted.size() ) )
+                    return false;
+            }
+
+            for ( size_t i = 0; i < wanted.size(); i++ )
+            {
+                const Job & w = wanted[ i ];
+
+                if ( NULL != Find( w.path ) )
+                    continue;
+
+                bool busy = false;
+                for ( size_t f = 0; f < inFlight.size() && !busy; f++ )
+                    busy = ( inFlight[ f ].path == w.path );
+
+                if ( !busy )
+                {
+                    job = w;
+                    return true;
+                }
+            }
+
+            return false;
+        } //NextJob
+
+        void Insert( const Job & job, shared_ptr<CDecodedImage> & image )
+        {
+            int priority = Priority( job.path );
+            size_t size = image ? image->Bytes() : 0;
+
+            while ( bytes + size > budget )
+            {
+                if ( !EvictOne( priority ) )
+                {
+                    tracer.Trace( "decode ahead: no room for %zu bytes for image %zu\n", size, job.index );
+                    wasted++;
+                    return;
+                }
+            }
+
+            Entry e;
+            e.path = job.path;
+            e.image = image;
+            e.lastUse = ++clock;
+            cache.push_back( e );
+            bytes += size;
+        } //Insert
+
+        void Worker()
+        {
+            decoder.ThreadStart();
+            unique_lock<mutex> lock( mtx );
+
+            while ( !stopping )
+            {
+                Job job;
+                if ( !NextJob( job ) )
+                {
+                    cvWork.wait( lock );
+                    continue;
+                }
+
+                inFlight.push_back( job );
+                lock.unlock();
+
+                shared_ptr<CDecodedImage> image = make_shared<CDecodedImage>();
+                bool ok = decoder.Decode( job.path.c_str(), *image );
+                if ( !ok )
+                    image.reset();
+
+                lock.lock();
+
+                for ( size_t f = 0; f < inFlight.size(); f++ )
+                {
+                    if ( inFlight[ f ].path == job.path )
+                    {
+                        inFlight.erase( inFlight.begin() + f );
+                        break;
+                    }
+                }
+
+                if ( ok )
+                    decoded++;
+
+                // The user may have moved on while this was decoding. Only keep what's still wanted.
+
+                if ( INT_MAX != Priority( job.path ) )
+                    Insert( job, image );
+                else if ( ok )
+                    wasted++;
+
+                cvIdle.notify_all();
+            }
+
+            lock.unlock();
+            decoder.ThreadEnd();
+        } //Worker
+
+    public:
+        CDecodeAhead( CImageDecoder & d, size_t budgetBytes, int imagesAhead = 3, unsigned threads = 2 ) :
+            decoder( d ), budget( budgetBytes ), ahead( imagesAhead ), stopping( false ),
+            bytes( 0 ), clock( 0 ), hits( 0 ), misses( 0 ), decoded( 0 ), wasted( 0 )
+        {
+            if ( 0 == threads )
+                threads = 1;
+
+            for ( unsigned t = 0; t < threads; t++ )
+                workers.push_back( thread( &CDecodeAhead::Worker, this ) );
+        } //CDecodeAhead
+
+        ~CDecodeAhead()
+        {
+            {
+                lock_guard<mutex> lock( mtx );
+                stopping = true;
+                wanted.clear();
+            }
+
+            cvWork.notify_all();
+
+            for ( size_t t = 0; t < workers.size(); t++ )
+                workers[ t ].join();
+
+            tracer.Trace( "decode ahead: %llu hits, %llu misses (%.1lf%% hit rate), %llu decoded, %llu wasted\n",
+                          hits, misses, HitRate(), decoded, wasted );
+        } //~CDecodeAhead
+
+        // Call after showing image current of count. direction is the last move, which gets most of the read-ahead.
+        // pathOf( i ) returns the path of image i; it's only called during this call. Queued work for images no
+        // longer nearby is dropped, and decodes already running for them are discarded when they finish.
+
+        template <class T> void Schedule( size_t currentIndex, size_t count, int direction, T pathOf )
+        {
+            {
+                lock_guard<mutex> lock( mtx );
+
+                currentPath = ( 0 == count ) ? wstring() : wstring( pathOf( currentIndex ) );
+                wanted.clear();
+
+                if ( count > 1 )
+                {
+                    int forward = ( DirectionPrevious == direction ) ? -1 : 1;
+                    int wantedAhead = (int) __min( (size_t) ahead, count - 1 );
+
+                    for ( int i = 1; i <= wantedAhead + 1; i++ )
+                    {
+                        // wantedAhead in the direction of travel, then one behind
+
+                        long long offset = ( i <= wantedAhead ) ? ( (long long) forward * i ) : -forward;
+                        size_t index = (size_t) ( ( (long long) currentIndex + offset + (long long) count ) % (long long) count );
+
+                        if ( index == currentIndex )
+                            continue;
+
+                        Job job;
+                        job.index = index;
+                        job.path = pathOf( index );
+
+                        if ( INT_MAX == Priority( job.path ) )
+                            wanted.push_back( job );
+                    }
+                }
+            }
+
+            cvWork.notify_all();
+        } //Schedule
+
+        // The decoded image for pwcPath if it's ready and the file hasn't changed since; NULL otherwise.
+        // The image stays cached, so stepping back to it later is also a hit.
+
+        shared_ptr<CDecodedImage> Take( const WCHAR * pwcPath, ULONGLONG stamp )
+        {
+            lock_guard<mutex> lock( mtx );
+
+            wstring path( pwcPath );
+            Entry * pEntry = Find( path );
+
+            if ( NULL != pEntry && pEntry->image && ( 0 == stamp || stamp == pEntry->image->stamp ) )
+            {
+                hits++;
+                pEntry->lastUse = ++clock;
+                return pEntry->image;
+            }
+
+            misses++;
+
+            // A stale decode is dropped so it can be redone; a failed one is kept so it isn't retried
+
+            if ( NULL != pEntry && pEntry->image )
+                Evict( pEntry - cache.data() );
+
+            return shared_ptr<CDecodedImage>();
+        } //Take
+
+        // Drop queued work and cached images and wait for running decodes to finish, so no worker holds
+        // a file open. Call before deleting or rewriting files, or when the decoder's output would change.
+
+        void Clear()
+        {
+            unique_lock<mutex> lock( mtx );
+
+            wanted.clear();
+            currentPath.clear();
+
+            while ( !inFlight.empty() )
+                cvIdle.wait( lock );
+
+            cache.clear();
+            bytes = 0;
+        } //Clear
+
+        double HitRate()
+        {
+            ULONGLONG total = hits + misses;
+            return ( 0 == total ) ? 0.0 : 100.0 * (double) hits / (double) total;
+        } //HitRate
+
+        void GetStats( ULONGLONG & h, ULONGLONG & m, ULONGLONG & d, ULONGLONG & w )
+        {
+            lock_guard<mutex> lock( mtx );
+
+            h = hits;
+            m = misses;
+            d = decoded;
+            w = wasted;
+        } //GetStats
+}; //CDecodeAhead
+
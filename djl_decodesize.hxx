@@ -0,0 +1,57 @@
+#pragma once
+
+//
+// Picks how far an image can be reduced while it's being decoded and still look the same when it's shown
+// scaled to fit a target (the window or monitor). Codecs like JPEG can decode at 1/2, 1/4, or 1/8 size
+// for a fraction of the work of a full decode. Nothing here depends on the codec or the platform.
+//
+
+class CDecodeSize
+{
+    public:
+        // Size of one dimension decoded at 1/divisor. JPEG's DCT scaling rounds partial blocks up.
+
+        static unsigned int Reduce( unsigned int size, unsigned int divisor )
+        {
+            return ( size + divisor - 1 ) / divisor;
+        } //Reduce
+
+        // True if a width x height image decoded at scaledWidth x scaledHeight still has at least as many pixels
+        // as are drawn when the image is fit into targetWidth x targetHeight. Images are never drawn larger than
+        // the target, so the full size always covers it.
+
+        static bool Covers( unsigned int width, unsigned int height, unsigned int scaledWidth, unsigned int scaledHeight,
+                            unsigned int targetWidth, unsigned int targetHeight )
+        {
+            if ( 0 == width || 0 == height )
+                return false;
+
+            if ( targetWidth >= width && targetHeight >= height )
+                return ( scaledWidth >= width && scaledHeight >= height );
+
+            unsigned long long w = width, h = height, tw = targetWidth, th = targetHeight;
+            unsigned long long sw = scaledWidth, sh = scaledHeight;
+
+            if ( tw * h <= th * w )
+                return ( sw >= tw && sh * w >= h * tw );  // the width fills the target; scale by tw / w
+
+            return ( sh >= th && sw * h >= w * th );      // the height fills the target; scale by th / h
+        } //Covers
+
+        // The largest power of two up to maxDivisor that width x height can be divided by while still covering
+        // the target. 1 means decode at full size. A target of 0 x 0 means there's no target.
+
+        static unsigned int Divisor( unsigned int width, unsigned int height, unsigned int targetWidth, unsigned int targetHeight,
+                                     unsigned int maxDivisor = 8 )
+        {
+            if ( 0 == targetWidth || 0 == targetHeight )
+                return 1;
+
+            for ( unsigned int d = maxDivisor; d > 1; d /= 2 )
+                if ( Covers( width, height, Reduce( width, d ), Reduce( height, d ), targetWidth, targetHeight ) )
+                    return d;
+
+            return 1;
+        } //Divisor
+}; //CDecodeSize
+
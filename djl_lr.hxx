@@ -24,16 +24,591 @@
 #include <libraw.h>
 #pragma comment( lib, "libraw_static.lib" )
 
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <list>
+#include <vector>
+#include <algorithm>
+
 #include "djltrace.hxx"
+#include "djl_decodesize.hxx"
 
 using namespace std;
 
+// How much work dcraw_process() does. lrq_Half skips demosaicing by making one pixel from each 2x2 block of
+// sensor sites, and lrq_Fast uses bilinear interpolation instead of AHD. Both are for images drawn scaled down.
+
+typedef enum LibRawQuality { lrq_Full, lrq_Fast, lrq_Half } LibRawQuality;
+
+//
+// dcraw_process() takes seconds for a large RAW file, so its output is kept in memory for the images shown most
+// recently and on disk in %LOCALAPPDATA%\pv\libraw for the rest. An entry matches only the same path, file size,
+// last-write time, bits per channel, and quality, so an edited file is processed again. Entries are written to
+// disk on a background thread, which is only started if the disk cache is used.
+//
+
+class CLibRawCache
+{
+    public:
+        struct Key
+        {
+            wstring path;                   // lowercased; Windows paths are case-insensitive
+            ULONGLONG fileSize;
+            ULONGLONG lastWrite;
+            int bpc;
+            LibRawQuality quality;
+
+            bool operator == ( const Key & k ) const
+            {
+                return fileSize == k.fileSize && lastWrite == k.lastWrite && bpc == k.bpc && quality == k.quality && path == k.path;
+            }
+        };
+
+        struct Image
+        {
+            int width, height, colors;      // of the pixels
+            int fullWidth, fullHeight;      // of the image processed at full quality
+        };
+
+    private:
+        struct Entry
+        {
+            Key key;
+            Image image;
+            shared_ptr<vector<byte>> pixels;
+        };
+
+        // Disk entries are this header, the path (pathChars WCHARs), then the pixels
+
+        struct DiskHeader
+        {
+            DWORD signature;
+            DWORD version;
+            ULONGLONG fileSize;
+            ULONGLONG lastWrite;
+            int bpc;
+            int quality;
+            Image image;
+            DWORD pathChars;
+            ULONGLONG pixelBytes;
+        };
+
+        static const DWORD diskSignature = 0x6372766c;  // "lvrc"
+        static const DWORD diskVersion = 1;
+
+        static const size_t maxPending = 2; // entries waiting for the disk; older ones are dropped
+
+        std::mutex mtx;                     // protects entries and memoryBytes
+        list<Entry> entries;                // most recently used first
+        size_t memoryBytes;
+        size_t memoryBudget;
+        ULONGLONG diskBudget;
+        WCHAR awcFolder[ MAX_PATH + 1 ];    // empty if there is no disk cache
+
+        std::mutex diskMtx;                 // protects pending, stopping, and useDisk
+        std::condition_variable diskWake;
+        list<Entry> pending;                // waiting for diskWriter, newest first
+        std::thread diskWriter;
+        bool stopping;
+        bool useDisk;
+        ULONGLONG diskBytes;                // size of the entries on disk. Only diskWriter uses it
+
+        static size_t PixelBytes( const Image & image, int bpc )
+        {
+            return (size_t) image.width * image.height * image.colors * ( bpc / 8 );
+        } //PixelBytes
+
+        static ULONGLONG Hash( const Key & key )
+        {
+            // FNV-1a of the lowercased path and everything else in the key
+
+            ULONGLONG h = 14695981039346656037ull;
+
+            for ( WCHAR wc : key.path )
+            {
+                h ^= (ULONGLONG) wc;
+                h *= 1099511628211ull;
+            }
+
+            ULONGLONG values[] = { key.fileSize, key.lastWrite, (ULONGLONG) key.bpc, (ULONGLONG) key.quality };
+
+            for ( size_t i = 0; i < _countof( values ); i++ )
+            {
+                h ^= values[ i ];
+                h *= 1099511628211ull;
+            }
+
+            return h;
+        } //Hash
+
+        bool DiskPath( const Key & key, const WCHAR * pwcExt, WCHAR * pwcPath, size_t cwcPath )
+        {
+            if ( 0 == awcFolder[ 0 ] )
+                return false;
+
+            return ( swprintf_s( pwcPath, cwcPath, L"%ws\\lr-%016llx.%ws", awcFolder, Hash( key ), pwcExt ) > 0 );
+        } //DiskPath
+
+        static bool ReadAll( HANDLE h, void * pv, ULONGLONG cb )
+        {
+            byte * pb = (byte *) pv;
+
+            while ( cb > 0 )
+            {
+                DWORD chunk = (DWORD) __min( cb, (ULONGLONG) 0x40000000 );
+                DWORD read = 0;
+                if ( !ReadFile( h, pb, chunk, &read, NULL ) || read != chunk )
+                    return false;
+
+                pb += chunk;
+                cb -= chunk;
+            }
+
+            return true;
+        } //ReadAll
+
+        static bool WriteAll( HANDLE h, const void * pv, ULONGLONG cb )
+        {
+            const byte * pb = (const byte *) pv;
+
+            while ( cb > 0 )
+            {
+                DWORD chunk = (DWORD) __min( cb, (ULONGLONG) 0x40000000 );
+                DWORD written = 0;
+                if ( !WriteFile( h, pb, chunk, &written, NULL ) || written != chunk )
+                    return false;
+
+                pb += chunk;
+                cb -= chunk;
+            }
+
+            return true;
+        } //WriteAll
+
+        void AddToMemory( const Key & key, const Image & image, shared_ptr<vector<byte>> & pixels )
+        {
+            size_t cb = pixels->size();
+            if ( cb > memoryBudget )
+                return;
+
+            lock_guard<mutex> lock( mtx );
+
+            for ( auto it = entries.begin(); it != entries.end(); it++ )
+            {
+                if ( it->key == key )
+                {
+                    memoryBytes -= it->pixels->size();
+                    entries.erase( it );
+                    break;
+                }
+            }
+
+            while ( !entries.empty() && ( memoryBytes + cb ) > memoryBudget )
+            {
+                memoryBytes -= entries.back().pixels->size();
+                entries.pop_back();
+            }
+
+            Entry entry;
+            entry.key = key;
+            entry.image = image;
+            entry.pixels = pixels;
+            entries.push_front( entry );
+            memoryBytes += cb;
+        } //AddToMemory
+
+        shared_ptr<vector<byte>> FindOnDisk( const Key & key, Image & image )
+        {
+            WCHAR awcPath[ MAX_PATH + 1 ];
+            if ( !DiskPath( key, L"bin", awcPath, _countof( awcPath ) ) )
+                return 0;
+
+            HANDLE h = CreateFile( awcPath, GENERIC_READ | FILE_WRITE_ATTRIBUTES, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL );
+            if ( INVALID_HANDLE_VALUE == h )
+                return 0;
+
+            shared_ptr<vector<byte>> pixels;
+            DiskHeader header;
+
+            if ( ReadAll( h, &header, sizeof header ) && diskSignature == header.signature && diskVersion == header.version &&
+                 key.fileSize == header.fileSize && key.lastWrite == header.lastWrite && key.bpc == header.bpc &&
+                 (int) key.quality == header.quality && key.path.size() == header.pathChars &&
+                 PixelBytes( header.image, key.bpc ) == header.pixelBytes )
+            {
+                wstring path( header.pathChars, 0 );
+
+                if ( ReadAll( h, &path[ 0 ], header.pathChars * sizeof( WCHAR ) ) && path == key.path )
+                {
+                    pixels.reset( new vector<byte>( (size_t) header.pixelBytes ) );
+
+                    if ( ReadAll( h, pixels->data(), header.pixelBytes ) )
+                    {
+                        image = header.image;
+
+                        // The last-write time orders entries for trimming, so a hit makes this one the newest
+
+                        FILETIME ftNow;
+                        GetSystemTimeAsFileTime( &ftNow );
+                        SetFileTime( h, NULL, NULL, &ftNow );
+                    }
+                    else
+                        pixels.reset();
+                }
+            }
+
+            CloseHandle( h );
+            return pixels;
+        } //FindOnDisk
+
+        void AddToDisk( const Key & key, const Image & image, const vector<byte> & pixels )
+        {
+            WCHAR awcPath[ MAX_PATH + 1 ], awcTemp[ MAX_PATH + 1 ];
+            if ( pixels.size() > diskBudget || !DiskPath( key, L"bin", awcPath, _countof( awcPath ) ) || !DiskPath( key, L"tmp", awcTemp, _countof( awcTemp ) ) )
+                return;
+
+            DiskHeader header;
+            memset( &header, 0, sizeof header );
+            header.signature = diskSignature;
+            header.version = diskVersion;
+            header.fileSize = key.fileSize;
+            header.lastWrite = key.lastWrite;
+            header.bpc = key.bpc;
+            header.quality = (int) key.quality;
+            header.image = image;
+            header.pathChars = (DWORD) key.path.size();
+            header.pixelBytes = pixels.size();
+
+            // Write a temporary file then rename it so a partial entry is never read
+
+            HANDLE h = CreateFile( awcTemp, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_FLAG_SEQUENTIAL_SCAN, NULL );
+            if ( INVALID_HANDLE_VALUE == h )
+            {
+                tracer.Trace( "can't create libraw cache file %ws, error %d\n", awcTemp, GetLastError() );
+                return;
+            }
+
+            bool ok = WriteAll( h, &header, sizeof header ) && WriteAll( h, key.path.c_str(), header.pathChars * sizeof( WCHAR ) ) &&
+                      WriteAll( h, pixels.data(), pixels.size() );
+            CloseHandle( h );
+
+            // An entry for the same key is replaced, so its size comes off the total
+
+            ULONGLONG replaced = 0;
+            WIN32_FILE_ATTRIBUTE_DATA data;
+            if ( GetFileAttributesEx( awcPath, GetFileExInfoStandard, &data ) )
+                replaced = ( (ULONGLONG) data.nFileSizeHigh << 32 ) | data.nFileSizeLow;
+
+            if ( ok )
+                ok = ( 0 != MoveFileEx( awcTemp, awcPath, MOVEFILE_REPLACE_EXISTING ) );
+
+            if ( !ok )
+            {
+                tracer.Trace( "can't write libraw cache file %ws, error %d\n", awcPath, GetLastError() );
+                DeleteFile( awcTemp );
+                return;
+            }
+
+            diskBytes += sizeof header + header.pathChars * sizeof( WCHAR ) + pixels.size();
+            diskBytes -= __min( diskBytes, replaced );
+
+            if ( diskBytes > diskBudget )
+                TrimDisk();
+        } //AddToDisk
+
+        void TrimDisk()
+        {
+            // Count the entries on disk, and if they're over budget delete the least recently used ones down to 3/4
+            // of it, so the folder isn't scanned again for a while. Only this scans; writes keep diskBytes current.
+
+            struct DiskEntry
+            {
+                ULONGLONG lastWrite;
+                ULONGLONG size;
+                wstring name;
+            };
+
+            WCHAR awcSpec[ MAX_PATH + 1 ];
+            if ( swprintf_s( awcSpec, _countof( awcSpec ), L"%ws\\lr-*.bin", awcFolder ) < 0 )
+                return;
+
+            vector<DiskEntry> found;
+            ULONGLONG total = 0;
+            WIN32_FIND_DATA fd;
+            HANDLE hFind = FindFirstFile( awcSpec, &fd );
+            diskBytes = 0;
+            if ( INVALID_HANDLE_VALUE == hFind )
+                return;
+
+            do
+            {
+                DiskEntry e;
+                e.lastWrite = ( (ULONGLONG) fd.ftLastWriteTime.dwHighDateTime << 32 ) | fd.ftLastWriteTime.dwLowDateTime;
+                e.size = ( (ULONGLONG) fd.nFileSizeHigh << 32 ) | fd.nFileSizeLow;
+                e.name = fd.cFileName;
+                total += e.size;
+                found.push_back( e );
+            } while ( FindNextFile( hFind, &fd ) );
+
+            FindClose( hFind );
+            diskBytes = total;
+
+            if ( total <= diskBudget )
+                return;
+
+            sort( found.begin(), found.end(), [] ( const DiskEntry & a, const DiskEntry & b ) { return a.lastWrite < b.lastWrite; } );
+
+            ULONGLONG target = diskBudget / 4 * 3;
+
+            for ( size_t i = 0; i < found.size() && total > target; i++ )
+            {
+                WCHAR awcPath[ MAX_PATH + 1 ];
+                if ( swprintf_s( awcPath, _countof( awcPath ), L"%ws\\%ws", awcFolder, found[ i ].name.c_str() ) > 0 && DeleteFile( awcPath ) )
+                    total -= found[ i ].size;
+            }
+
+            tracer.Trace( "trimmed libraw disk cache from %llu to %llu bytes\n", diskBytes, total );
+            diskBytes = total;
+        } //TrimDisk
+
+        void WriteToDisk()
+        {
+            // The disk writer thread. It counts what's on disk first, then writes entries as Add queues them.
+
+            TrimDisk();
+
+            unique_lock<mutex> lock( diskMtx );
+
+            for ( ;; )
+            {
+                diskWake.wait( lock, [this] { return stopping || !pending.empty(); } );
+                if ( stopping )
+                    break;
+
+                Entry entry = pending.front();
+                pending.pop_front();
+                lock.unlock();
+
+                AddToDisk( entry.key, entry.image, *entry.pixels );
+
+                lock.lock();
+            }
+        } //WriteToDisk
+
+        shared_ptr<vector<byte>> FindPending( const Key & key, Image & image )
+        {
+            lock_guard<mutex> lock( diskMtx );
+
+            for ( auto it = pending.begin(); it != pending.end(); it++ )
+            {
+                if ( it->key == key )
+                {
+                    image = it->image;
+                    return it->pixels;
+                }
+            }
+
+            return 0;
+        } //FindPending
+
+    public:
+        // The defaults hold a few 8-bit images from a 45 megapixel sensor in memory and a few dozen on disk
+
+        CLibRawCache( size_t memoryLimit = 384 * 1024 * 1024, ULONGLONG diskLimit = 4ull * 1024 * 1024 * 1024 ) :
+            memoryBytes( 0 ), memoryBudget( memoryLimit ), diskBudget( diskLimit ), stopping( false ), useDisk( true ), diskBytes( 0 )
+        {
+            awcFolder[ 0 ] = 0;
+
+            WCHAR awcAppData[ MAX_PATH + 1 ];
+            DWORD len = GetEnvironmentVariable( L"LOCALAPPDATA", awcAppData, _countof( awcAppData ) );
+            if ( 0 == len || len >= _countof( awcAppData ) )
+                return;
+
+            if ( swprintf_s( awcFolder, _countof( awcFolder ), L"%ws\\pv", awcAppData ) < 0 )
+            {
+                awcFolder[ 0 ] = 0;
+                return;
+            }
+
+            CreateDirectory( awcFolder, NULL );
+            wcscat_s( awcFolder, _countof( awcFolder ), L"\\libraw" );
+            CreateDirectory( awcFolder, NULL );
+
+            DWORD attributes = GetFileAttributes( awcFolder );
+            if ( INVALID_FILE_ATTRIBUTES == attributes || !( attributes & FILE_ATTRIBUTE_DIRECTORY ) )
+                awcFolder[ 0 ] = 0;
+        }
+
+        ~CLibRawCache()
+        {
+            // A write in progress finishes; queued ones are dropped
+
+            {
+                lock_guard<mutex> lock( diskMtx );
+                stopping = true;
+                pending.clear();
+            }
+
+            diskWake.notify_one();
+
+            if ( diskWriter.joinable() )
+                diskWriter.join();
+        }
+
+        // Turn the disk cache off or back on. Entries already on disk are left there.
+
+        void UseDisk( bool use )
+        {
+            lock_guard<mutex> lock( diskMtx );
+            useDisk = use;
+
+            if ( !use )
+                pending.clear();
+        } //UseDisk
+
+        // False if the file can't be found, in which case nothing about it should be cached
+
+        static bool MakeKey( const WCHAR * pwcPath, int bpc, LibRawQuality quality, Key & key )
+        {
+            WIN32_FILE_ATTRIBUTE_DATA data;
+            if ( !GetFileAttributesEx( pwcPath, GetFileExInfoStandard, &data ) )
+                return false;
+
+            key.path = pwcPath;
+            for ( WCHAR & wc : key.path )
+                wc = towlower( wc );
+
+            key.fileSize = ( (ULONGLONG) data.nFileSizeHigh << 32 ) | data.nFileSizeLow;
+            key.lastWrite = ( (ULONGLONG) data.ftLastWriteTime.dwHighDateTime << 32 ) | data.ftLastWriteTime.dwLowDateTime;
+            key.bpc = bpc;
+            key.quality = quality;
+            return true;
+        } //MakeKey
+
+        // Returns a copy of the cached pixels that the caller owns, or 0 if there is no entry for key
+
+        byte * Find( const Key & key, Image & image )
+        {
+            shared_ptr<vector<byte>> pixels;
+
+            {
+                lock_guard<mutex> lock( mtx );
+
+                for ( auto it = entries.begin(); it != entries.end(); it++ )
+                {
+                    if ( it->key == key )
+                    {
+                        entries.splice( entries.begin(), entries, it );
+                        image = it->image;
+                        pixels = it->pixels;
+                        break;
+                    }
+                }
+            }
+
+            if ( !pixels )
+                pixels = FindPending( key, image );
+
+            if ( !pixels )
+            {
+                bool disk;
+
+                {
+                    lock_guard<mutex> lock( diskMtx );
+                    disk = useDisk;
+                }
+
+                if ( disk )
+                    pixels = FindOnDisk( key, image );
+
+                if ( !pixels )
+                    return 0;
+
+                AddToMemory( key, image, pixels );
+            }
+
+            byte * pb = new byte[ pixels->size() ];
+            memcpy( pb, pixels->data(), pixels->size() );
+            return pb;
+        } //Find
+
+        // The disk write happens later on the disk writer thread, which shares the copy of the pixels kept in memory
+
+        void Add( const Key & key, const Image & image, const byte * pb )
+        {
+            shared_ptr<vector<byte>> pixels( new vector<byte>( pb, pb + PixelBytes( image, key.bpc ) ) );
+            AddToMemory( key, image, pixels );
+
+            if ( 0 == awcFolder[ 0 ] || pixels->size() > diskBudget )
+                return;
+
+            {
+                lock_guard<mutex> lock( diskMtx );
+
+                if ( !useDisk || stopping )
+                    return;
+
+                Entry entry;
+                entry.key = key;
+                entry.image = image;
+                entry.pixels = pixels;
+                pending.push_front( entry );
+
+                if ( pending.size() > maxPending )
+                    pending.pop_back();
+
+                if ( !diskWriter.joinable() )
+                    diskWriter = std::thread( &CLibRawCache::WriteToDisk, this );
+            }
+
+            diskWake.notify_one();
+        } //Add
+}; //CLibRawCache
+
 class CLibRaw
 {
+    private:
+        static CLibRawCache & Cache()
+        {
+            static CLibRawCache cache;
+            return cache;
+        } //Cache
+
+        // Full quality unless the image is drawn scaled to fit a target. Half size is used when it still
+        // has at least the pixels drawn.
+
+        static LibRawQuality ChooseQuality( LibRaw & processor, int targetWidth, int targetHeight )
+        {
+            if ( targetWidth <= 0 || targetHeight <= 0 )
+                return lrq_Full;
+
+            libraw_image_sizes_t & sizes = processor.imgdata.sizes;
+            unsigned int w = sizes.width;
+            unsigned int h = sizes.height;
+            if ( sizes.flip & 4 )
+                swap( w, h );
+
+            // LibRaw only halves images with a color filter array, and then it rounds down
+
+            if ( 0 != processor.imgdata.idata.filters && CDecodeSize::Covers( w, h, w / 2, h / 2, targetWidth, targetHeight ) )
+                return lrq_Half;
+
+            return lrq_Fast;
+        } //ChooseQuality
+
     public:
         CLibRaw() {}
 
-        static byte * ProcessRaw( const WCHAR * pwcPath, int bpc, int & width, int & height, int & colors )
+        // Whether processed images are also kept on disk, in %LOCALAPPDATA%\pv\libraw. They're always kept in memory.
+
+        static void UseDiskCache( bool use ) { Cache().UseDisk( use ); }
+
+        // Returns the processed image in memory, BGR or gray, which the caller deletes. When targetWidth x targetHeight
+        // is given the image will be drawn fit to that size, so a faster, lower-quality preview may be returned;
+        // *pPreview is set when it is. *pFullWidth x *pFullHeight is always the size at full quality.
+
+        static byte * ProcessRaw( const WCHAR * pwcPath, int bpc, int & width, int & height, int & colors,
+                                  int targetWidth = 0, int targetHeight = 0, bool * pPreview = 0, int * pFullWidth = 0, int * pFullHeight = 0 )
         {
             if ( 16 != bpc && 8 != bpc )
                 return 0;
@@ -47,13 +622,64 @@ class CLibRaw
             size_t converted = 0;
             wcstombs_s( &converted, inputFile.get(), len, pwcPath, len );
   
+            // open_file() only parses metadata; unpack() and dcraw_process() are where the time goes
+
             int ret = rawProcessor->open_file( inputFile.get() );
             if ( LIBRAW_SUCCESS != ret )
             {
                 tracer.Trace( "libraw can't (error %d) open input file %s\n", ret, inputFile.get() );
                 return 0;
             }
-  
+
+            LibRawQuality quality = ChooseQuality( *rawProcessor, targetWidth, targetHeight );
+
+            // A full-quality image in the cache is better than a preview and just as fast
+
+            CLibRawCache::Key key;
+            CLibRawCache::Image image;
+            bool cacheable = CLibRawCache::MakeKey( pwcPath, bpc, quality, key );
+
+            if ( cacheable )
+            {
+                byte * pb = Cache().Find( key, image );
+
+                if ( 0 == pb && lrq_Full != quality )
+                {
+                    CLibRawCache::Key fullKey = key;
+                    fullKey.quality = lrq_Full;
+                    pb = Cache().Find( fullKey, image );
+                    if ( 0 != pb )
+                        quality = lrq_Full;
+                }
+
+                if ( 0 != pb )
+                {
+                    tracer.Trace( "  libraw cache hit, quality %d, %d x %d for %ws\n", quality, image.width, image.height, pwcPath );
+                    width = image.width;
+                    height = image.height;
+                    colors = image.colors;
+                    if ( pPreview )
+                        *pPreview = ( lrq_Full != quality );
+                    if ( pFullWidth )
+                        *pFullWidth = image.fullWidth;
+                    if ( pFullHeight )
+                        *pFullHeight = image.fullHeight;
+                    return pb;
+                }
+            }
+
+            // Read these before processing; dcraw_process() changes them to the output size
+
+            image.fullWidth = rawProcessor->imgdata.sizes.width;
+            image.fullHeight = rawProcessor->imgdata.sizes.height;
+            if ( rawProcessor->imgdata.sizes.flip & 4 )
+                swap( image.fullWidth, image.fullHeight );
+
+            if ( lrq_Half == quality )
+                rawProcessor->imgdata.params.half_size = 1;
+            else if ( lrq_Fast == quality )
+                rawProcessor->imgdata.params.user_qual = 0;   // bilinear
+
             ret = rawProcessor->unpack();
             if ( LIBRAW_SUCCESS != ret )
             {
@@ -85,6 +711,20 @@ class CLibRaw
                 return 0;
             }
 
+            image.width = width;
+            image.height = height;
+            image.colors = colors;
+
+            if ( cacheable )
+                Cache().Add( key, image, data.get() );
+
+            if ( pPreview )
+                *pPreview = ( lrq_Full != quality );
+            if ( pFullWidth )
+                *pFullWidth = image.fullWidth;
+            if ( pFullHeight )
+                *pFullHeight = image.fullHeight;
+
             return data.release();
         } //ProcessRaw
 
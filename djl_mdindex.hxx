@@ -0,0 +1,548 @@
+#pragma once
+
+//
+// Persistent index of image metadata for one root folder, so sorting a previously seen folder doesn't re-parse
+// every file. Entries are keyed by path and validated against the file's size and last-write time; stale or
+// missing entries are parsed again and written back by Save().
+//
+// The file is memory-mapped and searched in place: a header, then fixed-size records sorted by path hash,
+// then a pool holding the UTF-16 paths (relative to the root) followed by the deduplicated char strings.
+//
+
+#include <windows.h>
+#include <wctype.h>
+
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <algorithm>
+
+#include <djltrace.hxx>
+#include <djl_strm.hxx>
+#include <djlimagedata.hxx>
+
+using namespace std;
+
+class CMetadataIndex
+{
+    private:
+        static const DWORD IndexSignature = 0x7864696d; // "midx"
+        static const DWORD IndexVersion = 2;
+        static const int DateTimeLen = 20;              // "2005:02:17 21:21:31" plus a null
+
+        struct IndexHeader
+        {
+            DWORD signature;
+            DWORD version;
+            DWORD recordCount;
+            DWORD rootOffset;                           // root folder as a WCHAR string in the pool
+            ULONGLONG poolBytes;
+        };
+
+        struct IndexRecord
+        {
+            ULONGLONG pathHash;
+            ULONGLONG fileSize;
+            ULONGLONG lastWrite;
+            __int64 embeddedImageOffset;
+            __int64 embeddedImageLength;
+            __int64 orientationOffset;
+            __int64 orientationOffset2;
+            __int64 ratingInXMPOffset;
+            double latitude;
+            double longitude;
+            DWORD pathOffset;                           // pool offsets of null-terminated strings
+            DWORD makeOffset;
+            DWORD modelOffset;
+            DWORD lensOffset;
+            int embeddedImageWidth;
+            int embeddedImageHeight;
+            int imageWidth;
+            int imageHeight;
+            int orientation;
+            int orientation2;
+            WORD orientationType;
+            WORD orientationType2;
+            char acDateTimeOriginal[ DateTimeLen ];
+            char acDateTime[ DateTimeLen ];
+            char ratingInXMP;
+            BYTE orientationLittleEndian;
+            BYTE holdsAdobeEditsInXMP;
+            BYTE reserved;
+            DWORD fields;                               // ImageMetadata::Field* bits the record was parsed for
+        };
+
+        static_assert( 0 == ( sizeof( IndexHeader ) % 8 ), "index header must keep records aligned" );
+        static_assert( 0 == ( sizeof( IndexRecord ) % 8 ), "index records must stay aligned" );
+
+        // A record parsed this session, waiting for Save()
+
+        struct PendingEntry
+        {
+            wstring path;
+            string make;
+            string model;
+            string lens;
+            IndexRecord record;
+        };
+
+        WCHAR awcRoot[ MAX_PATH + 1 ];
+        size_t rootLen;
+        WCHAR awcIndexPath[ MAX_PATH + 1 ];
+
+        unique_ptr<CStream> indexStream;
+        vector<BYTE> indexBuffer;                       // used when the index file can't be mapped
+        const BYTE * pIndex;
+        ULONGLONG indexBytes;
+        const IndexRecord * pRecords;
+        DWORD recordCount;
+        const BYTE * pPool;
+        ULONGLONG poolBytes;
+
+        vector<BYTE> recordUsed;                        // per record: found valid by Lookup, so Save() keeps it
+        std::mutex mtx;                                 // protects pending
+        vector<PendingEntry> pending;
+
+        static ULONGLONG HashPath( const WCHAR * pwc )
+        {
+            // FNV-1a of the lowercased path; Windows paths are case-insensitive
+
+            ULONGLONG h = 14695981039346656037ull;
+
+            while ( 0 != *pwc )
+            {
+                h ^= (ULONGLONG) towlower( *pwc++ );
+                h *= 1099511628211ull;
+            }
+
+            return h;
+        } //HashPath
+
+        static ULONGLONG FileTimeValue( const FILETIME & ft )
+        {
+            ULARGE_INTEGER uli;
+            uli.LowPart = ft.dwLowDateTime;
+            uli.HighPart = ft.dwHighDateTime;
+            return uli.QuadPart;
+        } //FileTimeValue
+
+        const WCHAR * RelativePath( const WCHAR * pwcPath )
+        {
+            // paths outside the root can't be indexed
+
+            if ( 0 == rootLen || _wcsnicmp( pwcPath, awcRoot, rootLen ) )
+                return NULL;
+
+            return pwcPath + rootLen;
+        } //RelativePath
+
+        const WCHAR * PoolPath( DWORD poolOffset )
+        {
+            if ( 0 != ( poolOffset % sizeof( WCHAR ) ) || poolOffset >= poolBytes )
+                return NULL;
+
+            const WCHAR * pwc = (const WCHAR *) ( pPool + poolOffset );
+            size_t maxLen = (size_t) ( poolBytes - poolOffset ) / sizeof( WCHAR );
+
+            if ( wcsnlen( pwc, maxLen ) == maxLen )
+                return NULL;
+
+            return pwc;
+        } //PoolPath
+
+        const char * PoolString( DWORD poolOffset )
+        {
+            if ( poolOffset >= poolBytes )
+                return "";
+
+            const char * pc = (const char *) ( pPool + poolOffset );
+            size_t maxLen = (size_t) ( poolBytes - poolOffset );
+
+            if ( strnlen( pc, maxLen ) == maxLen )
+                return "";
+
+            return pc;
+        } //PoolString
+
+        void Unload()
+        {
+            indexStream.reset( NULL );
+            indexBuffer.clear();
+            pIndex = NULL;
+            indexBytes = 0;
+            pRecords = NULL;
+            recordCount = 0;
+            pPool = NULL;
+            poolBytes = 0;
+            recordUsed.clear();
+        } //Unload
+
+        bool MapIndex()
+        {
+            indexStream.reset( new CStream( awcIndexPath ) );
+
+            if ( !indexStream->Ok() || indexStream->Length() < sizeof( IndexHeader ) )
+                return false;
+
+            indexBytes = indexStream->Length();
+
+            if ( indexBytes > ULONG_MAX )
+                return false;
+
+            if ( indexStream->EnableMapping() )
+                pIndex = indexStream->View( 0, (ULONG) indexBytes );
+
+            if ( NULL == pIndex )
+            {
+                indexBuffer.resize( (size_t) indexBytes );
+
+                if ( indexBytes != indexStream->Read( indexBuffer.data(), (ULONG) indexBytes ) )
+                    return false;
+
+                pIndex = indexBuffer.data();
+            }
+
+            const IndexHeader * pHeader = (const IndexHeader *) pIndex;
+
+            if ( IndexSignature != pHeader->signature || IndexVersion != pHeader->version )
+            {
+                tracer.Trace( "metadata index %ws has signature %#x version %u; ignoring it\n", awcIndexPath, pHeader->signature, pHeader->version );
+                return false;
+            }
+
+            ULONGLONG recordBytes = (ULONGLONG) pHeader->recordCount * sizeof( IndexRecord );
+
+            if ( sizeof( IndexHeader ) + recordBytes + pHeader->poolBytes != indexBytes )
+            {
+                tracer.Trace( "metadata index %ws is truncated or corrupt\n", awcIndexPath );
+                return false;
+            }
+
+            recordCount = pHeader->recordCount;
+            pRecords = (const IndexRecord *) ( pIndex + sizeof( IndexHeader ) );
+            pPool = pIndex + sizeof( IndexHeader ) + recordBytes;
+            poolBytes = pHeader->poolBytes;
+
+            // an index for a different folder that happens to hash to the same file name is useless
+
+            const WCHAR * pwcIndexRoot = PoolPath( pHeader->rootOffset );
+
+            if ( NULL == pwcIndexRoot || _wcsicmp( pwcIndexRoot, awcRoot ) )
+            {
+                tracer.Trace( "metadata index %ws is for a different root folder\n", awcIndexPath );
+                return false;
+            }
+
+            recordUsed.resize( recordCount, 0 );
+            return true;
+        } //MapIndex
+
+        static void CopyDateTime( char * pcOut, const char * pcIn )
+        {
+            strncpy_s( pcOut, DateTimeLen, pcIn, _TRUNCATE );
+        } //CopyDateTime
+
+        static DWORD AddToPool( vector<BYTE> & pool, const void * pv, size_t cb )
+        {
+            DWORD poolOffset = (DWORD) pool.size();
+            const BYTE * pb = (const BYTE *) pv;
+            pool.insert( pool.end(), pb, pb + cb );
+            return poolOffset;
+        } //AddToPool
+
+        static DWORD AddStringToPool( vector<BYTE> & pool, map<string, DWORD> & strings, const char * pc )
+        {
+            // make, model, and lens repeat across thousands of files, so each distinct string is stored once
+
+            auto it = strings.find( pc );
+            if ( strings.end() != it )
+                return it->second;
+
+            DWORD poolOffset = AddToPool( pool, pc, strlen( pc ) + 1 );
+            strings[ pc ] = poolOffset;
+            return poolOffset;
+        } //AddStringToPool
+
+    public:
+        CMetadataIndex() : rootLen( 0 ), pIndex( NULL ), indexBytes( 0 ), pRecords( NULL ), recordCount( 0 ), pPool( NULL ), poolBytes( 0 )
+        {
+            awcRoot[ 0 ] = 0;
+            awcIndexPath[ 0 ] = 0;
+        }
+
+        ~CMetadataIndex()
+        {
+            Unload();
+        }
+
+        // The index for a root folder lives in %LOCALAPPDATA%\pv so read-only photo folders can be indexed too.
+        // The file name is a hash of the root folder's path.
+
+        static bool IndexPathForRoot( const WCHAR * pwcRoot, WCHAR * pwcIndexPath, size_t cwcIndexPath )
+        {
+            WCHAR awcAppData[ MAX_PATH + 1 ];
+            DWORD len = GetEnvironmentVariable( L"LOCALAPPDATA", awcAppData, _countof( awcAppData ) );
+            if ( 0 == len || len >= _countof( awcAppData ) )
+                return false;
+
+            WCHAR awcFolder[ MAX_PATH + 1 ];
+            if ( swprintf_s( awcFolder, _countof( awcFolder ), L"%ws\\pv", awcAppData ) < 0 )
+                return false;
+
+            CreateDirectory( awcFolder, NULL );
+
+            return ( swprintf_s( pwcIndexPath, cwcIndexPath, L"%ws\\mdindex-%016llx.bin", awcFolder, HashPath( pwcRoot ) ) > 0 );
+        } //IndexPathForRoot
+
+        // Load the index for pwcRoot. Returns false if there isn't a usable index yet, but the object is still
+        // ready for Update() and Save().
+
+        bool Load( const WCHAR * pwcRoot )
+        {
+            Unload();
+            pending.clear();
+
+            rootLen = wcslen( pwcRoot );
+            if ( 0 == rootLen || rootLen >= _countof( awcRoot ) || !IndexPathForRoot( pwcRoot, awcIndexPath, _countof( awcIndexPath ) ) )
+            {
+                rootLen = 0;
+                return false;
+            }
+
+            wcscpy_s( awcRoot, _countof( awcRoot ), pwcRoot );
+
+            if ( !MapIndex() )
+            {
+                Unload();
+                return false;
+            }
+
+            tracer.Trace( "loaded metadata index %ws with %u records for %ws\n", awcIndexPath, recordCount, awcRoot );
+            return true;
+        } //Load
+
+        // Fill md from the index if pwcPath has a record matching the file's current size and last-write time
+        // that was parsed for at least the requested fields. Only the subset of ImageMetadata needed for sorting,
+        // rating, and rotating is stored. Safe to call from many threads at once.
+
+        bool Lookup( const WCHAR * pwcPath, ULONGLONG fileSize, const FILETIME & ftLastWrite, ImageMetadata & md, DWORD fields = ImageMetadata::FieldAll )
+        {
+            const WCHAR * pwcRelative = RelativePath( pwcPath );
+            if ( NULL == pwcRelative || 0 == recordCount )
+                return false;
+
+            ULONGLONG hash = HashPath( pwcRelative );
+
+            const IndexRecord * pEnd = pRecords + recordCount;
+            const IndexRecord * pRecord = lower_bound( pRecords, pEnd, hash,
+                                                       [] ( const IndexRecord & r, ULONGLONG h ) { return r.pathHash < h; } );
+
+            for ( ; pRecord < pEnd && hash == pRecord->pathHash; pRecord++ )
+            {
+                const WCHAR * pwcRecordPath = PoolPath( pRecord->pathOffset );
+
+                if ( NULL == pwcRecordPath || _wcsicmp( pwcRecordPath, pwcRelative ) )
+                    continue;
+
+                if ( fileSize != pRecord->fileSize || FileTimeValue( ftLastWrite ) != pRecord->lastWrite )
+                    return false; // the file changed since it was indexed
+
+                if ( fields != ( fields & pRecord->fields ) )
+                    return false; // parsed for fewer fields than the caller needs
+
+                const IndexRecord & r = *pRecord;
+                md.Initialize();
+                md.Embedded_Image_Offset = r.embeddedImageOffset;
+                md.Embedded_Image_Length = r.embeddedImageLength;
+                md.Embedded_Image_Width = r.embeddedImageWidth;
+                md.Embedded_Image_Height = r.embeddedImageHeight;
+                md.Orientation_Value = r.orientation;
+                md.Orientation_Value2 = r.orientation2;
+                md.Orientation_Offset = r.orientationOffset;
+                md.Orientation_Offset2 = r.orientationOffset2;
+                md.Orientation_Type = r.orientationType;
+                md.Orientation_Type2 = r.orientationType2;
+                md.Orientation_LittleEndian = ( 0 != r.orientationLittleEndian );
+                md.ImageWidth = r.imageWidth;
+                md.ImageHeight = r.imageHeight;
+                md.Latitude = r.latitude;
+                md.Longitude = r.longitude;
+                md.holdsAdobeEditsInXMP = ( 0 != r.holdsAdobeEditsInXMP );
+                md.RatingInXMP_Offset = r.ratingInXMPOffset;
+                md.RatingInXMP = r.ratingInXMP;
+                strcpy_s( md.acDateTimeOriginal, _countof( md.acDateTimeOriginal ), r.acDateTimeOriginal );
+                strcpy_s( md.acDateTime, _countof( md.acDateTime ), r.acDateTime );
+                strcpy_s( md.acMake, _countof( md.acMake ), PoolString( r.makeOffset ) );
+                strcpy_s( md.acModel, _countof( md.acModel ), PoolString( r.modelOffset ) );
+                strcpy_s( md.acLensModel, _countof( md.acLensModel ), PoolString( r.lensOffset ) );
+
+                recordUsed[ pRecord - pRecords ] = 1;
+                return true;
+            }
+
+            return false;
+        } //Lookup
+
+        // Record freshly parsed metadata for pwcPath; fields is the mask it was parsed with.
+        // Safe to call from many threads at once.
+
+        void Update( const WCHAR * pwcPath, ULONGLONG fileSize, const FILETIME & ftLastWrite, const ImageMetadata & md, DWORD fields = ImageMetadata::FieldAll )
+        {
+            const WCHAR * pwcRelative = RelativePath( pwcPath );
+            if ( NULL == pwcRelative )
+                return;
+
+            PendingEntry entry;
+            entry.path = pwcRelative;
+            entry.make = md.acMake;
+            entry.model = md.acModel;
+            entry.lens = md.acLensModel;
+
+            IndexRecord & r = entry.record;
+            memset( &r, 0, sizeof r );
+            r.pathHash = HashPath( pwcRelative );
+            r.fileSize = fileSize;
+            r.lastWrite = FileTimeValue( ftLastWrite );
+            r.fields = fields;
+            r.embeddedImageOffset = md.Embedded_Image_Offset;
+            r.embeddedImageLength = md.Embedded_Image_Length;
+            r.embeddedImageWidth = md.Embedded_Image_Width;
+            r.embeddedImageHeight = md.Embedded_Image_Height;
+            r.orientation = md.Orientation_Value;
+            r.orientation2 = md.Orientation_Value2;
+            r.orientationOffset = md.Orientation_Offset;
+            r.orientationOffset2 = md.Orientation_Offset2;
+            r.orientationType = (WORD) md.Orientation_Type;
+            r.orientationType2 = (WORD) md.Orientation_Type2;
+            r.orientationLittleEndian = md.Orientation_LittleEndian;
+            r.imageWidth = md.ImageWidth;
+            r.imageHeight = md.ImageHeight;
+            r.latitude = md.Latitude;
+            r.longitude = md.Longitude;
+            r.holdsAdobeEditsInXMP = md.holdsAdobeEditsInXMP;
+            r.ratingInXMPOffset = md.RatingInXMP_Offset;
+            r.ratingInXMP = md.RatingInXMP;
+            CopyDateTime( r.acDateTimeOriginal, md.acDateTimeOriginal );
+            CopyDateTime( r.acDateTime, md.acDateTime );
+
+            lock_guard<mutex> lock( mtx );
+            pending.push_back( std::move( entry ) );
+        } //Update
+
+        // Write the records found valid by Lookup() plus those added by Update(); records for files that weren't
+        // looked up this session are dropped. The new index is written to a temporary file and then swapped in.
+
+        bool Save()
+        {
+            if ( 0 == rootLen )
+                return false;
+
+            size_t usedCount = count( recordUsed.begin(), recordUsed.end(), (BYTE) 1 );
+
+            if ( 0 == pending.size() && usedCount == recordCount )
+                return true; // nothing changed
+
+            size_t total = usedCount + pending.size();
+            if ( total > ULONG_MAX )
+                return false;
+
+            // Build the records and pool. WCHAR paths go first so they stay aligned, then the char strings.
+
+            vector<IndexRecord> records;
+            records.reserve( total );
+            vector<BYTE> pool;
+            map<string, DWORD> strings;
+            vector<const char *> texts;
+            texts.reserve( total * 3 );
+
+            DWORD rootOffset = AddToPool( pool, awcRoot, ( rootLen + 1 ) * sizeof( WCHAR ) );
+
+            for ( DWORD i = 0; i < recordCount; i++ )
+            {
+                if ( !recordUsed[ i ] )
+                    continue;
+
+                const WCHAR * pwcPath = PoolPath( pRecords[ i ].pathOffset );
+                records.push_back( pRecords[ i ] );
+                records.back().pathOffset = AddToPool( pool, pwcPath, ( wcslen( pwcPath ) + 1 ) * sizeof( WCHAR ) );
+                texts.push_back( PoolString( pRecords[ i ].makeOffset ) );
+                texts.push_back( PoolString( pRecords[ i ].modelOffset ) );
+                texts.push_back( PoolString( pRecords[ i ].lensOffset ) );
+            }
+
+            for ( size_t i = 0; i < pending.size(); i++ )
+            {
+                PendingEntry & entry = pending[ i ];
+                records.push_back( entry.record );
+                records.back().pathOffset = AddToPool( pool, entry.path.c_str(), ( entry.path.length() + 1 ) * sizeof( WCHAR ) );
+                texts.push_back( entry.make.c_str() );
+                texts.push_back( entry.model.c_str() );
+                texts.push_back( entry.lens.c_str() );
+            }
+
+            for ( size_t i = 0; i < records.size(); i++ )
+            {
+                records[ i ].makeOffset = AddStringToPool( pool, strings, texts[ i * 3 ] );
+                records[ i ].modelOffset = AddStringToPool( pool, strings, texts[ i * 3 + 1 ] );
+                records[ i ].lensOffset = AddStringToPool( pool, strings, texts[ i * 3 + 2 ] );
+            }
+
+            if ( pool.size() > ULONG_MAX )
+                return false;
+
+            stable_sort( records.begin(), records.end(),
+                         [] ( const IndexRecord & a, const IndexRecord & b ) { return a.pathHash < b.pathHash; } );
+
+            IndexHeader header = {0};
+            header.signature = IndexSignature;
+            header.version = IndexVersion;
+            header.recordCount = (DWORD) records.size();
+            header.rootOffset = rootOffset;
+            header.poolBytes = pool.size();
+
+            WCHAR awcTemp[ MAX_PATH + 1 ];
+            if ( swprintf_s( awcTemp, _countof( awcTemp ), L"%ws.tmp", awcIndexPath ) < 0 )
+                return false;
+
+            bool ok = false;
+            {
+                CStream temp( awcTemp, true );
+
+                if ( temp.Ok() )
+                {
+                    ULONG cbRecords = (ULONG) ( records.size() * sizeof( IndexRecord ) );
+                    ok = ( sizeof header == temp.Write( &header, sizeof header ) ) &&
+                         ( cbRecords == temp.Write( records.data(), cbRecords ) ) &&
+                         ( pool.size() == temp.Write( pool.data(), (ULONG) pool.size() ) );
+                }
+            }
+
+            // the old index is mapped and some of the records came from it, so only release it now
+
+            Unload();
+            pending.clear();
+
+            if ( ok )
+                ok = ( 0 != MoveFileEx( awcTemp, awcIndexPath, MOVEFILE_REPLACE_EXISTING ) );
+
+            if ( !ok )
+            {
+                tracer.Trace( "unable to write metadata index %ws, error %d\n", awcIndexPath, GetLastError() );
+                DeleteFile( awcTemp );
+                return false;
+            }
+
+            tracer.Trace( "wrote metadata index %ws with %zu records, %zu pool bytes\n", awcIndexPath, records.size(), pool.size() );
+
+            // map the new index so further lookups this session hit. Every record in it is current.
+
+            if ( MapIndex() )
+                fill( recordUsed.begin(), recordUsed.end(), (BYTE) 1 );
+            else
+                Unload();
+
+            return true;
+        } //Save
+}; //CMetadataIndex
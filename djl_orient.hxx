@@ -0,0 +1,719 @@
+#pragma once
+
+//
+// Turns and mirrors pixels for all 8 Exif orientations, 1 through 8 bytes per pixel (8, 16, 24, 32, 48, and 64 bits).
+// Orientations 1-4 keep pixel rows together, so each output row is a copy or a reversed copy of one source row.
+// Orientations 5-8 transpose, so output rows are source columns; those are done in square tiles small enough
+// that the source rows a tile touches stay in cache. 32bpp and 64bpp pixels (PBGRA and 16-bit RGBA) move through
+// SSE2 or NEON registers in 4x4 and 2x2 blocks. Bands of output rows run on separate threads.
+//
+// Orientation values are the Exif ones: 1 is as-is, 2 mirrors left to right, 3 turns 180 degrees, 4 mirrors top to
+// bottom, 5 transposes (mirror then turn 270 clockwise), 6 turns 90 clockwise, 7 transverses (mirror then turn 90
+// clockwise), and 8 turns 270 clockwise. Nothing here depends on Windows.
+//
+// COrientPixels::ApplyRect orients all or part of an image a strip of source rows at a time, as it's decoded.
+// COrientStream applies an orientation to images too big to hold twice in memory, using a scratch file.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stddef.h>
+
+#include <algorithm>
+#include <memory>
+#include <new>
+#include <thread>
+#include <vector>
+
+#if defined( _M_X64 ) || defined( __x86_64__ ) || ( defined( _M_IX86_FP ) && _M_IX86_FP >= 2 ) || defined( __SSE2__ )
+    #define DJL_ORIENT_SSE2
+    #include <emmintrin.h>
+#elif defined( _M_ARM64 ) || defined( __aarch64__ )
+    #define DJL_ORIENT_NEON
+    #include <arm_neon.h>
+#endif
+
+class COrientPixels
+{
+    private:
+        // Output pixel ( x, y ) comes from source byte base + x * stepX + y * stepY
+
+        struct Walk
+        {
+            const uint8_t * base;
+            ptrdiff_t stepX;
+            ptrdiff_t stepY;
+        };
+
+        static Walk SourceWalk( const uint8_t * src, int width, int height, size_t stride, int bpp, int orientation )
+        {
+            ptrdiff_t s = (ptrdiff_t) stride;
+            ptrdiff_t right = (ptrdiff_t) ( width - 1 ) * bpp;
+            ptrdiff_t bottom = (ptrdiff_t) ( height - 1 ) * s;
+            Walk w;
+
+            switch ( orientation )
+            {
+                case 2: w.base = src + right; w.stepX = -bpp; w.stepY = s; break;
+                case 3: w.base = src + bottom + right; w.stepX = -bpp; w.stepY = -s; break;
+                case 4: w.base = src + bottom; w.stepX = bpp; w.stepY = -s; break;
+                case 5: w.base = src; w.stepX = s; w.stepY = bpp; break;
+                case 6: w.base = src + bottom; w.stepX = -s; w.stepY = bpp; break;
+                case 7: w.base = src + bottom + right; w.stepX = -s; w.stepY = -bpp; break;
+                case 8: w.base = src + right; w.stepX = s; w.stepY = -bpp; break;
+                default: w.base = src; w.stepX = bpp; w.stepY = s; break;
+            }
+
+            return w;
+        } //SourceWalk
+
+        // Where source pixel ( x, y ) of a width x height image is in the oriented image
+
+        static void OrientPoint( int x, int y, int width, int height, int orientation, int & outX, int & outY )
+        {
+            switch ( orientation )
+            {
+                case 2: outX = width - 1 - x; outY = y; break;
+                case 3: outX = width - 1 - x; outY = height - 1 - y; break;
+                case 4: outX = x; outY = height - 1 - y; break;
+                case 5: outX = y; outY = x; break;
+                case 6: outX = height - 1 - y; outY = x; break;
+                case 7: outX = height - 1 - y; outY = width - 1 - x; break;
+                case 8: outX = y; outY = width - 1 - x; break;
+                default: outX = x; outY = y; break;
+            }
+        } //OrientPoint
+
+        // Run f( start, end ) over [ 0, count ) split into up to threads bands of at least minPerBand
+
+        template <class F> static void InBands( int count, unsigned int threads, int minPerBand, F f )
+        {
+            if ( 0 == threads )
+                threads = std::max( 1u, std::thread::hardware_concurrency() );
+
+            int bands = std::max( 1, std::min( (int) threads, count / std::max( 1, minPerBand ) ) );
+            std::vector<std::thread> workers;
+
+            for ( int b = 1; b < bands; b++ )
+                workers.emplace_back( f, (int) ( (long long) count * b / bands ), (int) ( (long long) count * ( b + 1 ) / bands ) );
+
+            f( 0, count / bands );
+
+            for ( size_t i = 0; i < workers.size(); i++ )
+                workers[ i ].join();
+        } //InBands
+
+        template <int N> static void SwapPixel( uint8_t * a, uint8_t * b )
+        {
+            uint8_t t[ N ];
+            memcpy( t, a, N );
+            memcpy( a, b, N );
+            memcpy( b, t, N );
+        } //SwapPixel
+
+        // dst gets count pixels read backward starting at src
+
+        template <int N> static void ReverseRow( uint8_t * dst, const uint8_t * src, int count )
+        {
+            int x = 0;
+
+#if defined( DJL_ORIENT_SSE2 )
+            if ( 4 == N )
+                for ( ; x + 4 <= count; x += 4 )
+                    _mm_storeu_si128( (__m128i *) ( dst + x * 4 ), _mm_shuffle_epi32( _mm_loadu_si128( (const __m128i *) ( src - ( x + 3 ) * 4 ) ), 0x1b ) );
+            else if ( 8 == N )
+                for ( ; x + 2 <= count; x += 2 )
+                    _mm_storeu_si128( (__m128i *) ( dst + x * 8 ), _mm_shuffle_epi32( _mm_loadu_si128( (const __m128i *) ( src - ( x + 1 ) * 8 ) ), 0x4e ) );
+#elif defined( DJL_ORIENT_NEON )
+            if ( 4 == N )
+            {
+                for ( ; x + 4 <= count; x += 4 )
+                {
+                    uint32x4_t v = vrev64q_u32( vld1q_u32( (const uint32_t *) ( src - ( x + 3 ) * 4 ) ) );
+                    vst1q_u32( (uint32_t *) ( dst + x * 4 ), vextq_u32( v, v, 2 ) );
+                }
+            }
+            else if ( 8 == N )
+            {
+                for ( ; x + 2 <= count; x += 2 )
+                {
+                    uint64x2_t v = vld1q_u64( (const uint64_t *) ( src - ( x + 1 ) * 8 ) );
+                    vst1q_u64( (uint64_t *) ( dst + x * 8 ), vextq_u64( v, v, 1 ) );
+                }
+            }
+#endif
+            for ( ; x < count; x++ )
+                memcpy( dst + x * N, src - (ptrdiff_t) x * N, N );
+        } //ReverseRow
+
+        // One tile of a transposing orientation: output rows [ y0, y1 ) and columns [ x0, x1 ). Source pixels
+        // along an output column are adjacent (stepY is +-N), and along an output row they're a source row apart.
+
+        template <int N> static void TransposeTile( const Walk & w, uint8_t * dst, size_t dstStride, int x0, int x1, int y0, int y1 )
+        {
+            int y = y0;
+
+#if defined( DJL_ORIENT_SSE2 ) || defined( DJL_ORIENT_NEON )
+            const int block = ( 4 == N ) ? 4 : ( 8 == N ) ? 2 : 0;
+            bool backward = ( w.stepY < 0 );
+
+            if ( 0 != block )
+            {
+                int xBlocks = x0 + ( ( x1 - x0 ) / block ) * block;
+
+                for ( ; y + block <= y1; y += block )
+                {
+                    uint8_t * pRow = dst + (size_t) y * dstStride;
+                    int x = x0;
+
+                    for ( ; x < xBlocks; x += block )
+                    {
+                        // Load block source runs, each an output column's block pixels, and transpose them to rows
+
+                        const uint8_t * p = w.base + x * w.stepX + y * w.stepY;
+                        if ( backward )
+                            p -= ( block - 1 ) * N;
+
+    #if defined( DJL_ORIENT_SSE2 )
+                        if ( 4 == N )
+                        {
+                            __m128 r0 = _mm_castsi128_ps( _mm_loadu_si128( (const __m128i *) p ) );
+                            __m128 r1 = _mm_castsi128_ps( _mm_loadu_si128( (const __m128i *) ( p + w.stepX ) ) );
+                            __m128 r2 = _mm_castsi128_ps( _mm_loadu_si128( (const __m128i *) ( p + 2 * w.stepX ) ) );
+                            __m128 r3 = _mm_castsi128_ps( _mm_loadu_si128( (const __m128i *) ( p + 3 * w.stepX ) ) );
+                            _MM_TRANSPOSE4_PS( r0, r1, r2, r3 );
+
+                            if ( backward )
+                            {
+                                __m128 t = r0; r0 = r3; r3 = t;
+                                t = r1; r1 = r2; r2 = t;
+                            }
+
+                            _mm_storeu_ps( (float *) ( pRow + x * 4 ), r0 );
+                            _mm_storeu_ps( (float *) ( pRow + dstStride + x * 4 ), r1 );
+                            _mm_storeu_ps( (float *) ( pRow + 2 * dstStride + x * 4 ), r2 );
+                            _mm_storeu_ps( (float *) ( pRow + 3 * dstStride + x * 4 ), r3 );
+                        }
+                        else
+                        {
+                            __m128i c0 = _mm_loadu_si128( (const __m128i *) p );
+                            __m128i c1 = _mm_loadu_si128( (const __m128i *) ( p + w.stepX ) );
+                            __m128i r0 = _mm_unpacklo_epi64( c0, c1 );
+                            __m128i r1 = _mm_unpackhi_epi64( c0, c1 );
+
+                            _mm_storeu_si128( (__m128i *) ( pRow + x * 8 ), backward ? r1 : r0 );
+                            _mm_storeu_si128( (__m128i *) ( pRow + dstStride + x * 8 ), backward ? r0 : r1 );
+                        }
+    #else
+                        if ( 4 == N )
+                        {
+                            uint32x4_t c0 = vld1q_u32( (const uint32_t *) p );
+                            uint32x4_t c1 = vld1q_u32( (const uint32_t *) ( p + w.stepX ) );
+                            uint32x4_t c2 = vld1q_u32( (const uint32_t *) ( p + 2 * w.stepX ) );
+                            uint32x4_t c3 = vld1q_u32( (const uint32_t *) ( p + 3 * w.stepX ) );
+                            uint32x4x2_t t01 = vtrnq_u32( c0, c1 );
+                            uint32x4x2_t t23 = vtrnq_u32( c2, c3 );
+                            uint32x4_t r[ 4 ];
+                            r[ 0 ] = vcombine_u32( vget_low_u32( t01.val[ 0 ] ), vget_low_u32( t23.val[ 0 ] ) );
+                            r[ 1 ] = vcombine_u32( vget_low_u32( t01.val[ 1 ] ), vget_low_u32( t23.val[ 1 ] ) );
+                            r[ 2 ] = vcombine_u32( vget_high_u32( t01.val[ 0 ] ), vget_high_u32( t23.val[ 0 ] ) );
+                            r[ 3 ] = vcombine_u32( vget_high_u32( t01.val[ 1 ] ), vget_high_u32( t23.val[ 1 ] ) );
+
+                            for ( int j = 0; j < 4; j++ )
+                                vst1q_u32( (uint32_t *) ( pRow + j * dstStride + x * 4 ), r[ backward ? 3 - j : j ] );
+                        }
+                        else
+                        {
+                            uint64x2_t c0 = vld1q_u64( (const uint64_t *) p );
+                            uint64x2_t c1 = vld1q_u64( (const uint64_t *) ( p + w.stepX ) );
+                            uint64x2_t r0 = vcombine_u64( vget_low_u64( c0 ), vget_low_u64( c1 ) );
+                            uint64x2_t r1 = vcombine_u64( vget_high_u64( c0 ), vget_high_u64( c1 ) );
+
+                            vst1q_u64( (uint64_t *) ( pRow + x * 8 ), backward ? r1 : r0 );
+                            vst1q_u64( (uint64_t *) ( pRow + dstStride + x * 8 ), backward ? r0 : r1 );
+                        }
+    #endif
+                    }
+
+                    for ( int j = 0; j < block; j++ )
+                        for ( int xr = x; xr < x1; xr++ )
+                            memcpy( pRow + j * dstStride + xr * N, w.base + xr * w.stepX + ( y + j ) * w.stepY, N );
+                }
+            }
+#endif
+            for ( ; y < y1; y++ )
+            {
+                uint8_t * pRow = dst + (size_t) y * dstStride;
+
+                for ( int x = x0; x < x1; x++ )
+                    memcpy( pRow + x * N, w.base + x * w.stepX + y * w.stepY, N );
+            }
+        } //TransposeTile
+
+        template <int N> static void ApplyN( const Walk & w, int outWidth, int outHeight, uint8_t * dst, size_t dstStride, unsigned int threads )
+        {
+            if ( w.stepX == N || w.stepX == -N )
+            {
+                InBands( outHeight, threads, 64, [&] ( int yStart, int yEnd )
+                {
+                    for ( int y = yStart; y < yEnd; y++ )
+                    {
+                        const uint8_t * pSrc = w.base + y * w.stepY;
+                        uint8_t * pDst = dst + (size_t) y * dstStride;
+
+                        if ( w.stepX > 0 )
+                            memcpy( pDst, pSrc, (size_t) outWidth * N );
+                        else
+                            ReverseRow<N>( pDst, pSrc, outWidth );
+                    }
+                } );
+
+                return;
+            }
+
+            const int tile = ( N <= 4 ) ? 64 : 32;
+            int tileRows = ( outHeight + tile - 1 ) / tile;
+
+            InBands( tileRows, threads, 1, [&] ( int tStart, int tEnd )
+            {
+                for ( int t = tStart; t < tEnd; t++ )
+                {
+                    int y0 = t * tile;
+                    int y1 = std::min( outHeight, y0 + tile );
+
+                    for ( int x0 = 0; x0 < outWidth; x0 += tile )
+                        TransposeTile<N>( w, dst, dstStride, x0, std::min( outWidth, x0 + tile ), y0, y1 );
+                }
+            } );
+        } //ApplyN
+
+        template <int N> static void MirrorInPlace( uint8_t * pixels, int width, int height, size_t stride, unsigned int threads )
+        {
+            InBands( height, threads, 64, [&] ( int yStart, int yEnd )
+            {
+                for ( int y = yStart; y < yEnd; y++ )
+                {
+                    uint8_t * pRow = pixels + (size_t) y * stride;
+
+                    for ( int x = 0; x < width / 2; x++ )
+                        SwapPixel<N>( pRow + x * N, pRow + ( width - 1 - x ) * N );
+                }
+            } );
+        } //MirrorInPlace
+
+        template <int N> static void FlipInPlace( uint8_t * pixels, int width, int height, size_t stride, bool mirror, unsigned int threads )
+        {
+            // Swap rows y and height - 1 - y, reversing them too for a 180 degree turn. An odd middle row is only mirrored.
+
+            InBands( height / 2, threads, 32, [&] ( int yStart, int yEnd )
+            {
+                std::vector<uint8_t> row( (size_t) width * N );
+
+                for ( int y = yStart; y < yEnd; y++ )
+                {
+                    uint8_t * pTop = pixels + (size_t) y * stride;
+                    uint8_t * pBottom = pixels + (size_t) ( height - 1 - y ) * stride;
+
+                    if ( mirror )
+                    {
+                        ReverseRow<N>( row.data(), pTop + ( width - 1 ) * N, width );
+                        ReverseRow<N>( pTop, pBottom + ( width - 1 ) * N, width );
+                    }
+                    else
+                    {
+                        memcpy( row.data(), pTop, row.size() );
+                        memcpy( pTop, pBottom, row.size() );
+                    }
+
+                    memcpy( pBottom, row.data(), row.size() );
+                }
+            } );
+
+            if ( mirror && ( height & 1 ) )
+                MirrorInPlace<N>( pixels + (size_t) ( height / 2 ) * stride, width, 1, stride, 1 );
+        } //FlipInPlace
+
+        template <int N> static void TransposeInPlace( uint8_t * pixels, int size, size_t stride, unsigned int threads )
+        {
+            // Swap each tile above the diagonal with its mirror below it, a pixel at a time
+
+            const int tile = ( N <= 4 ) ? 64 : 32;
+            int tiles = ( size + tile - 1 ) / tile;
+
+            InBands( tiles, threads, 1, [&] ( int tStart, int tEnd )
+            {
+                for ( int ty = tStart; ty < tEnd; ty++ )
+                {
+                    int y0 = ty * tile;
+                    int y1 = std::min( size, y0 + tile );
+
+                    for ( int tx = ty; tx < tiles; tx++ )
+                    {
+                        int x0 = tx * tile;
+                        int x1 = std::min( size, x0 + tile );
+
+                        for ( int y = y0; y < y1; y++ )
+                            for ( int x = std::max( x0, y + 1 ); x < x1; x++ )
+                                SwapPixel<N>( pixels + (size_t) y * stride + x * N, pixels + (size_t) x * stride + y * N );
+                    }
+                }
+            } );
+        } //TransposeInPlace
+
+        template <int N> static void ApplyInPlaceN( uint8_t * pixels, int width, int height, size_t stride, int orientation, unsigned int threads )
+        {
+            // 6, 7, and 8 are a transpose followed by 2, 3, and 4
+
+            if ( orientation >= 5 )
+            {
+                TransposeInPlace<N>( pixels, width, stride, threads );
+                orientation -= 4;
+            }
+
+            if ( 2 == orientation )
+                MirrorInPlace<N>( pixels, width, height, stride, threads );
+            else if ( 3 == orientation || 4 == orientation )
+                FlipInPlace<N>( pixels, width, height, stride, 3 == orientation, threads );
+        } //ApplyInPlaceN
+
+    public:
+        static bool ValidPixelSize( int bpp ) { return ( bpp >= 1 && bpp <= 4 ) || 6 == bpp || 8 == bpp; }
+
+        // Size of width x height pixels after orientation is applied
+
+        static void OrientedSize( int width, int height, int orientation, int & outWidth, int & outHeight )
+        {
+            bool sideways = ( orientation >= 5 && orientation <= 8 );
+            outWidth = sideways ? height : width;
+            outHeight = sideways ? width : height;
+        } //OrientedSize
+
+        // Orientations that keep the size can always be applied in place; transposes only to square images
+
+        static bool CanApplyInPlace( int width, int height, int orientation )
+        {
+            return ( orientation <= 4 || width == height );
+        } //CanApplyInPlace
+
+        // The rectangle of the oriented image that source rectangle ( x, y, w, h ) of a width x height image becomes.
+        // A rectangle's pixels oriented on their own are that part of the oriented image.
+
+        static void OrientRect( int x, int y, int w, int h, int width, int height, int orientation, int & outX, int & outY, int & outW, int & outH )
+        {
+            int ax, ay, bx, by;
+            OrientPoint( x, y, width, height, orientation, ax, ay );
+            OrientPoint( x + w - 1, y + h - 1, width, height, orientation, bx, by );
+            outX = std::min( ax, bx );
+            outY = std::min( ay, by );
+            outW = std::abs( bx - ax ) + 1;
+            outH = std::abs( by - ay ) + 1;
+        } //OrientRect
+
+        // The source rectangle of a width x height image that becomes rectangle ( x, y, w, h ) of the oriented image
+
+        static void SourceRect( int x, int y, int w, int h, int width, int height, int orientation, int & srcX, int & srcY, int & srcW, int & srcH )
+        {
+            // Every orientation undoes itself except the quarter turns, which undo each other
+
+            int inverse = ( 6 == orientation ) ? 8 : ( 8 == orientation ) ? 6 : orientation;
+            int outWidth, outHeight;
+            OrientedSize( width, height, orientation, outWidth, outHeight );
+            OrientRect( x, y, w, h, outWidth, outHeight, inverse, srcX, srcY, srcW, srcH );
+        } //SourceRect
+
+        // Write rectangle ( x, y, w, h ) of the oriented image to dst, reading the source it comes from stripRows rows
+        // at a time with read( srcX, srcY, srcW, srcH, strip, stripStride ), which returns false to stop. Only one
+        // strip of the source is held at once, so an image can be oriented as it's decoded without a copy of all of
+        // it. Returns false if read fails or the strip can't be allocated.
+
+        template <class R> static bool ApplyRect( int width, int height, int bpp, int orientation, int x, int y, int w, int h,
+                                                  uint8_t * dst, size_t dstStride, int stripRows, R read, unsigned int threads = 0 )
+        {
+            if ( NULL == dst || w <= 0 || h <= 0 || !ValidPixelSize( bpp ) || orientation < 1 || orientation > 8 )
+                return false;
+
+            int srcX, srcY, srcW, srcH;
+            SourceRect( x, y, w, h, width, height, orientation, srcX, srcY, srcW, srcH );
+            stripRows = std::max( 1, std::min( stripRows, srcH ) );
+
+            size_t stripStride = (size_t) srcW * bpp;
+            std::unique_ptr<uint8_t[]> strip( new ( std::nothrow ) uint8_t[ stripStride * stripRows ] );
+            if ( !strip )
+                return false;
+
+            for ( int row = srcY; row < srcY + srcH; row += stripRows )
+            {
+                int rows = std::min( stripRows, srcY + srcH - row );
+                if ( !read( srcX, row, srcW, rows, strip.get(), stripStride ) )
+                    return false;
+
+                int outX, outY, outW, outH;
+                OrientRect( srcX, row, srcW, rows, width, height, orientation, outX, outY, outW, outH );
+                Apply( strip.get(), srcW, rows, stripStride, dst + (size_t) ( outY - y ) * dstStride + (size_t) ( outX - x ) * bpp,
+                       dstStride, bpp, orientation, threads );
+            }
+
+            return true;
+        } //ApplyRect
+
+        // Write src with orientation applied to dst, which is OrientedSize. bpp is 1, 2, 3, 4, 6, or 8 bytes.
+        // threads 0 means one per core.
+
+        static bool Apply( const uint8_t * src, int width, int height, size_t srcStride, uint8_t * dst, size_t dstStride,
+                           int bpp, int orientation, unsigned int threads = 0 )
+        {
+            if ( NULL == src || NULL == dst || width <= 0 || height <= 0 || !ValidPixelSize( bpp ) || orientation < 1 || orientation > 8 )
+                return false;
+
+            Walk w = SourceWalk( src, width, height, srcStride, bpp, orientation );
+            int outWidth, outHeight;
+            OrientedSize( width, height, orientation, outWidth, outHeight );
+
+            switch ( bpp )
+            {
+                case 1: ApplyN<1>( w, outWidth, outHeight, dst, dstStride, threads ); break;
+                case 2: ApplyN<2>( w, outWidth, outHeight, dst, dstStride, threads ); break;
+                case 3: ApplyN<3>( w, outWidth, outHeight, dst, dstStride, threads ); break;
+                case 4: ApplyN<4>( w, outWidth, outHeight, dst, dstStride, threads ); break;
+                case 6: ApplyN<6>( w, outWidth, outHeight, dst, dstStride, threads ); break;
+                default: ApplyN<8>( w, outWidth, outHeight, dst, dstStride, threads ); break;
+            }
+
+            return true;
+        } //Apply
+
+        // Apply orientation to pixels where they are. Returns false if CanApplyInPlace doesn't allow it.
+
+        static bool ApplyInPlace( uint8_t * pixels, int width, int height, size_t stride, int bpp, int orientation, unsigned int threads = 0 )
+        {
+            if ( NULL == pixels || width <= 0 || height <= 0 || !ValidPixelSize( bpp ) || orientation < 1 || orientation > 8 )
+                return false;
+
+            if ( !CanApplyInPlace( width, height, orientation ) )
+                return false;
+
+            switch ( bpp )
+            {
+                case 1: ApplyInPlaceN<1>( pixels, width, height, stride, orientation, threads ); break;
+                case 2: ApplyInPlaceN<2>( pixels, width, height, stride, orientation, threads ); break;
+                case 3: ApplyInPlaceN<3>( pixels, width, height, stride, orientation, threads ); break;
+                case 4: ApplyInPlaceN<4>( pixels, width, height, stride, orientation, threads ); break;
+                case 6: ApplyInPlaceN<6>( pixels, width, height, stride, orientation, threads ); break;
+                default: ApplyInPlaceN<8>( pixels, width, height, stride, orientation, threads ); break;
+            }
+
+            return true;
+        } //ApplyInPlace
+
+        // The same result as Apply from a plain loop over output pixels, as the reference for tests and benchmarks
+
+        static bool Reference( const uint8_t * src, int width, int height, size_t srcStride, uint8_t * dst, size_t dstStride,
+                               int bpp, int orientation )
+        {
+            if ( NULL == src || NULL == dst || width <= 0 || height <= 0 || !ValidPixelSize( bpp ) || orientation < 1 || orientation > 8 )
+                return false;
+
+            Walk w = SourceWalk( src, width, height, srcStride, bpp, orientation );
+            int outWidth, outHeight;
+            OrientedSize( width, height, orientation, outWidth, outHeight );
+
+            for ( int y = 0; y < outHeight; y++ )
+                for ( int x = 0; x < outWidth; x++ )
+                    memcpy( dst + (size_t) y * dstStride + (size_t) x * bpp, w.base + x * w.stepX + y * w.stepY, bpp );
+
+            return true;
+        } //Reference
+}; //COrientPixels
+
+// Applies an orientation to an image read top to bottom in strips and written top to bottom in bands, within a
+// memory budget. Decoders of PNG and TIFF strips only read forward cheaply and encoders only write forward, so
+// when the image doesn't fit the budget it takes two passes through a scratch file:
+//   1) read source strips, orient each, and write the result to the scratch file as tiles of output bands
+//   2) gather each output band's tiles from the scratch file and write the band
+// Orientations 1 and 2 map strips to bands in order and need no scratch file.
+//
+// Reader is bool ( int y, int rows, uint8_t * pixels, size_t stride ) and fills source rows y through y + rows - 1.
+// Writer is bool ( int rows, const uint8_t * pixels, size_t stride ) and takes the next rows of the output.
+
+class COrientStream
+{
+    private:
+        static bool ScratchSeek( FILE * fp, unsigned long long offset )
+        {
+#ifdef _WIN32
+            return ( 0 == _fseeki64( fp, (long long) offset, SEEK_SET ) );
+#else
+            return ( 0 == fseeko( fp, (off_t) offset, SEEK_SET ) );
+#endif
+        } //ScratchSeek
+
+        static bool ScratchWrite( FILE * fp, unsigned long long offset, const uint8_t * p, size_t len )
+        {
+            return ScratchSeek( fp, offset ) && ( len == fwrite( p, 1, len, fp ) );
+        } //ScratchWrite
+
+        static bool ScratchRead( FILE * fp, unsigned long long offset, uint8_t * p, size_t len )
+        {
+            return ScratchSeek( fp, offset ) && ( len == fread( p, 1, len, fp ) );
+        } //ScratchRead
+
+        static bool Transposes( int orientation ) { return ( orientation >= 5 && orientation <= 8 ); }
+
+        // Orientations that put the top of the source at the bottom (1-4) or right (5-8) of the output
+
+        static bool Reverses( int orientation ) { return ( 3 == orientation || 4 == orientation || 6 == orientation || 7 == orientation ); }
+
+        static int StripRows( int width, int height, int bpp, size_t budget )
+        {
+            // A pass holds a source strip and the strip oriented
+
+            size_t rowBytes = (size_t) width * bpp;
+            return (int) std::max( (size_t) 1, std::min( (size_t) height, budget / ( 2 * rowBytes ) ) );
+        } //StripRows
+
+        static bool Fits( int width, int height, int bpp, size_t budget )
+        {
+            return ( 2 * (unsigned long long) width * height * bpp <= budget );
+        } //Fits
+
+    public:
+        // True if width x height can't be oriented in budget bytes without a scratch file
+
+        static bool NeedsScratch( int width, int height, int bpp, int orientation, size_t budget )
+        {
+            return ( orientation > 2 && !Fits( width, height, bpp, budget ) );
+        } //NeedsScratch
+
+        // Write the source with orientation applied. scratch is an empty file opened for reading and writing, and is
+        // only used if NeedsScratch. Peak memory is about budget bytes plus the caller's decoder and encoder.
+
+        template <class Reader, class Writer>
+        static bool Apply( int width, int height, int bpp, int orientation, size_t budget, FILE * scratch, Reader read, Writer write,
+                           unsigned int threads = 0 )
+        {
+            if ( width <= 0 || height <= 0 || orientation < 1 || orientation > 8 )
+                return false;
+
+            int outWidth, outHeight;
+            COrientPixels::OrientedSize( width, height, orientation, outWidth, outHeight );
+            size_t srcStride = (size_t) width * bpp;
+            size_t outStride = (size_t) outWidth * bpp;
+
+            if ( Fits( width, height, bpp, budget ) )
+            {
+                // It all fits, so read it all, orient it, and write it all
+
+                std::vector<uint8_t> src( srcStride * height ), dst( outStride * outHeight );
+
+                return read( 0, height, src.data(), srcStride ) &&
+                       COrientPixels::Apply( src.data(), width, height, srcStride, dst.data(), outStride, bpp, orientation, threads ) &&
+                       write( outHeight, dst.data(), outStride );
+            }
+
+            int stripRows = StripRows( width, height, bpp, budget );
+            int strips = ( height + stripRows - 1 ) / stripRows;
+            std::vector<uint8_t> strip( srcStride * stripRows ), oriented( srcStride * stripRows );
+
+            if ( orientation <= 2 )
+            {
+                for ( int y = 0; y < height; y += stripRows )
+                {
+                    int rows = std::min( stripRows, height - y );
+
+                    if ( !read( y, rows, strip.data(), srcStride ) ||
+                         !COrientPixels::Apply( strip.data(), width, rows, srcStride, oriented.data(), srcStride, bpp, orientation, threads ) ||
+                         !write( rows, oriented.data(), srcStride ) )
+                        return false;
+                }
+
+                return true;
+            }
+
+            if ( NULL == scratch )
+                return false;
+
+            // Pass 1. An oriented strip is an output band for 3 and 4, and a column of every output band for 5-8.
+            // Transposed strips are stripRows pixels wide and outHeight rows tall, so rows [ b * bandRows, ... )
+            // of one are already the contiguous tile for band b. Each strip's tiles get a slot of maximum size.
+
+            bool transposes = Transposes( orientation );
+            int bandRows = transposes ? (int) std::max( (size_t) 1, std::min( (size_t) outHeight, budget / ( 2 * outStride ) ) ) : stripRows;
+            int bands = ( outHeight + bandRows - 1 ) / bandRows;
+            unsigned long long tileSlot = transposes ? (unsigned long long) bandRows * stripRows * bpp : (unsigned long long) stripRows * outStride;
+
+            for ( int s = 0; s < strips; s++ )
+            {
+                int y = s * stripRows;
+                int rows = std::min( stripRows, height - y );
+                size_t orientedStride = transposes ? (size_t) rows * bpp : outStride;
+
+                if ( !read( y, rows, strip.data(), srcStride ) ||
+                     !COrientPixels::Apply( strip.data(), width, rows, srcStride, oriented.data(), orientedStride, bpp, orientation, threads ) )
+                    return false;
+
+                if ( transposes )
+                {
+                    for ( int b = 0; b < bands; b++ )
+                    {
+                        int tileRows = std::min( bandRows, outHeight - b * bandRows );
+
+                        if ( !ScratchWrite( scratch, ( (unsigned long long) b * strips + s ) * tileSlot, oriented.data() + (size_t) b * bandRows * orientedStride,
+                                            (size_t) tileRows * orientedStride ) )
+                            return false;
+                    }
+                }
+                else if ( !ScratchWrite( scratch, s * tileSlot, oriented.data(), (size_t) rows * outStride ) )
+                    return false;
+            }
+
+            // Pass 2. Reversing orientations put the first strip last.
+
+            std::vector<uint8_t>().swap( strip );
+            std::vector<uint8_t>().swap( oriented );
+            bool reverses = Reverses( orientation );
+
+            if ( !transposes )
+            {
+                std::vector<uint8_t> band( (size_t) stripRows * outStride );
+
+                for ( int i = 0; i < strips; i++ )
+                {
+                    int s = reverses ? strips - 1 - i : i;
+                    int rows = std::min( stripRows, height - s * stripRows );
+
+                    if ( !ScratchRead( scratch, s * tileSlot, band.data(), (size_t) rows * outStride ) || !write( rows, band.data(), outStride ) )
+                        return false;
+                }
+
+                return true;
+            }
+
+            std::vector<uint8_t> band( (size_t) bandRows * outStride ), tile( (size_t) tileSlot );
+
+            for ( int b = 0; b < bands; b++ )
+            {
+                int tileRows = std::min( bandRows, outHeight - b * bandRows );
+
+                for ( int s = 0; s < strips; s++ )
+                {
+                    int y = s * stripRows;
+                    int rows = std::min( stripRows, height - y );
+                    size_t tileStride = (size_t) rows * bpp;
+                    int x = reverses ? height - y - rows : y;
+
+                    if ( !ScratchRead( scratch, ( (unsigned long long) b * strips + s ) * tileSlot, tile.data(), (size_t) tileRows * tileStride ) )
+                        return false;
+
+                    for ( int r = 0; r < tileRows; r++ )
+                        memcpy( band.data() + (size_t) r * outStride + (size_t) x * bpp, tile.data() + (size_t) r * tileStride, tileStride );
+                }
+
+                if ( !write( tileRows, band.data(), outStride ) )
+                    return false;
+            }
+
+            return true;
+        } //Apply
+}; //COrientStream
@@ -80,6 +80,8 @@ extern "C" int nanosleep( const struct timespec * duration, struct timespec * re
     #include <sched.h>
     #include <unistd.h>
     #include <ctype.h>
+    #include <string.h>
+    #include <wchar.h>
 
     #define not_inlined __attribute__ ((noinline))
     #define force_inlined inline
@@ -108,6 +110,62 @@ extern "C" int nanosleep( const struct timespec * duration, struct timespec * re
     #define _stricmp strcasecmp
     #define MAX_PATH 1024
 
+    // Windows types used by headers that build for both Windows and Linux
+
+    typedef long long __int64;
+    typedef uint8_t BYTE;
+    typedef uint16_t WORD;
+    typedef uint32_t DWORD;
+    typedef int32_t LONG;
+    typedef uint32_t ULONG;
+    typedef unsigned long long ULONGLONG;
+    typedef int BOOL;
+    typedef wchar_t WCHAR;
+    typedef wchar_t * PWCHAR;
+
+    #ifndef __min
+        #define __min( a, b ) ( ( ( a ) < ( b ) ) ? ( a ) : ( b ) )
+        #define __max( a, b ) ( ( ( a ) > ( b ) ) ? ( a ) : ( b ) )
+    #endif
+
+    #define _wcsicmp wcscasecmp
+    #define _wcsnicmp wcsncasecmp
+
+    inline uint16_t _byteswap_ushort( uint16_t x ) { return __builtin_bswap16( x ); }
+    inline uint32_t _byteswap_ulong( uint32_t x ) { return __builtin_bswap32( x ); }
+    inline uint64_t _byteswap_uint64( uint64_t x ) { return __builtin_bswap64( x ); }
+
+    inline int strcpy_s( char * dst, size_t len, const char * src )
+    {
+        if ( 0 == len )
+            return -1;
+
+        strncpy( dst, src, len - 1 );
+        dst[ len - 1 ] = 0;
+        return 0;
+    } //strcpy_s
+
+    inline int wcscpy_s( wchar_t * dst, size_t len, const wchar_t * src )
+    {
+        if ( 0 == len )
+            return -1;
+
+        wcsncpy( dst, src, len - 1 );
+        dst[ len - 1 ] = 0;
+        return 0;
+    } //wcscpy_s
+
+    template <typename... Args> inline int sprintf_s( char * dst, size_t len, const char * format, Args... args )
+    {
+        // like the msft version, return the count of characters written, not the count that would have been
+
+        int written = snprintf( dst, len, format, args... );
+        if ( written < 0 || 0 == len )
+            return 0;
+
+        return ( (size_t) written >= len ) ? (int) ( len - 1 ) : written;
+    } //sprintf_s
+
     inline char * strupr( char * s )
     {
         for ( char * t = s; *t; t++ )
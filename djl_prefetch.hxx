@@ -0,0 +1,442 @@
+#pragma once
+
+//
+// Opens many files and reads the first page of each at once, so a batch of metadata parses isn't a serial chain
+// of open/seek/read on each thread with a queue depth of 1. Parsers wait for each header as it lands, parse
+// through the file it was read from, and seed their CStream cache with it; most JPG and RAW metadata is in that
+// first page, and reads beyond it are issued by the parser as usual. Each file stays open until it's released.
+//
+// With PV_IO_URING defined on Linux the opens and reads are queued on an io_uring, each open followed by its
+// read as it completes. Otherwise, or if the kernel won't create a ring, a pool of threads keeps that many
+// synchronous reads in flight.
+//
+
+#include <djl_os.hxx>
+#include <djltrace.hxx>
+#include <djl_strm.hxx>
+
+#include <atomic>
+#include <memory>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#if defined( PV_IO_URING ) && !defined( _WIN32 )
+    #include <fcntl.h>
+    #include <unistd.h>
+    #include <sys/mman.h>
+    #include <sys/syscall.h>
+    #include <linux/io_uring.h>
+#endif
+
+using namespace std;
+
+class CHeaderPrefetch
+{
+    private:
+        struct Header
+        {
+            unique_ptr<BYTE[]> data;  // not value-initialized; only bytes of it are ever read
+            ULONG bytes;
+            bool ready;
+            bool endsFile;          // the bytes read are the whole file
+            CStream::FileHandle file; // open until Release()
+#if defined( PV_IO_URING ) && !defined( _WIN32 )
+            char acPath[ MAX_PATH + 1 ];
+#endif
+        };
+
+        const WCHAR * const * ppwcPaths;
+        size_t count;
+        ULONG headerBytes;
+        size_t window;              // headers read but not yet released are limited to this many
+        vector<Header> headers;
+        vector<thread> threads;
+        atomic<size_t> next;
+        size_t released;
+        bool stopping;
+        std::mutex mtx;
+        condition_variable cvReady;
+        condition_variable cvReleased;
+
+        bool WaitForWindow( size_t i )
+        {
+            // Don't read further ahead of the parsers than the window, so memory doesn't grow with the batch
+
+            unique_lock<mutex> lock( mtx );
+            cvReleased.wait( lock, [&] { return stopping || ( i < ( released + window ) ); } );
+            return !stopping;
+        } //WaitForWindow
+
+        void Complete( size_t i, ULONG bytes, __int64 fileLength )
+        {
+            // A read can return less than was asked for before the end of a file on network file systems, so
+            // only the file's length says whether the header is all of it.
+
+            Header & h = headers[ i ];
+            h.bytes = bytes;
+            h.endsFile = ( fileLength >= 0 && (__int64) bytes >= fileLength );
+
+            lock_guard<mutex> lock( mtx );
+            h.ready = true;
+            cvReady.notify_all();
+        } //Complete
+
+        void ReadHeaders()
+        {
+            for ( size_t i = next++; i < count; i = next++ )
+            {
+                if ( !WaitForWindow( i ) )
+                    return;
+
+                Header & h = headers[ i ];
+                ULONG bytes = 0;
+                __int64 fileLength = -1;
+                CStream stream( ppwcPaths[ i ] );
+
+                if ( stream.Ok() )
+                {
+                    h.data.reset( new BYTE[ headerBytes ] );
+                    bytes = stream.Read( h.data.get(), headerBytes );
+                    fileLength = stream.Length();
+                    h.file = stream.Detach();
+                }
+
+                Complete( i, bytes, fileLength );
+            }
+        } //ReadHeaders
+
+#if defined( PV_IO_URING ) && !defined( _WIN32 )
+
+        struct Ring
+        {
+            int fd;
+            void * pSQ;
+            size_t cbSQ;
+            void * pCQ;
+            size_t cbCQ;
+            io_uring_sqe * pSQEs;
+            size_t cbSQEs;
+            unsigned * sqHead;
+            unsigned * sqTail;
+            unsigned * sqMask;
+            unsigned * sqArray;
+            unsigned * cqHead;
+            unsigned * cqTail;
+            unsigned * cqMask;
+            io_uring_cqe * pCQEs;
+            unsigned pendingSubmits;
+        };
+
+        Ring ring;
+
+        bool CreateRing( unsigned entries )
+        {
+            memset( &ring, 0, sizeof( ring ) );
+            ring.fd = -1;
+
+            io_uring_params params;
+            memset( &params, 0, sizeof( params ) );
+
+            int fd = (int) syscall( __NR_io_uring_setup, entries, &params );
+            if ( fd < 0 )
+                return false;
+
+            ring.fd = fd;
+            ring.cbSQ = params.sq_off.array + params.sq_entries * sizeof( unsigned );
+            ring.cbCQ = params.cq_off.cqes + params.cq_entries * sizeof( io_uring_cqe );
+
+            if ( params.features & IORING_FEAT_SINGLE_MMAP )
+                ring.cbSQ = ring.cbCQ = __max( ring.cbSQ, ring.cbCQ );
+
+            ring.pSQ = mmap( NULL, ring.cbSQ, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING );
+            if ( MAP_FAILED == ring.pSQ )
+            {
+                ring.pSQ = NULL;
+                return false;
+            }
+
+            if ( params.features & IORING_FEAT_SINGLE_MMAP )
+                ring.pCQ = ring.pSQ;
+            else
+            {
+                ring.pCQ = mmap( NULL, ring.cbCQ, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING );
+                if ( MAP_FAILED == ring.pCQ )
+                {
+                    ring.pCQ = NULL;
+                    return false;
+                }
+            }
+
+            ring.cbSQEs = params.sq_entries * sizeof( io_uring_sqe );
+            void * pSQEs = mmap( NULL, ring.cbSQEs, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES );
+            if ( MAP_FAILED == pSQEs )
+                return false;
+
+            ring.pSQEs = (io_uring_sqe *) pSQEs;
+
+            BYTE * pSQ = (BYTE *) ring.pSQ;
+            ring.sqHead = (unsigned *) ( pSQ + params.sq_off.head );
+            ring.sqTail = (unsigned *) ( pSQ + params.sq_off.tail );
+            ring.sqMask = (unsigned *) ( pSQ + params.sq_off.ring_mask );
+            ring.sqArray = (unsigned *) ( pSQ + params.sq_off.array );
+
+            BYTE * pCQ = (BYTE *) ring.pCQ;
+            ring.cqHead = (unsigned *) ( pCQ + params.cq_off.head );
+            ring.cqTail = (unsigned *) ( pCQ + params.cq_off.tail );
+            ring.cqMask = (unsigned *) ( pCQ + params.cq_off.ring_mask );
+            ring.pCQEs = (io_uring_cqe *) ( pCQ + params.cq_off.cqes );
+            return true;
+        } //CreateRing
+
+        void FreeRing()
+        {
+            if ( NULL != ring.pSQEs )
+                munmap( ring.pSQEs, ring.cbSQEs );
+
+            if ( NULL != ring.pCQ && ring.pCQ != ring.pSQ )
+                munmap( ring.pCQ, ring.cbCQ );
+
+            if ( NULL != ring.pSQ )
+                munmap( ring.pSQ, ring.cbSQ );
+
+            if ( -1 != ring.fd )
+                close( ring.fd );
+
+            memset( &ring, 0, sizeof( ring ) );
+            ring.fd = -1;
+        } //FreeRing
+
+        io_uring_sqe * NextSQE( size_t i, bool isRead )
+        {
+            // The ring has twice as many entries as requests in flight, so there's always room
+
+            unsigned tail = *ring.sqTail;
+            unsigned index = tail & *ring.sqMask;
+            io_uring_sqe * sqe = & ring.pSQEs[ index ];
+            memset( sqe, 0, sizeof( *sqe ) );
+            sqe->user_data = ( i << 1 ) | ( isRead ? 1 : 0 );
+            ring.sqArray[ index ] = index;
+            __atomic_store_n( ring.sqTail, tail + 1, __ATOMIC_RELEASE );
+            ring.pendingSubmits++;
+            return sqe;
+        } //NextSQE
+
+        void QueueOpen( size_t i )
+        {
+            io_uring_sqe * sqe = NextSQE( i, false );
+            sqe->opcode = IORING_OP_OPENAT;
+            sqe->fd = AT_FDCWD;
+            sqe->addr = (ULONGLONG) headers[ i ].acPath;
+            sqe->open_flags = O_RDONLY | O_CLOEXEC;
+        } //QueueOpen
+
+        void QueueRead( size_t i )
+        {
+            Header & h = headers[ i ];
+            h.data.reset( new BYTE[ headerBytes ] );
+
+            io_uring_sqe * sqe = NextSQE( i, true );
+            sqe->opcode = IORING_OP_READ;
+            sqe->fd = h.file;
+            sqe->addr = (ULONGLONG) h.data.get();
+            sqe->len = headerBytes;
+            sqe->off = 0;
+        } //QueueRead
+
+        void RingHeaders( unsigned depth )
+        {
+            // Each file is a two-step state machine: the open completes, then its read is queued.
+            // Completions arrive in any order; a file's header is published as soon as its read lands.
+
+            size_t nextOpen = 0;
+            size_t done = 0;
+            unsigned inFlight = 0;
+
+            while ( done < count )
+            {
+                while ( inFlight < depth && nextOpen < count )
+                {
+                    {
+                        lock_guard<mutex> lock( mtx );
+                        if ( stopping || nextOpen >= ( released + window ) )
+                            break;
+                    }
+
+                    Header & h = headers[ nextOpen ];
+                    size_t converted = wcstombs( h.acPath, ppwcPaths[ nextOpen ], sizeof( h.acPath ) );
+
+                    if ( (size_t) -1 == converted || converted >= sizeof( h.acPath ) )
+                    {
+                        Complete( nextOpen, 0, -1 );
+                        done++;
+                    }
+                    else
+                    {
+                        QueueOpen( nextOpen );
+                        inFlight++;
+                    }
+
+                    nextOpen++;
+                }
+
+                if ( 0 == inFlight )
+                {
+                    if ( done >= count )
+                        break;
+
+                    // the window is full; wait for the parsers to catch up
+
+                    if ( !WaitForWindow( nextOpen ) )
+                        break;
+
+                    continue;
+                }
+
+                int result = (int) syscall( __NR_io_uring_enter, ring.fd, ring.pendingSubmits, 1, IORING_ENTER_GETEVENTS, NULL, 0 );
+                if ( result < 0 && EINTR != errno )
+                {
+                    tracer.Trace( "io_uring_enter failed with errno %d\n", errno );
+                    break;
+                }
+
+                if ( result > 0 )
+                    ring.pendingSubmits -= __min( (unsigned) result, ring.pendingSubmits );
+
+                unsigned head = *ring.cqHead;
+
+                while ( head != __atomic_load_n( ring.cqTail, __ATOMIC_ACQUIRE ) )
+                {
+                    io_uring_cqe & cqe = ring.pCQEs[ head & *ring.cqMask ];
+                    size_t i = (size_t) ( cqe.user_data >> 1 );
+                    bool isRead = ( 0 != ( cqe.user_data & 1 ) );
+                    Header & h = headers[ i ];
+
+                    if ( !isRead && cqe.res >= 0 )
+                    {
+                        h.file = cqe.res;
+                        QueueRead( i );
+                    }
+                    else
+                    {
+                        // the file stays open for the parser; a failed read still leaves it usable
+
+                        __int64 fileLength = -1;
+                        struct stat st;
+                        if ( isRead && 0 == fstat( h.file, &st ) )
+                            fileLength = st.st_size;
+
+                        Complete( i, ( isRead && cqe.res > 0 ) ? (ULONG) cqe.res : 0, fileLength );
+                        inFlight--;
+                        done++;
+                    }
+
+                    head++;
+                }
+
+                __atomic_store_n( ring.cqHead, head, __ATOMIC_RELEASE );
+            }
+
+            // anything not read (shutdown or a ring failure) is published empty so no waiter hangs. A file opened
+            // whose read never completed is closed, since the kernel may still write to its buffer until the ring goes.
+
+            for ( size_t i = 0; i < count; i++ )
+            {
+                if ( !headers[ i ].ready )
+                {
+                    CStream::CloseFileHandle( headers[ i ].file );
+                    headers[ i ].file = CStream::InvalidHandle();
+                    Complete( i, 0, -1 );
+                }
+            }
+        } //RingHeaders
+
+#endif // PV_IO_URING
+
+    public:
+        // depth is the number of reads kept in flight at once
+
+        CHeaderPrefetch( const WCHAR * const * paths, size_t pathCount, unsigned depth = 32, ULONG bytes = CStream::DefaultPageBytes ) :
+            ppwcPaths( paths ), count( pathCount ), headerBytes( bytes ), next( 0 ), released( 0 ), stopping( false )
+        {
+            if ( 0 == depth )
+                depth = 1;
+
+            window = 4 * (size_t) depth;
+            headers.resize( count );
+
+            for ( size_t i = 0; i < count; i++ )
+            {
+                headers[ i ].bytes = 0;
+                headers[ i ].ready = false;
+                headers[ i ].endsFile = false;
+                headers[ i ].file = CStream::InvalidHandle();
+            }
+
+            if ( 0 == count )
+                return;
+
+#if defined( PV_IO_URING ) && !defined( _WIN32 )
+            if ( CreateRing( 2 * depth ) )
+            {
+                threads.push_back( thread( [this, depth] { RingHeaders( depth ); FreeRing(); } ) );
+                return;
+            }
+
+            tracer.Trace( "io_uring isn't available (errno %d), so headers are read by a thread pool\n", errno );
+            FreeRing();
+#endif
+
+            unsigned threadCount = (unsigned) __min( (size_t) depth, count );
+
+            for ( unsigned t = 0; t < threadCount; t++ )
+                threads.push_back( thread( [this] { ReadHeaders(); } ) );
+        } //CHeaderPrefetch
+
+        ~CHeaderPrefetch()
+        {
+            {
+                lock_guard<mutex> lock( mtx );
+                stopping = true;
+                cvReleased.notify_all();
+            }
+
+            for ( size_t t = 0; t < threads.size(); t++ )
+                threads[ t ].join();
+
+            for ( size_t i = 0; i < headers.size(); i++ )
+                CStream::CloseFileHandle( headers[ i ].file );
+        } //~CHeaderPrefetch
+
+        // Block until the header of file i has been read. Returns the bytes read, 0 if the file couldn't be read.
+        // file is the open file, or CStream::InvalidHandle() if it couldn't be opened. Both stay valid until Release( i ).
+
+        ULONG Wait( size_t i, const BYTE ** ppData, bool & endsFile, CStream::FileHandle & file )
+        {
+            Header & h = headers[ i ];
+
+            {
+                unique_lock<mutex> lock( mtx );
+                cvReady.wait( lock, [&] { return h.ready; } );
+            }
+
+            *ppData = h.data.get();
+            endsFile = h.endsFile;
+            file = h.file;
+            return h.bytes;
+        } //Wait
+
+        // Call once per file when its header is no longer needed, so reads further ahead can start
+
+        void Release( size_t i )
+        {
+            headers[ i ].data.reset();
+            CStream::CloseFileHandle( headers[ i ].file );
+            headers[ i ].file = CStream::InvalidHandle();
+
+            lock_guard<mutex> lock( mtx );
+            released++;
+            cvReleased.notify_all();
+        } //Release
+}; //CHeaderPrefetch
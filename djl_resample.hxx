@@ -0,0 +1,619 @@
+#pragma once
+
+//
+// Resamples 32bpp BGRA and 24bpp BGR images on the CPU with a cubic or Lanczos kernel, for fitting images to the
+// window and for thumbnails and exports that run without D2D. The filter is separable. Each band of output rows
+// filters the source rows it needs horizontally into a small ring of float rows, and each output row is then a
+// weighted sum of ring rows, so memory stays small however large the image. Bands run on separate threads.
+// The inner loops use AVX2 or SSE4.1 on x86 and x64 (whichever the CPU has) and NEON on ARM64, and the scalar
+// code is both the fallback and the reference the others are checked against.
+//
+// Channels are filtered independently and the channel order doesn't matter. 32bpp images should have premultiplied
+// alpha (as WIC's PBGRA and D2D bitmaps do) so transparent edges don't bleed color. Nothing here depends on Windows.
+//
+
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+#if defined( _M_X64 ) || defined( _M_IX86 ) || defined( __x86_64__ ) || defined( __i386__ )
+    #define DJL_RESAMPLE_X86
+    #include <immintrin.h>
+    #ifdef _MSC_VER
+        #include <intrin.h>
+        #define DJL_TARGET_SSE41
+        #define DJL_TARGET_AVX2
+    #else
+        #define DJL_TARGET_SSE41 __attribute__(( target( "sse4.1" ) ))
+        #define DJL_TARGET_AVX2 __attribute__(( target( "avx2,fma" ) ))
+    #endif
+#elif defined( _M_ARM64 ) || defined( __aarch64__ )
+    #define DJL_RESAMPLE_NEON
+    #include <arm_neon.h>
+#endif
+
+class CResample
+{
+    public:
+        enum Kernel { Cubic, Lanczos3 };
+        enum Code { Scalar, SSE41, AVX2, NEON };
+
+    private:
+        // Which source pixels each output pixel along one axis is made of, and their weights
+
+        struct Axis
+        {
+            int maxTaps;
+            std::vector<int> start;
+            std::vector<int> count;
+            std::vector<float> weights;    // maxTaps per output pixel
+
+            const float * Weights( int i ) const { return weights.data() + (size_t) i * maxTaps; }
+
+            void Build( int srcSize, int dstSize, Kernel kernel )
+            {
+                // Pixel j covers [ j, j + 1 ) so its center is j + 0.5. Shrinking widens the kernel by the scale
+                // so every source pixel contributes. Taps that fall off the image are dropped and the rest
+                // renormalized, which keeps edges from darkening.
+
+                double scale = (double) srcSize / (double) dstSize;
+                double filterScale = std::max( 1.0, scale );
+                double support = KernelSupport( kernel ) * filterScale;
+
+                maxTaps = (int) ceil( 2.0 * support ) + 2;
+                start.resize( dstSize );
+                count.resize( dstSize );
+                weights.assign( (size_t) dstSize * maxTaps, 0.0f );
+
+                std::vector<double> w( maxTaps );
+
+                for ( int i = 0; i < dstSize; i++ )
+                {
+                    double center = ( i + 0.5 ) * scale;
+                    int left = std::max( 0, (int) floor( center - support ) );
+                    int right = std::min( srcSize, (int) ceil( center + support ) );
+                    double sum = 0.0;
+
+                    for ( int j = left; j < right; j++ )
+                    {
+                        w[ j - left ] = KernelAt( kernel, ( j + 0.5 - center ) / filterScale );
+                        sum += w[ j - left ];
+                    }
+
+                    int first = 0;
+                    int last = right - left;
+
+                    while ( first < last && 0.0 == w[ first ] )
+                        first++;
+
+                    while ( last > first && 0.0 == w[ last - 1 ] )
+                        last--;
+
+                    float * pw = weights.data() + (size_t) i * maxTaps;
+
+                    if ( sum <= 0.0 || first == last )
+                    {
+                        start[ i ] = std::min( srcSize - 1, std::max( 0, (int) center ) );
+                        count[ i ] = 1;
+                        pw[ 0 ] = 1.0f;
+                        continue;
+                    }
+
+                    start[ i ] = left + first;
+                    count[ i ] = last - first;
+
+                    for ( int t = first; t < last; t++ )
+                        pw[ t - first ] = (float) ( w[ t ] / sum );
+                }
+            } //Build
+        }; //Axis
+
+        struct Job
+        {
+            const uint8_t * src;
+            size_t srcStride;
+            int srcWidth;
+            uint8_t * dst;
+            size_t dstStride;
+            int dstWidth;
+            int bpp;
+            Code code;
+            Axis horizontal;
+            Axis vertical;
+        };
+
+        static double KernelSupport( Kernel kernel ) { return ( Lanczos3 == kernel ) ? 3.0 : 2.0; }
+
+        static double Sinc( double x )
+        {
+            if ( 0.0 == x )
+                return 1.0;
+
+            x *= 3.14159265358979323846;
+            return sin( x ) / x;
+        } //Sinc
+
+        static double KernelAt( Kernel kernel, double x )
+        {
+            x = fabs( x );
+
+            if ( Lanczos3 == kernel )
+                return ( x < 3.0 ) ? Sinc( x ) * Sinc( x / 3.0 ) : 0.0;
+
+            // Catmull-Rom: the cubic with a = -0.5, which keeps edges sharp without much ringing
+
+            const double a = -0.5;
+
+            if ( x < 1.0 )
+                return ( ( a + 2.0 ) * x - ( a + 3.0 ) ) * x * x + 1.0;
+
+            if ( x < 2.0 )
+                return ( ( a * x - 5.0 * a ) * x + 8.0 * a ) * x - 4.0 * a;
+
+            return 0.0;
+        } //KernelAt
+
+        static uint8_t ToByte( float v )
+        {
+            v = std::min( 255.0f, std::max( 0.0f, v ) );
+            return (uint8_t) ( v + 0.5f );
+        } //ToByte
+
+        // A pixel as 4 bytes. 24bpp pixels read the next pixel's first byte when that's in the row, and zero
+        // otherwise; the 4th channel of a 24bpp image is computed but never written.
+
+        static uint32_t LoadPixel( const uint8_t * p, int bpp, const uint8_t * pRowEnd )
+        {
+            uint32_t v;
+
+            if ( 4 == bpp || p + 4 <= pRowEnd )
+                memcpy( &v, p, 4 );
+            else
+                v = (uint32_t) p[ 0 ] | ( (uint32_t) p[ 1 ] << 8 ) | ( (uint32_t) p[ 2 ] << 16 );
+
+            return v;
+        } //LoadPixel
+
+        // Horizontal passes: one row of source pixels to a row of 4 floats per output pixel
+
+        static void HorizontalScalar( const uint8_t * src, const uint8_t * pRowEnd, int bpp, const Axis & axis, int width, float * out )
+        {
+            for ( int x = 0; x < width; x++, out += 4 )
+            {
+                const float * w = axis.Weights( x );
+                const uint8_t * p = src + (size_t) axis.start[ x ] * bpp;
+                float sum[ 4 ] = { 0.0f, 0.0f, 0.0f, 0.0f };
+
+                for ( int t = 0; t < axis.count[ x ]; t++, p += bpp )
+                {
+                    uint32_t v = LoadPixel( p, bpp, pRowEnd );
+
+                    for ( int c = 0; c < 4; c++ )
+                        sum[ c ] += w[ t ] * (float) ( ( v >> ( 8 * c ) ) & 0xff );
+                }
+
+                memcpy( out, sum, sizeof( sum ) );
+            }
+        } //HorizontalScalar
+
+        // Vertical passes: a weighted sum of count float rows to one row of output pixels
+
+        static void VerticalScalar( const float * const * rows, const float * w, int count, int width, uint8_t * dst, int bpp )
+        {
+            for ( int x = 0; x < width; x++, dst += bpp )
+            {
+                float sum[ 4 ] = { 0.0f, 0.0f, 0.0f, 0.0f };
+
+                for ( int t = 0; t < count; t++ )
+                    for ( int c = 0; c < 4; c++ )
+                        sum[ c ] += w[ t ] * rows[ t ][ 4 * x + c ];
+
+                for ( int c = 0; c < bpp; c++ )
+                    dst[ c ] = ToByte( sum[ c ] );
+            }
+        } //VerticalScalar
+
+#ifdef DJL_RESAMPLE_X86
+
+        DJL_TARGET_SSE41 static __m128 PixelToFloats( uint32_t v )
+        {
+            return _mm_cvtepi32_ps( _mm_cvtepu8_epi32( _mm_cvtsi32_si128( (int) v ) ) );
+        } //PixelToFloats
+
+        // Clamp 4 pixels of floats to 0..255, round, and store them as bpp bytes each
+
+        DJL_TARGET_SSE41 static void StoreFour( __m128 a, __m128 b, __m128 c, __m128 d, uint8_t * dst, int bpp )
+        {
+            const __m128 zero = _mm_setzero_ps();
+            const __m128 max = _mm_set1_ps( 255.0f );
+            const __m128 half = _mm_set1_ps( 0.5f );
+
+            __m128i ia = _mm_cvttps_epi32( _mm_add_ps( _mm_min_ps( _mm_max_ps( a, zero ), max ), half ) );
+            __m128i ib = _mm_cvttps_epi32( _mm_add_ps( _mm_min_ps( _mm_max_ps( b, zero ), max ), half ) );
+            __m128i ic = _mm_cvttps_epi32( _mm_add_ps( _mm_min_ps( _mm_max_ps( c, zero ), max ), half ) );
+            __m128i id = _mm_cvttps_epi32( _mm_add_ps( _mm_min_ps( _mm_max_ps( d, zero ), max ), half ) );
+            __m128i bytes = _mm_packus_epi16( _mm_packus_epi32( ia, ib ), _mm_packus_epi32( ic, id ) );
+
+            if ( 4 == bpp )
+                _mm_storeu_si128( (__m128i *) dst, bytes );
+            else
+            {
+                bytes = _mm_shuffle_epi8( bytes, _mm_setr_epi8( 0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1 ) );
+                _mm_storel_epi64( (__m128i *) dst, bytes );
+                int last = _mm_cvtsi128_si32( _mm_srli_si128( bytes, 8 ) );
+                memcpy( dst + 8, &last, 4 );
+            }
+        } //StoreFour
+
+        DJL_TARGET_SSE41 static void StoreOne( __m128 a, uint8_t * dst, int bpp )
+        {
+            a = _mm_add_ps( _mm_min_ps( _mm_max_ps( a, _mm_setzero_ps() ), _mm_set1_ps( 255.0f ) ), _mm_set1_ps( 0.5f ) );
+            __m128i i = _mm_cvttps_epi32( a );
+            int v = _mm_cvtsi128_si32( _mm_packus_epi16( _mm_packus_epi32( i, i ), _mm_setzero_si128() ) );
+            memcpy( dst, &v, bpp );
+        } //StoreOne
+
+        DJL_TARGET_SSE41 static void HorizontalSSE41( const uint8_t * src, const uint8_t * pRowEnd, int bpp, const Axis & axis, int width, float * out )
+        {
+            for ( int x = 0; x < width; x++, out += 4 )
+            {
+                const float * w = axis.Weights( x );
+                const uint8_t * p = src + (size_t) axis.start[ x ] * bpp;
+                int count = axis.count[ x ];
+                __m128 sum = _mm_setzero_ps();
+
+                for ( int t = 0; t < count; t++, p += bpp )
+                    sum = _mm_add_ps( sum, _mm_mul_ps( PixelToFloats( LoadPixel( p, bpp, pRowEnd ) ), _mm_set1_ps( w[ t ] ) ) );
+
+                _mm_storeu_ps( out, sum );
+            }
+        } //HorizontalSSE41
+
+        DJL_TARGET_SSE41 static void VerticalSSE41( const float * const * rows, const float * w, int count, int width, uint8_t * dst, int bpp )
+        {
+            int x = 0;
+
+            for ( ; x + 4 <= width; x += 4, dst += 4 * bpp )
+            {
+                __m128 a = _mm_setzero_ps(), b = _mm_setzero_ps(), c = _mm_setzero_ps(), d = _mm_setzero_ps();
+
+                for ( int t = 0; t < count; t++ )
+                {
+                    const float * r = rows[ t ] + 4 * x;
+                    __m128 wt = _mm_set1_ps( w[ t ] );
+                    a = _mm_add_ps( a, _mm_mul_ps( _mm_loadu_ps( r ), wt ) );
+                    b = _mm_add_ps( b, _mm_mul_ps( _mm_loadu_ps( r + 4 ), wt ) );
+                    c = _mm_add_ps( c, _mm_mul_ps( _mm_loadu_ps( r + 8 ), wt ) );
+                    d = _mm_add_ps( d, _mm_mul_ps( _mm_loadu_ps( r + 12 ), wt ) );
+                }
+
+                StoreFour( a, b, c, d, dst, bpp );
+            }
+
+            for ( ; x < width; x++, dst += bpp )
+            {
+                __m128 a = _mm_setzero_ps();
+
+                for ( int t = 0; t < count; t++ )
+                    a = _mm_add_ps( a, _mm_mul_ps( _mm_loadu_ps( rows[ t ] + 4 * x ), _mm_set1_ps( w[ t ] ) ) );
+
+                StoreOne( a, dst, bpp );
+            }
+        } //VerticalSSE41
+
+        DJL_TARGET_AVX2 static void HorizontalAVX2( const uint8_t * src, const uint8_t * pRowEnd, int bpp, const Axis & axis, int width, float * out )
+        {
+            // Two taps per step: both pixels widen to 8 floats, and the two weights spread to match
+
+            const __m256i spread = _mm256_setr_epi32( 0, 0, 0, 0, 1, 1, 1, 1 );
+
+            for ( int x = 0; x < width; x++, out += 4 )
+            {
+                const float * w = axis.Weights( x );
+                const uint8_t * p = src + (size_t) axis.start[ x ] * bpp;
+                int count = axis.count[ x ];
+                __m256 sum2 = _mm256_setzero_ps();
+                int t = 0;
+
+                for ( ; t + 2 <= count; t += 2, p += 2 * bpp )
+                {
+                    __m128i two = ( 4 == bpp ) ? _mm_loadl_epi64( (const __m128i *) p ) :
+                                                 _mm_unpacklo_epi32( _mm_cvtsi32_si128( (int) LoadPixel( p, bpp, pRowEnd ) ),
+                                                                     _mm_cvtsi32_si128( (int) LoadPixel( p + bpp, bpp, pRowEnd ) ) );
+                    __m256 pixels = _mm256_cvtepi32_ps( _mm256_cvtepu8_epi32( two ) );
+                    __m256 weights = _mm256_permutevar8x32_ps( _mm256_castps128_ps256( _mm_castsi128_ps( _mm_loadl_epi64( (const __m128i *) ( w + t ) ) ) ), spread );
+                    sum2 = _mm256_fmadd_ps( pixels, weights, sum2 );
+                }
+
+                __m128 sum = _mm_add_ps( _mm256_castps256_ps128( sum2 ), _mm256_extractf128_ps( sum2, 1 ) );
+
+                if ( t < count )
+                    sum = _mm_fmadd_ps( PixelToFloats( LoadPixel( p, bpp, pRowEnd ) ), _mm_set1_ps( w[ t ] ), sum );
+
+                _mm_storeu_ps( out, sum );
+            }
+        } //HorizontalAVX2
+
+        DJL_TARGET_AVX2 static void VerticalAVX2( const float * const * rows, const float * w, int count, int width, uint8_t * dst, int bpp )
+        {
+            int x = 0;
+
+            for ( ; x + 4 <= width; x += 4, dst += 4 * bpp )
+            {
+                __m256 ab = _mm256_setzero_ps(), cd = _mm256_setzero_ps();
+
+                for ( int t = 0; t < count; t++ )
+                {
+                    const float * r = rows[ t ] + 4 * x;
+                    __m256 wt = _mm256_set1_ps( w[ t ] );
+                    ab = _mm256_fmadd_ps( _mm256_loadu_ps( r ), wt, ab );
+                    cd = _mm256_fmadd_ps( _mm256_loadu_ps( r + 8 ), wt, cd );
+                }
+
+                StoreFour( _mm256_castps256_ps128( ab ), _mm256_extractf128_ps( ab, 1 ),
+                           _mm256_castps256_ps128( cd ), _mm256_extractf128_ps( cd, 1 ), dst, bpp );
+            }
+
+            for ( ; x < width; x++, dst += bpp )
+            {
+                __m128 a = _mm_setzero_ps();
+
+                for ( int t = 0; t < count; t++ )
+                    a = _mm_fmadd_ps( _mm_loadu_ps( rows[ t ] + 4 * x ), _mm_set1_ps( w[ t ] ), a );
+
+                StoreOne( a, dst, bpp );
+            }
+        } //VerticalAVX2
+
+#endif // DJL_RESAMPLE_X86
+
+#ifdef DJL_RESAMPLE_NEON
+
+        static float32x4_t PixelToFloats( uint32_t v )
+        {
+            uint16x4_t u16 = vget_low_u16( vmovl_u8( vcreate_u8( v ) ) );
+            return vcvtq_f32_u32( vmovl_u16( u16 ) );
+        } //PixelToFloats
+
+        static uint16x4_t ToWords( float32x4_t a )
+        {
+            a = vaddq_f32( vminq_f32( vmaxq_f32( a, vdupq_n_f32( 0.0f ) ), vdupq_n_f32( 255.0f ) ), vdupq_n_f32( 0.5f ) );
+            return vmovn_u32( vcvtq_u32_f32( a ) );
+        } //ToWords
+
+        static void HorizontalNEON( const uint8_t * src, const uint8_t * pRowEnd, int bpp, const Axis & axis, int width, float * out )
+        {
+            for ( int x = 0; x < width; x++, out += 4 )
+            {
+                const float * w = axis.Weights( x );
+                const uint8_t * p = src + (size_t) axis.start[ x ] * bpp;
+                int count = axis.count[ x ];
+                float32x4_t sum = vdupq_n_f32( 0.0f );
+
+                for ( int t = 0; t < count; t++, p += bpp )
+                    sum = vmlaq_n_f32( sum, PixelToFloats( LoadPixel( p, bpp, pRowEnd ) ), w[ t ] );
+
+                vst1q_f32( out, sum );
+            }
+        } //HorizontalNEON
+
+        static void VerticalNEON( const float * const * rows, const float * w, int count, int width, uint8_t * dst, int bpp )
+        {
+            int x = 0;
+
+            for ( ; x + 4 <= width; x += 4, dst += 4 * bpp )
+            {
+                float32x4_t a = vdupq_n_f32( 0.0f ), b = a, c = a, d = a;
+
+                for ( int t = 0; t < count; t++ )
+                {
+                    const float * r = rows[ t ] + 4 * x;
+                    a = vmlaq_n_f32( a, vld1q_f32( r ), w[ t ] );
+                    b = vmlaq_n_f32( b, vld1q_f32( r + 4 ), w[ t ] );
+                    c = vmlaq_n_f32( c, vld1q_f32( r + 8 ), w[ t ] );
+                    d = vmlaq_n_f32( d, vld1q_f32( r + 12 ), w[ t ] );
+                }
+
+                uint8x16_t bytes = vcombine_u8( vmovn_u16( vcombine_u16( ToWords( a ), ToWords( b ) ) ),
+                                                vmovn_u16( vcombine_u16( ToWords( c ), ToWords( d ) ) ) );
+
+                if ( 4 == bpp )
+                    vst1q_u8( dst, bytes );
+                else
+                {
+                    uint8_t four[ 16 ];
+                    vst1q_u8( four, bytes );
+
+                    for ( int i = 0; i < 4; i++ )
+                        memcpy( dst + 3 * i, four + 4 * i, 3 );
+                }
+            }
+
+            for ( ; x < width; x++, dst += bpp )
+            {
+                float32x4_t a = vdupq_n_f32( 0.0f );
+
+                for ( int t = 0; t < count; t++ )
+                    a = vmlaq_n_f32( a, vld1q_f32( rows[ t ] + 4 * x ), w[ t ] );
+
+                uint32_t v = vget_lane_u32( vreinterpret_u32_u8( vmovn_u16( vcombine_u16( ToWords( a ), ToWords( a ) ) ) ), 0 );
+                memcpy( dst, &v, bpp );
+            }
+        } //VerticalNEON
+
+#endif // DJL_RESAMPLE_NEON
+
+        static void Horizontal( const Job & job, const uint8_t * src, float * out )
+        {
+            const uint8_t * pRowEnd = src + (size_t) job.srcWidth * job.bpp;
+
+#ifdef DJL_RESAMPLE_X86
+            if ( AVX2 == job.code )
+                return HorizontalAVX2( src, pRowEnd, job.bpp, job.horizontal, job.dstWidth, out );
+            if ( SSE41 == job.code )
+                return HorizontalSSE41( src, pRowEnd, job.bpp, job.horizontal, job.dstWidth, out );
+#endif
+#ifdef DJL_RESAMPLE_NEON
+            if ( NEON == job.code )
+                return HorizontalNEON( src, pRowEnd, job.bpp, job.horizontal, job.dstWidth, out );
+#endif
+            HorizontalScalar( src, pRowEnd, job.bpp, job.horizontal, job.dstWidth, out );
+        } //Horizontal
+
+        static void Vertical( const Job & job, const float * const * rows, int y )
+        {
+            const float * w = job.vertical.Weights( y );
+            int count = job.vertical.count[ y ];
+            uint8_t * dst = job.dst + (size_t) y * job.dstStride;
+
+#ifdef DJL_RESAMPLE_X86
+            if ( AVX2 == job.code )
+                return VerticalAVX2( rows, w, count, job.dstWidth, dst, job.bpp );
+            if ( SSE41 == job.code )
+                return VerticalSSE41( rows, w, count, job.dstWidth, dst, job.bpp );
+#endif
+#ifdef DJL_RESAMPLE_NEON
+            if ( NEON == job.code )
+                return VerticalNEON( rows, w, count, job.dstWidth, dst, job.bpp );
+#endif
+            VerticalScalar( rows, w, count, job.dstWidth, dst, job.bpp );
+        } //Vertical
+
+        static void Band( const Job & job, int yStart, int yEnd )
+        {
+            // Source row r is filtered into ring slot r % slots. Each output row needs a run of consecutive
+            // source rows no longer than the ring and later rows never need earlier sources, so a row is
+            // filtered once and is never overwritten while it's still needed.
+
+            int slots = job.vertical.maxTaps;
+            size_t rowFloats = (size_t) job.dstWidth * 4;
+            std::vector<float> ring( slots * rowFloats );
+            std::vector<int> rowInSlot( slots, -1 );
+            std::vector<const float *> rows( slots );
+
+            for ( int y = yStart; y < yEnd; y++ )
+            {
+                int first = job.vertical.start[ y ];
+
+                for ( int t = 0; t < job.vertical.count[ y ]; t++ )
+                {
+                    int r = first + t;
+                    int slot = r % slots;
+                    float * pRow = ring.data() + slot * rowFloats;
+
+                    if ( rowInSlot[ slot ] != r )
+                    {
+                        Horizontal( job, job.src + (size_t) r * job.srcStride, pRow );
+                        rowInSlot[ slot ] = r;
+                    }
+
+                    rows[ t ] = pRow;
+                }
+
+                Vertical( job, rows.data(), y );
+            }
+        } //Band
+
+    public:
+        // The fastest code this CPU runs
+
+        static Code BestCode()
+        {
+#if defined( DJL_RESAMPLE_X86 ) && defined( _MSC_VER )
+            static const Code best = [] ()
+            {
+                int info[ 4 ];
+                __cpuid( info, 0 );
+                int maxLeaf = info[ 0 ];
+
+                __cpuid( info, 1 );
+                bool sse41 = 0 != ( info[ 2 ] & ( 1 << 19 ) );
+                bool fma = 0 != ( info[ 2 ] & ( 1 << 12 ) );
+                bool osAvx = ( 0 != ( info[ 2 ] & ( 1 << 27 ) ) ) && ( 6 == ( _xgetbv( 0 ) & 6 ) );
+                bool avx2 = false;
+
+                if ( maxLeaf >= 7 )
+                {
+                    __cpuidex( info, 7, 0 );
+                    avx2 = 0 != ( info[ 1 ] & ( 1 << 5 ) );
+                }
+
+                return ( avx2 && fma && osAvx ) ? AVX2 : sse41 ? SSE41 : Scalar;
+            }();
+
+            return best;
+#elif defined( DJL_RESAMPLE_X86 )
+            static const Code best = ( __builtin_cpu_supports( "avx2" ) && __builtin_cpu_supports( "fma" ) ) ? AVX2 :
+                                     __builtin_cpu_supports( "sse4.1" ) ? SSE41 : Scalar;
+            return best;
+#elif defined( DJL_RESAMPLE_NEON )
+            return NEON;
+#else
+            return Scalar;
+#endif
+        } //BestCode
+
+        static bool Supported( Code code )
+        {
+            Code best = BestCode();
+
+            if ( Scalar == code || best == code )
+                return true;
+
+            return ( SSE41 == code && AVX2 == best );
+        } //Supported
+
+        static const char * CodeName( Code code )
+        {
+            static const char * names[] = { "scalar", "sse4.1", "avx2", "neon" };
+            return names[ code ];
+        } //CodeName
+
+        // Resample src into dst, both bpp (3 or 4) bytes per pixel. threads 0 means one per core. code is
+        // Scalar for the reference results; code the CPU doesn't support falls back to BestCode.
+
+        static bool Resample( const uint8_t * src, int srcWidth, int srcHeight, size_t srcStride,
+                              uint8_t * dst, int dstWidth, int dstHeight, size_t dstStride,
+                              int bpp, Kernel kernel = Lanczos3, unsigned int threads = 0, Code code = BestCode() )
+        {
+            if ( NULL == src || NULL == dst || srcWidth <= 0 || srcHeight <= 0 || dstWidth <= 0 || dstHeight <= 0 )
+                return false;
+
+            if ( 3 != bpp && 4 != bpp )
+                return false;
+
+            Job job;
+            job.src = src;
+            job.srcStride = srcStride;
+            job.srcWidth = srcWidth;
+            job.dst = dst;
+            job.dstStride = dstStride;
+            job.dstWidth = dstWidth;
+            job.bpp = bpp;
+            job.code = Supported( code ) ? code : BestCode();
+            job.horizontal.Build( srcWidth, dstWidth, kernel );
+            job.vertical.Build( srcHeight, dstHeight, kernel );
+
+            // Each band re-filters the few source rows it shares with the band before it, so bands aren't tiny
+
+            if ( 0 == threads )
+                threads = std::max( 1u, std::thread::hardware_concurrency() );
+
+            int bands = std::max( 1, std::min( (int) threads, dstHeight / 32 ) );
+            std::vector<std::thread> workers;
+
+            for ( int b = 1; b < bands; b++ )
+                workers.emplace_back( Band, std::cref( job ), (int) ( (long long) dstHeight * b / bands ), (int) ( (long long) dstHeight * ( b + 1 ) / bands ) );
+
+            Band( job, 0, dstHeight / bands );
+
+            for ( size_t i = 0; i < workers.size(); i++ )
+                workers[ i ].join();
+
+            return true;
+        } //Resample
+}; //CResample
@@ -15,6 +15,7 @@ using namespace std;
 
 #include "djltrace.hxx"
 #include "djlimagedata.hxx"
+#include "djl_orient.hxx"
 
 using namespace Microsoft::WRL;
 
@@ -25,10 +26,146 @@ using namespace Microsoft::WRL;
 //   -- BMP files fail to get a BlockReader object, which that codec doesn't support, and fall back to flip-rotate of pixels.
 //   -- GIF and PNG files fail in SetMetadataByName with WINCODEC_ERR_UNEXPECTEDMETADATATYPE, and fall back to flip-rotate of pixels.
 //   -- ICO files fail because WIC has no ICO encoder. There is no code here to rotate ICO files.
+// Pixels are rotated in strips within RotationMemoryBudget, through a scratch file next to the output when the image is
+// bigger than that, so huge scans and panoramas don't need the whole bitmap in memory.
 
 class CImageRotation
 {
 private:
+    static const size_t RotationMemoryBudget = 64 * 1024 * 1024;
+
+    static UINT BytesPerPixel( IWICImagingFactory * pIWICFactory, WICPixelFormatGUID & format )
+    {
+        ComPtr<IWICComponentInfo> componentInfo;
+        HRESULT hr = pIWICFactory->CreateComponentInfo( format, componentInfo.GetAddressOf() );
+
+        ComPtr<IWICPixelFormatInfo> formatInfo;
+        if ( SUCCEEDED( hr ) )
+            hr = componentInfo.As( &formatInfo );
+
+        UINT bits = 0;
+        if ( SUCCEEDED( hr ) )
+            hr = formatInfo->GetBitsPerPixel( &bits );
+
+        if ( FAILED( hr ) || 0 != ( bits % 8 ) )
+            return 0;
+
+        return bits / 8;
+    } //BytesPerPixel
+
+    static HRESULT WriteRotatedPixels( IWICImagingFactory * pIWICFactory, IWICBitmapSource * pSource, IWICBitmapFrameEncode * pFrameEncode,
+                                       WCHAR const * pwcOutputPath, bool right, bool & written )
+    {
+        // Read the source in strips and write it to the encoder rotated, in bands. written is false when the pixel format
+        // is one COrientPixels can't move (packed bits or 128-bit floats); the frame's size is set and the caller falls
+        // back to the flip rotator.
+
+        written = false;
+
+        UINT width = 0, height = 0;
+        HRESULT hr = pSource->GetSize( &width, &height );
+
+        WICPixelFormatGUID sourceFormat = {0};
+        if ( SUCCEEDED( hr ) )
+            hr = pSource->GetPixelFormat( &sourceFormat );
+
+        if ( SUCCEEDED( hr ) )
+            hr = pFrameEncode->SetSize( height, width );
+
+        WICPixelFormatGUID format = sourceFormat;
+        if ( SUCCEEDED( hr ) )
+            hr = pFrameEncode->SetPixelFormat( &format );
+
+        if ( FAILED( hr ) )
+        {
+            tracer.Trace( "can't set size and pixel format of rotated frame: %#x\n", hr );
+            return hr;
+        }
+
+        ComPtr<IWICBitmapSource> source( pSource );
+
+        if ( format != sourceFormat )
+        {
+            ComPtr<IWICFormatConverter> converter;
+            hr = pIWICFactory->CreateFormatConverter( converter.GetAddressOf() );
+
+            if ( SUCCEEDED( hr ) )
+                hr = converter->Initialize( pSource, format, WICBitmapDitherTypeNone, NULL, 0.f, WICBitmapPaletteTypeCustom );
+
+            if ( FAILED( hr ) )
+            {
+                tracer.Trace( "can't convert to the encoder's pixel format: %#x\n", hr );
+                return S_OK;
+            }
+
+            source.Reset();
+            source.Attach( converter.Detach() );
+        }
+
+        int bpp = (int) BytesPerPixel( pIWICFactory, format );
+        if ( !COrientPixels::ValidPixelSize( bpp ) )
+        {
+            tracer.Trace( "can't rotate %d-byte pixels in strips\n", bpp );
+            return S_OK;
+        }
+
+        double dpiX = 0.0, dpiY = 0.0;
+        if ( SUCCEEDED( source->GetResolution( &dpiX, &dpiY ) ) )
+            pFrameEncode->SetResolution( dpiY, dpiX );
+
+        ComPtr<IWICPalette> palette;
+        if ( SUCCEEDED( pIWICFactory->CreatePalette( palette.GetAddressOf() ) ) && SUCCEEDED( source->CopyPalette( palette.Get() ) ) )
+            pFrameEncode->SetPalette( palette.Get() );
+
+        int orientation = right ? 6 : 8;
+        FILE * scratch = NULL;
+        WCHAR awcScratch[ MAX_PATH + 10 ];
+
+        if ( COrientStream::NeedsScratch( width, height, bpp, orientation, RotationMemoryBudget ) )
+        {
+            wcscpy( awcScratch, pwcOutputPath );
+            wcscat( awcScratch, L".scratch" );
+
+            // T keeps it in the cache if there's room and D deletes it when closed
+
+            errno_t err = _wfopen_s( &scratch, awcScratch, L"w+bTD" );
+            if ( 0 != err )
+            {
+                tracer.Trace( "can't create scratch file %ws for rotation, error %d\n", awcScratch, err );
+                return E_FAIL;
+            }
+        }
+
+        ULONGLONG start = GetTickCount64();
+
+        bool ok = COrientStream::Apply( width, height, bpp, orientation, RotationMemoryBudget, scratch,
+                                        [&] ( int y, int rows, uint8_t * pixels, size_t stride )
+                                        {
+                                            WICRect rect = { 0, y, (INT) width, rows };
+                                            hr = source->CopyPixels( &rect, (UINT) stride, (UINT) ( stride * rows ), pixels );
+                                            return SUCCEEDED( hr );
+                                        },
+                                        [&] ( int rows, const uint8_t * pixels, size_t stride )
+                                        {
+                                            hr = pFrameEncode->WritePixels( rows, (UINT) stride, (UINT) ( stride * rows ), (BYTE *) pixels );
+                                            return SUCCEEDED( hr );
+                                        } );
+
+        if ( NULL != scratch )
+            fclose( scratch );
+
+        if ( !ok )
+        {
+            tracer.Trace( "rotating pixels in strips failed: %#x\n", hr );
+            return FAILED( hr ) ? hr : E_FAIL;
+        }
+
+        tracer.Trace( "  rotated %u x %u pixels, %d bytes each, %s in %llu ms\n", width, height, bpp,
+                      ( NULL != scratch ) ? "through a scratch file" : "in memory", GetTickCount64() - start );
+
+        written = true;
+        return S_OK;
+    } //WriteRotatedPixels
 
     static WCHAR const * ExpectedOrientationName( GUID & containerFormat )
     {
@@ -308,8 +445,13 @@ private:
                 bitmapSource.Attach( frameDecode.Detach() );
     
                 // Transform the bits if the file format doesn't support Exif Orientation.
-             
+
+                bool written = false;
+
                 if ( SUCCEEDED( hr ) && useFlipRotator )
+                    hr = WriteRotatedPixels( pIWICFactory, bitmapSource.Get(), frameEncode.Get(), pwcOutputPath, right, written );
+             
+                if ( SUCCEEDED( hr ) && useFlipRotator && !written )
                 {
                     ComPtr<IWICBitmapFlipRotator> rotator;
                     hr = pIWICFactory->CreateBitmapFlipRotator( rotator.GetAddressOf() );
@@ -330,7 +472,7 @@ private:
                     }
                 }
        
-                if ( SUCCEEDED( hr ) )
+                if ( SUCCEEDED( hr ) && !written )
                 {
                     hr = frameEncode->WriteSource( bitmapSource.Get(), NULL );
                     if ( FAILED( hr ) ) tracer.Trace( "frameencode->writesource: %#x\n", hr );
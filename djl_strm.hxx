@@ -4,27 +4,286 @@
 // Stream over a file or subset of a file
 //
 
+#include <djl_os.hxx>
+#include <chrono>
+#include <vector>
+
+#ifndef _WIN32
+    #include <fcntl.h>
+    #include <stdlib.h>
+    #include <string.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #ifdef __linux__
+        #include <sys/vfs.h>
+    #endif
+#endif
+
+// Counters a stream adds to as it's used. Several streams can share one of these.
+
+struct StreamStats
+{
+    ULONGLONG opens;       // files opened by streams using these stats
+    ULONGLONG reads;       // calls to CStream::Read
+    ULONGLONG fileReads;   // calls to ReadFile that Read actually issued
+    ULONGLONG fileSeeks;   // calls to SetFilePointerEx that Read actually issued
+    ULONGLONG fileBytes;   // bytes ReadFile returned, or bytes taken from the mapped view
+    ULONGLONG ioNanoseconds; // time in open, seek, read, and map calls. Page faults on mapped views aren't included.
+
+    ULONGLONG ReadsSaved() const { return ( reads > fileReads ) ? ( reads - fileReads ) : 0; }
+
+    void Add( const StreamStats & other )
+    {
+        opens += other.opens;
+        reads += other.reads;
+        fileReads += other.fileReads;
+        fileSeeks += other.fileSeeks;
+        fileBytes += other.fileBytes;
+        ioNanoseconds += other.ioNanoseconds;
+    } //Add
+
+    static ULONGLONG Now()
+    {
+        return (ULONGLONG) std::chrono::duration_cast<std::chrono::nanoseconds>( std::chrono::steady_clock::now().time_since_epoch() ).count();
+    } //Now
+};
+
 class CStream
 {
     private:
+        // Optional read-ahead cache. Pages are aligned to physical offsets in the file so streams over
+        // embedded images share the same layout as the outer file, and misses replace the least recently used page.
+
+        struct CachePage
+        {
+            __int64 fileOffset;    // -1 if the page holds nothing
+            ULONG bytes;           // can be less than the page size at the end of the file
+            ULONGLONG lastUse;
+            std::vector<BYTE> data;
+        };
+
         __int64 length;
         __int64 offset;
         __int64 embedOffset;
+#ifdef _WIN32
         HANDLE hFile;
+        HANDLE hMapping;
+#else
+        int fd;
+#endif
         bool handleOwned;
         bool seekCalled;
         bool forWrite;
+        std::vector<CachePage> pages;
+        ULONG pageSize;
+        ULONGLONG pageClock;
+        StreamStats * pStats;
+        bool openPending;           // the open and openNanoseconds haven't been charged to stats yet
+        ULONGLONG openNanoseconds;  // time to open and map the file
+        const BYTE * pView;     // the whole file when it's mapped, physical offsets
+        __int64 viewLength;
+
+        void OpenFile( WCHAR const * pwcFile, bool write )
+        {
+            ULONGLONG start = StreamStats::Now();
+
+#ifdef _WIN32
+            if ( write )
+                hFile = CreateFile( pwcFile, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, CREATE_ALWAYS, 0, 0 );
+            else
+                hFile = CreateFile( pwcFile, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, 0, 0 );
+#else
+            char acPath[ MAX_PATH + 1 ];
+            size_t converted = wcstombs( acPath, pwcFile, sizeof( acPath ) );
+
+            if ( (size_t) -1 == converted || converted >= sizeof( acPath ) )
+                fd = -1;
+            else if ( write )
+                fd = open( acPath, O_RDWR | O_CREAT | O_TRUNC, 0644 );
+            else
+                fd = open( acPath, O_RDONLY );
+#endif
+
+            openPending = true;
+            openNanoseconds = StreamStats::Now() - start;
+        } //OpenFile
+
+        bool FileSize( __int64 & size )
+        {
+#ifdef _WIN32
+            LARGE_INTEGER liSize;
+            BOOL ok = GetFileSizeEx( hFile, &liSize );
+            size = liSize.QuadPart;
+            return ok;
+#else
+            struct stat st;
+            if ( 0 != fstat( fd, &st ) )
+                return false;
+            size = st.st_size;
+            return true;
+#endif
+        } //FileSize
+
+        void SetFilePosition( __int64 physical )
+        {
+            ULONGLONG start = pStats ? StreamStats::Now() : 0;
+
+#ifdef _WIN32
+            LARGE_INTEGER li;
+            li.QuadPart = physical;
+            SetFilePointerEx( hFile, li, NULL, FILE_BEGIN );
+#else
+            lseek( fd, physical, SEEK_SET );
+#endif
+
+            if ( pStats )
+            {
+                pStats->fileSeeks++;
+                pStats->ioNanoseconds += StreamStats::Now() - start;
+            }
+        } //SetFilePosition
+
+        bool ReadFromFile( void * pv, ULONG cb, DWORD & dwRead )
+        {
+            ULONGLONG start = pStats ? StreamStats::Now() : 0;
+
+#ifdef _WIN32
+            bool ok = ( 0 != ReadFile( hFile, pv, cb, &dwRead, NULL ) );
+#else
+            ssize_t result = read( fd, pv, cb );
+            dwRead = ( result > 0 ) ? (DWORD) result : 0;
+            bool ok = ( result >= 0 );
+#endif
+
+            if ( pStats )
+            {
+                pStats->fileReads++;
+                pStats->fileBytes += dwRead;
+                pStats->ioNanoseconds += StreamStats::Now() - start;
+            }
+
+            return ok;
+        } //ReadFromFile
+
+        bool WriteToFile( void * pv, ULONG cb, DWORD & dwWritten )
+        {
+#ifdef _WIN32
+            return WriteFile( hFile, pv, cb, &dwWritten, NULL );
+#else
+            ssize_t result = write( fd, pv, cb );
+            dwWritten = ( result > 0 ) ? (DWORD) result : 0;
+            return ( result >= 0 );
+#endif
+        } //WriteToFile
+
+        CachePage * FindPage( __int64 physical )
+        {
+            __int64 pageOffset = physical - ( physical % pageSize );
+            CachePage * pLRU = &pages[ 0 ];
+
+            for ( size_t i = 0; i < pages.size(); i++ )
+            {
+                CachePage & page = pages[ i ];
+
+                if ( pageOffset == page.fileOffset )
+                {
+                    page.lastUse = ++pageClock;
+                    return &page;
+                }
+
+                if ( page.lastUse < pLRU->lastUse )
+                    pLRU = &page;
+            }
+
+            if ( pLRU->data.size() != pageSize )
+                pLRU->data.resize( pageSize );
+
+            SetFilePosition( pageOffset );
+            seekCalled = true;
+
+            DWORD dwRead = 0;
+            bool ok = ReadFromFile( pLRU->data.data(), pageSize, dwRead );
+
+            if ( !ok )
+            {
+                pLRU->fileOffset = -1;
+                pLRU->bytes = 0;
+                return NULL;
+            }
+
+            pLRU->fileOffset = pageOffset;
+            pLRU->bytes = dwRead;
+            pLRU->lastUse = ++pageClock;
+            return pLRU;
+        } //FindPage
+
+        ULONG ReadCached( void * pv, ULONG cb )
+        {
+            BYTE * pOut = (BYTE *) pv;
+            ULONG copied = 0;
+
+            while ( copied < cb )
+            {
+                __int64 physical = embedOffset + offset + copied;
+                CachePage * page = FindPage( physical );
+
+                if ( NULL == page )
+                    break;
+
+                __int64 inPage = physical - page->fileOffset;
+
+                if ( inPage >= page->bytes )
+                    break; // end of file
+
+                ULONG toCopy = (ULONG) __min( (__int64) ( cb - copied ), page->bytes - inPage );
+                memcpy( pOut + copied, page->data.data() + inPage, toCopy );
+                copied += toCopy;
+            }
+
+            // the file pointer no longer matches offset
+
+            seekCalled = true;
+            offset += copied;
+            return copied;
+        } //ReadCached
+
+        void InitCache()
+        {
+            pageSize = 0;
+            pageClock = 0;
+            pStats = NULL;
+            openPending = false;
+            openNanoseconds = 0;
+            pView = NULL;
+            viewLength = 0;
+#ifdef _WIN32
+            hMapping = NULL;
+#endif
+        } //InitCache
 
     public:
+#ifdef _WIN32
+        typedef HANDLE FileHandle;
+        static FileHandle InvalidHandle() { return INVALID_HANDLE_VALUE; }
+#else
+        typedef int FileHandle;
+        static FileHandle InvalidHandle() { return -1; }
+#endif
+
         CStream()
         {
             length = 0;
             offset = 0;
             embedOffset = 0;
+#ifdef _WIN32
             hFile = INVALID_HANDLE_VALUE;
+#else
+            fd = -1;
+#endif
             handleOwned = false;
             seekCalled = false;
             forWrite = false;
+            InitCache();
         } //CStream
 
         CStream( WCHAR const * pwcFile, bool write = false )
@@ -35,36 +294,34 @@ class CStream
             seekCalled = false;
             handleOwned = true;
             forWrite = write;
+            InitCache();
 
-            if ( forWrite )
-                hFile = CreateFile( pwcFile, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, CREATE_ALWAYS, 0, 0 );
-            else
-            {
-                hFile = CreateFile( pwcFile, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, 0, 0 );
+            OpenFile( pwcFile, forWrite );
 
-                if ( INVALID_HANDLE_VALUE != hFile )
-                {
-                    LARGE_INTEGER liSize;
-                    GetFileSizeEx( hFile, &liSize );
-                    length = liSize.QuadPart;
-                }
-            }
+            if ( !forWrite && Ok() )
+                FileSize( length );
         } //CStream
 
-        CStream( HANDLE h )
+        // A stream over a file someone else opened and will close, e.g. one CHeaderPrefetch read the header of
+
+        explicit CStream( FileHandle h )
         {
             embedOffset = 0;
             length = 0;
             offset = 0;
             seekCalled = true; // don't trust where this handle has been
             handleOwned = false;
+#ifdef _WIN32
             hFile = h;
+#else
+            fd = h;
+#endif
             forWrite = false;
+            InitCache();
 
-            LARGE_INTEGER liSize;
-            BOOL ok = GetFileSizeEx( hFile, &liSize );
-            if ( ok )
-                length = liSize.QuadPart;
+            __int64 size;
+            if ( Ok() && FileSize( size ) )
+                length = size;
         } //CStream
 
         CStream( WCHAR const * pwcFile, __int64 embeddedOffset, __int64 embeddedLength )
@@ -81,24 +338,24 @@ class CStream
             seekCalled = true; // need to get to virtual 0 on first read
             handleOwned = true;
             forWrite = false;
-            hFile = CreateFile( pwcFile, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, 0 );
+            InitCache();
+            OpenFile( pwcFile, false );
 
-            if ( INVALID_HANDLE_VALUE == hFile )
+            if ( !Ok() )
                 length = 0;
             else
             {
-                LARGE_INTEGER liSize;
-                BOOL ok = GetFileSizeEx( hFile, &liSize );
-                if ( ok )
+                __int64 size;
+                if ( FileSize( size ) )
                 {
-                    if ( embedOffset > liSize.QuadPart )
+                    if ( embedOffset > size )
                     {
                         embedOffset = 0;
                         length = 0;
                     }
                     else
                     {
-                        length = __min( liSize.QuadPart - embeddedOffset, length );
+                        length = __min( size - embeddedOffset, length );
                     }
                 }
                 else
@@ -111,11 +368,32 @@ class CStream
 
         void CloseFile()
         {
+            if ( NULL != pView )
+            {
+#ifdef _WIN32
+                UnmapViewOfFile( pView );
+                CloseHandle( hMapping );
+                hMapping = NULL;
+#else
+                munmap( (void *) pView, viewLength );
+#endif
+                pView = NULL;
+                viewLength = 0;
+            }
+
+#ifdef _WIN32
             if ( handleOwned && INVALID_HANDLE_VALUE != hFile )
             {
                 CloseHandle( hFile );
                 hFile = INVALID_HANDLE_VALUE;
             }
+#else
+            if ( handleOwned && -1 != fd )
+            {
+                close( fd );
+                fd = -1;
+            }
+#endif
         } //CloseFile
 
         ~CStream()
@@ -123,18 +401,189 @@ class CStream
             CloseFile();
         }
 
+        // Give the open file to the caller, who must close it. The stream keeps reading from it until it's closed.
+
+        FileHandle Detach()
+        {
+            handleOwned = false;
+#ifdef _WIN32
+            return hFile;
+#else
+            return fd;
+#endif
+        } //Detach
+
+        static void CloseFileHandle( FileHandle h )
+        {
+#ifdef _WIN32
+            if ( INVALID_HANDLE_VALUE != h )
+                ::CloseHandle( h );
+#else
+            if ( -1 != h )
+                close( h );
+#endif
+        } //CloseFileHandle
+
+        // Serve reads smaller than a page from memory. Metadata parsing does many tiny reads clustered in a few
+        // places in the file, so a handful of pages turns hundreds of ReadFile/SetFilePointerEx calls into a few.
+
+        static const ULONG DefaultPageBytes = 64 * 1024;
+
+        void EnableCache( ULONG pageCount = 4, ULONG bytesPerPage = DefaultPageBytes )
+        {
+            if ( forWrite || 0 == pageCount || 0 == bytesPerPage )
+                return;
+
+            pageSize = bytesPerPage;
+            pages.resize( pageCount );
+
+            for ( size_t i = 0; i < pages.size(); i++ )
+            {
+                pages[ i ].fileOffset = -1;
+                pages[ i ].bytes = 0;
+                pages[ i ].lastUse = 0;
+            }
+        } //EnableCache
+
+        // Hand the cache bytes that were already read from physical offset fileOffset, e.g. a header read ahead
+        // of the parse along with many other files. Only whole pages are taken, or a short page that ends the file.
+
+        bool SeedCache( __int64 fileOffset, const BYTE * pData, ULONG bytes, bool endsFile )
+        {
+            if ( 0 == pageSize || NULL != pView || fileOffset < 0 || 0 != ( fileOffset % pageSize ) )
+                return false;
+
+            if ( bytes > pageSize || ( bytes < pageSize && !endsFile ) )
+                return false;
+
+            CachePage * pLRU = &pages[ 0 ];
+
+            for ( size_t i = 0; i < pages.size(); i++ )
+            {
+                if ( fileOffset == pages[ i ].fileOffset )
+                    return true;
+
+                if ( pages[ i ].lastUse < pLRU->lastUse )
+                    pLRU = &pages[ i ];
+            }
+
+            if ( pLRU->data.size() != pageSize )
+                pLRU->data.resize( pageSize );
+
+            memcpy( pLRU->data.data(), pData, bytes );
+            pLRU->fileOffset = fileOffset;
+            pLRU->bytes = bytes;
+            pLRU->lastUse = ++pageClock;
+            return true;
+        } //SeedCache
+
+        // Map the whole file so reads are memory copies and View() can hand out pointers into the file.
+        // Returns false and leaves the stream using buffered reads if the file can't or shouldn't be mapped.
+
+        bool EnableMapping()
+        {
+            if ( forWrite || NULL != pView || !Ok() || IsRemoteFile() )
+                return false;
+
+            __int64 size;
+            if ( !FileSize( size ) || 0 == size || (ULONGLONG) size > (ULONGLONG) SIZE_MAX )
+                return false;
+
+            ULONGLONG start = StreamStats::Now();
+
+#ifdef _WIN32
+            hMapping = CreateFileMapping( hFile, NULL, PAGE_READONLY, 0, 0, NULL );
+            if ( NULL == hMapping )
+                return false;
+
+            pView = (const BYTE *) MapViewOfFile( hMapping, FILE_MAP_READ, 0, 0, 0 );
+            if ( NULL == pView )
+            {
+                CloseHandle( hMapping );
+                hMapping = NULL;
+                return false;
+            }
+#else
+            void * p = mmap( NULL, (size_t) size, PROT_READ, MAP_PRIVATE, fd, 0 );
+            if ( MAP_FAILED == p )
+                return false;
+
+            pView = (const BYTE *) p;
+#endif
+
+            viewLength = size;
+
+            if ( pStats )
+                pStats->ioNanoseconds += StreamStats::Now() - start;
+            else
+                openNanoseconds += StreamStats::Now() - start;
+
+            return true;
+        } //EnableMapping
+
+        bool IsMapped() { return ( NULL != pView ); }
+
+        bool IsRemoteFile()
+        {
+            // page faults over the network are slow and a mapping of a remote file can fail at any point if
+            // the connection drops, so files on network shares always use buffered reads.
+
+#ifdef _WIN32
+            FILE_REMOTE_PROTOCOL_INFO info;
+            return GetFileInformationByHandleEx( hFile, FileRemoteProtocolInfo, &info, sizeof info );
+#elif defined( __linux__ )
+            struct statfs fs;
+            if ( 0 != fstatfs( fd, &fs ) )
+                return true;
+
+            const unsigned long nfs = 0x6969, smb = 0x517b, cifs = 0xff534d42, smb2 = 0xfe534d42, fuse = 0x65735546;
+            unsigned long type = (unsigned long) fs.f_type;
+            return ( nfs == type || smb == type || cifs == type || smb2 == type || fuse == type );
+#else
+            return false;
+#endif
+        } //IsRemoteFile
+
+        // A pointer to cb bytes at location in the stream if the file is mapped, otherwise NULL.
+        // The memory is valid until the stream is closed.
+
+        const BYTE * View( __int64 location, ULONG cb )
+        {
+            if ( NULL == pView || location < 0 || cb > length || location > ( length - cb ) )
+                return NULL;
+
+            __int64 physical = embedOffset + location;
+
+            if ( ( physical + cb ) > viewLength )
+                return NULL;
+
+            if ( pStats )
+                pStats->fileBytes += cb;
+
+            return pView + physical;
+        } //View
+
+        void SetStats( StreamStats * p )
+        {
+            // the open happened in the constructor, before any stats were set, so charge it to the first ones
+
+            if ( NULL != p && openPending )
+            {
+                p->opens++;
+                p->ioNanoseconds += openNanoseconds;
+                openPending = false;
+            }
+
+            pStats = p;
+        } //SetStats
+
         ULONG Read( void *pv, ULONG cb )
         {
             if ( 0 == length )
                 return 0;
 
-            if ( seekCalled )
-            {
-                LARGE_INTEGER li;
-                li.QuadPart = offset + embedOffset;
-                SetFilePointerEx( hFile, li, NULL, FILE_BEGIN );
-                seekCalled = false;
-            }
+            if ( pStats )
+                pStats->reads++;
 
             if ( ( offset + cb ) > length )
             {
@@ -144,8 +593,29 @@ class CStream
                     cb = 0;
             }
 
+            if ( NULL != pView )
+            {
+                const BYTE * p = View( offset, cb );
+                if ( NULL == p )
+                    return 0;
+
+                memcpy( pv, p, cb );
+                offset += cb;
+                seekCalled = true;
+                return cb;
+            }
+
+            if ( cb < pageSize )
+                return ReadCached( pv, cb );
+
+            if ( seekCalled )
+            {
+                SetFilePosition( offset + embedOffset );
+                seekCalled = false;
+            }
+
             DWORD dwRead = 0;
-            BOOL ok = ReadFile( hFile, pv, cb, &dwRead, NULL );
+            bool ok = ReadFromFile( pv, cb, dwRead );
 
             if ( ok )
                 offset += cb;
@@ -169,7 +639,11 @@ class CStream
             return true;
         } //Seek
 
+#ifdef _WIN32
         bool Ok() { return ( INVALID_HANDLE_VALUE != hFile ); }
+#else
+        bool Ok() { return ( -1 != fd ); }
+#endif
         __int64 Tell() { return offset; }
         __int64 Length() { return length; }
         bool AtEOF() { return ( offset >= length ); }
@@ -186,14 +660,12 @@ class CStream
         {
             if ( seekCalled )
             {
-                LARGE_INTEGER li;
-                li.QuadPart = offset + embedOffset;
-                SetFilePointerEx( hFile, li, NULL, FILE_BEGIN );
+                SetFilePosition( offset + embedOffset );
                 seekCalled = false;
             }
 
             DWORD dwWritten = 0;
-            BOOL ok = WriteFile( hFile, pv, cb, &dwWritten, NULL );
+            bool ok = WriteToFile( pv, cb, dwWritten );
 
             if ( ok )
             {
@@ -0,0 +1,1159 @@
+#pragma once
+
+//
+// Rewrites a TIFF file with its image data recompressed as Deflate or LZW (with the horizontal predictor where it
+// helps) or uncompressed. Images are re-chunked into strips of about TargetStripBytes, and batches of strips are
+// compressed in parallel, one strip per task, then written in order.
+//
+// Every IFD in the main chain and every sub-IFD (SubIFDs, Exif, GPS, Interoperability) is kept, with all of its
+// tags copied byte for byte in the original byte order. Only the tags that describe image data layout change:
+// Compression, Predictor, RowsPerStrip, StripOffsets, and StripByteCounts (tile tags are replaced with strips).
+// IFDs are written after the image data, with new offsets. If any tag or IFD can't be read whole, Rewrite fails
+// rather than write a file without it. Images this can't decode (JPEG and other codecs) are copied as they are.
+// Data that points into the file from inside a tag's value, such as a MakerNote with absolute offsets, isn't
+// relocated, which is the same as any other TIFF rewriter. BigTIFF isn't handled.
+//
+// Nothing here depends on Windows; Deflate uses zlib.
+//
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <set>
+#include <thread>
+#include <vector>
+
+#include <zlib.h>
+
+#if defined( _MSC_VER )
+    #pragma comment( lib, "zlib.lib" )
+#endif
+
+class CTiffRewriter
+{
+    public:
+        // TIFF Compression tag values
+
+        enum { CompressionNone = 1, CompressionLZW = 5, CompressionDeflate = 8, CompressionAdobeDeflate = 32946, CompressionPackBits = 32773 };
+
+        struct Stats
+        {
+            int images;                       // IFDs with image data
+            int recompressed;                 // of those, the ones decoded and compressed again
+            unsigned long long pixelBytes;    // uncompressed bytes of the recompressed images
+            unsigned long long dataBytes;     // compressed bytes written for them
+            unsigned long long fileBytes;     // size of the rewritten file
+        };
+
+    private:
+        static const size_t TargetStripBytes = 256 * 1024;
+
+        enum
+        {
+            TagImageWidth = 256, TagImageLength = 257, TagBitsPerSample = 258, TagCompression = 259, TagStripOffsets = 273,
+            TagSamplesPerPixel = 277, TagRowsPerStrip = 278, TagStripByteCounts = 279, TagFreeOffsets = 288, TagFreeByteCounts = 289,
+            TagPlanarConfiguration = 284, TagPredictor = 317, TagTileWidth = 322, TagTileLength = 323, TagTileOffsets = 324,
+            TagTileByteCounts = 325, TagSubIFDs = 330, TagSampleFormat = 339, TagJPEGInterchangeFormat = 513, TagJPEGInterchangeFormatLength = 514,
+            TagExifIFD = 34665, TagGPSIFD = 34853, TagInteroperabilityIFD = 40965,
+        };
+
+        enum { TypeShort = 3, TypeLong = 4, TypeIFD = 13 };
+
+        struct Entry
+        {
+            uint16_t tag;
+            uint16_t type;
+            uint32_t count;
+            std::vector<uint8_t> value;       // count values in the file's byte order
+            std::vector<size_t> children;     // for IFD pointer tags, indexes into ifds
+        };
+
+        struct Ifd
+        {
+            std::vector<Entry> entries;
+            uint32_t offset;                  // where it's written in the output
+        };
+
+        struct Layout
+        {
+            uint32_t width, height, samples, bits, planar, compression, predictor, sampleFormat;
+            bool tiled;
+            uint32_t chunkWidth, chunkHeight; // tile size, or width x RowsPerStrip
+            uint32_t chunksAcross, chunksDown, planes;
+            size_t rowBytes;                  // one row of one plane of the whole image
+            size_t chunkRowBytes;             // one row of one plane of a chunk
+            std::vector<uint32_t> offsets, counts;
+        };
+
+        FILE * fpIn;
+        FILE * fpOut;
+        bool bigEndian;
+        unsigned long long inSize;
+        unsigned long long outPos;
+        unsigned int threads;
+        const char * error;
+        std::vector<Ifd> ifds;
+        std::vector<size_t> chain;
+        std::set<uint32_t> visited;
+        Stats stats;
+        int lostTags;                         // entries Parse couldn't read whole, so Rewrite would drop them
+        uint16_t firstLostTag;
+        bool lostIfd;                         // an IFD in the main chain couldn't be read
+        char lostError[ 100 ];
+
+        void Lose( uint16_t tag )
+        {
+            if ( 0 == lostTags++ )
+                firstLostTag = tag;
+        } //Lose
+
+        static bool Seek( FILE * fp, unsigned long long offset )
+        {
+#ifdef _WIN32
+            return ( 0 == _fseeki64( fp, (long long) offset, SEEK_SET ) );
+#else
+            return ( 0 == fseeko( fp, (off_t) offset, SEEK_SET ) );
+#endif
+        } //Seek
+
+        bool ReadAt( unsigned long long offset, void * p, size_t len )
+        {
+            if ( offset > inSize || len > inSize - offset )
+                return false;
+
+            return Seek( fpIn, offset ) && ( len == fread( p, 1, len, fpIn ) );
+        } //ReadAt
+
+        bool Write( const void * p, size_t len )
+        {
+            if ( 0 != len && len != fwrite( p, 1, len, fpOut ) )
+            {
+                error = "can't write the output file";
+                return false;
+            }
+
+            outPos += len;
+            return true;
+        } //Write
+
+        bool WriteAlign()
+        {
+            uint8_t zero = 0;
+            return ( 0 == ( outPos & 1 ) ) || Write( &zero, 1 );
+        } //WriteAlign
+
+        uint16_t Get16( const uint8_t * p ) const { return bigEndian ? (uint16_t) ( ( p[ 0 ] << 8 ) | p[ 1 ] ) : (uint16_t) ( ( p[ 1 ] << 8 ) | p[ 0 ] ); }
+
+        uint32_t Get32( const uint8_t * p ) const
+        {
+            return bigEndian ? ( (uint32_t) p[ 0 ] << 24 ) | ( (uint32_t) p[ 1 ] << 16 ) | ( (uint32_t) p[ 2 ] << 8 ) | p[ 3 ]
+                             : ( (uint32_t) p[ 3 ] << 24 ) | ( (uint32_t) p[ 2 ] << 16 ) | ( (uint32_t) p[ 1 ] << 8 ) | p[ 0 ];
+        } //Get32
+
+        void Put16( uint8_t * p, uint16_t v ) const
+        {
+            if ( bigEndian ) { p[ 0 ] = (uint8_t) ( v >> 8 ); p[ 1 ] = (uint8_t) v; }
+            else { p[ 0 ] = (uint8_t) v; p[ 1 ] = (uint8_t) ( v >> 8 ); }
+        } //Put16
+
+        void Put32( uint8_t * p, uint32_t v ) const
+        {
+            if ( bigEndian ) { p[ 0 ] = (uint8_t) ( v >> 24 ); p[ 1 ] = (uint8_t) ( v >> 16 ); p[ 2 ] = (uint8_t) ( v >> 8 ); p[ 3 ] = (uint8_t) v; }
+            else { p[ 0 ] = (uint8_t) v; p[ 1 ] = (uint8_t) ( v >> 8 ); p[ 2 ] = (uint8_t) ( v >> 16 ); p[ 3 ] = (uint8_t) ( v >> 24 ); }
+        } //Put32
+
+        static uint32_t TypeSize( uint16_t type )
+        {
+            switch ( type )
+            {
+                case 1: case 2: case 6: case 7: return 1;  // BYTE, ASCII, SBYTE, UNDEFINED
+                case 3: case 8: return 2;                  // SHORT, SSHORT
+                case 4: case 9: case 11: case 13: return 4; // LONG, SLONG, FLOAT, IFD
+                case 5: case 10: case 12: return 8;        // RATIONAL, SRATIONAL, DOUBLE
+                default: return 0;
+            }
+        } //TypeSize
+
+        static bool IsIfdPointer( uint16_t tag )
+        {
+            return ( TagSubIFDs == tag || TagExifIFD == tag || TagGPSIFD == tag || TagInteroperabilityIFD == tag );
+        } //IsIfdPointer
+
+        uint32_t Value( const Entry & e, uint32_t i ) const
+        {
+            if ( i >= e.count )
+                return 0;
+
+            if ( 1 == TypeSize( e.type ) )
+                return e.value[ i ];
+
+            if ( 2 == TypeSize( e.type ) )
+                return Get16( e.value.data() + 2 * i );
+
+            return Get32( e.value.data() + 4 * i );
+        } //Value
+
+        static const Entry * Find( const Ifd & ifd, uint16_t tag )
+        {
+            for ( size_t i = 0; i < ifd.entries.size(); i++ )
+                if ( tag == ifd.entries[ i ].tag )
+                    return &ifd.entries[ i ];
+
+            return NULL;
+        } //Find
+
+        uint32_t Number( const Ifd & ifd, uint16_t tag, uint32_t defaultValue ) const
+        {
+            const Entry * e = Find( ifd, tag );
+            return ( NULL == e || 0 == e->count ) ? defaultValue : Value( *e, 0 );
+        } //Number
+
+        Entry MakeEntry( uint16_t tag, uint16_t type, const std::vector<uint32_t> & values ) const
+        {
+            Entry e;
+            e.tag = tag;
+            e.type = type;
+            e.count = (uint32_t) values.size();
+            e.value.resize( values.size() * TypeSize( type ) );
+
+            for ( size_t i = 0; i < values.size(); i++ )
+            {
+                if ( TypeShort == type )
+                    Put16( e.value.data() + 2 * i, (uint16_t) values[ i ] );
+                else
+                    Put32( e.value.data() + 4 * i, values[ i ] );
+            }
+
+            return e;
+        } //MakeEntry
+
+        static void SetEntry( Ifd & ifd, const Entry & e )
+        {
+            for ( size_t i = 0; i < ifd.entries.size(); i++ )
+            {
+                if ( e.tag == ifd.entries[ i ].tag )
+                {
+                    ifd.entries[ i ] = e;
+                    return;
+                }
+            }
+
+            ifd.entries.push_back( e );
+        } //SetEntry
+
+        static void RemoveEntry( Ifd & ifd, uint16_t tag )
+        {
+            for ( size_t i = 0; i < ifd.entries.size(); i++ )
+            {
+                if ( tag == ifd.entries[ i ].tag )
+                {
+                    ifd.entries.erase( ifd.entries.begin() + i );
+                    return;
+                }
+            }
+        } //RemoveEntry
+
+        // Parse the IFD at offset and the sub-IFDs it points to. Returns the index in ifds or SIZE_MAX.
+
+        size_t ParseIfd( uint32_t offset, int depth, uint32_t * pNext )
+        {
+            if ( depth > 8 || 0 == offset || visited.count( offset ) )
+                return SIZE_MAX;
+
+            visited.insert( offset );
+
+            uint8_t b[ 12 ];
+            if ( !ReadAt( offset, b, 2 ) )
+                return SIZE_MAX;
+
+            uint16_t n = Get16( b );
+            Ifd ifd;
+            ifd.offset = 0;
+
+            for ( uint16_t i = 0; i < n; i++ )
+            {
+                if ( !ReadAt( offset + 2ull + 12ull * i, b, 12 ) )
+                    return SIZE_MAX;
+
+                Entry e;
+                e.tag = Get16( b );
+                e.type = Get16( b + 2 );
+                e.count = Get32( b + 4 );
+                unsigned long long size = (unsigned long long) TypeSize( e.type ) * e.count;
+
+                // An unknown type has no known size, so its value can't be found to copy
+
+                if ( 0 == TypeSize( e.type ) || size > inSize )
+                {
+                    Lose( e.tag );
+                    continue;
+                }
+
+                e.value.resize( (size_t) size );
+
+                if ( size <= 4 )
+                    memcpy( e.value.data(), b + 8, (size_t) size );
+                else if ( !ReadAt( Get32( b + 8 ), e.value.data(), (size_t) size ) )
+                {
+                    Lose( e.tag );
+                    continue;
+                }
+
+                ifd.entries.push_back( e );
+            }
+
+            if ( NULL != pNext )
+            {
+                *pNext = 0;
+                if ( ReadAt( offset + 2ull + 12ull * n, b, 4 ) )
+                    *pNext = Get32( b );
+            }
+
+            size_t index = ifds.size();
+            ifds.push_back( ifd );
+
+            // ifds can reallocate while parsing children, so find the entries by index each time
+
+            for ( size_t i = 0; i < ifds[ index ].entries.size(); i++ )
+            {
+                Entry & e = ifds[ index ].entries[ i ];
+
+                if ( !IsIfdPointer( e.tag ) || ( TypeLong != e.type && TypeIFD != e.type ) )
+                    continue;
+
+                std::vector<uint32_t> childOffsets;
+                for ( uint32_t c = 0; c < e.count; c++ )
+                    childOffsets.push_back( Value( e, c ) );
+
+                std::vector<size_t> children;
+                for ( size_t c = 0; c < childOffsets.size(); c++ )
+                {
+                    size_t child = ParseIfd( childOffsets[ c ], depth + 1, NULL );
+                    if ( SIZE_MAX != child )
+                        children.push_back( child );
+                    else
+                        Lose( ifds[ index ].entries[ i ].tag );
+                }
+
+                ifds[ index ].entries[ i ].children = children;
+            }
+
+            return index;
+        } //ParseIfd
+
+        bool Parse()
+        {
+            Seek( fpIn, 0 );
+#ifdef _WIN32
+            _fseeki64( fpIn, 0, SEEK_END );
+            inSize = (unsigned long long) _ftelli64( fpIn );
+#else
+            fseeko( fpIn, 0, SEEK_END );
+            inSize = (unsigned long long) ftello( fpIn );
+#endif
+            uint8_t header[ 8 ];
+
+            if ( !ReadAt( 0, header, 8 ) || header[ 0 ] != header[ 1 ] || ( 'I' != header[ 0 ] && 'M' != header[ 0 ] ) )
+            {
+                error = "not a TIFF file";
+                return false;
+            }
+
+            bigEndian = ( 'M' == header[ 0 ] );
+
+            if ( 42 != Get16( header + 2 ) )
+            {
+                error = ( 43 == Get16( header + 2 ) ) ? "BigTIFF isn't handled" : "not a TIFF file";
+                return false;
+            }
+
+            uint32_t next = Get32( header + 4 );
+
+            while ( 0 != next && chain.size() < 10000 )
+            {
+                // A chain that loops back on itself ends there; anything else that stops it loses IFDs
+
+                bool loops = ( 0 != visited.count( next ) );
+                size_t index = ParseIfd( next, 0, &next );
+                if ( SIZE_MAX == index )
+                {
+                    lostIfd = !loops;
+                    break;
+                }
+
+                chain.push_back( index );
+            }
+
+            if ( chain.empty() )
+            {
+                error = "the TIFF file has no IFDs";
+                return false;
+            }
+
+            return true;
+        } //Parse
+
+        bool GetLayout( const Ifd & ifd, Layout & l ) const
+        {
+            const Entry * offsets = Find( ifd, TagTileOffsets );
+            const Entry * counts = Find( ifd, TagTileByteCounts );
+            l.tiled = ( NULL != offsets );
+
+            if ( !l.tiled )
+            {
+                offsets = Find( ifd, TagStripOffsets );
+                counts = Find( ifd, TagStripByteCounts );
+            }
+
+            if ( NULL == offsets || NULL == counts || offsets->count != counts->count )
+                return false;
+
+            l.width = Number( ifd, TagImageWidth, 0 );
+            l.height = Number( ifd, TagImageLength, 0 );
+            l.samples = Number( ifd, TagSamplesPerPixel, 1 );
+            l.bits = Number( ifd, TagBitsPerSample, 1 );
+            l.planar = Number( ifd, TagPlanarConfiguration, 1 );
+            l.compression = Number( ifd, TagCompression, CompressionNone );
+            l.predictor = Number( ifd, TagPredictor, 1 );
+            l.sampleFormat = Number( ifd, TagSampleFormat, 1 );
+            l.chunkWidth = l.tiled ? Number( ifd, TagTileWidth, 0 ) : l.width;
+            l.chunkHeight = l.tiled ? Number( ifd, TagTileLength, 0 ) : std::min( l.height, Number( ifd, TagRowsPerStrip, l.height ) );
+
+            if ( 0 == l.width || 0 == l.height || 0 == l.samples || l.samples > 256 || 0 == l.bits || l.bits > 64 ||
+                 0 == l.chunkWidth || 0 == l.chunkHeight )
+                return false;
+
+            l.planes = ( 2 == l.planar ) ? l.samples : 1;
+            uint32_t rowSamples = ( 2 == l.planar ) ? 1 : l.samples;
+            l.rowBytes = ( (size_t) l.width * rowSamples * l.bits + 7 ) / 8;
+            l.chunkRowBytes = ( (size_t) l.chunkWidth * rowSamples * l.bits + 7 ) / 8;
+            l.chunksAcross = ( l.width + l.chunkWidth - 1 ) / l.chunkWidth;
+            l.chunksDown = ( l.height + l.chunkHeight - 1 ) / l.chunkHeight;
+
+            for ( uint32_t i = 0; i < offsets->count; i++ )
+            {
+                l.offsets.push_back( Value( *offsets, i ) );
+                l.counts.push_back( Value( *counts, i ) );
+            }
+
+            return true;
+        } //GetLayout
+
+        static bool CanDecode( const Layout & l )
+        {
+            bool codec = ( CompressionNone == l.compression || CompressionLZW == l.compression || CompressionDeflate == l.compression ||
+                           CompressionAdobeDeflate == l.compression || CompressionPackBits == l.compression );
+            bool predictor = ( 1 == l.predictor ) || ( 2 == l.predictor && ( 8 == l.bits || 16 == l.bits || 32 == l.bits ) );
+            bool sameBits = true; // checked by the caller against every BitsPerSample value
+            uint32_t rowSamples = ( 2 == l.planar ) ? 1 : l.samples;
+            bool byteColumns = !l.tiled || ( 0 == ( ( (size_t) rowSamples * l.bits ) % 8 ) );
+
+            return codec && predictor && sameBits && byteColumns &&
+                   ( l.offsets.size() == (size_t) l.chunksAcross * l.chunksDown * l.planes );
+        } //CanDecode
+
+        // Horizontal differencing over each row; stride is the distance between a sample and its left neighbor
+
+        template <typename T> static T Swap( T v )
+        {
+            T r = 0;
+            for ( size_t i = 0; i < sizeof( T ); i++ )
+                r = (T) ( ( r << 8 ) | ( ( v >> ( 8 * i ) ) & 0xff ) );
+            return r;
+        } //Swap
+
+        template <typename T> static void Predict( uint8_t * row, size_t samples, size_t stride, bool swap, bool undo )
+        {
+            T * p = (T *) row; // rows start at multiples of the row size, which keeps samples aligned
+
+            if ( swap )
+                for ( size_t i = 0; i < samples; i++ )
+                    p[ i ] = Swap( p[ i ] );
+
+            if ( undo )
+                for ( size_t i = stride; i < samples; i++ )
+                    p[ i ] = (T) ( p[ i ] + p[ i - stride ] );
+            else
+                for ( size_t i = samples - 1; i >= stride && i < samples; i-- )
+                    p[ i ] = (T) ( p[ i ] - p[ i - stride ] );
+
+            if ( swap )
+                for ( size_t i = 0; i < samples; i++ )
+                    p[ i ] = Swap( p[ i ] );
+        } //Predict
+
+        void PredictRows( uint8_t * data, size_t rows, size_t rowBytes, uint32_t bits, uint32_t stride, bool undo ) const
+        {
+            static const uint16_t one = 1;
+            bool swap = ( bigEndian == ( 1 == *(const uint8_t *) &one ) ) && ( bits > 8 );
+            size_t samples = rowBytes / ( bits / 8 );
+
+            for ( size_t r = 0; r < rows; r++ )
+            {
+                uint8_t * row = data + r * rowBytes;
+
+                if ( 8 == bits )
+                    Predict<uint8_t>( row, samples, stride, false, undo );
+                else if ( 16 == bits )
+                    Predict<uint16_t>( row, samples, stride, swap, undo );
+                else
+                    Predict<uint32_t>( row, samples, stride, swap, undo );
+            }
+        } //PredictRows
+
+        // TIFF LZW: MSB-first codes of 9 to 12 bits, Clear 256, EOI 257, and code widths that grow one code early
+
+        static bool LzwDecode( const uint8_t * src, size_t srcLen, uint8_t * dst, size_t dstLen )
+        {
+            std::vector<uint16_t> prefix( 4096 );
+            std::vector<uint8_t> suffix( 4096 ), first( 4096 );
+            std::vector<uint16_t> length( 4096 );
+            std::vector<uint8_t> stack( 4096 );
+
+            for ( int i = 0; i < 256; i++ )
+            {
+                suffix[ i ] = first[ i ] = (uint8_t) i;
+                length[ i ] = 1;
+            }
+
+            size_t out = 0, bitPos = 0, totalBits = srcLen * 8;
+            int nbits = 9, next = 258, previous = -1;
+
+            while ( out < dstLen && bitPos + nbits <= totalBits )
+            {
+                int code = 0;
+                for ( int i = 0; i < nbits; i++, bitPos++ )
+                    code = ( code << 1 ) | ( ( src[ bitPos >> 3 ] >> ( 7 - ( bitPos & 7 ) ) ) & 1 );
+
+                if ( 257 == code )
+                    break;
+
+                if ( 256 == code )
+                {
+                    nbits = 9;
+                    next = 258;
+                    previous = -1;
+                    continue;
+                }
+
+                if ( -1 == previous )
+                {
+                    if ( code > 255 )
+                        return false;
+                    dst[ out++ ] = (uint8_t) code;
+                    previous = code;
+                    continue;
+                }
+
+                if ( code > next || next >= 4096 )
+                    return false;
+
+                // the new entry is previous plus the first byte of code, which is previous's first byte if code is new
+
+                uint8_t firstByte = ( code == next ) ? first[ previous ] : first[ code ];
+                prefix[ next ] = (uint16_t) previous;
+                suffix[ next ] = firstByte;
+                first[ next ] = first[ previous ];
+                length[ next ] = (uint16_t) ( length[ previous ] + 1 );
+                next++;
+
+                size_t len = length[ code ];
+                int c = code;
+                for ( size_t i = len; i > 0; i-- )
+                {
+                    stack[ i - 1 ] = suffix[ c ];
+                    c = prefix[ c ];
+                }
+
+                size_t copy = std::min( len, dstLen - out );
+                memcpy( dst + out, stack.data(), copy );
+                out += copy;
+                previous = code;
+
+                if ( next + 1 >= ( 1 << nbits ) && nbits < 12 )
+                    nbits++;
+            }
+
+            return true;
+        } //LzwDecode
+
+        static void LzwEncode( const uint8_t * src, size_t srcLen, std::vector<uint8_t> & dst )
+        {
+            // The table maps ( prefix code, byte ) to a code with open addressing
+
+            const int TableSize = 8191; // prime, about twice the 4094 codes
+            std::vector<uint32_t> keys( TableSize );
+            std::vector<uint16_t> codes( TableSize );
+            dst.clear();
+            dst.reserve( srcLen / 2 + 64 );
+
+            uint32_t bits = 0;
+            int bitCount = 0;
+            int nbits = 9, maxCode = 511, next = 258;
+
+            auto put = [&] ( int code )
+            {
+                bits = ( bits << nbits ) | (uint32_t) code;
+                bitCount += nbits;
+                while ( bitCount >= 8 )
+                {
+                    bitCount -= 8;
+                    dst.push_back( (uint8_t) ( bits >> bitCount ) );
+                }
+            };
+
+            auto clear = [&] ()
+            {
+                std::fill( keys.begin(), keys.end(), 0 );
+                nbits = 9;
+                maxCode = 511;
+                next = 258;
+            };
+
+            auto added = [&] ()
+            {
+                if ( ++next == 4094 )
+                {
+                    put( 256 );
+                    clear();
+                }
+                else if ( next > maxCode )
+                {
+                    nbits++;
+                    maxCode = ( 1 << nbits ) - 1;
+                }
+            };
+
+            clear();
+            put( 256 );
+
+            if ( 0 != srcLen )
+            {
+                int w = src[ 0 ];
+
+                for ( size_t i = 1; i < srcLen; i++ )
+                {
+                    // keys hold key + 1 so 0 means empty
+
+                    uint32_t key = ( (uint32_t) w << 8 ) | src[ i ];
+                    uint32_t h = ( key * 2654435761u ) % TableSize;
+
+                    while ( 0 != keys[ h ] && keys[ h ] != key + 1 )
+                        h = ( h + 1 ) % TableSize;
+
+                    if ( 0 != keys[ h ] )
+                    {
+                        w = codes[ h ];
+                        continue;
+                    }
+
+                    put( w );
+                    keys[ h ] = key + 1;
+                    codes[ h ] = (uint16_t) next;
+                    added();
+                    w = src[ i ];
+                }
+
+                put( w );
+                added();
+            }
+
+            put( 257 );
+
+            if ( bitCount > 0 )
+                dst.push_back( (uint8_t) ( bits << ( 8 - bitCount ) ) );
+        } //LzwEncode
+
+        static void PackBitsDecode( const uint8_t * src, size_t srcLen, uint8_t * dst, size_t dstLen )
+        {
+            size_t in = 0, out = 0;
+
+            while ( in < srcLen && out < dstLen )
+            {
+                int n = (int8_t) src[ in++ ];
+
+                if ( n >= 0 )
+                {
+                    size_t copy = std::min( std::min( (size_t) n + 1, srcLen - in ), dstLen - out );
+                    memcpy( dst + out, src + in, copy );
+                    in += n + 1;
+                    out += copy;
+                }
+                else if ( -128 != n && in < srcLen )
+                {
+                    size_t copy = std::min( (size_t) ( 1 - n ), dstLen - out );
+                    memset( dst + out, src[ in++ ], copy );
+                    out += copy;
+                }
+            }
+        } //PackBitsDecode
+
+        // Decode chunk (strip or tile) index into chunk, which is chunkRowBytes x chunkHeight. Short or damaged data
+        // leaves the rest zero, the way most readers show it.
+
+        bool DecodeChunk( const Layout & l, uint32_t index, std::vector<uint8_t> & chunk, std::vector<uint8_t> & compressed )
+        {
+            std::fill( chunk.begin(), chunk.end(), 0 );
+
+            uint32_t count = l.counts[ index ];
+            compressed.resize( count );
+            if ( 0 == count || !ReadAt( l.offsets[ index ], compressed.data(), count ) )
+                return true;
+
+            if ( CompressionNone == l.compression )
+                memcpy( chunk.data(), compressed.data(), std::min( chunk.size(), (size_t) count ) );
+            else if ( CompressionLZW == l.compression )
+                LzwDecode( compressed.data(), count, chunk.data(), chunk.size() );
+            else if ( CompressionPackBits == l.compression )
+                PackBitsDecode( compressed.data(), count, chunk.data(), chunk.size() );
+            else
+            {
+                z_stream z;
+                memset( &z, 0, sizeof( z ) );
+                if ( Z_OK != inflateInit( &z ) )
+                    return false;
+
+                z.next_in = compressed.data();
+                z.avail_in = count;
+                z.next_out = chunk.data();
+                z.avail_out = (uInt) chunk.size();
+                inflate( &z, Z_FINISH );
+                inflateEnd( &z );
+            }
+
+            if ( 2 == l.predictor )
+                PredictRows( chunk.data(), l.chunkHeight, l.chunkRowBytes, l.bits, ( 2 == l.planar ) ? 1 : l.samples, true );
+
+            return true;
+        } //DecodeChunk
+
+        // Reads rows of one plane of an image in order, decoding each source strip or row of tiles once
+
+        struct RowReader
+        {
+            CTiffRewriter & owner;
+            const Layout & l;
+            uint32_t plane;
+            uint32_t band;                  // chunksDown index held in rows, or UINT32_MAX
+            std::vector<uint8_t> rows;      // chunkHeight rows of the full image width
+            std::vector<uint8_t> chunk, compressed;
+
+            RowReader( CTiffRewriter & o, const Layout & layout, uint32_t p ) : owner( o ), l( layout ), plane( p ), band( UINT32_MAX )
+            {
+                rows.resize( l.rowBytes * l.chunkHeight );
+                chunk.resize( l.chunkRowBytes * l.chunkHeight );
+            }
+
+            bool Read( uint32_t y, uint8_t * dst )
+            {
+                uint32_t b = y / l.chunkHeight;
+
+                if ( b != band )
+                {
+                    band = b;
+                    uint32_t first = ( plane * l.chunksDown + b ) * l.chunksAcross;
+
+                    for ( uint32_t c = 0; c < l.chunksAcross; c++ )
+                    {
+                        if ( !owner.DecodeChunk( l, first + c, chunk, compressed ) )
+                            return false;
+
+                        // for strips this is one copy; tiles past the right edge are cropped
+
+                        size_t x = (size_t) c * l.chunkRowBytes;
+                        size_t bytes = std::min( l.chunkRowBytes, l.rowBytes - x );
+
+                        for ( uint32_t r = 0; r < l.chunkHeight; r++ )
+                            memcpy( rows.data() + r * l.rowBytes + x, chunk.data() + r * l.chunkRowBytes, bytes );
+                    }
+                }
+
+                memcpy( dst, rows.data() + (size_t) ( y - b * l.chunkHeight ) * l.rowBytes, l.rowBytes );
+                return true;
+            }
+        }; //RowReader
+
+        template <class F> static void ParallelFor( int count, unsigned int threads, F f )
+        {
+            std::atomic<int> next( 0 );
+            auto worker = [&] ()
+            {
+                for ( int i = next++; i < count; i = next++ )
+                    f( i );
+            };
+
+            std::vector<std::thread> workers;
+            for ( unsigned int t = 1; t < threads && (int) t < count; t++ )
+                workers.emplace_back( worker );
+
+            worker();
+
+            for ( size_t i = 0; i < workers.size(); i++ )
+                workers[ i ].join();
+        } //ParallelFor
+
+        bool Recompress( Ifd & ifd, const Layout & l, int compression, bool predictor, int level )
+        {
+            bool predict = predictor && ( CompressionNone != compression ) && ( 8 == l.bits || 16 == l.bits || 32 == l.bits ) && ( 3 != l.sampleFormat );
+            uint32_t stride = ( 2 == l.planar ) ? 1 : l.samples;
+            uint32_t rowsPerStrip = (uint32_t) std::max( (size_t) 1, std::min( (size_t) l.height, TargetStripBytes / l.rowBytes ) );
+            uint32_t stripsPerPlane = ( l.height + rowsPerStrip - 1 ) / rowsPerStrip;
+            int batch = (int) std::max( 1u, threads ) * 4;
+            std::vector<uint32_t> offsets, counts;
+            std::vector<std::vector<uint8_t>> raw( batch ), packed( batch );
+
+            for ( uint32_t plane = 0; plane < l.planes; plane++ )
+            {
+                RowReader reader( *this, l, plane );
+
+                for ( uint32_t s = 0; s < stripsPerPlane; s += batch )
+                {
+                    int n = (int) std::min( (uint32_t) batch, stripsPerPlane - s );
+
+                    for ( int i = 0; i < n; i++ )
+                    {
+                        uint32_t y0 = ( s + i ) * rowsPerStrip;
+                        uint32_t rows = std::min( rowsPerStrip, l.height - y0 );
+                        raw[ i ].resize( rows * l.rowBytes );
+
+                        for ( uint32_t r = 0; r < rows; r++ )
+                            if ( !reader.Read( y0 + r, raw[ i ].data() + r * l.rowBytes ) )
+                            {
+                                error = "can't decode the source image";
+                                return false;
+                            }
+                    }
+
+                    std::atomic<bool> ok( true );
+
+                    ParallelFor( n, threads, [&] ( int i )
+                    {
+                        std::vector<uint8_t> & in = raw[ i ];
+                        std::vector<uint8_t> & out = packed[ i ];
+
+                        if ( predict )
+                            PredictRows( in.data(), in.size() / l.rowBytes, l.rowBytes, l.bits, stride, false );
+
+                        if ( CompressionLZW == compression )
+                            LzwEncode( in.data(), in.size(), out );
+                        else if ( CompressionDeflate == compression )
+                        {
+                            uLongf len = compressBound( (uLong) in.size() );
+                            out.resize( len );
+                            if ( Z_OK != compress2( out.data(), &len, in.data(), (uLong) in.size(), level ) )
+                                ok = false;
+                            out.resize( len );
+                        }
+                        else
+                            out.swap( in );
+                    } );
+
+                    if ( !ok )
+                    {
+                        error = "zlib can't compress a strip";
+                        return false;
+                    }
+
+                    for ( int i = 0; i < n; i++ )
+                    {
+                        stats.pixelBytes += ( CompressionNone == compression ) ? packed[ i ].size() : raw[ i ].size();
+                        stats.dataBytes += packed[ i ].size();
+                        offsets.push_back( (uint32_t) outPos );
+                        counts.push_back( (uint32_t) packed[ i ].size() );
+
+                        if ( !Write( packed[ i ].data(), packed[ i ].size() ) || !WriteAlign() )
+                            return false;
+                    }
+                }
+            }
+
+            std::vector<uint32_t> one( 1 );
+            RemoveEntry( ifd, TagTileWidth );
+            RemoveEntry( ifd, TagTileLength );
+            RemoveEntry( ifd, TagTileOffsets );
+            RemoveEntry( ifd, TagTileByteCounts );
+            one[ 0 ] = compression;
+            SetEntry( ifd, MakeEntry( TagCompression, TypeShort, one ) );
+            one[ 0 ] = rowsPerStrip;
+            SetEntry( ifd, MakeEntry( TagRowsPerStrip, TypeLong, one ) );
+            SetEntry( ifd, MakeEntry( TagStripOffsets, TypeLong, offsets ) );
+            SetEntry( ifd, MakeEntry( TagStripByteCounts, TypeLong, counts ) );
+
+            if ( predict )
+            {
+                one[ 0 ] = 2;
+                SetEntry( ifd, MakeEntry( TagPredictor, TypeShort, one ) );
+            }
+            else
+                RemoveEntry( ifd, TagPredictor );
+
+            stats.recompressed++;
+            return true;
+        } //Recompress
+
+        bool CopyChunks( Ifd & ifd, const Layout & l )
+        {
+            std::vector<uint32_t> offsets;
+            std::vector<uint8_t> data;
+
+            for ( size_t i = 0; i < l.offsets.size(); i++ )
+            {
+                data.resize( l.counts[ i ] );
+                if ( !ReadAt( l.offsets[ i ], data.data(), data.size() ) )
+                {
+                    error = "an image chunk is past the end of the file";
+                    return false;
+                }
+
+                offsets.push_back( (uint32_t) outPos );
+                if ( !Write( data.data(), data.size() ) || !WriteAlign() )
+                    return false;
+            }
+
+            SetEntry( ifd, MakeEntry( l.tiled ? TagTileOffsets : TagStripOffsets, TypeLong, offsets ) );
+            return true;
+        } //CopyChunks
+
+        // Thumbnails in old-style JPEG IFDs are a single block located by tags 513 and 514
+
+        bool CopyJpegInterchange( Ifd & ifd )
+        {
+            const Entry * offset = Find( ifd, TagJPEGInterchangeFormat );
+            uint32_t length = Number( ifd, TagJPEGInterchangeFormatLength, 0 );
+
+            if ( NULL == offset )
+                return true;
+
+            std::vector<uint8_t> data( length );
+            if ( 0 == length || !ReadAt( Value( *offset, 0 ), data.data(), length ) )
+            {
+                RemoveEntry( ifd, TagJPEGInterchangeFormat );
+                RemoveEntry( ifd, TagJPEGInterchangeFormatLength );
+                return true;
+            }
+
+            std::vector<uint32_t> one( 1, (uint32_t) outPos );
+            SetEntry( ifd, MakeEntry( TagJPEGInterchangeFormat, TypeLong, one ) );
+            return Write( data.data(), data.size() ) && WriteAlign();
+        } //CopyJpegInterchange
+
+        bool WriteIfds()
+        {
+            // Assign each IFD an offset, then write each IFD followed by its values that don't fit in an entry
+
+            for ( size_t i = 0; i < ifds.size(); i++ )
+            {
+                Ifd & ifd = ifds[ i ];
+                std::sort( ifd.entries.begin(), ifd.entries.end(), [] ( const Entry & a, const Entry & b ) { return a.tag < b.tag; } );
+
+                // a pointer with no sub-IFDs (a count of 0) has nothing to point at in the new file
+
+                for ( size_t e = 0; e < ifd.entries.size(); e++ )
+                {
+                    Entry & entry = ifd.entries[ e ];
+
+                    if ( !IsIfdPointer( entry.tag ) )
+                        continue;
+
+                    if ( entry.children.empty() )
+                        ifd.entries.erase( ifd.entries.begin() + e-- );
+                    else
+                    {
+                        entry.count = (uint32_t) entry.children.size();
+                        entry.value.resize( 4 * entry.count );
+                    }
+                }
+            }
+
+            unsigned long long offset = outPos;
+
+            for ( size_t i = 0; i < ifds.size(); i++ )
+            {
+                ifds[ i ].offset = (uint32_t) offset;
+                offset += 2 + 12 * ifds[ i ].entries.size() + 4;
+
+                for ( size_t e = 0; e < ifds[ i ].entries.size(); e++ )
+                    if ( ifds[ i ].entries[ e ].value.size() > 4 )
+                        offset += ( ifds[ i ].entries[ e ].value.size() + 1 ) & ~(size_t) 1;
+            }
+
+            if ( offset > 0xffffffffull )
+            {
+                error = "the rewritten file would be over 4 GB";
+                return false;
+            }
+
+            for ( size_t i = 0; i < ifds.size(); i++ )
+            {
+                Ifd & ifd = ifds[ i ];
+                std::vector<uint8_t> table( 2 + 12 * ifd.entries.size() + 4 );
+                std::vector<uint8_t> values;
+                uint32_t valuesOffset = ifd.offset + (uint32_t) table.size();
+
+                Put16( table.data(), (uint16_t) ifd.entries.size() );
+
+                for ( size_t e = 0; e < ifd.entries.size(); e++ )
+                {
+                    Entry & entry = ifd.entries[ e ];
+                    uint8_t * p = table.data() + 2 + 12 * e;
+
+                    for ( size_t c = 0; c < entry.children.size(); c++ )
+                        Put32( entry.value.data() + 4 * c, ifds[ entry.children[ c ] ].offset );
+
+                    Put16( p, entry.tag );
+                    Put16( p + 2, entry.type );
+                    Put32( p + 4, entry.count );
+
+                    if ( entry.value.size() <= 4 )
+                        memcpy( p + 8, entry.value.data(), entry.value.size() );
+                    else
+                    {
+                        Put32( p + 8, valuesOffset + (uint32_t) values.size() );
+                        values.insert( values.end(), entry.value.begin(), entry.value.end() );
+                        if ( values.size() & 1 )
+                            values.push_back( 0 );
+                    }
+                }
+
+                // only the main chain links to a next IFD
+
+                uint32_t next = 0;
+                for ( size_t c = 0; c + 1 < chain.size(); c++ )
+                    if ( i == chain[ c ] )
+                        next = ifds[ chain[ c + 1 ] ].offset;
+
+                Put32( table.data() + table.size() - 4, next );
+
+                if ( !Write( table.data(), table.size() ) || !Write( values.data(), values.size() ) )
+                    return false;
+            }
+
+            uint8_t header[ 8 ] = { (uint8_t) ( bigEndian ? 'M' : 'I' ), (uint8_t) ( bigEndian ? 'M' : 'I' ) };
+            Put16( header + 2, 42 );
+            Put32( header + 4, ifds[ chain[ 0 ] ].offset );
+
+            if ( !Seek( fpOut, 0 ) || 8 != fwrite( header, 1, 8, fpOut ) || 0 != fflush( fpOut ) )
+            {
+                error = "can't write the output file";
+                return false;
+            }
+
+            return true;
+        } //WriteIfds
+
+    public:
+        CTiffRewriter() : fpIn( NULL ), fpOut( NULL ), bigEndian( false ), inSize( 0 ), outPos( 0 ), threads( 1 ), error( "" ),
+                          lostTags( 0 ), firstLostTag( 0 ), lostIfd( false )
+        {
+            lostError[ 0 ] = 0;
+            memset( &stats, 0, sizeof( stats ) );
+        }
+
+        // Why the last call failed
+
+        const char * Error() const { return error; }
+
+        const Stats & GetStats() const { return stats; }
+
+        // Compression of the first image in the file, or 0 if it isn't a TIFF
+
+        uint32_t GetCompression( FILE * in )
+        {
+            fpIn = in;
+            ifds.clear();
+            chain.clear();
+            visited.clear();
+            lostTags = 0;
+            lostIfd = false;
+
+            if ( !Parse() )
+                return 0;
+
+            return Number( ifds[ chain[ 0 ] ], TagCompression, CompressionNone );
+        } //GetCompression
+
+        // Write in to out with every image compressed with compression (CompressionNone, CompressionLZW, or
+        // CompressionDeflate). predictor enables horizontal differencing for 8, 16, and 32-bit integer samples, and level
+        // is the zlib level. After the predictor, level 1 is within a few percent of level 6's size for photos at several
+        // times the speed. threads 0 means one per core. out must be empty and opened for writing and seeking.
+
+        bool Rewrite( FILE * in, FILE * out, int compression, unsigned int threadCount = 0, bool predictor = true, int level = Z_BEST_SPEED )
+        {
+            if ( CompressionNone != compression && CompressionLZW != compression && CompressionDeflate != compression )
+            {
+                error = "the compression must be none, LZW, or Deflate";
+                return false;
+            }
+
+            fpIn = in;
+            fpOut = out;
+            outPos = 0;
+            threads = ( 0 == threadCount ) ? std::max( 1u, std::thread::hardware_concurrency() ) : threadCount;
+            memset( &stats, 0, sizeof( stats ) );
+            ifds.clear();
+            chain.clear();
+            visited.clear();
+            lostTags = 0;
+            lostIfd = false;
+            error = "";
+
+            if ( !Parse() )
+                return false;
+
+            // Every tag is kept or the file isn't rewritten, so the caller can fall back without losing metadata
+
+            if ( lostIfd )
+            {
+                error = "an IFD in the main chain can't be read, so it would be lost";
+                return false;
+            }
+
+            if ( 0 != lostTags )
+            {
+                if ( 1 == lostTags )
+                    snprintf( lostError, sizeof( lostError ), "tag %u can't be read, so it would be lost", firstLostTag );
+                else
+                    snprintf( lostError, sizeof( lostError ), "%d tags can't be read, including tag %u, so they would be lost", lostTags, firstLostTag );
+                error = lostError;
+                return false;
+            }
+
+            uint8_t header[ 8 ] = { 0 };
+            if ( !Write( header, sizeof( header ) ) )
+                return false;
+
+            for ( size_t i = 0; i < ifds.size(); i++ )
+            {
+                Ifd & ifd = ifds[ i ];
+                RemoveEntry( ifd, TagFreeOffsets );
+                RemoveEntry( ifd, TagFreeByteCounts );
+
+                if ( !CopyJpegInterchange( ifd ) )
+                    return false;
+
+                Layout l;
+                if ( !GetLayout( ifd, l ) )
+                    continue;
+
+                stats.images++;
+
+                bool sameBits = true;
+                const Entry * bits = Find( ifd, TagBitsPerSample );
+                for ( uint32_t b = 1; NULL != bits && b < bits->count; b++ )
+                    sameBits = sameBits && ( Value( *bits, b ) == l.bits );
+
+                bool ok = ( sameBits && CanDecode( l ) ) ? Recompress( ifd, l, compression, predictor, level ) : CopyChunks( ifd, l );
+                if ( !ok )
+                    return false;
+            }
+
+            if ( !WriteIfds() )
+                return false;
+
+            stats.fileBytes = outPos;
+            return true;
+        } //Rewrite
+}; //CTiffRewriter
@@ -1,6 +1,8 @@
 #pragma once
 
 // sets the compression state of a TIFF file
+// With PV_USE_ZLIB the file is rewritten by CTiffRewriter, which compresses strips in parallel and keeps every tag.
+// Otherwise, or if CTiffRewriter can't handle the file, WIC decodes and re-encodes it.
 
 #include <windows.h>
 #include <wincodecsdk.h>
@@ -9,6 +11,10 @@
 
 #include <djltrace.hxx>
 
+#ifdef PV_USE_ZLIB
+#include <djl_tiffrw.hxx>
+#endif
+
 using namespace Microsoft::WRL;
 
 #pragma comment( lib, "ole32.lib" )
@@ -32,29 +38,34 @@ private:
         return true;
     } //CreateOutputPath
 
-    // OneDrive, Defender, the Indexer, etc. all hold files and prevent renames.
+    // OneDrive, Defender, the Indexer, etc. all hold files for a while and make renames and deletes fail.
+    // Those errors go away when they let go; others won't, so they aren't retried.
 
-    BOOL MoveFileWithRetries( WCHAR const * oldname, WCHAR const * newname )
+    static bool IsTransientError( DWORD err )
     {
-        //printf( "renaming %ws to %ws\n", oldname, newname );
-        BOOL ok;
-    
+        return ( ERROR_SHARING_VIOLATION == err || ERROR_LOCK_VIOLATION == err || ERROR_ACCESS_DENIED == err );
+    } //IsTransientError
+
+    BOOL ReplaceFileWithRetries( WCHAR const * replacement, WCHAR const * path )
+    {
+        // One rename replaces path, so if it fails path is still the original file and nothing is left under another name
+
+        BOOL ok = false;
+
         for ( int attempt = 0; attempt < 20; attempt++ )
         {
-            ok = MoveFile( oldname, newname );
-            if ( ok )
+            ok = MoveFileEx( replacement, path, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH );
+            if ( ok || !IsTransientError( GetLastError() ) )
                 break;
-    
+
             Sleep( 500 );
-            //printf( "r" );
         }
-    
+
         return ok;
-    } //MoveFileWithRetries
+    } //ReplaceFileWithRetries
 
     BOOL DeleteFileWithRetries( WCHAR const * path )
     {
-        //printf( "deleting %ws\n", path );
         BOOL ok = false;
 
         for ( int attempt = 0; attempt < 20; attempt++ )
@@ -71,16 +82,68 @@ private:
                 break;
             }
 
-            if ( ERROR_SHARING_VIOLATION != err )
+            if ( !IsTransientError( err ) )
                 break;
     
             Sleep( 500 );
-            //printf( "d" );
         }
     
         return ok;
     } //DeleteFileWithRetries
 
+#ifdef PV_USE_ZLIB
+
+    HRESULT RewriteTiff( WCHAR const * pwcPath, WCHAR const * pwcOutputPath, DWORD compressionMethod, bool & alreadyCompressed )
+    {
+        alreadyCompressed = false;
+
+        FILE * fpIn = NULL;
+        errno_t err = _wfopen_s( &fpIn, pwcPath, L"rb" );
+        if ( 0 != err )
+        {
+            tracer.Trace( "can't open tiff file %ws, error %d\n", pwcPath, err );
+            return E_FAIL;
+        }
+
+        CTiffRewriter rewriter;
+        DWORD currentCompression = rewriter.GetCompression( fpIn );
+        tracer.Trace( "the current compression is %d for file %ws\n", currentCompression, pwcPath );
+
+        if ( compressionMethod == currentCompression )
+        {
+            fclose( fpIn );
+            alreadyCompressed = true;
+            return S_OK;
+        }
+
+        FILE * fpOut = NULL;
+        err = _wfopen_s( &fpOut, pwcOutputPath, L"wb" );
+        if ( 0 != err )
+        {
+            tracer.Trace( "can't create temporary tiff file %ws, error %d\n", pwcOutputPath, err );
+            fclose( fpIn );
+            return E_FAIL;
+        }
+
+        ULONGLONG start = GetTickCount64();
+        bool ok = rewriter.Rewrite( fpIn, fpOut, compressionMethod );
+        fclose( fpIn );
+        ok = ( 0 == fclose( fpOut ) ) && ok;
+
+        if ( !ok )
+        {
+            tracer.Trace( "can't rewrite tiff file %ws: %s\n", pwcPath, rewriter.Error() );
+            return E_FAIL;
+        }
+
+        const CTiffRewriter::Stats & stats = rewriter.GetStats();
+        tracer.Trace( "rewrote tiff in %llu ms: %d of %d images recompressed, %llu bytes of pixels in %llu bytes, file is %llu bytes\n",
+                      GetTickCount64() - start, stats.recompressed, stats.images, stats.pixelBytes, stats.dataBytes, stats.fileBytes );
+        return S_OK;
+    } //RewriteTiff
+
+#endif // PV_USE_ZLIB
+
     HRESULT SetTiffCompression( ComPtr<IWICImagingFactory> & wicFactory, WCHAR const * pwcPath, WCHAR const * pwcOutputPath, DWORD compressionMethod )
     {
         ComPtr<IWICBitmapDecoder> decoder;
@@ -348,6 +411,8 @@ public:
             return HRESULT_FROM_WIN32( GetLastError() );
         }
     
+        // a temporary file can be left from a run that was killed
+
         ok = DeleteFileWithRetries( awcOutputPath );
         if ( !ok )
         {
@@ -355,64 +420,47 @@ public:
             return HRESULT_FROM_WIN32( GetLastError() );
         }
 
-        DWORD currentCompression = 0;
-        HRESULT hr = GetTiffCompression( wicFactory, awcInputPath, &currentCompression );
-        if ( FAILED( hr ) )
-        {
-            tracer.Trace( "failed to read current compression value: %#x\n", hr );
-            return hr;
-        }
-    
-        tracer.Trace( "the current compression is %d for file %ws\n", currentCompression, awcInputPath );
-    
-        if ( compressionMethod == currentCompression )
-            return S_OK;
-    
-        hr = SetTiffCompression( wicFactory, awcInputPath, awcOutputPath, compressionMethod );
-        if ( SUCCEEDED( hr ) )
-        {
-            // 1) rename the original file to a safety name
-            // Loop because sometimes Onedrive opens the file for a long time and doesn't let go.
-    
-            WCHAR awcSafety[ MAX_PATH ];
-            wcscpy( awcSafety, awcInputPath );
-            wcscat( awcSafety, L"-saved" );
-
-            // if it exists from a prior failed run, delete the safety file
+        HRESULT hr = E_FAIL;
+        bool alreadyCompressed = false;
 
-            ok = DeleteFileWithRetries( awcSafety );
-            if ( !ok )
-            {
-                tracer.Trace( "can't delete the residual safety file, error %d\n", GetLastError() );
-                return HRESULT_FROM_WIN32( GetLastError() );
-            }
+#ifdef PV_USE_ZLIB
+        hr = RewriteTiff( awcInputPath, awcOutputPath, compressionMethod, alreadyCompressed );
+        if ( FAILED( hr ) )
+            DeleteFileWithRetries( awcOutputPath );
+#endif
 
-            ok = MoveFileWithRetries( awcInputPath, awcSafety );
-            if ( !ok )
-            {
-                tracer.Trace( "can't rename the original file to safety name, error %d\n", GetLastError() );
-                return HRESULT_FROM_WIN32( GetLastError() );
-            }
-    
-            // rename the compressed file as the origianal file
-    
-            ok = MoveFileWithRetries( awcOutputPath, awcInputPath );
-            if ( !ok )
+        if ( FAILED( hr ) )
+        {
+            DWORD currentCompression = 0;
+            hr = GetTiffCompression( wicFactory, awcInputPath, &currentCompression );
+            if ( FAILED( hr ) )
             {
-                tracer.Trace( "can't rename new file to the original file name, error %d\n", GetLastError() );
-                return HRESULT_FROM_WIN32( GetLastError() );
+                tracer.Trace( "failed to read current compression value: %#x\n", hr );
+                return hr;
             }
     
-            // delete the (renamed) original file
+            tracer.Trace( "the current compression is %d for file %ws\n", currentCompression, awcInputPath );
     
-            ok = DeleteFileWithRetries( awcSafety );
+            alreadyCompressed = ( compressionMethod == currentCompression );
+            if ( !alreadyCompressed )
+                hr = SetTiffCompression( wicFactory, awcInputPath, awcOutputPath, compressionMethod );
+        }
+
+        if ( SUCCEEDED( hr ) && !alreadyCompressed )
+        {
+            // the new file takes the original's name in one step; the original is only gone once that works
+
+            ok = ReplaceFileWithRetries( awcOutputPath, awcInputPath );
             if ( !ok )
             {
-                tracer.Trace( "can't delete the saved original file, error %d\n", GetLastError() );
-                return HRESULT_FROM_WIN32( GetLastError() );
+                hr = HRESULT_FROM_WIN32( GetLastError() );
+                tracer.Trace( "can't replace the original file with the compressed file, error %#x\n", hr );
             }
         }
 
+        if ( FAILED( hr ) )
+            DeleteFileWithRetries( awcOutputPath );
+
         return hr;
     } //CompressTiff
 }; //CTiffCompression
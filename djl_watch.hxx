@@ -0,0 +1,459 @@
+#pragma once
+
+//
+// Watches a folder tree and reports files and folders that are added, removed, modified, or renamed, so a list
+// built by enumerating the tree can be kept current without enumerating it again. Changes are reported on the
+// watcher's thread; callers typically queue them for their UI thread.
+//
+// On Windows this is ReadDirectoryChangesW on the root with the whole subtree watched. On Linux it's inotify,
+// which watches one folder at a time, so each folder gets a watch and new folders are watched as they appear.
+// Files created in a new folder before its watch was added aren't reported, so a folder that's added should
+// be enumerated by the caller.
+//
+// Usage:
+//     CFolderWatch watch;
+//     watch.Start( L"c:\\photos", [&] ( const CFolderChange & change ) { ... } );
+//     ...
+//     watch.Stop(); // also done by the destructor
+//
+
+#include <djl_os.hxx>
+#include <djltrace.hxx>
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <map>
+#endif
+
+struct CFolderChange
+{
+    enum Action { Added, Removed, Modified, Renamed, Overflow };
+
+    Action action;
+    std::wstring path;      // the file or folder; the new name for Renamed. Empty for Overflow
+    std::wstring oldPath;   // the previous name for Renamed
+    bool isFolder;          // known for Added and Renamed. Removed items may be either
+};
+
+class CFolderWatch
+{
+    private:
+        std::function<void ( const CFolderChange & )> onChange;
+        std::thread watcher;
+        std::wstring root;      // with a trailing separator
+
+#ifdef _WIN32
+        HANDLE hFolder;
+        HANDLE hStop;
+
+        void Report( CFolderChange::Action action, const WCHAR * pwcName, DWORD cbName, const std::wstring & oldPath = std::wstring() )
+        {
+            // Names are lowercased like CEnumFolder's, so paths from both compare equal
+
+            std::wstring name( pwcName, cbName / sizeof( WCHAR ) );
+            _wcslwr_s( &name[ 0 ], name.length() + 1 );
+
+            CFolderChange change;
+            change.action = action;
+            change.path = root + name;
+            change.oldPath = oldPath;
+
+            DWORD attr = ( CFolderChange::Removed == action ) ? INVALID_FILE_ATTRIBUTES : GetFileAttributesW( change.path.c_str() );
+            change.isFolder = ( INVALID_FILE_ATTRIBUTES != attr && 0 != ( attr & FILE_ATTRIBUTE_DIRECTORY ) );
+
+            onChange( change );
+        } //Report
+
+        void Watch()
+        {
+            const DWORD cbBuffer = 64 * 1024; // the most a network share will return
+            std::unique_ptr<DWORD[]> buffer( new DWORD[ cbBuffer / sizeof( DWORD ) ] );
+            HANDLE hEvent = CreateEvent( NULL, TRUE, FALSE, NULL );
+            if ( NULL == hEvent )
+                return;
+
+            const DWORD filter = FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_DIR_NAME | FILE_NOTIFY_CHANGE_SIZE | FILE_NOTIFY_CHANGE_LAST_WRITE;
+            std::wstring renamedFrom;
+
+            do
+            {
+                OVERLAPPED overlapped = {};
+                overlapped.hEvent = hEvent;
+                ResetEvent( hEvent );
+
+                if ( !ReadDirectoryChangesW( hFolder, buffer.get(), cbBuffer, TRUE, filter, NULL, &overlapped, NULL ) )
+                {
+                    tracer.Trace( "can't watch folder %ws, error %d\n", root.c_str(), GetLastError() );
+                    break;
+                }
+
+                HANDLE handles[] = { hStop, hEvent };
+                DWORD wait = WaitForMultipleObjects( _countof( handles ), handles, FALSE, INFINITE );
+                DWORD cbResult = 0;
+
+                if ( WAIT_OBJECT_0 + 1 != wait )
+                {
+                    CancelIoEx( hFolder, &overlapped );
+                    GetOverlappedResult( hFolder, &overlapped, &cbResult, TRUE );
+                    break;
+                }
+
+                if ( !GetOverlappedResult( hFolder, &overlapped, &cbResult, FALSE ) )
+                    break;
+
+                if ( 0 == cbResult )
+                {
+                    // The buffer overflowed and the changes are lost
+
+                    CFolderChange change;
+                    change.action = CFolderChange::Overflow;
+                    change.isFolder = false;
+                    onChange( change );
+                    continue;
+                }
+
+                BYTE * pb = (BYTE *) buffer.get();
+
+                for ( ;; )
+                {
+                    FILE_NOTIFY_INFORMATION * pfni = (FILE_NOTIFY_INFORMATION *) pb;
+
+                    if ( FILE_ACTION_ADDED == pfni->Action )
+                        Report( CFolderChange::Added, pfni->FileName, pfni->FileNameLength );
+                    else if ( FILE_ACTION_REMOVED == pfni->Action )
+                        Report( CFolderChange::Removed, pfni->FileName, pfni->FileNameLength );
+                    else if ( FILE_ACTION_MODIFIED == pfni->Action )
+                        Report( CFolderChange::Modified, pfni->FileName, pfni->FileNameLength );
+                    else if ( FILE_ACTION_RENAMED_OLD_NAME == pfni->Action )
+                    {
+                        renamedFrom.assign( pfni->FileName, pfni->FileNameLength / sizeof( WCHAR ) );
+                        _wcslwr_s( &renamedFrom[ 0 ], renamedFrom.length() + 1 );
+                        renamedFrom = root + renamedFrom;
+                    }
+                    else if ( FILE_ACTION_RENAMED_NEW_NAME == pfni->Action )
+                    {
+                        if ( renamedFrom.empty() )
+                            Report( CFolderChange::Added, pfni->FileName, pfni->FileNameLength );
+                        else
+                            Report( CFolderChange::Renamed, pfni->FileName, pfni->FileNameLength, renamedFrom );
+
+                        renamedFrom.clear();
+                    }
+
+                    if ( 0 == pfni->NextEntryOffset )
+                        break;
+
+                    pb += pfni->NextEntryOffset;
+                }
+            } while ( true );
+
+            CloseHandle( hEvent );
+        } //Watch
+
+#else
+        int fdNotify;
+        int fdStop[ 2 ];                    // written to by Stop to wake the watcher
+        std::map<int, std::string> folders; // watch descriptor to folder path with a trailing slash
+
+        static const uint32_t watchMask = IN_CREATE | IN_DELETE | IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO |
+                                          IN_DELETE_SELF | IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK;
+
+        void AddWatches( const std::string & folder )
+        {
+            // Watch folder and every folder under it
+
+            int wd = inotify_add_watch( fdNotify, folder.c_str(), watchMask );
+            if ( -1 == wd )
+            {
+                tracer.Trace( "can't watch folder %s, errno %d\n", folder.c_str(), errno );
+                return;
+            }
+
+            folders[ wd ] = folder;
+
+            DIR * pdir = opendir( folder.c_str() );
+            if ( NULL == pdir )
+                return;
+
+            struct dirent * pent;
+            while ( NULL != ( pent = readdir( pdir ) ) )
+            {
+                if ( !strcmp( pent->d_name, "." ) || !strcmp( pent->d_name, ".." ) )
+                    continue;
+
+                bool isDir = ( DT_DIR == pent->d_type );
+                if ( DT_UNKNOWN == pent->d_type )
+                {
+                    struct stat st;
+                    isDir = ( 0 == fstatat( dirfd( pdir ), pent->d_name, &st, AT_SYMLINK_NOFOLLOW ) && S_ISDIR( st.st_mode ) );
+                }
+
+                if ( isDir )
+                    AddWatches( folder + pent->d_name + "/" );
+            }
+
+            closedir( pdir );
+        } //AddWatches
+
+        void RenameWatches( const std::string & oldFolder, const std::string & newFolder )
+        {
+            // A renamed folder keeps its watches, but they and the watches under it have the old path
+
+            for ( auto it = folders.begin(); it != folders.end(); it++ )
+                if ( 0 == it->second.compare( 0, oldFolder.length(), oldFolder ) )
+                    it->second = newFolder + it->second.substr( oldFolder.length() );
+        } //RenameWatches
+
+        static std::wstring Wide( const std::string & s )
+        {
+            size_t cwc = mbstowcs( NULL, s.c_str(), 0 );
+            if ( (size_t) -1 == cwc )
+                return std::wstring();
+
+            std::wstring w( cwc, 0 );
+            mbstowcs( &w[ 0 ], s.c_str(), cwc + 1 );
+            return w;
+        } //Wide
+
+        void Report( CFolderChange::Action action, const std::string & path, bool isFolder, const std::string & oldPath = std::string() )
+        {
+            CFolderChange change;
+            change.action = action;
+            change.path = Wide( path );
+            change.oldPath = Wide( oldPath );
+            change.isFolder = isFolder;
+
+            if ( !change.path.empty() )
+                onChange( change );
+        } //Report
+
+        void Watch()
+        {
+            alignas( struct inotify_event ) char buffer[ 64 * 1024 ];
+
+            for ( ;; )
+            {
+                struct pollfd fds[ 2 ] = { { fdNotify, POLLIN, 0 }, { fdStop[ 0 ], POLLIN, 0 } };
+                if ( poll( fds, 2, -1 ) < 0 )
+                {
+                    if ( EINTR == errno )
+                        continue;
+                    break;
+                }
+
+                if ( 0 != fds[ 1 ].revents )
+                    break;
+
+                ssize_t cb = read( fdNotify, buffer, sizeof( buffer ) );
+                if ( cb <= 0 )
+                {
+                    if ( cb < 0 && ( EINTR == errno || EAGAIN == errno ) )
+                        continue;
+                    break;
+                }
+
+                // A rename is a MOVED_FROM followed by a MOVED_TO with the same cookie. A MOVED_FROM without
+                // one was moved out of the tree, and a MOVED_TO without one was moved in.
+
+                uint32_t movedCookie = 0;
+                std::string movedFrom;
+                bool movedFolder = false;
+
+                for ( char * p = buffer; p < buffer + cb; )
+                {
+                    struct inotify_event * pev = (struct inotify_event *) p;
+                    p += sizeof( struct inotify_event ) + pev->len;
+
+                    if ( 0 != ( pev->mask & IN_Q_OVERFLOW ) )
+                    {
+                        Report( CFolderChange::Overflow, std::string(), false );
+                        continue;
+                    }
+
+                    auto folder = folders.find( pev->wd );
+                    if ( 0 != ( pev->mask & IN_IGNORED ) )
+                    {
+                        if ( folder != folders.end() )
+                            folders.erase( folder );
+                        continue;
+                    }
+
+                    if ( folder == folders.end() || 0 == pev->len )
+                        continue;
+
+                    std::string path = folder->second + pev->name;
+                    bool isFolder = ( 0 != ( pev->mask & IN_ISDIR ) );
+
+                    if ( 0 != movedCookie && ( 0 == ( pev->mask & IN_MOVED_TO ) || pev->cookie != movedCookie ) )
+                    {
+                        Report( CFolderChange::Removed, movedFrom, movedFolder );
+                        movedCookie = 0;
+                    }
+
+                    if ( 0 != ( pev->mask & IN_CREATE ) )
+                    {
+                        if ( isFolder )
+                            AddWatches( path + "/" );
+                        Report( CFolderChange::Added, path, isFolder );
+                    }
+                    else if ( 0 != ( pev->mask & IN_DELETE ) )
+                        Report( CFolderChange::Removed, path, isFolder );
+                    else if ( 0 != ( pev->mask & IN_CLOSE_WRITE ) )
+                        Report( CFolderChange::Modified, path, false );
+                    else if ( 0 != ( pev->mask & IN_MOVED_FROM ) )
+                    {
+                        movedCookie = pev->cookie;
+                        movedFrom = path;
+                        movedFolder = isFolder;
+                    }
+                    else if ( 0 != ( pev->mask & IN_MOVED_TO ) )
+                    {
+                        if ( 0 != movedCookie )
+                        {
+                            if ( isFolder )
+                                RenameWatches( movedFrom + "/", path + "/" );
+                            Report( CFolderChange::Renamed, path, isFolder, movedFrom );
+                            movedCookie = 0;
+                        }
+                        else
+                        {
+                            if ( isFolder )
+                                AddWatches( path + "/" );
+                            Report( CFolderChange::Added, path, isFolder );
+                        }
+                    }
+                }
+
+                if ( 0 != movedCookie )
+                    Report( CFolderChange::Removed, movedFrom, movedFolder );
+            }
+        } //Watch
+#endif
+
+    public:
+        CFolderWatch()
+        {
+#ifdef _WIN32
+            hFolder = INVALID_HANDLE_VALUE;
+            hStop = NULL;
+#else
+            fdNotify = -1;
+            fdStop[ 0 ] = fdStop[ 1 ] = -1;
+#endif
+        } //CFolderWatch
+
+        ~CFolderWatch()
+        {
+            Stop();
+        } //~CFolderWatch
+
+        // Start watching pwcRoot and everything under it. callback is called on the watcher's thread.
+
+        bool Start( const WCHAR * pwcRoot, std::function<void ( const CFolderChange & )> callback )
+        {
+            Stop();
+            onChange = callback;
+            root = pwcRoot;
+
+#ifdef _WIN32
+            if ( !root.empty() && L'\\' != root.back() )
+                root += L'\\';
+
+            hFolder = CreateFileW( root.c_str(), FILE_LIST_DIRECTORY, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                                   NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, NULL );
+            if ( INVALID_HANDLE_VALUE == hFolder )
+            {
+                tracer.Trace( "can't open folder %ws to watch it, error %d\n", root.c_str(), GetLastError() );
+                return false;
+            }
+
+            hStop = CreateEvent( NULL, TRUE, FALSE, NULL );
+            if ( NULL == hStop )
+            {
+                CloseHandle( hFolder );
+                hFolder = INVALID_HANDLE_VALUE;
+                return false;
+            }
+#else
+            if ( !root.empty() && L'/' != root.back() )
+                root += L'/';
+
+            char acRoot[ MAX_PATH ];
+            size_t len = wcstombs( acRoot, root.c_str(), sizeof( acRoot ) );
+            if ( (size_t) -1 == len || len >= sizeof( acRoot ) )
+                return false;
+
+            fdNotify = inotify_init1( IN_NONBLOCK | IN_CLOEXEC );
+            if ( -1 == fdNotify )
+            {
+                tracer.Trace( "can't create an inotify instance, errno %d\n", errno );
+                return false;
+            }
+
+            if ( 0 != pipe( fdStop ) )
+            {
+                close( fdNotify );
+                fdNotify = -1;
+                return false;
+            }
+
+            AddWatches( acRoot );
+#endif
+
+            watcher = std::thread( &CFolderWatch::Watch, this );
+            return true;
+        } //Start
+
+        void Stop()
+        {
+#ifdef _WIN32
+            if ( NULL != hStop )
+                SetEvent( hStop );
+#else
+            if ( -1 != fdStop[ 1 ] )
+            {
+                char c = 0;
+                ssize_t written = write( fdStop[ 1 ], &c, 1 );
+                (void) written;
+            }
+#endif
+
+            if ( watcher.joinable() )
+                watcher.join();
+
+#ifdef _WIN32
+            if ( INVALID_HANDLE_VALUE != hFolder )
+                CloseHandle( hFolder );
+            if ( NULL != hStop )
+                CloseHandle( hStop );
+
+            hFolder = INVALID_HANDLE_VALUE;
+            hStop = NULL;
+#else
+            if ( -1 != fdNotify )
+                close( fdNotify );
+            if ( -1 != fdStop[ 0 ] )
+            {
+                close( fdStop[ 0 ] );
+                close( fdStop[ 1 ] );
+            }
+
+            fdNotify = -1;
+            fdStop[ 0 ] = fdStop[ 1 ] = -1;
+            folders.clear();
+#endif
+        } //Stop
+}; //CFolderWatch
@@ -4,23 +4,284 @@
 // Enumerate the filesystem to build a list of paths matching a criteria
 //
 
+#ifdef _WIN32
 #include <windows.h>
+#include <ppl.h>
+#else
+#include <dirent.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <wctype.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#include <deque>
+#include <string>
+#include <thread>
+#endif
+
+#include <atomic>
+#include <functional>
+#include <memory>
 
+#include <djltrace.hxx>
 #include <djlsav.hxx>
+
+#ifdef _WIN32
 #include <djl_pa.hxx>
-#include <djltrace.hxx>
-#include <ppl.h>
 
 using namespace concurrency;
+#endif
 
 class CEnumFolder
 {
     private:
         bool recurse;
         CStringArray * resultStrings;
+#ifdef _WIN32
         CPathArray * resultPaths;
+#endif
         const WCHAR * const * extensions;
         int extensionCount;
+        std::atomic<bool> cancelled;
+        std::function<void ()> folderDone;
+
+#ifndef _WIN32
+        // The POSIX walker opens each folder relative to its parent's fd with openat, so the kernel resolves one
+        // name rather than a full path. Threads take folders from their own queue depth first, which keeps few
+        // fds open, and steal from the other end of other threads' queues when they run dry. Each thread keeps
+        // the paths it finds and hands them over in one locked append.
+
+        struct WalkFolder
+        {
+            int fd;
+            std::string path;       // with a trailing slash
+            WalkFolder( int f, const std::string & p ) : fd( f ), path( p ) {}
+            ~WalkFolder() { close( fd ); }
+        };
+
+        struct WalkItem
+        {
+            std::shared_ptr<WalkFolder> parent; // closed once its last queued child is opened
+            std::string name;
+        };
+
+        struct WalkQueue
+        {
+            std::mutex mtx;
+            std::deque<WalkItem> items;
+        };
+
+        struct WalkState
+        {
+            std::vector<std::string> extensions;
+            std::string spec;
+            bool allFiles;
+            unsigned threads;
+            std::unique_ptr<WalkQueue[]> queues;
+            std::atomic<size_t> pending;        // folders queued or being scanned
+        };
+
+#ifdef __linux__
+        struct WalkDirent64                     // what getdents64 returns; glibc doesn't declare it
+        {
+            unsigned long long d_ino;
+            long long d_off;
+            unsigned short d_reclen;
+            unsigned char d_type;
+            char d_name[ 1 ];
+        };
+#endif
+
+        bool MatchesName( const WalkState & state, const char * pcName )
+        {
+            // The raw name is checked, so files that don't match are never converted to wide characters
+
+            if ( !state.allFiles && 0 != fnmatch( state.spec.c_str(), pcName, FNM_CASEFOLD ) )
+                return false;
+
+            if ( 0 == state.extensions.size() )
+                return true;
+
+            const char * pext = strrchr( pcName, '.' );
+            if ( NULL == pext )
+                return false;
+
+            pext++;
+
+            for ( size_t i = 0; i < state.extensions.size(); i++ )
+                if ( !strcasecmp( pext, state.extensions[ i ].c_str() ) )
+                    return true;
+
+            return false;
+        } //MatchesName
+
+        void AddEntry( WalkState & state, unsigned self, const std::shared_ptr<WalkFolder> & folder, const char * pcName,
+                       unsigned char type, std::vector<WCHAR *> & found )
+        {
+            if ( '.' == pcName[ 0 ] && ( 0 == pcName[ 1 ] || ( '.' == pcName[ 1 ] && 0 == pcName[ 2 ] ) ) )
+                return;
+
+            bool isDir = ( DT_DIR == type );
+            bool isFile = ( DT_REG == type );
+
+            if ( DT_UNKNOWN == type || DT_LNK == type )
+            {
+                // follow links to files, but not to folders since they can form cycles
+
+                struct stat st;
+                if ( 0 == fstatat( folder->fd, pcName, &st, 0 ) )
+                {
+                    isFile = S_ISREG( st.st_mode );
+                    isDir = ( DT_UNKNOWN == type ) && S_ISDIR( st.st_mode );
+                }
+            }
+
+            if ( isDir )
+            {
+                if ( recurse )
+                {
+                    WalkItem item;
+                    item.parent = folder;
+                    item.name = pcName;
+                    state.pending++;
+
+                    lock_guard<mutex> lock( state.queues[ self ].mtx );
+                    state.queues[ self ].items.push_back( item );
+                }
+            }
+            else if ( isFile && MatchesName( state, pcName ) )
+            {
+                std::string path = folder->path + pcName;
+                size_t cwc = mbstowcs( NULL, path.c_str(), 0 );
+                if ( (size_t) -1 == cwc || cwc >= MAX_PATH )
+                {
+                    tracer.Trace( "skipping very long or unconvertible path %s\n", path.c_str() );
+                    return;
+                }
+
+                WCHAR * pwc = new WCHAR[ cwc + 1 ];
+                mbstowcs( pwc, path.c_str(), cwc + 1 );
+                found.push_back( pwc );
+            }
+        } //AddEntry
+
+        void Publish( std::vector<WCHAR *> & found )
+        {
+            if ( 0 != found.size() && 0 != resultStrings )
+                resultStrings->Adopt( found );
+
+            for ( size_t i = 0; i < found.size(); i++ )
+                delete [] found[ i ];
+
+            found.clear();
+        } //Publish
+
+        void ScanFolder( WalkState & state, unsigned self, const std::shared_ptr<WalkFolder> & folder, std::vector<WCHAR *> & found )
+        {
+#ifdef __linux__
+            alignas( 8 ) char buffer[ 32768 ];
+
+            while ( !cancelled )
+            {
+                long cb = syscall( SYS_getdents64, folder->fd, buffer, sizeof( buffer ) );
+                if ( cb <= 0 )
+                    break;
+
+                for ( long offset = 0; offset < cb; )
+                {
+                    WalkDirent64 * pent = (WalkDirent64 *) ( buffer + offset );
+                    offset += pent->d_reclen;
+                    AddEntry( state, self, folder, pent->d_name, pent->d_type, found );
+                }
+            }
+#else
+            int fdList = dup( folder->fd );
+            DIR * pdir = ( -1 == fdList ) ? NULL : fdopendir( fdList );
+            if ( NULL == pdir )
+            {
+                if ( -1 != fdList )
+                    close( fdList );
+                return;
+            }
+
+            struct dirent * pent;
+            while ( !cancelled && NULL != ( pent = readdir( pdir ) ) )
+                AddEntry( state, self, folder, pent->d_name, pent->d_type, found );
+
+            closedir( pdir );
+#endif
+
+            if ( folderDone )
+            {
+                // Someone is watching results arrive, so hand them over a folder at a time
+
+                Publish( found );
+                folderDone();
+            }
+        } //ScanFolder
+
+        bool TakeItem( WalkState & state, unsigned self, WalkItem & item )
+        {
+            for ( unsigned i = 0; i < state.threads; i++ )
+            {
+                WalkQueue & queue = state.queues[ ( self + i ) % state.threads ];
+                lock_guard<mutex> lock( queue.mtx );
+
+                if ( !queue.items.empty() )
+                {
+                    if ( 0 == i )
+                    {
+                        item = std::move( queue.items.back() );
+                        queue.items.pop_back();
+                    }
+                    else
+                    {
+                        item = std::move( queue.items.front() );
+                        queue.items.pop_front();
+                    }
+
+                    return true;
+                }
+            }
+
+            return false;
+        } //TakeItem
+
+        void WalkThread( WalkState & state, unsigned self )
+        {
+            std::vector<WCHAR *> found;
+            WalkItem item;
+
+            while ( !cancelled )
+            {
+                if ( !TakeItem( state, self, item ) )
+                {
+                    if ( 0 == state.pending )
+                        break;
+
+                    std::this_thread::yield();
+                    continue;
+                }
+
+                int fd = openat( item.parent->fd, item.name.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC );
+                std::string path = item.parent->path + item.name + '/';
+                item.parent.reset();
+
+                if ( -1 != fd )
+                    ScanFolder( state, self, std::make_shared<WalkFolder>( fd, path ), found );
+                else
+                    tracer.Trace( "can't open folder %s, errno %d\n", path.c_str(), errno );
+
+                state.pending--;
+            }
+
+            Publish( found );
+        } //WalkThread
+#endif
 
         bool HasValidExtension( const WCHAR * pwc )
         {
@@ -53,6 +314,7 @@ class CEnumFolder
         // aExtensions:  a sorted list of valid file extensions not including a period. May be NULL.
         // cExtensions:  count of extensions in the array. may be 0.
 
+#ifdef _WIN32
         CEnumFolder( bool recurseFolders, CPathArray * pPathArray, const WCHAR * const * aExtensions, int cExtensions )
         {
             recurse = recurseFolders;
@@ -60,24 +322,39 @@ class CEnumFolder
             resultPaths = pPathArray;
             extensions = aExtensions;
             extensionCount = cExtensions;
+            cancelled = false;
         }
+#endif
 
         CEnumFolder( bool recurseFolders, CStringArray * pStringArray, const WCHAR * const * aExtensions, int cExtensions )
         {
             recurse = recurseFolders;
             resultStrings = pStringArray;
+#ifdef _WIN32
             resultPaths = NULL;
+#endif
             extensions = aExtensions;
             extensionCount = cExtensions;
+            cancelled = false;
         }
 
+        // Called after the files in each folder have been added, on whichever thread enumerated the folder.
+        // Lets a caller enumerating on another thread show results as they arrive.
+
+        void SetFolderCallback( std::function<void ()> callback ) { folderDone = callback; }
+
+        // Stop an enumeration running on another thread soon; Enumerate returns without visiting more folders
+
+        void Cancel() { cancelled = true; }
+
         // pwcFolder:   the root of the enumeration, e.g. C:\users
         // pwcFileSpec: a wildcard string like "*", "*.jpg", or "??.jpg". Can be NULL for "*"
 
+#ifdef _WIN32
         void Enumerate( const WCHAR * pwcFolder, const WCHAR * pwcFileSpec )
         {
             size_t len = wcslen( pwcFolder );
-            if ( 0 == len )
+            if ( 0 == len || cancelled )
                 return;
 
             WCHAR *pwcSpec = ( 0 == pwcFileSpec ) ? L"*" : pwcFileSpec;
@@ -127,7 +404,12 @@ class CEnumFolder
                             else if ( HasValidExtension( fd.cFileName ) )
                             {
                                 if ( 0 != resultPaths )
-                                    resultPaths->Add( awc, fd.ftCreationTime, fd.ftLastWriteTime );
+                                {
+                                    ULARGE_INTEGER size;
+                                    size.LowPart = fd.nFileSizeLow;
+                                    size.HighPart = fd.nFileSizeHigh;
+                                    resultPaths->Add( awc, fd.ftCreationTime, fd.ftLastWriteTime, size.QuadPart );
+                                }
                                 if ( 0 != resultStrings )
                                     resultStrings->Add( awc );
                             }
@@ -137,12 +419,15 @@ class CEnumFolder
                             tracer.Trace( "skipping very long path %ws and file %ws\n", awc, fd.cFileName );
                         }
                     }
-                } while ( FindNextFile( hFile, &fd ) );
+                } while ( !cancelled && FindNextFile( hFile, &fd ) );
         
                 FindClose( hFile );
             }
 
-            if ( recurse )
+            if ( folderDone )
+                folderDone();
+
+            if ( recurse && !cancelled )
             {
                 // If the filespec didn't include all files, look for folders here
 
@@ -184,5 +469,69 @@ class CEnumFolder
                 } );
             }
         }
+#else
+        void Enumerate( const WCHAR * pwcFolder, const WCHAR * pwcFileSpec )
+        {
+            // Names are matched case-insensitively like on Windows, but paths keep their case since
+            // Linux filesystems are case-sensitive.
+
+            char acFolder[ MAX_PATH ];
+            size_t len = wcstombs( acFolder, pwcFolder, sizeof( acFolder ) );
+            if ( 0 == len || (size_t) -1 == len || len >= ( sizeof( acFolder ) - 1 ) )
+            {
+                tracer.Trace( "skipping very long or unconvertible enumerate path %ws\n", pwcFolder );
+                return;
+            }
+
+            if ( '/' != acFolder[ len - 1 ] )
+            {
+                acFolder[ len++ ] = '/';
+                acFolder[ len ] = 0;
+            }
+
+            WalkState state;
+            char acSpec[ MAX_PATH ];
+            size_t specLen = wcstombs( acSpec, ( 0 == pwcFileSpec ) ? L"*" : pwcFileSpec, sizeof( acSpec ) );
+            if ( (size_t) -1 == specLen || specLen >= sizeof( acSpec ) )
+                return;
+
+            state.spec = acSpec;
+            state.allFiles = ( !strcmp( acSpec, "*" ) || !strcmp( acSpec, "*.*" ) );
+
+            for ( int i = 0; i < extensionCount; i++ )
+            {
+                char acExt[ 100 ];
+                size_t extLen = wcstombs( acExt, extensions[ i ], sizeof( acExt ) );
+                if ( (size_t) -1 != extLen && extLen < sizeof( acExt ) )
+                    state.extensions.push_back( acExt );
+            }
+
+            if ( cancelled )
+                return;
+
+            int fd = open( acFolder, O_RDONLY | O_DIRECTORY | O_CLOEXEC );
+            if ( -1 == fd )
+                return;
+
+            state.threads = __max( 1u, std::thread::hardware_concurrency() );
+            state.queues.reset( new WalkQueue[ state.threads ] );
+            state.pending = 0;
+
+            // The root is scanned here, which seeds the first thread's queue with its subfolders
+
+            std::vector<WCHAR *> found;
+            ScanFolder( state, 0, std::make_shared<WalkFolder>( fd, std::string( acFolder ) ), found );
+            Publish( found );
+
+            std::vector<std::thread> threads;
+            for ( unsigned t = 1; t < state.threads; t++ )
+                threads.push_back( std::thread( &CEnumFolder::WalkThread, this, std::ref( state ), t ) );
+
+            WalkThread( state, 0 );
+
+            for ( size_t t = 0; t < threads.size(); t++ )
+                threads[ t ].join();
+        }
+#endif
 };
 
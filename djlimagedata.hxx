@@ -8,28 +8,91 @@
 //
 // This code reduces the calls to ReadFile at the expense of some clarity.
 
+#ifdef _WIN32
 #include <windows.h>
 #include <shlwapi.h>
+#include <io.h>
+#include <eh.h>
+#include <sys\stat.h>
+#endif
 
 #include <stdlib.h>
 #include <stdio.h>
-#include <io.h>
 #include <limits.h>
 #include <float.h>
-#include <eh.h>
 #include <math.h>
-#include <sys\stat.h>
 
 #include <string>
 #include <memory>
 #include <mutex>
+#include <thread>
+#include <vector>
 
 #include "djltrace.hxx"
 #include "djl_strm.hxx"
+#include "djl_prefetch.hxx"
 #include "djl_crop.hxx"
 
 #pragma warning( disable: 4189 ) // many places parse data that's unused in order to get to later data
 
+#ifndef _WIN32 // the bitmap headers from wingdi.h, as they're laid out in BMP files
+
+#pragma pack( push, 2 )
+struct BITMAPFILEHEADER
+{
+    WORD bfType;
+    DWORD bfSize;
+    WORD bfReserved1;
+    WORD bfReserved2;
+    DWORD bfOffBits;
+};
+#pragma pack( pop )
+
+struct BITMAPINFOHEADER
+{
+    DWORD biSize;
+    LONG biWidth;
+    LONG biHeight;
+    WORD biPlanes;
+    WORD biBitCount;
+    DWORD biCompression;
+    DWORD biSizeImage;
+    LONG biXPelsPerMeter;
+    LONG biYPelsPerMeter;
+    DWORD biClrUsed;
+    DWORD biClrImportant;
+};
+
+struct BITMAPV5HEADER
+{
+    DWORD bV5Size;
+    LONG bV5Width;
+    LONG bV5Height;
+    WORD bV5Planes;
+    WORD bV5BitCount;
+    DWORD bV5Compression;
+    DWORD bV5SizeImage;
+    LONG bV5XPelsPerMeter;
+    LONG bV5YPelsPerMeter;
+    DWORD bV5ClrUsed;
+    DWORD bV5ClrImportant;
+    DWORD bV5RedMask;
+    DWORD bV5GreenMask;
+    DWORD bV5BlueMask;
+    DWORD bV5AlphaMask;
+    DWORD bV5CSType;
+    BYTE bV5Endpoints[ 36 ];
+    DWORD bV5GammaRed;
+    DWORD bV5GammaGreen;
+    DWORD bV5GammaBlue;
+    DWORD bV5Intent;
+    DWORD bV5ProfileData;
+    DWORD bV5ProfileSize;
+    DWORD bV5Reserved;
+};
+
+#endif
+
 using namespace std;
 
 /*
@@ -48,7 +111,217 @@ using namespace std;
   13 = IFD pointer (Olympus ORF uses this)
 */
 
-class CImageData
+// Everything found in one file, including the offsets needed to write the rating and orientation back.
+// It's a plain value with no references to the stream it came from, so it can be copied, cached, and
+// handed between threads freely.
+
+struct ImageMetadata
+{
+    static constexpr double InvalidCoordinate = 1000.0;
+
+    // Groups of fields a caller can ask a parse for. Fields outside the mask may be left unset; the parser
+    // skips the sub-IFDs and XMP packets that can't contribute to what was asked for.
+
+    static const DWORD FieldCaptureTime = 0x1;    // acDateTimeOriginal, acDateTime
+    static const DWORD FieldOrientation = 0x2;    // Orientation_* values and the offsets to write them
+    static const DWORD FieldRating = 0x4;         // RatingInXMP*, holdsAdobeEditsInXMP
+    static const DWORD FieldCamera = 0x8;         // make, model, body serial number
+    static const DWORD FieldLens = 0x10;          // lens make, model, serial number
+    static const DWORD FieldExposure = 0x20;      // exposure, aperture, ISO, focal lengths
+    static const DWORD FieldGPS = 0x40;           // Latitude, Longitude
+    static const DWORD FieldDimensions = 0x80;    // ImageWidth, ImageHeight
+    static const DWORD FieldEmbeddedImage = 0x100; // Embedded_Image_*, Embedded_Images
+    static const DWORD FieldAll = 0xffff;
+
+    static const int EmbeddedCodecUnknown = 0;
+    static const int EmbeddedCodecJPG = 1;
+    static const int EmbeddedCodecPNG = 2;
+    static const int EmbeddedCodecBMP = 3;
+
+    struct EmbeddedImage
+    {
+        __int64 offset;
+        __int64 length;
+        int width;          // 0 if the image couldn't be measured
+        int height;
+        int codec;          // EmbeddedCodec*
+    };
+
+    static const int MaxEmbeddedImages = 8;   // thumbnail, medium preview, and full-size JPG, with room to spare
+
+    DWORD Heif_Exif_ItemID;
+    __int64 Heif_Exif_Offset;
+    __int64 Heif_Exif_Length;
+    __int64 Canon_CR3_Exif_IFD0;
+    __int64 Canon_CR3_Exif_Exif_IFD;
+    __int64 Canon_CR3_Exif_Makernotes_IFD;
+    __int64 Canon_CR3_Exif_GPS_IFD;
+    __int64 Canon_CR3_Embedded_JPG_Length;
+
+    __int64 WebP_Exif_Offset;
+    __int64 WebP_Exif_Length;
+
+    __int64 Embedded_Image_Offset;
+    __int64 Embedded_Image_Length;
+    int Embedded_Image_Width;
+    int Embedded_Image_Height;
+
+    // Every embedded image found, in the order found. Embedded_Image_* above is the one the parser settled on,
+    // which is usually the largest and is always in this list.
+
+    EmbeddedImage Embedded_Images[ MaxEmbeddedImages ];
+    int Embedded_Image_Count;
+
+    int Orientation_Value;
+    int Orientation_Value2;
+
+    // Offsets for writes into the file
+    __int64 Orientation_Offset;
+    __int64 Orientation_Offset2;
+    __int64 Orientation_Type;
+    __int64 Orientation_Type2;
+    bool Orientation_LittleEndian;
+
+    char acDateTimeOriginal[ 100 ];
+    char acDateTime[ 100 ];
+    int ImageWidth;
+    int ImageHeight;
+    int ISO;
+    int ExposureNum;
+    int ExposureDen;
+    int FNumberNum;
+    int FNumberDen;
+    int ApertureNum;
+    int ApertureDen;
+    int ExposureProgram;
+    int ExposureMode;
+    int FocalLengthNum;
+    int FocalLengthDen;
+    int FocalLengthIn35mmFilm;
+    int ComputedSensorWidth;
+    int ComputedSensorHeight;
+    double Latitude;
+    double Longitude;
+    char acLensMake[ 100 ];
+    char acLensModel[ 100 ];
+    char acLensSerialNumber[ 100 ];
+    char acMake[ 100 ];
+    char acModel[ 100 ];
+    char acSerialNumber[ 100 ];
+    bool holdsAdobeEditsInXMP;
+    __int64 RatingInXMP_Offset; // offset of 1 ascii character in the range of 0-5.
+    char RatingInXMP;
+
+    void Initialize()
+    {
+        Heif_Exif_ItemID = 0xffffffff;
+        Heif_Exif_Offset = 0;
+        Heif_Exif_Length = 0;
+        Canon_CR3_Exif_IFD0 = 0;
+        Canon_CR3_Exif_Exif_IFD = 0;
+        Canon_CR3_Exif_Makernotes_IFD = 0;
+        Canon_CR3_Exif_GPS_IFD = 0;
+        Canon_CR3_Embedded_JPG_Length = 0;
+
+        WebP_Exif_Offset = 0;
+        WebP_Exif_Length = 0;
+
+        Embedded_Image_Offset = 0;
+        Embedded_Image_Length = 0;
+        Embedded_Image_Width = 0;
+        Embedded_Image_Height = 0;
+        Embedded_Image_Count = 0;
+
+        Orientation_Value = -1;
+        Orientation_Offset = 0;
+        Orientation_Type = 0;
+        Orientation_Value2 = -1;
+        Orientation_Offset2 = 0;
+        Orientation_Type2 = 0;
+        Orientation_LittleEndian = false;
+
+        acDateTimeOriginal[ 0 ] = 0;
+        acDateTime[ 0 ] = 0;
+        ImageWidth = -1;
+        ImageHeight = -1;
+        ISO = -1;
+        ExposureNum = -1;
+        ExposureDen = -1;
+        FNumberNum = -1;
+        FNumberDen = -1;
+        ApertureNum = -1;
+        ApertureDen = -1;
+        ExposureProgram = -1;
+        ExposureMode = -1;
+        FocalLengthNum = -1;
+        FocalLengthDen = -1;
+        FocalLengthIn35mmFilm = -1;
+        ComputedSensorWidth = -1;
+        ComputedSensorHeight = -1;
+        Longitude = InvalidCoordinate;
+        Latitude = InvalidCoordinate;
+        acLensMake[ 0 ] = 0;
+        acLensModel[ 0 ] = 0;
+        acLensSerialNumber[ 0 ] = 0;
+        acMake[ 0 ] = 0;
+        acModel[ 0 ] = 0;
+        acSerialNumber[ 0 ] = 0;
+        holdsAdobeEditsInXMP = false;
+        RatingInXMP_Offset = 0; // offset of 1 ascii character in the range of 0-5.
+        RatingInXMP = 0;        // integer 0..5 only valid if RatingInXMP_Offset isn't 0
+    } //Initialize
+
+    const char * CaptureDateTime() const
+    {
+        // the original capture time if it's known, otherwise the file's DateTime. Empty if neither was found.
+
+        if ( 0 != acDateTimeOriginal[ 0 ] )
+            return acDateTimeOriginal;
+
+        return acDateTime;
+    } //CaptureDateTime
+
+    static int SelectEmbeddedImage( const EmbeddedImage * pImages, int count, int targetWidth, int targetHeight )
+    {
+        // Return the index of the smallest measured image that covers targetWidth x targetHeight in either
+        // orientation, since previews may be stored rotated relative to the display. If none covers it, the
+        // largest. -1 if no image has known dimensions. Ties go to the earlier image.
+
+        int targetLong = __max( targetWidth, targetHeight );
+        int targetShort = __min( targetWidth, targetHeight );
+        int bestCovering = -1;
+        int largest = -1;
+
+        for ( int i = 0; i < count; i++ )
+        {
+            const EmbeddedImage & ei = pImages[ i ];
+            if ( ei.width <= 0 || ei.height <= 0 || EmbeddedCodecUnknown == ei.codec )
+                continue;
+
+            long long area = (long long) ei.width * ei.height;
+
+            if ( -1 == largest || area > (long long) pImages[ largest ].width * pImages[ largest ].height )
+                largest = i;
+
+            bool covers = ( __max( ei.width, ei.height ) >= targetLong ) && ( __min( ei.width, ei.height ) >= targetShort );
+
+            if ( covers && ( -1 == bestCovering || area < (long long) pImages[ bestCovering ].width * pImages[ bestCovering ].height ) )
+                bestCovering = i;
+        }
+
+        return ( -1 != bestCovering ) ? bestCovering : largest;
+    } //SelectEmbeddedImage
+
+    ImageMetadata()
+    {
+        Initialize();
+    }
+};
+
+// Parses one file into an ImageMetadata record. An instance lives for a single parse and owns no
+// state beyond the record it's filling, so any number of parses can run on different threads at once.
+
+class CImageParser
 {
 private:
     struct TwoDWORDs
@@ -56,11 +329,11 @@ private:
         DWORD dw1;
         DWORD dw2;
 
-        void Endian( bool littleEndian )
+        template <bool littleEndian> void Endian()
         {
             if ( !littleEndian )
             {
-                dw1= _byteswap_ulong( dw1 );
+                dw1 = _byteswap_ulong( dw1 );
                 dw2 = _byteswap_ulong( dw2 );
             }
         }
@@ -73,115 +346,97 @@ private:
         DWORD count;
         DWORD offset;
 
-        void Endian( bool littleEndian )
+        void Swap()
         {
-            if ( !littleEndian )
+            id = _byteswap_ushort( id );
+            type = _byteswap_ushort( type );
+            count = _byteswap_ulong( count );
+            offset = _byteswap_ulong( offset );
+        } //Swap
+
+        template <bool littleEndian> void AdjustOffset()
+        {
+            if ( 1 != count )
+                return;
+        
+            if ( littleEndian )
             {
-                id = _byteswap_ushort( id );
-                type = _byteswap_ushort( type );
-                count = _byteswap_ulong( count );
-                offset = _byteswap_ulong( offset );
+                if ( 1 == type || 6 == type )
+                    offset &= 0xff;
+                else if ( 3 == type || 8 == type )
+                    offset &= 0xffff;
             }
-
-            offset = AdjustOffset( littleEndian );
-        }
-
-        private:
-
-            DWORD AdjustOffset( bool littleEndian )
+            else
             {
-                if ( 1 != count )
-                    return offset;
-            
-                if ( littleEndian )
-                {
-                    if ( 1 == type || 6 == type )
-                        return offset & 0xff;
-            
-                    if ( 3 == type || 8 == type )
-                        return offset & 0xffff;
-                }
-                else
-                {
-                    // The DWORD has already been swapped, but to interpret it as a 1 or 2 byte quantity,
-                    // that must be shifted as well.
+                // The DWORD has already been swapped, but to interpret it as a 1 or 2 byte quantity,
+                // that must be shifted as well.
     
-                    if ( 1 == type || 6 == type )
-                        return ( offset >> 24 );
-            
-                    if ( 3 == type || 8 == type )
-                        return ( offset >> 16 );
-                }
-            
-                return offset;
-            } //AdjustOffset
+                if ( 1 == type || 6 == type )
+                    offset >>= 24;
+                else if ( 3 == type || 8 == type )
+                    offset >>= 16;
+            }
+        } //AdjustOffset
     };
     
-    std::mutex g_mtx;
-    CCropFactor g_factor;
-    CStream * g_pStream = NULL;
-    const double InvalidCoordinate = 1000.0;
     static const WORD MaxIFDHeaders = 200; // assume anything more than this is a corrupt or badly parsed file.
                                            // panasonic makernotes sometimes have 133 entries.
-    
-    WCHAR g_awcPath[ MAX_PATH + 1 ];
-    FILETIME g_ftWrite;
-    
-    DWORD g_Heif_Exif_ItemID                = 0xffffffff;
-    __int64 g_Heif_Exif_Offset              = 0;
-    __int64 g_Heif_Exif_Length              = 0;
-    __int64 g_Canon_CR3_Exif_IFD0           = 0;
-    __int64 g_Canon_CR3_Exif_Exif_IFD       = 0;
-    __int64 g_Canon_CR3_Exif_Makernotes_IFD = 0;
-    __int64 g_Canon_CR3_Exif_GPS_IFD        = 0;
-    __int64 g_Canon_CR3_Embedded_JPG_Length = 0;
 
-    __int64 g_WebP_Exif_Offset              = 0;
-    __int64 g_WebP_Exif_Length              = 0;
-    
-    __int64 g_Embedded_Image_Offset = 0;
-    __int64 g_Embedded_Image_Length = 0;
-    int g_Embedded_Image_Width = 0;
-    int g_Embedded_Image_Height = 0;
-    int g_Orientation_Value = -1;
-    int g_Orientation_Value2 = -1;
+    ImageMetadata & md;
+    CStream * pStream;
+    const WCHAR * pwcPath;
+    StreamStats stats;
+    bool mapFiles;
+    DWORD fields;       // ImageMetadata::Field* bits the caller needs
+    int fileFormat;     // one of the Format* values, set once the file's type is known
+    bool recordPreviews; // false while walking an embedded image, whose offsets aren't relative to the file
+    const BYTE * pSeed; // the first bytes of the file if they were read ahead of the parse
+    ULONG seedBytes;
+    bool seedEndsFile;
+    CStream::FileHandle seedFile; // the file they were read from, still open
 
-    // Offsets for writes into the file
-    __int64 g_Orientation_Offset = 0;
-    __int64 g_Orientation_Offset2 = 0;
-    __int64 g_Orientation_Type = 0;
-    __int64 g_Orientation_Type2 = 0;
-    bool g_Orientation_LittleEndian = false;
-    
-    char g_acDateTimeOriginal[ 100 ];
-    char g_acDateTime[ 100 ];
-    int g_ImageWidth;
-    int g_ImageHeight;
-    int g_ISO;
-    int g_ExposureNum;
-    int g_ExposureDen;
-    int g_FNumberNum;
-    int g_FNumberDen;
-    int g_ApertureNum;
-    int g_ApertureDen;
-    int g_ExposureProgram;
-    int g_ExposureMode;
-    int g_FocalLengthNum;
-    int g_FocalLengthDen;
-    int g_FocalLengthIn35mmFilm;
-    int g_ComputedSensorWidth;
-    int g_ComputedSensorHeight;
-    double g_Latitude;
-    double g_Longitude;
-    char g_acLensMake[ 100 ];
-    char g_acLensModel[ 100 ];
-    char g_acLensSerialNumber[ 100 ];
-    char g_acMake[ 100 ];
-    char g_acModel[ 100 ];
-    char g_acSerialNumber[ 100 ];
-    bool g_holdsAdobeEditsInXMP;
-    __int64 g_RatingInXMP_Offset = 0; // offset of 1 ascii character in the range of 0-5.
-    char g_RatingInXMP = 0;
+    bool Wants( DWORD f ) { return 0 != ( fields & f ); }
+
+    // Makernotes are large and vendor-specific, and hold only lens, serial, ISO, and preview details.
+    // Sub-IFDs hold the RAW dimensions and previews.
+
+    bool WantsMakernotes() { return Wants( ImageMetadata::FieldCamera | ImageMetadata::FieldLens | ImageMetadata::FieldExposure | ImageMetadata::FieldEmbeddedImage ); }
+    bool WantsSubIFDs() { return Wants( ImageMetadata::FieldDimensions | ImageMetadata::FieldEmbeddedImage | ImageMetadata::FieldExposure ); }
+
+    bool Resolved()
+    {
+        // True once everything asked for is found and nothing later in the file can change it, so the walk can stop.
+        // Only fields with a single source qualify; the others (orientation has two, dimensions take the largest
+        // of several IFDs) are only complete once the whole file has been walked.
+
+        if ( 0 != ( fields & ~( ImageMetadata::FieldCaptureTime | ImageMetadata::FieldRating | ImageMetadata::FieldGPS ) ) )
+            return false;
+
+        if ( Wants( ImageMetadata::FieldCaptureTime ) && 0 == md.acDateTimeOriginal[ 0 ] )
+            return false;
+
+        if ( Wants( ImageMetadata::FieldRating ) && 0 == md.RatingInXMP_Offset )
+            return false;
+
+        if ( Wants( ImageMetadata::FieldGPS ) && ( ImageMetadata::InvalidCoordinate == md.Latitude || ImageMetadata::InvalidCoordinate == md.Longitude ) )
+            return false;
+
+        return true;
+    } //Resolved
+
+    CStream * PrepareStream( CStream * ps )
+    {
+        if ( !mapFiles || !ps->EnableMapping() )
+        {
+            ps->EnableCache();
+
+            if ( 0 != seedBytes )
+                ps->SeedCache( 0, pSeed, seedBytes, seedEndsFile );
+        }
+
+        ps->SetStats( &stats );
+        return ps;
+    } //PrepareStream
     
     WORD FixEndianWORD( WORD w, bool littleEndian )
     {
@@ -191,13 +446,16 @@ private:
         return w;
     } //FixEndianWORD
     
-    unsigned long long GetULONGLONG( __int64 offset, bool littleEndian )
+    // The IFD walkers below are templates on the file's byte order, so it's chosen once per IFD chain rather
+    // than tested on every field. The bool overloads are for the header sniffing that happens before that.
+
+    template <bool littleEndian> unsigned long long GetULONGLONG( __int64 offset )
     {
         unsigned long long ull = 0;
 
-        if ( g_pStream->Seek( offset ) )
+        if ( pStream->Seek( offset ) )
         {
-            g_pStream->Read( &ull, sizeof ull );
+            pStream->Read( &ull, sizeof ull );
     
             if ( !littleEndian )
                 ull = _byteswap_uint64( ull );
@@ -206,13 +464,18 @@ private:
         return ull;
     } //GetULONGULONG
 
-    DWORD GetDWORD( __int64 offset, bool littleEndian )
+    unsigned long long GetULONGLONG( __int64 offset, bool littleEndian )
+    {
+        return littleEndian ? GetULONGLONG<true>( offset ) : GetULONGLONG<false>( offset );
+    } //GetULONGLONG
+
+    template <bool littleEndian> DWORD GetDWORD( __int64 offset )
     {
         DWORD dw = 0;     // Note: some files are malformed and point to reads beyond the EOF. Return 0 in these cases
 
-        if ( g_pStream->Seek( offset ) )
+        if ( pStream->Seek( offset ) )
         {
-            g_pStream->Read( &dw, sizeof dw );
+            pStream->Read( &dw, sizeof dw );
     
             if ( !littleEndian )
                 dw = _byteswap_ulong( dw );
@@ -220,14 +483,19 @@ private:
     
         return dw;
     } //GetDWORD
+
+    DWORD GetDWORD( __int64 offset, bool littleEndian )
+    {
+        return littleEndian ? GetDWORD<true>( offset ) : GetDWORD<false>( offset );
+    } //GetDWORD
     
-    WORD GetWORD( __int64 offset, bool littleEndian )
+    template <bool littleEndian> WORD GetWORD( __int64 offset )
     {
         WORD w = 0;
 
-        if ( g_pStream->Seek( offset ) )
+        if ( pStream->Seek( offset ) )
         {
-            g_pStream->Read( &w, sizeof w );
+            pStream->Read( &w, sizeof w );
     
             if ( !littleEndian )
                 w = _byteswap_ushort( w );
@@ -235,13 +503,18 @@ private:
     
         return w;
     } //GetWORD
+
+    WORD GetWORD( __int64 offset, bool littleEndian )
+    {
+        return littleEndian ? GetWORD<true>( offset ) : GetWORD<false>( offset );
+    } //GetWORD
     
-    byte GetBYTE( __int64 offset )
+    BYTE GetBYTE( __int64 offset )
     {
-        byte b = 0;
+        BYTE b = 0;
 
-        if ( g_pStream->Seek( offset ) )
-            g_pStream->Read( &b, sizeof b );
+        if ( pStream->Seek( offset ) )
+            pStream->Read( &b, sizeof b );
     
         return b;
     } //GetBYTE
@@ -250,21 +523,35 @@ private:
     {
         memset( pData, 0, byteCount );
 
-        if ( g_pStream->Seek( offset ) )
-            g_pStream->Read( pData, byteCount );
+        if ( pStream->Seek( offset ) )
+            pStream->Read( pData, byteCount );
     } //GetBytes
 
-    bool GetIFDHeaders( __int64 offset, IFDHeader * pHeader, WORD numHeaders, bool littleEndian )
+    template <bool littleEndian> bool GetIFDHeaders( __int64 offset, IFDHeader * pHeader, WORD numHeaders )
     {
         if ( 0 == numHeaders )
             return true;
 
         bool ok = true;
-        int cb = sizeof IFDHeader * numHeaders;
+        int cb = sizeof( IFDHeader ) * numHeaders;
+
+        const BYTE * pView = pStream->View( offset, cb );
+        if ( NULL != pView )
+            memcpy( pHeader, pView, cb );
+        else
+            GetBytes( offset, pHeader, cb );
+
+        // Decode the whole array in branch-free passes. The swap loop is independent per entry so the compiler
+        // can vectorize it; it's compiled out entirely for little-endian files.
+
+        if ( !littleEndian )
+            for ( WORD i = 0; i < numHeaders; i++ )
+                pHeader[i].Swap();
 
-        GetBytes( offset, pHeader, cb );
         for ( WORD i = 0; i < numHeaders; i++ )
-            pHeader[i].Endian( littleEndian );
+            pHeader[i].AdjustOffset<littleEndian>();
+
+        bool isPanasonic = !strcmp( md.acMake, "Panasonic" );
 
         for ( WORD i = 0; i < numHeaders; i++ )
         {
@@ -272,12 +559,12 @@ private:
             // Note the Panasonic LX100, S1R, zs100, & zs200 write 0x100 to the type's second byte, so mask it off.
             // Not all Panasonic RAW files do this -- GF1 for example.
 
-            if ( !strcmp( g_acMake, "Panasonic" ) && ( 0x100 == ( 0xff00 & pHeader[i].type ) ) )
+            if ( isPanasonic && ( 0x100 == ( 0xff00 & pHeader[i].type ) ) )
                 pHeader[i].type &= 0xff;
 
             if ( pHeader[i].type > 13 )
             {
-                tracer.Trace( "record %d has invalid type %#x make %s, model %s, path %ws\n", i, pHeader[i].type, g_acMake, g_acModel, g_awcPath );
+                tracer.Trace( "record %d has invalid type %#x make %s, model %s, path %ws\n", i, pHeader[i].type, md.acMake, md.acModel, pwcPath );
                 ok = false;
                 break;
             }
@@ -286,11 +573,11 @@ private:
         return ok;
     } //GetIFDHeaders
     
-    int GetTwoDWORDs( __int64 offset, TwoDWORDs * pb, bool littleEndian )
+    template <bool littleEndian> int GetTwoDWORDs( __int64 offset, TwoDWORDs * pb )
     {
-        GetBytes( offset, pb, sizeof TwoDWORDs );
-        pb->Endian( littleEndian );
-        return sizeof TwoDWORDs;
+        GetBytes( offset, pb, sizeof( TwoDWORDs ) );
+        pb->Endian<littleEndian>();
+        return sizeof( TwoDWORDs );
     } //GetTwoDWORDs
     
     void GetString( __int64 offset, char * pcOutput, int outputSize, int maxBytes )
@@ -303,10 +590,10 @@ private:
         if ( maxBytes < 0 )
             maxBytes = 0;
 
-        if ( g_pStream->Seek( offset ) )
+        if ( pStream->Seek( offset ) )
         {
             int maxlen = __min( outputSize - 1, maxBytes );
-            g_pStream->Read( pcOutput, maxlen );
+            pStream->Read( pcOutput, maxlen );
     
             // In case the string wasn't already null terminated because it wasn't stored with a null or the
             // count of bytes didn't include the null termination, add it now. This may add a second null,
@@ -366,7 +653,7 @@ private:
         return IsPerhapsAnImageHeader( x );
     } //IsPerhapsAnImage
 
-    void EnumerateGPSTags( __int64 IFDOffset, __int64 headerBase, bool littleEndian )
+    template <bool littleEndian> void EnumerateGPSTags( __int64 IFDOffset, __int64 headerBase )
     {
         if ( 0xffffffff == IFDOffset )
             return;
@@ -378,7 +665,7 @@ private:
     
         while ( 0 != IFDOffset ) 
         {
-            WORD NumTags = GetWORD( IFDOffset + headerBase, littleEndian );
+            WORD NumTags = GetWORD<littleEndian>( IFDOffset + headerBase );
             IFDOffset += 2;
 
             // the file is problematic if this is true
@@ -386,13 +673,13 @@ private:
             if ( NumTags > MaxIFDHeaders )
                 break;
         
-            if ( !GetIFDHeaders( IFDOffset + headerBase, aHeaders.data(), NumTags, littleEndian ) )
+            if ( !GetIFDHeaders<littleEndian>( IFDOffset + headerBase, aHeaders.data(), NumTags ) )
                 break;
         
             for ( int i = 0; i < NumTags; i++ )
             {
                 IFDHeader & head = aHeaders[ i ];
-                IFDOffset += sizeof IFDHeader;
+                IFDOffset += sizeof( IFDHeader );
 
                 if ( 1 == head.id && 2 == head.type )
                 {
@@ -404,19 +691,19 @@ private:
                 }
                 else if ( 2 == head.id && ( ( 10 == head.type ) || ( 5 == head.type ) ) && 3 == head.count )
                 {
-                    LONG num1 = GetDWORD( (__int64) head.offset +      headerBase, littleEndian );
-                    LONG den1 = GetDWORD( (__int64) head.offset +  4 + headerBase, littleEndian );
+                    LONG num1 = GetDWORD<littleEndian>( (__int64) head.offset +      headerBase );
+                    LONG den1 = GetDWORD<littleEndian>( (__int64) head.offset +  4 + headerBase );
                     double d1 = (double) num1 / (double) den1;
     
-                    LONG num2 = GetDWORD( (__int64) head.offset +  8 + headerBase, littleEndian );
-                    LONG den2 = GetDWORD( (__int64) head.offset + 12 + headerBase, littleEndian );
+                    LONG num2 = GetDWORD<littleEndian>( (__int64) head.offset +  8 + headerBase );
+                    LONG den2 = GetDWORD<littleEndian>( (__int64) head.offset + 12 + headerBase );
                     double d2 = (double) num2 / (double) den2;
     
-                    LONG num3 = GetDWORD( (__int64) head.offset + 16 + headerBase, littleEndian );
-                    LONG den3 = GetDWORD( (__int64) head.offset + 20 + headerBase, littleEndian );
+                    LONG num3 = GetDWORD<littleEndian>( (__int64) head.offset + 16 + headerBase );
+                    LONG den3 = GetDWORD<littleEndian>( (__int64) head.offset + 20 + headerBase );
                     double d3 = (double) num3 / (double) den3;
     
-                    g_Latitude = d1 + ( d2 / 60.0 ) + ( d3 / 3600.0 );
+                    md.Latitude = d1 + ( d2 / 60.0 ) + ( d3 / 3600.0 );
                 }
                 else if ( 3 == head.id && 2 == head.type )
                 {
@@ -428,36 +715,36 @@ private:
                 }
                 else if ( 4 == head.id && ( ( 10 == head.type ) || ( 5 == head.type ) ) && 3 == head.count )
                 {
-                    LONG num1 = GetDWORD( (__int64) head.offset +      headerBase, littleEndian );
-                    LONG den1 = GetDWORD( (__int64) head.offset +  4 + headerBase, littleEndian );
+                    LONG num1 = GetDWORD<littleEndian>( (__int64) head.offset +      headerBase );
+                    LONG den1 = GetDWORD<littleEndian>( (__int64) head.offset +  4 + headerBase );
                     double d1 = (double) num1 / (double) den1;
     
-                    LONG num2 = GetDWORD( (__int64) head.offset +  8 + headerBase, littleEndian );
-                    LONG den2 = GetDWORD( (__int64) head.offset + 12 + headerBase, littleEndian );
+                    LONG num2 = GetDWORD<littleEndian>( (__int64) head.offset +  8 + headerBase );
+                    LONG den2 = GetDWORD<littleEndian>( (__int64) head.offset + 12 + headerBase );
                     double d2 = (double) num2 / (double) den2;
     
-                    LONG num3 = GetDWORD( (__int64) head.offset + 16 + headerBase, littleEndian );
-                    LONG den3 = GetDWORD( (__int64) head.offset + 20 + headerBase, littleEndian );
+                    LONG num3 = GetDWORD<littleEndian>( (__int64) head.offset + 16 + headerBase );
+                    LONG den3 = GetDWORD<littleEndian>( (__int64) head.offset + 20 + headerBase );
                     double d3 = (double) num3 / (double) den3;
     
-                    g_Longitude = d1 + ( d2 / 60.0 ) + ( d3 / 3600.0 );
+                    md.Longitude = d1 + ( d2 / 60.0 ) + ( d3 / 3600.0 );
                 }
             }
     
-            IFDOffset = GetDWORD( IFDOffset + headerBase, littleEndian );
+            IFDOffset = GetDWORD<littleEndian>( IFDOffset + headerBase );
     
             if ( 0xffffffff == IFDOffset )
                 break;
         }
     
         if ( latNeg )
-            g_Latitude = -g_Latitude;
+            md.Latitude = -md.Latitude;
     
         if ( lonNeg )
-            g_Longitude = -g_Longitude;
+            md.Longitude = -md.Longitude;
     } //EnumerateGPSTags
     
-    void EnumerateNikonPreviewIFD( __int64 IFDOffset, __int64 headerBase, bool littleEndian )
+    template <bool littleEndian> void EnumerateNikonPreviewIFD( __int64 IFDOffset, __int64 headerBase )
     {
         vector<IFDHeader> aHeaders( MaxIFDHeaders );
         __int64 provisionalOffset = 0;
@@ -466,19 +753,19 @@ private:
         {
             provisionalOffset = 0;
 
-            WORD NumTags = GetWORD( IFDOffset + headerBase, littleEndian );
+            WORD NumTags = GetWORD<littleEndian>( IFDOffset + headerBase );
             IFDOffset += 2;
     
             if ( NumTags > MaxIFDHeaders )
                 break;
 
-            if ( !GetIFDHeaders( IFDOffset + headerBase, aHeaders.data(), NumTags, littleEndian ) )
+            if ( !GetIFDHeaders<littleEndian>( IFDOffset + headerBase, aHeaders.data(), NumTags ) )
                 break;
         
             for ( int i = 0; i < NumTags; i++ )
             {
                 IFDHeader & head = aHeaders[ i ];
-                IFDOffset += sizeof IFDHeader;
+                IFDOffset += sizeof( IFDHeader );
 
                 if ( 0x201 == head.id && 4 == head.type )
                 {
@@ -487,19 +774,24 @@ private:
                 }
                 else if ( 0x202 == head.id && 4 == head.type )
                 {
-                    if ( 0 != provisionalOffset && 0 != head.offset && 0xfffffffff != head.offset && head.offset > g_Embedded_Image_Length )
+                    if ( 0 != provisionalOffset && 0 != head.offset && 0xfffffffff != head.offset )
                     {
-                        g_Embedded_Image_Offset = provisionalOffset;
-                        g_Embedded_Image_Length = head.offset;
+                        AddEmbeddedImage( provisionalOffset, head.offset );
+
+                        if ( head.offset > md.Embedded_Image_Length )
+                        {
+                            md.Embedded_Image_Offset = provisionalOffset;
+                            md.Embedded_Image_Length = head.offset;
+                        }
                     }
                 }
             }
     
-            IFDOffset = GetDWORD( IFDOffset + headerBase, littleEndian );
+            IFDOffset = GetDWORD<littleEndian>( IFDOffset + headerBase );
         }
     } //EnumerateNikonPreviewIFD
     
-    void EnumerateNikonMakernotes( __int64 IFDOffset, __int64 headerBase, bool littleEndian )
+    template <bool littleEndian> void EnumerateNikonMakernotes( __int64 IFDOffset, __int64 headerBase )
     {
         // https://www.exiv2.org/tags-nikon.html
     
@@ -508,23 +800,23 @@ private:
     
         while ( 0 != IFDOffset ) 
         {
-            WORD NumTags = GetWORD( IFDOffset + headerBase, littleEndian );
+            WORD NumTags = GetWORD<littleEndian>( IFDOffset + headerBase );
             IFDOffset += 2;
     
             if ( NumTags > MaxIFDHeaders )
                 break;
         
-            if ( !GetIFDHeaders( IFDOffset + headerBase, aHeaders.data(), NumTags, littleEndian ) )
+            if ( !GetIFDHeaders<littleEndian>( IFDOffset + headerBase, aHeaders.data(), NumTags ) )
                 break;
 
             for ( int i = 0; i < NumTags; i++ )
             {
                 IFDHeader & head = aHeaders[ i ];
-                IFDOffset += sizeof IFDHeader;
+                IFDOffset += sizeof( IFDHeader );
 
                 if ( 2 == head.id && 3 == head.type )
                 {
-                    g_ISO = head.offset;
+                    md.ISO = head.offset;
                 }
                 else if ( 17 == head.id && 4 == head.type && 1 == head.count )
                 {
@@ -533,34 +825,34 @@ private:
                     // This "original - 8" in originalNikonMakernotesOffset is clearly a hack. But it woks on images from the D300, D70, and D100
                     // Note it's needed to correctly compute both the preview IFD start and the embedded JPG preview start
     
-                    EnumerateNikonPreviewIFD( head.offset, originalNikonMakernotesOffset + headerBase, littleEndian );
+                    EnumerateNikonPreviewIFD<littleEndian>( head.offset, originalNikonMakernotesOffset + headerBase );
                 }
             }
     
-            IFDOffset = GetDWORD( IFDOffset + headerBase, littleEndian );
+            IFDOffset = GetDWORD<littleEndian>( IFDOffset + headerBase );
         }
     } //EnumerateNikonMakernotes
     
-    void EnumerateOlympusCameraSettingsIFD( __int64 IFDOffset, __int64 headerBase, bool littleEndian )
+    template <bool littleEndian> void EnumerateOlympusCameraSettingsIFD( __int64 IFDOffset, __int64 headerBase )
     {
         bool previewIsValid = false;
         vector<IFDHeader> aHeaders( MaxIFDHeaders );
     
         while ( 0 != IFDOffset ) 
         {
-            WORD NumTags = GetWORD( IFDOffset + headerBase, littleEndian );
+            WORD NumTags = GetWORD<littleEndian>( IFDOffset + headerBase );
             IFDOffset += 2;
     
             if ( NumTags > MaxIFDHeaders )
                 break;
 
-            if ( !GetIFDHeaders( IFDOffset + headerBase, aHeaders.data(), NumTags, littleEndian ) )
+            if ( !GetIFDHeaders<littleEndian>( IFDOffset + headerBase, aHeaders.data(), NumTags ) )
                 break;
         
             for ( int i = 0; i < NumTags; i++ )
             {
                 IFDHeader & head = aHeaders[ i ];
-                IFDOffset += sizeof IFDHeader;
+                IFDOffset += sizeof( IFDHeader );
 
                 if ( 256 == head.id && 4 == head.type )
                 {
@@ -569,20 +861,20 @@ private:
                 else if ( 257 == head.id && 4 == head.type )
                 {
                     if ( previewIsValid )
-                        g_Embedded_Image_Offset = head.offset + headerBase;
+                        md.Embedded_Image_Offset = head.offset + headerBase;
                 }
                 else if ( 258 == head.id && 4 == head.type )
                 {
                     if ( previewIsValid )
-                        g_Embedded_Image_Length = head.offset;
+                        md.Embedded_Image_Length = head.offset;
                 }
             }
     
-            IFDOffset = GetDWORD( IFDOffset + headerBase, littleEndian );
+            IFDOffset = GetDWORD<littleEndian>( IFDOffset + headerBase );
         }
     } //EnumerateOlympusCameraSettingsIFD
     
-    void EnumerateFujifilmMakernotes( __int64 IFDOffset, __int64 headerBase, bool littleEndian )
+    template <bool littleEndian> void EnumerateFujifilmMakernotes( __int64 IFDOffset, __int64 headerBase )
     {
         // https://www.exiv2.org/tags-fujifilm.html
     
@@ -594,25 +886,25 @@ private:
     
         while ( 0 != IFDOffset ) 
         {
-            WORD NumTags = GetWORD( IFDOffset + headerBase, littleEndian );
+            WORD NumTags = GetWORD<littleEndian>( IFDOffset + headerBase );
             IFDOffset += 2;
     
             if ( NumTags > MaxIFDHeaders )
                 break;
         
-            if ( !GetIFDHeaders( IFDOffset + headerBase, aHeaders.data(), NumTags, littleEndian ) )
+            if ( !GetIFDHeaders<littleEndian>( IFDOffset + headerBase, aHeaders.data(), NumTags ) )
                 break;
     
             for ( int i = 0; i < NumTags; i++ )
             {
                 IFDHeader & head = aHeaders[ i ];
-                IFDOffset += sizeof IFDHeader;
+                IFDOffset += sizeof( IFDHeader );
     
                 if ( 16 == head.id )
                 {
                     ULONG stringOffset = ( head.count <= 4 ) ? ( (ULONG) IFDOffset - 4 ) : head.offset;
-                    GetString( stringOffset + tagHeaderBase + headerBase, g_acSerialNumber, _countof( g_acSerialNumber ), head.count );
-                    //tracer.Trace( "fujifilm makernote (alternate) Serial #: %s\n", g_acSerialNumber );
+                    GetString( stringOffset + tagHeaderBase + headerBase, md.acSerialNumber, _countof( md.acSerialNumber ), head.count );
+                    //tracer.Trace( "fujifilm makernote (alternate) Serial #: %s\n", md.acSerialNumber );
                 }
                 else if ( 5169 == head.id && 4 == head.type )
                 {
@@ -626,7 +918,7 @@ private:
                 }
             }
     
-            IFDOffset = GetDWORD( IFDOffset + headerBase, littleEndian );
+            IFDOffset = GetDWORD<littleEndian>( IFDOffset + headerBase );
         }
     } //EnumerateFujifilmMakernotes
 
@@ -644,19 +936,19 @@ private:
         }
     } //DetectGarbage
 
-    void EnumeratePanasonicMakernotes( __int64 IFDOffset, __int64 headerBase, bool littleEndian )
+    template <bool littleEndian> void EnumeratePanasonicMakernotes( __int64 IFDOffset, __int64 headerBase )
     {
         vector<IFDHeader> aHeaders( MaxIFDHeaders );
     
         while ( 0 != IFDOffset ) 
         {
-            WORD NumTags = GetWORD( IFDOffset + headerBase, littleEndian );
+            WORD NumTags = GetWORD<littleEndian>( IFDOffset + headerBase );
             IFDOffset += 2;
     
             if ( NumTags > MaxIFDHeaders )
                 break;
         
-            if ( !GetIFDHeaders( IFDOffset + headerBase, aHeaders.data(), NumTags, littleEndian ) )
+            if ( !GetIFDHeaders<littleEndian>( IFDOffset + headerBase, aHeaders.data(), NumTags ) )
                 break;
     
             // Note: Photomatix Pro 5.0.1 (64-bit) generates .tif files where these 3 strings are garbage.
@@ -665,35 +957,35 @@ private:
             for ( int i = 0; i < NumTags; i++ )
             {
                 IFDHeader & head = aHeaders[ i ];
-                IFDOffset += sizeof IFDHeader;
+                IFDOffset += sizeof( IFDHeader );
                 
                 if ( 37 == head.id && 7 == head.type && 16 == head.count )
                 {
                     // treat this as if it's a string even though it's a type 7 
 
                     ULONG stringOffset = ( head.count <= 4 ) ? ( (ULONG) IFDOffset - 4 ) : head.offset;
-                    GetString( stringOffset + headerBase, g_acSerialNumber, _countof( g_acSerialNumber ), head.count );
-                    DetectGarbage( g_acSerialNumber );
+                    GetString( stringOffset + headerBase, md.acSerialNumber, _countof( md.acSerialNumber ), head.count );
+                    DetectGarbage( md.acSerialNumber );
                 }
                 else if ( 81 == head.id && 2 == head.type )
                 {
                     ULONG stringOffset = ( head.count <= 4 ) ? ( (ULONG) IFDOffset - 4 ) : head.offset;
-                    GetString( stringOffset + headerBase, g_acLensModel, _countof( g_acLensModel ), head.count );
-                    DetectGarbage( g_acLensModel );
+                    GetString( stringOffset + headerBase, md.acLensModel, _countof( md.acLensModel ), head.count );
+                    DetectGarbage( md.acLensModel );
                 }
                 else if ( 82 == head.id && 2 == head.type )
                 {
                     ULONG stringOffset = ( head.count <= 4 ) ? ( (ULONG) IFDOffset - 4 ) : head.offset;
-                    GetString( stringOffset + headerBase, g_acLensSerialNumber, _countof( g_acLensSerialNumber ), head.count );
-                    DetectGarbage( g_acLensSerialNumber );
+                    GetString( stringOffset + headerBase, md.acLensSerialNumber, _countof( md.acLensSerialNumber ), head.count );
+                    DetectGarbage( md.acLensSerialNumber );
                 }
             }
     
-            IFDOffset = GetDWORD( IFDOffset + headerBase, littleEndian );
+            IFDOffset = GetDWORD<littleEndian>( IFDOffset + headerBase );
         }
     } //EnumeratePanasonicMakernotes
 
-    void EnumerateMakernotes( __int64 IFDOffset, __int64 headerBase, bool littleEndian )
+    template <bool littleEndian> void EnumerateMakernotes( __int64 IFDOffset, __int64 headerBase )
     {
         __int64 originalIFDOffset = IFDOffset;
     
@@ -712,134 +1004,148 @@ private:
     
         // Note: Canon and Sony cameras have no manufacturer string filler before the IFD begins
     
-        if ( !strcmp( g_acMake, "NIKON CORPORATION" ) )
+        if ( !strcmp( md.acMake, "NIKON CORPORATION" ) )
         {
             IFDOffset += 10;
-            WORD endian = GetWORD( IFDOffset + headerBase, littleEndian );
-            littleEndian = ( 0x4d4d != endian );
+            WORD endian = GetWORD<littleEndian>( IFDOffset + headerBase );
     
             // https://www.exiv2.org/tags-nikon.html     Format 3 for D100
     
             IFDOffset += 8;
             isNikon = true;
     
-            EnumerateNikonMakernotes( IFDOffset, headerBase, littleEndian );
+            // Nikon makernotes carry their own byte order, independent of the rest of the file
+
+            if ( 0x4d4d == endian )
+                EnumerateNikonMakernotes<false>( IFDOffset, headerBase );
+            else
+                EnumerateNikonMakernotes<true>( IFDOffset, headerBase );
             return;
         }
-        if ( !strcmp( g_acMake, "Nikon" ) )
+        if ( !strcmp( md.acMake, "Nikon" ) )
         {
             IFDOffset += 10;
-            WORD endian = GetWORD( IFDOffset + headerBase, littleEndian );
-            littleEndian = ( 0x4d4d != endian );
+            WORD endian = GetWORD<littleEndian>( IFDOffset + headerBase );
     
             // https://www.exiv2.org/tags-nikon.html     Format 3 for D100
     
             IFDOffset += 8;
             isNikon = true;
     
-            EnumerateNikonMakernotes( IFDOffset, headerBase, littleEndian );
+            // Nikon makernotes carry their own byte order, independent of the rest of the file
+
+            if ( 0x4d4d == endian )
+                EnumerateNikonMakernotes<false>( IFDOffset, headerBase );
+            else
+                EnumerateNikonMakernotes<true>( IFDOffset, headerBase );
             return;
         }
-        if ( !strcmp( g_acMake, "NIKON" ) )
+        if ( !strcmp( md.acMake, "NIKON" ) )
         {
             IFDOffset += 10;
-            WORD endian = GetWORD( IFDOffset + headerBase, littleEndian );
-            littleEndian = ( 0x4d4d != endian );
+            WORD endian = GetWORD<littleEndian>( IFDOffset + headerBase );
     
             // https://www.exiv2.org/tags-nikon.html     Format 3 for D100
     
             IFDOffset += 8;
             isNikon = true;
     
-            EnumerateNikonMakernotes( IFDOffset, headerBase, littleEndian );
+            // Nikon makernotes carry their own byte order, independent of the rest of the file
+
+            if ( 0x4d4d == endian )
+                EnumerateNikonMakernotes<false>( IFDOffset, headerBase );
+            else
+                EnumerateNikonMakernotes<true>( IFDOffset, headerBase );
             return;
         }
-        else if ( !strcmp( g_acMake, "LEICA CAMERA AG" ) )
+        else if ( !strcmp( md.acMake, "LEICA CAMERA AG" ) )
         {
             IFDOffset += 8;
             isLeica = true;
         }
-        else if ( !strcmp( g_acMake, "RICOH IMAGING COMPANY, LTD." ) )
+        else if ( !strcmp( md.acMake, "RICOH IMAGING COMPANY, LTD." ) )
         {
             // GR III, etc.
     
             IFDOffset += 8;
             isRicoh = true;
     
-            if ( !strcmp( g_acModel, "PENTAX K-3 Mark III" ) )
+            if ( !strcmp( md.acModel, "PENTAX K-3 Mark III" ) )
                 IFDOffset += 2;
         }
-        else if ( !strcmp( g_acMake, "RICOH" ) )
+        else if ( !strcmp( md.acMake, "RICOH" ) )
         {
             // THETA, etc.
     
             IFDOffset += 8;
             isRicohTheta = true;
         }
-        else if ( !strcmp( g_acMake, "PENTAX" ) )
+        else if ( !strcmp( md.acMake, "PENTAX" ) )
         {
             IFDOffset += 6;
             isPentax = true;
         }
-        else if ( !strcmp( g_acMake, "OLYMPUS IMAGING CORP." ) )
+        else if ( !strcmp( md.acMake, "OLYMPUS IMAGING CORP." ) )
         {
             IFDOffset += 12;
             isOlympus = true;
         }
-        else if ( !strcmp( g_acMake, "OLYMPUS CORPORATION" ) )
+        else if ( !strcmp( md.acMake, "OLYMPUS CORPORATION" ) )
         {
             IFDOffset += 12;
             isOlympus = true;
         }
-        else if ( !strcmp( g_acMake, "Eastman Kodak Company" ) )
+        else if ( !strcmp( md.acMake, "Eastman Kodak Company" ) )
         {
             isEastmanKodak = true;
             return; // apparently unparsable
         }
-        else if ( !strcmp( g_acMake, "FUJIFILM" ) )
+        else if ( !strcmp( md.acMake, "FUJIFILM" ) )
         {
             IFDOffset += 12;
             isFujifilm = true;
     
-            EnumerateFujifilmMakernotes( IFDOffset, headerBase, littleEndian );
+            EnumerateFujifilmMakernotes<littleEndian>( IFDOffset, headerBase );
             return;
         }
-        else if ( !strcmp( g_acMake, "Panasonic" ) )
+        else if ( !strcmp( md.acMake, "Panasonic" ) )
         {
             IFDOffset += 12;
             isPanasonic = true;
 
-            EnumeratePanasonicMakernotes( IFDOffset, headerBase, littleEndian );
+            EnumeratePanasonicMakernotes<littleEndian>( IFDOffset, headerBase );
             return;
         }
-        else if ( !strcmp( g_acMake, "Apple" ) )
+        else if ( !strcmp( md.acMake, "Apple" ) )
         {
-            if ( !strcmp( g_acModel, "iPhone 12" ) )
+            // iPhone 12 makernotes are big-endian. Start over with that byte order.
+
+            if ( littleEndian && !strcmp( md.acModel, "iPhone 12" ) )
             {
-                IFDOffset += 14;
-                littleEndian = false;
+                EnumerateMakernotes<false>( originalIFDOffset, headerBase );
+                return;
             }
-            else
-                IFDOffset += 14;
+
+            IFDOffset += 14;
     
             isApple = true;
         }
-        else if ( !strcmp( g_acMake, "SONY" ) ) // real camera
+        else if ( !strcmp( md.acMake, "SONY" ) ) // real camera
         {
             isSony = true;
         }
-        else if ( !strcmp( g_acMake, "Sony" ) ) // cellphone
+        else if ( !strcmp( md.acMake, "Sony" ) ) // cellphone
         {
             IFDOffset += 12;
             isSony = true;
         }
-        else if ( !strcmp( g_acMake, "CANON" ) )
+        else if ( !strcmp( md.acMake, "CANON" ) )
         {
             isCanon = true;
         }
-        else if ( !strcmp( g_acMake, "" ) )
+        else if ( !strcmp( md.acMake, "" ) )
         {
-            if ( !strcmp( g_acModel, "DMC-GM1" ) )
+            if ( !strcmp( md.acModel, "DMC-GM1" ) )
             {
                 IFDOffset += 12;
                 isPanasonic = true;
@@ -850,7 +1156,7 @@ private:
 
         while ( 0 != IFDOffset ) 
         {
-            WORD NumTags = GetWORD( IFDOffset + headerBase, littleEndian );
+            WORD NumTags = GetWORD<littleEndian>( IFDOffset + headerBase );
             IFDOffset += 2;
     
             // the file is problematic if this is true
@@ -858,28 +1164,28 @@ private:
             if ( NumTags > MaxIFDHeaders )
                 break;
         
-            if ( !GetIFDHeaders( IFDOffset + headerBase, aHeaders.data(), NumTags, littleEndian ) )
+            if ( !GetIFDHeaders<littleEndian>( IFDOffset + headerBase, aHeaders.data(), NumTags ) )
                 break;
         
             for ( int i = 0; i < NumTags; i++ )
             {
                 IFDHeader & head = aHeaders[ i ];
-                IFDOffset += sizeof IFDHeader;
+                IFDOffset += sizeof( IFDHeader );
 
                 if ( 5 == head.id && 7 == head.type && isRicohTheta )
                 {
-                    if ( head.count < ( _countof( g_acSerialNumber ) - 1 ) )
+                    if ( head.count < ( _countof( md.acSerialNumber ) - 1 ) )
                     {
-                        GetBytes( head.offset + headerBase, g_acSerialNumber, head.count );
-                        g_acSerialNumber[ head.count ] = 0;
+                        GetBytes( head.offset + headerBase, md.acSerialNumber, head.count );
+                        md.acSerialNumber[ head.count ] = 0;
                     }
                 }
                 else if ( 12 == head.id && 4 == head.type && 1 == head.count && isCanon )
                 {
-                    if ( 0 == g_acSerialNumber )
+                    if ( 0 == md.acSerialNumber )
                     {
-                        sprintf_s( g_acSerialNumber, _countof( g_acSerialNumber ), "%u", head.offset );
-                        //tracer.Trace( "canon makernote serial number: %s\n", g_acSerialNumber );
+                        sprintf_s( md.acSerialNumber, _countof( md.acSerialNumber ), "%u", head.offset );
+                        //tracer.Trace( "canon makernote serial number: %s\n", md.acSerialNumber );
                     }
                 }                         
                 else if ( 224 == head.id && 17 == head.count )
@@ -910,7 +1216,7 @@ private:
     
                         // Ricoh assumes the base is originalIFDOffset
 
-                        GetString( originalIFDOffset + stringOffset + headerBase, g_acSerialNumber, _countof( g_acSerialNumber ), head.count );
+                        GetString( originalIFDOffset + stringOffset + headerBase, md.acSerialNumber, _countof( md.acSerialNumber ), head.count );
                     }
                 }
                 else if ( 1280 == head.id && isLeica )
@@ -922,15 +1228,15 @@ private:
                 }
                 else if ( 8224 == head.id && 13 == head.type && isOlympus )
                 {
-                    EnumerateOlympusCameraSettingsIFD( head.offset, originalIFDOffset + headerBase, littleEndian );
+                    EnumerateOlympusCameraSettingsIFD<littleEndian>( head.offset, originalIFDOffset + headerBase );
                 }
             }
     
-            IFDOffset = GetDWORD( IFDOffset + headerBase, littleEndian );
+            IFDOffset = GetDWORD<littleEndian>( IFDOffset + headerBase );
         }
     } //EnumerateMakernotes
     
-    void EnumerateExifTags( __int64 IFDOffset, __int64 headerBase, bool littleEndian )
+    template <bool littleEndian> void EnumerateExifTags( __int64 IFDOffset, __int64 headerBase )
     {
         DWORD XResolutionNum = 0;
         DWORD XResolutionDen = 0;
@@ -943,7 +1249,7 @@ private:
     
         while ( 0 != IFDOffset ) 
         {
-            WORD NumTags = GetWORD( IFDOffset + headerBase, littleEndian );
+            WORD NumTags = GetWORD<littleEndian>( IFDOffset + headerBase );
             IFDOffset += 2;
 
             // the file is problematic if this is true
@@ -951,87 +1257,91 @@ private:
             if ( NumTags > MaxIFDHeaders )
                 break;
         
-            if ( !GetIFDHeaders( IFDOffset + headerBase, aHeaders.data(), NumTags, littleEndian ) )
+            if ( !GetIFDHeaders<littleEndian>( IFDOffset + headerBase, aHeaders.data(), NumTags ) )
                 break;
         
             for ( int i = 0; i < NumTags; i++ )
             {
                 IFDHeader & head = aHeaders[ i ];
-                IFDOffset += sizeof IFDHeader;
+                IFDOffset += sizeof( IFDHeader );
 
                 if ( 33434 == head.id && 5 == head.type )
                 {
                     TwoDWORDs td;
-                    GetTwoDWORDs( head.offset + headerBase, &td, littleEndian );
-                    g_ExposureNum = td.dw1;
-                    g_ExposureDen = td.dw2;
+                    GetTwoDWORDs<littleEndian>( head.offset + headerBase, &td );
+                    md.ExposureNum = td.dw1;
+                    md.ExposureDen = td.dw2;
                 }
                 else if ( 33434 == head.id && 4 == head.type )
                 {
-                    g_ExposureNum = 1;
-                    g_ExposureDen = head.offset;
+                    md.ExposureNum = 1;
+                    md.ExposureDen = head.offset;
                 }
                 else if ( 33437 == head.id && 5 == head.type ) // FNumber
                 {
                     TwoDWORDs td;
-                    GetTwoDWORDs( head.offset + headerBase, &td, littleEndian );
+                    GetTwoDWORDs<littleEndian>( head.offset + headerBase, &td );
 
-                    g_FNumberNum = td.dw1;
-                    g_FNumberDen = td.dw2;
+                    md.FNumberNum = td.dw1;
+                    md.FNumberDen = td.dw2;
                 }
                 else if ( 34850 == head.id )
-                    g_ExposureProgram = head.offset;
+                    md.ExposureProgram = head.offset;
                 else if ( 34855 == head.id )
-                    g_ISO = head.offset;
+                    md.ISO = head.offset;
                 else if ( 36867 == head.id && 2 == head.type )
                 {
                     __int64 stringOffset = ( head.count <= 4 ) ? ( IFDOffset - 4 ) : head.offset;
-                    GetString( stringOffset + headerBase, g_acDateTimeOriginal, _countof( g_acDateTimeOriginal ), head.count );
+                    GetString( stringOffset + headerBase, md.acDateTimeOriginal, _countof( md.acDateTimeOriginal ), head.count );
+
+                    if ( Resolved() )
+                        return;
                 }
                 else if ( 37378 == head.id && 5 == head.type ) // ApertureValue
                 {
                     TwoDWORDs td;
-                    GetTwoDWORDs( head.offset + headerBase, &td, littleEndian );
+                    GetTwoDWORDs<littleEndian>( head.offset + headerBase, &td );
 
-                    g_ApertureNum = td.dw1;
-                    g_ApertureDen = td.dw2;
+                    md.ApertureNum = td.dw1;
+                    md.ApertureDen = td.dw2;
                 }
                 else if ( 37386 == head.id && 5 == head.type )
                 {
                     TwoDWORDs td;
-                    GetTwoDWORDs( head.offset + headerBase, &td, littleEndian );
-                    g_FocalLengthNum = td.dw1; 
-                    g_FocalLengthDen = td.dw2; 
+                    GetTwoDWORDs<littleEndian>( head.offset + headerBase, &td );
+                    md.FocalLengthNum = td.dw1; 
+                    md.FocalLengthDen = td.dw2; 
                 }
                 else if ( 37500 == head.id )
                 {
-                    EnumerateMakernotes( head.offset, headerBase, littleEndian );
+                    if ( WantsMakernotes() )
+                        EnumerateMakernotes<littleEndian>( head.offset, headerBase );
                 }
                 else if ( 40962 == head.id )
                 {
                     pixelWidth = head.offset;
     
-                    if ( (int) head.offset > g_ImageWidth )
-                        g_ImageWidth = head.offset;
+                    if ( (int) head.offset > md.ImageWidth )
+                        md.ImageWidth = head.offset;
                 }
                 else if ( 40963 == head.id )
                 {
                     pixelHeight = head.offset;
     
-                    if ( (int) head.offset > g_ImageHeight )
-                        g_ImageHeight = head.offset;
+                    if ( (int) head.offset > md.ImageHeight )
+                        md.ImageHeight = head.offset;
                 }
                 else if ( 41486 == head.id )
                 {
                     TwoDWORDs td;
-                    GetTwoDWORDs( head.offset + headerBase, &td, littleEndian );
+                    GetTwoDWORDs<littleEndian>( head.offset + headerBase, &td );
                     XResolutionNum = td.dw1;
                     XResolutionDen = td.dw2;
                 }
                 else if ( 41487 == head.id )
                 {
                     TwoDWORDs td;
-                    GetTwoDWORDs( head.offset + headerBase, &td, littleEndian );
+                    GetTwoDWORDs<littleEndian>( head.offset + headerBase, &td );
                     YResolutionNum = td.dw1;
                     YResolutionDen = td.dw2;
                 }
@@ -1041,37 +1351,37 @@ private:
                 }
                 else if ( 41986 == head.id )
                 {
-                    g_ExposureMode = head.offset;
+                    md.ExposureMode = head.offset;
                 }
                 else if ( 41989 == head.id )
                 {
-                    g_FocalLengthIn35mmFilm = head.offset;
+                    md.FocalLengthIn35mmFilm = head.offset;
                 }
                 else if ( 42033 == head.id && 2 == head.type )
                 {
                     __int64 stringOffset = ( head.count <= 4 ) ? ( IFDOffset - 4 ) : head.offset;
-                    GetString( stringOffset + headerBase, g_acSerialNumber, _countof( g_acSerialNumber ), head.count );
-                    //tracer.Trace( "exif Body Serial Number: %s\n", g_acSerialNumber );
+                    GetString( stringOffset + headerBase, md.acSerialNumber, _countof( md.acSerialNumber ), head.count );
+                    //tracer.Trace( "exif Body Serial Number: %s\n", md.acSerialNumber );
                 }
                 else if ( 42035 == head.id && 2 == head.type )
                 {
                     __int64 stringOffset = ( head.count <= 4 ) ? ( IFDOffset - 4 ) : head.offset;
-                    GetString( stringOffset + headerBase, g_acLensMake, _countof( g_acLensMake ), head.count );
+                    GetString( stringOffset + headerBase, md.acLensMake, _countof( md.acLensMake ), head.count );
                 }
                 else if ( 42036 == head.id && 2 == head.type )
                 {
                     __int64 stringOffset = ( head.count <= 4 ) ? ( IFDOffset - 4 ) : head.offset;
-                    GetString( stringOffset + headerBase, g_acLensModel, _countof( g_acLensModel ), head.count );
+                    GetString( stringOffset + headerBase, md.acLensModel, _countof( md.acLensModel ), head.count );
                 }
                 else if ( 42037 == head.id && 2 == head.type )
                 {
                     __int64 stringOffset = ( head.count <= 4 ) ? ( IFDOffset - 4 ) : head.offset;
-                    GetString( stringOffset + headerBase, g_acLensSerialNumber, _countof( g_acLensSerialNumber ), head.count );
-                    //tracer.Trace( "exif Lens Serial Number: %s\n", g_acLensSerialNumber );
+                    GetString( stringOffset + headerBase, md.acLensSerialNumber, _countof( md.acLensSerialNumber ), head.count );
+                    //tracer.Trace( "exif Lens Serial Number: %s\n", md.acLensSerialNumber );
                 }
             }
     
-            IFDOffset = GetDWORD( IFDOffset + headerBase, littleEndian );
+            IFDOffset = GetDWORD<littleEndian>( IFDOffset + headerBase );
         }
     
         if ( 0 != XResolutionNum && 0 != XResolutionDen && 0 != YResolutionNum && 0 != YResolutionDen && 0 != sensorSizeUnit &&
@@ -1109,12 +1419,12 @@ private:
     
             //tracer.Trace( "exif (Computed) sensor WxH:         %lf, %lf\n", sensorSizeXmm, sensorSizeYmm );
     
-            g_ComputedSensorWidth = (int) round( sensorSizeXmm );
-            g_ComputedSensorHeight = (int) round( sensorSizeYmm );
+            md.ComputedSensorWidth = (int) round( sensorSizeXmm );
+            md.ComputedSensorHeight = (int) round( sensorSizeYmm );
         }
     } //EnumerateExifTags
 
-    void EnumerateGenericIFD( __int64 IFDOffset, __int64 headerBase, bool littleEndian )
+    template <bool littleEndian> void EnumerateGenericIFD( __int64 IFDOffset, __int64 headerBase )
     {
         __int64 provisionalJPGOffset = 0;
         __int64 provisionalJPGFromRAWOffset = 0;
@@ -1127,7 +1437,7 @@ private:
             provisionalJPGOffset = 0;
             provisionalJPGFromRAWOffset = 0;
     
-            WORD NumTags = GetWORD( IFDOffset + headerBase, littleEndian );
+            WORD NumTags = GetWORD<littleEndian>( IFDOffset + headerBase );
             IFDOffset += 2;
     
             // the file is problematic if this is true
@@ -1135,13 +1445,13 @@ private:
             if ( NumTags > MaxIFDHeaders )
                 break;
         
-            if ( !GetIFDHeaders( IFDOffset + headerBase, aHeaders.data(), NumTags, littleEndian ) )
+            if ( !GetIFDHeaders<littleEndian>( IFDOffset + headerBase, aHeaders.data(), NumTags ) )
                 break;
         
             for ( int i = 0; i < NumTags; i++ )
             {
                 IFDHeader & head = aHeaders[ i ];
-                IFDOffset += sizeof IFDHeader;
+                IFDOffset += sizeof( IFDHeader );
 
                 //tracer.Trace( "genericifd head.id %d\n", head.id );
     
@@ -1151,13 +1461,13 @@ private:
                 }
                 else if ( 256 == head.id && IsIntType( head.type ) )
                 {
-                    if ( (int) head.offset > g_ImageWidth )
-                        g_ImageWidth = head.offset;
+                    if ( (int) head.offset > md.ImageWidth )
+                        md.ImageWidth = head.offset;
                 }
                 else if ( 257 == head.id && IsIntType( head.type ) )
                 {
-                    if ( (int) head.offset > g_ImageHeight )
-                        g_ImageHeight = head.offset;
+                    if ( (int) head.offset > md.ImageHeight )
+                        md.ImageHeight = head.offset;
                 }
                 else if ( 273 == head.id && IsIntType( head.type ) )
                 {
@@ -1166,10 +1476,15 @@ private:
                 }
                 else if ( 279 == head.id && IsIntType( head.type ) )
                 {
-                    if ( 0 != provisionalJPGOffset && 0 != head.offset && 0xffffffff != head.offset && !likelyRAW && head.offset > g_Embedded_Image_Length )
+                    if ( 0 != provisionalJPGOffset && 0 != head.offset && 0xffffffff != head.offset && !likelyRAW )
                     {
-                        g_Embedded_Image_Length = head.offset;
-                        g_Embedded_Image_Offset = provisionalJPGOffset;
+                        AddEmbeddedImage( provisionalJPGOffset, head.offset );
+
+                        if ( head.offset > md.Embedded_Image_Length )
+                        {
+                            md.Embedded_Image_Length = head.offset;
+                            md.Embedded_Image_Offset = provisionalJPGOffset;
+                        }
                     }
                 }
                 else if ( 513 == head.id && IsIntType( head.type ) )
@@ -1180,38 +1495,44 @@ private:
                 }
                 else if ( 514 == head.id && IsIntType( head.type ) )
                 {
-                    if ( 0 != head.offset && 0xffffffff != head.offset && 0 != provisionalJPGFromRAWOffset && ( head.offset > g_Embedded_Image_Length ) )
+                    if ( 0 != head.offset && 0xffffffff != head.offset && 0 != provisionalJPGFromRAWOffset )
                     {
-                        g_Embedded_Image_Length = head.offset;
-                        g_Embedded_Image_Offset = provisionalJPGFromRAWOffset;
+                        AddEmbeddedImage( provisionalJPGFromRAWOffset, head.offset );
+
+                        if ( head.offset > md.Embedded_Image_Length )
+                        {
+                            md.Embedded_Image_Length = head.offset;
+                            md.Embedded_Image_Offset = provisionalJPGFromRAWOffset;
+                        }
                     }
                 }
             }
     
-            IFDOffset = GetDWORD( IFDOffset + headerBase, littleEndian );
+            IFDOffset = GetDWORD<littleEndian>( IFDOffset + headerBase );
             currentIFD++;
         }
     } //EnumerateGenericIFD
     
 #pragma warning( disable: 4100 ) // unreference formal parameters
-    void GetPanasonicIFD0Tag( WORD tagID, WORD tagType, DWORD tagCount, DWORD tagOffset, __int64 headerBase, bool littleEndian, __int64 IFDOffset )
+    template <bool littleEndian> void GetPanasonicIFD0Tag( WORD tagID, WORD tagType, DWORD tagCount, DWORD tagOffset, __int64 headerBase, __int64 IFDOffset )
     {
         if ( 2 == tagID )
         {
-            if ( (int) tagOffset > g_ImageWidth )
-                g_ImageWidth = tagOffset;
+            if ( (int) tagOffset > md.ImageWidth )
+                md.ImageWidth = tagOffset;
         }
         else if ( 3 == tagID )
         {
-            if ( (int) tagOffset > g_ImageHeight )
-                g_ImageHeight = tagOffset;
+            if ( (int) tagOffset > md.ImageHeight )
+                md.ImageHeight = tagOffset;
         }
         else if ( 23 == tagID )
-            g_ISO = tagOffset;
+            md.ISO = tagOffset;
         else if ( 46 == tagID )
         {
-            g_Embedded_Image_Offset = tagOffset;
-            g_Embedded_Image_Length = tagCount;
+            md.Embedded_Image_Offset = tagOffset;
+            md.Embedded_Image_Length = tagCount;
+            AddEmbeddedImage( tagOffset, tagCount );
         }
     } //GetPanasonicIFD0Tag
 #pragma warning( default: 4100 ) // unreference formal parameters
@@ -1261,11 +1582,11 @@ private:
                 o += descriptionBytes;
     
                 DWORD width = GetDWORD( o, false );
-                g_ImageWidth = width;
+                md.ImageWidth = width;
                 o += 4;
     
                 DWORD height = GetDWORD( o, false );
-                g_ImageHeight = height;
+                md.ImageHeight = height;
                 o += 4;
     
                 DWORD bpp = GetDWORD( o, false );
@@ -1279,8 +1600,9 @@ private:
     
                 if ( ( imageLength > 2 ) && IsPerhapsAnImage( o, 0 ) )
                 {
-                    g_Embedded_Image_Offset = o;
-                    g_Embedded_Image_Length = imageLength;
+                    md.Embedded_Image_Offset = o;
+                    md.Embedded_Image_Length = imageLength;
+                    AddEmbeddedImage( o, imageLength );
 
                     // we've got the image and that's all this function does. return now.
                     return;
@@ -1294,19 +1616,58 @@ private:
         } while ( true );
     } //EnumerateFlac
     
-    void EnumerateXMPData( const char * pcIn, ULONGLONG fileOffset )
+    const char * GetXMPBytes( __int64 offset, ULONG length, unique_ptr<char> & bytes )
     {
-        // look for known xml tags rather than exhaustively parse the xml
+        // When the file is mapped, XMP data is searched in place. Otherwise it's copied to a null-terminated buffer.
+
+        const char * pc = (const char *) pStream->View( offset, length );
+        if ( NULL != pc )
+            return pc;
+
+        bytes.reset( new char[ length + 1 ] );
+        bytes.get()[ length ] = 0; // ensure it'll be null-terminated
+        GetBytes( offset, bytes.get(), length );
+        return bytes.get();
+    } //GetXMPBytes
+
+    static const char * FindString( const char * pcIn, size_t length, const char * pcFind )
+    {
+        // strstr that won't look past length bytes, since mapped data isn't null-terminated
+
+        size_t findLen = strlen( pcFind );
+        if ( 0 == findLen || findLen > length )
+            return NULL;
+
+        const char * pcLast = pcIn + length - findLen;
+
+        for ( const char * pc = pcIn; pc <= pcLast; pc++ )
+        {
+            pc = (const char *) memchr( pc, *pcFind, pcLast - pc + 1 );
+            if ( NULL == pc )
+                break;
+
+            if ( !memcmp( pc, pcFind, findLen ) )
+                return pc;
+        }
+
+        return NULL;
+    } //FindString
+
+    void EnumerateXMPData( const char * pcIn, size_t length, ULONGLONG fileOffset )
+    {
+        // look for known xml tags rather than exhaustively parse the xml. Stop at a null like strstr would.
+
+        length = strnlen( pcIn, length );
     
         const char * pcTag = "xmp:Rating>";
-        const char * pcRating = strstr( pcIn, pcTag );
+        const char * pcRating = FindString( pcIn, length, pcTag );
 
         if ( !pcRating )
         {
             // jpg and Sony RAW ARW files will have this form
     
             pcTag = "xmp:Rating=\"";
-            pcRating = strstr( pcIn, pcTag );
+            pcRating = FindString( pcIn, length, pcTag );
         }
 
         if ( !pcRating )
@@ -1314,18 +1675,18 @@ private:
             // Hasselblad RAW files have this form
     
             pcTag = "xap:Rating>";
-            pcRating = strstr( pcIn, pcTag );
+            pcRating = FindString( pcIn, length, pcTag );
         }
 
         if ( pcRating )
         {
             pcRating += strlen( pcTag );
-            char rating = *pcRating;
+            char rating = ( pcRating < ( pcIn + length ) ) ? *pcRating : 0;
 
             if ( rating >= '0' && rating <= '5'  )       // doesn't handle Adobe Bridge's -1
             {
-                g_RatingInXMP = rating - '0';
-                g_RatingInXMP_Offset = fileOffset + ( pcRating - pcIn );
+                md.RatingInXMP = rating - '0';
+                md.RatingInXMP_Offset = fileOffset + ( pcRating - pcIn );
             }
             else
                 tracer.Trace( "XMP rating value isn't a character 0 to 5: '%c' == %#x\n", rating, rating );
@@ -1385,9 +1746,9 @@ private:
                 return w;
             } //GetWORD
     
-            byte GetBYTE( __int64 & streamOffset )
+            BYTE GetBYTE( __int64 & streamOffset )
             {
-                byte b = 0;
+                BYTE b = 0;
 
                 if ( pStream->Seek( offset + streamOffset ) )
                 {
@@ -1517,7 +1878,7 @@ private:
                     itemType[ 4 ] = 0;
     
                     if ( !strcmp( itemType, "Exif" ) )
-                        g_Heif_Exif_ItemID = itemID;
+                        md.Heif_Exif_ItemID = itemID;
                 }
             }
             else if ( !strcmp( tag, "iloc" ) )
@@ -1623,10 +1984,10 @@ private:
                             extentLength = ( high << 32 ) | low;
                         }
     
-                        if ( itemID == (int) g_Heif_Exif_ItemID )
+                        if ( itemID == (int) md.Heif_Exif_ItemID )
                         {
-                            g_Heif_Exif_Offset = extentOffset;
-                            g_Heif_Exif_Length = extentLength;
+                            md.Heif_Exif_Offset = extentOffset;
+                            md.Heif_Exif_Length = extentLength;
                         }
                     }
                 }
@@ -1701,32 +2062,31 @@ private:
                     EnumerateBoxes( hsChild, depth + 1 );
                 }
 
-                if ( !strcmp( "be7acfcb97a942e89c71999491e3afac", acGUID ) )
+                if ( !strcmp( "be7acfcb97a942e89c71999491e3afac", acGUID ) && Wants( ImageMetadata::FieldRating ) )
                 {
                     // Adobe XMP data
     
                     ULONGLONG xmpLen = boxLen - ( offset - boxOffset );
-                    unique_ptr<char> bytes( new char[ xmpLen + 1 ] );
-                    bytes.get()[ xmpLen ] = 0; // ensure it'll be null-terminated
-                    hs.GetBytes( offset, bytes.get(), (ULONG) xmpLen );
-                    EnumerateXMPData( bytes.get(), offset );
+                    unique_ptr<char> bytes;
+                    const char * pcXMP = GetXMPBytes( hs.Offset() + offset, (ULONG) xmpLen, bytes );
+                    EnumerateXMPData( pcXMP, (size_t) xmpLen, offset );
                 }
             }
             else if ( !strcmp( tag, "CMT1" ) )
             {
-                g_Canon_CR3_Exif_IFD0 = hs.Offset() + offset;
+                md.Canon_CR3_Exif_IFD0 = hs.Offset() + offset;
             }
             else if ( !strcmp( tag, "CMT2" ) )
             {
-                g_Canon_CR3_Exif_Exif_IFD = hs.Offset() + offset;
+                md.Canon_CR3_Exif_Exif_IFD = hs.Offset() + offset;
             }
             else if ( !strcmp( tag, "CMT3" ) )
             {
-                g_Canon_CR3_Exif_Makernotes_IFD = hs.Offset() + offset;
+                md.Canon_CR3_Exif_Makernotes_IFD = hs.Offset() + offset;
             }
             else if ( !strcmp( tag, "CMT4" ) )
             {
-                g_Canon_CR3_Exif_GPS_IFD = hs.Offset() + offset;
+                md.Canon_CR3_Exif_GPS_IFD = hs.Offset() + offset;
             }
             else if ( !strcmp( tag, "PRVW" ) )
             {
@@ -1739,8 +2099,9 @@ private:
     
                 // This should work per https://github.com/exiftool/canon_cr3, but it doesn't exist
     
-                g_Embedded_Image_Length = length;
-                g_Embedded_Image_Offset = offset + hs.Offset();
+                md.Embedded_Image_Length = length;
+                md.Embedded_Image_Offset = offset + hs.Offset();
+                AddEmbeddedImage( md.Embedded_Image_Offset, length );
             }
             else if ( !strcmp( tag, "mdat" ) ) // Canon .CR3 main data
             {
@@ -1748,10 +2109,11 @@ private:
                 DWORD head = hs.GetDWORD( offset, false );
     
                 if ( ( 0xffd8ffdb == head ) && // looks like JPG
-                     ( 0 != g_Canon_CR3_Embedded_JPG_Length ) )
+                     ( 0 != md.Canon_CR3_Embedded_JPG_Length ) )
                 {
-                    g_Embedded_Image_Length = g_Canon_CR3_Embedded_JPG_Length;
-                    g_Embedded_Image_Offset = jpgOffset;
+                    md.Embedded_Image_Length = md.Canon_CR3_Embedded_JPG_Length;
+                    md.Embedded_Image_Offset = jpgOffset;
+                    AddEmbeddedImage( jpgOffset, md.Canon_CR3_Embedded_JPG_Length );
                 }
             }
             else if ( !strcmp( tag, "trak" ) ) // Canon .CR3 metadata
@@ -1784,8 +2146,8 @@ private:
                 {
                     DWORD len = hs.GetDWORD( offset, false );
     
-                    if ( ( 3 == i ) && ( 0 == g_Canon_CR3_Embedded_JPG_Length ) )
-                        g_Canon_CR3_Embedded_JPG_Length = len;
+                    if ( ( 3 == i ) && ( 0 == md.Canon_CR3_Embedded_JPG_Length ) )
+                        md.Canon_CR3_Embedded_JPG_Length = len;
                 }
             }
     
@@ -1804,7 +2166,7 @@ private:
         EnumerateBoxes( hs, 0 );
     } //EnumerateHeif
     
-    void EnumerateIFD0( __int64 IFDOffset, __int64 headerBase, bool littleEndian, WCHAR const * pwcExt )
+    template <bool littleEndian> void EnumerateIFD0( __int64 IFDOffset, __int64 headerBase, WCHAR const * pwcExt )
     {
         int currentIFD = 0;
         __int64 provisionalJPGOffset = 0;
@@ -1818,23 +2180,23 @@ private:
             provisionalJPGOffset = 0;
             provisionalEmbeddedJPGOffset = 0;
     
-            WORD NumTags = GetWORD( IFDOffset + headerBase, littleEndian );
+            WORD NumTags = GetWORD<littleEndian>( IFDOffset + headerBase );
             IFDOffset += 2;
         
             if ( NumTags > MaxIFDHeaders )
                 break;
 
-            if ( !GetIFDHeaders( IFDOffset + headerBase, aHeaders.data(), NumTags, littleEndian ) )
+            if ( !GetIFDHeaders<littleEndian>( IFDOffset + headerBase, aHeaders.data(), NumTags ) )
                 break;
 
             for ( int i = 0; i < NumTags; i++ )
             {
                 IFDHeader & head = aHeaders[ i ];
-                IFDOffset += sizeof IFDHeader;
+                IFDOffset += sizeof( IFDHeader );
 
                 if ( ( !_wcsicmp( pwcExt, L".rw2" ) ) && ( ( head.id < 254 ) || ( head.id >= 280 && head.id <= 290 ) ) )
                 {
-                    GetPanasonicIFD0Tag( head.id, head.type, head.count, head.offset, headerBase, littleEndian, IFDOffset );
+                    GetPanasonicIFD0Tag<littleEndian>( head.id, head.type, head.count, head.offset, headerBase, IFDOffset );
                     continue;
                 }
     
@@ -1846,18 +2208,18 @@ private:
                 }
                 else if ( 256 == head.id && IsIntType( head.type ) )
                 {
-                    if ( (int) head.offset > g_ImageWidth )
-                        g_ImageWidth = head.offset;
+                    if ( (int) head.offset > md.ImageWidth )
+                        md.ImageWidth = head.offset;
                 }
                 else if ( 257 == head.id && IsIntType( head.type ) )
                 {
-                    if ( (int) head.offset > g_ImageHeight )
-                        g_ImageHeight = head.offset;
+                    if ( (int) head.offset > md.ImageHeight )
+                        md.ImageHeight = head.offset;
                 }
                 else if ( 258 == head.id && 3 == head.type && 3 == head.count )
                 {
                     // read the first one
-                    lastBitsPerSample = GetWORD( head.offset + headerBase, littleEndian );
+                    lastBitsPerSample = GetWORD<littleEndian>( head.offset + headerBase );
                 }
                 else if ( 258 == head.id && 3 == head.type && 1 == head.count )
                 {
@@ -1866,12 +2228,12 @@ private:
                 else if ( 271 == head.id  && 2 == head.type )
                 {
                     __int64 stringOffset = ( head.count <= 4 ) ? ( IFDOffset - 4 ) : head.offset;
-                    GetString( stringOffset + headerBase, g_acMake, _countof( g_acMake ), head.count );
+                    GetString( stringOffset + headerBase, md.acMake, _countof( md.acMake ), head.count );
                 }
                 else if ( 272 == head.id && 2 == head.type )
                 {
                     __int64 stringOffset = ( head.count <= 4 ) ? ( IFDOffset - 4 ) : head.offset;
-                    GetString( stringOffset + headerBase, g_acModel, _countof( g_acModel ), head.count );
+                    GetString( stringOffset + headerBase, md.acModel, _countof( md.acModel ), head.count );
                 }
                 else if ( 273 == head.id && IsIntType( head.type ) )
                 {
@@ -1880,43 +2242,48 @@ private:
                 }
                 else if ( 274 == head.id && IsIntType( head.type ) )
                 {
-                    if ( -1 == g_Orientation_Value )
+                    if ( -1 == md.Orientation_Value )
                     {
-                        g_Orientation_Value = head.offset;
-                        g_Orientation_Offset = headerBase + IFDOffset - 4;
-                        g_Orientation_Type = head.type;
-                        g_Orientation_LittleEndian = littleEndian;
+                        md.Orientation_Value = head.offset;
+                        md.Orientation_Offset = headerBase + IFDOffset - 4;
+                        md.Orientation_Type = head.type;
+                        md.Orientation_LittleEndian = littleEndian;
                     }
                     else
                     {
-                        g_Orientation_Value2 = head.offset;
-                        g_Orientation_Offset2 = headerBase + IFDOffset - 4;
-                        g_Orientation_Type2 = head.type;
+                        md.Orientation_Value2 = head.offset;
+                        md.Orientation_Offset2 = headerBase + IFDOffset - 4;
+                        md.Orientation_Type2 = head.type;
                     }
                 }
                 else if ( 279 == head.id && IsIntType( head.type ) )
                 {
-                    if ( ( lastBitsPerSample != 16 ) && 0 != provisionalJPGOffset && 0 != head.offset && 0xffffffff != head.offset && !likelyRAW && ( head.offset > g_Embedded_Image_Length ) )
+                    if ( ( lastBitsPerSample != 16 ) && 0 != provisionalJPGOffset && 0 != head.offset && 0xffffffff != head.offset && !likelyRAW )
                     {
-                        g_Embedded_Image_Length = head.offset;
-                        g_Embedded_Image_Offset = provisionalJPGOffset;
+                        AddEmbeddedImage( provisionalJPGOffset, head.offset );
+
+                        if ( head.offset > md.Embedded_Image_Length )
+                        {
+                            md.Embedded_Image_Length = head.offset;
+                            md.Embedded_Image_Offset = provisionalJPGOffset;
+                        }
                     }
                 }
                 else if ( 306 == head.id && 2 == head.type )
                 {
                     __int64 stringOffset = ( head.count <= 4 ) ? ( IFDOffset - 4 ) : head.offset;
-                    GetString( stringOffset + headerBase, g_acDateTime, _countof( g_acDateTime ), head.count );
+                    GetString( stringOffset + headerBase, md.acDateTime, _countof( md.acDateTime ), head.count );
                 }
-                else if ( 330 == head.id && 4 == head.type )
+                else if ( 330 == head.id && 4 == head.type && WantsSubIFDs() )
                 {
                     if ( 1 == head.count )
-                        EnumerateGenericIFD( head.offset, headerBase, littleEndian );
+                        EnumerateGenericIFD<littleEndian>( head.offset, headerBase );
                     else
                     {
                         for ( size_t item = 0; item < head.count; item++ )
                         {
-                            DWORD oIFD = GetDWORD( ( item * 4 ) + head.offset + headerBase, littleEndian );
-                            EnumerateGenericIFD( oIFD, headerBase, littleEndian );
+                            DWORD oIFD = GetDWORD<littleEndian>( ( item * 4 ) + head.offset + headerBase );
+                            EnumerateGenericIFD<littleEndian>( oIFD, headerBase );
                         }
                     }
                 }
@@ -1928,10 +2295,15 @@ private:
                 }
                 else if ( 514 == head.id && IsIntType( head.type ) )
                 {
-                    if ( 0 != head.offset && 0xffffffff != head.offset && 0 != provisionalEmbeddedJPGOffset && ( head.offset > g_Embedded_Image_Length ) )
+                    if ( 0 != head.offset && 0xffffffff != head.offset && 0 != provisionalEmbeddedJPGOffset )
                     {
-                        g_Embedded_Image_Length = head.offset;
-                        g_Embedded_Image_Offset = provisionalEmbeddedJPGOffset;
+                        AddEmbeddedImage( provisionalEmbeddedJPGOffset, head.offset );
+
+                        if ( head.offset > md.Embedded_Image_Length )
+                        {
+                            md.Embedded_Image_Length = head.offset;
+                            md.Embedded_Image_Offset = provisionalEmbeddedJPGOffset;
+                        }
                     }
                 }
                 else if ( 700 == head.id )
@@ -1939,56 +2311,103 @@ private:
                     // XMP Data. Adobe products update (and move and resize) this tag to include edits for DNG, TIFF, and JPG files.
                     // The data is there instead of in .xmp files, as it is for other RAW formats.
 
-                    if ( head.count > 4 && head.count < 65536 )
+                    if ( head.count > 4 && head.count < 65536 && Wants( ImageMetadata::FieldRating ) )
                     {
-                        unique_ptr<char> bytes( new char[ head.count + 1 ] );
-                        bytes.get()[ head.count ] = 0; // ensure it'll be null-terminated
-                        GetBytes( head.offset + headerBase, bytes.get(), head.count );
-                        if ( strstr( bytes.get(), "Adobe XMP Core" ) )
-                            g_holdsAdobeEditsInXMP = true;
+                        unique_ptr<char> bytes;
+                        const char * pcXMP = GetXMPBytes( head.offset + headerBase, head.count, bytes );
+                        size_t xmpLen = strnlen( pcXMP, head.count );
+                        if ( FindString( pcXMP, xmpLen, "Adobe XMP Core" ) )
+                            md.holdsAdobeEditsInXMP = true;
+
+                        EnumerateXMPData( pcXMP, xmpLen, head.offset + headerBase );
 
-                        EnumerateXMPData( bytes.get(), head.offset + headerBase );
+                        if ( Resolved() )
+                            return;
                     }
                 }
                 else if ( 34665 == head.id )
                 {
-                    EnumerateExifTags( head.offset, headerBase, littleEndian );
+                    EnumerateExifTags<littleEndian>( head.offset, headerBase );
+
+                    if ( Resolved() )
+                        return;
                 }
                 else if ( 34853 == head.id )
                 {
-                    EnumerateGPSTags( head.offset, headerBase, littleEndian );
+                    if ( Wants( ImageMetadata::FieldGPS ) )
+                    {
+                        EnumerateGPSTags<littleEndian>( head.offset, headerBase );
+
+                        if ( Resolved() )
+                            return;
+                    }
                 }
                 else if ( 41989 == head.id && IsIntType( head.type ) )
                 {
                     // This is generally in ExifTags, but for Nikon it can sometimes be here in IFD0
 
-                    g_FocalLengthIn35mmFilm = head.offset;
+                    md.FocalLengthIn35mmFilm = head.offset;
                 }
                 else if ( 42037 == head.id && 2 == head.type )
                 {
                     __int64 stringOffset = ( head.count <= 4 ) ? ( IFDOffset - 4 ) : head.offset;
-                    GetString( stringOffset + headerBase, g_acLensSerialNumber, _countof( g_acLensSerialNumber ), head.count );
-                    //tracer.Trace( "IFD0 Lens Serial Number: %s\n", g_acLensSerialNumber );
+                    GetString( stringOffset + headerBase, md.acLensSerialNumber, _countof( md.acLensSerialNumber ), head.count );
+                    //tracer.Trace( "IFD0 Lens Serial Number: %s\n", md.acLensSerialNumber );
                 }
                 else if ( 50735 == head.id && 2 == head.type )
                 {
                      __int64 stringOffset = ( head.count <= 4 ) ? ( IFDOffset - 4 ) : head.offset;
-                    GetString( stringOffset + headerBase, g_acSerialNumber, _countof( g_acSerialNumber ), head.count );
-                    //tracer.Trace( "IFD0 Body Serial Number: %s\n", g_acSerialNumber );
+                    GetString( stringOffset + headerBase, md.acSerialNumber, _countof( md.acSerialNumber ), head.count );
+                    //tracer.Trace( "IFD0 Body Serial Number: %s\n", md.acSerialNumber );
                 }
                 else if ( 50740 == head.id && IsIntType( head.type ) )
                 {
                     // Sony and Ricoh Makernotes (in addition to makernotes stored in Exif IFD)
     
-                    EnumerateMakernotes( head.offset, headerBase, littleEndian );
+                    if ( WantsMakernotes() )
+                        EnumerateMakernotes<littleEndian>( head.offset, headerBase );
                 }
             }
     
-            IFDOffset = GetDWORD( IFDOffset + headerBase, littleEndian );
+            IFDOffset = GetDWORD<littleEndian>( IFDOffset + headerBase );
     
             currentIFD++;
         }
     } //EnumerateIFD0
+
+    // Entry points for callers that learn the byte order at runtime. This is the only place it's tested.
+
+    void EnumerateIFD0( __int64 IFDOffset, __int64 headerBase, bool littleEndian, WCHAR const * pwcExt )
+    {
+        if ( littleEndian )
+            EnumerateIFD0<true>( IFDOffset, headerBase, pwcExt );
+        else
+            EnumerateIFD0<false>( IFDOffset, headerBase, pwcExt );
+    } //EnumerateIFD0
+
+    void EnumerateExifTags( __int64 IFDOffset, __int64 headerBase, bool littleEndian )
+    {
+        if ( littleEndian )
+            EnumerateExifTags<true>( IFDOffset, headerBase );
+        else
+            EnumerateExifTags<false>( IFDOffset, headerBase );
+    } //EnumerateExifTags
+
+    void EnumerateMakernotes( __int64 IFDOffset, __int64 headerBase, bool littleEndian )
+    {
+        if ( littleEndian )
+            EnumerateMakernotes<true>( IFDOffset, headerBase );
+        else
+            EnumerateMakernotes<false>( IFDOffset, headerBase );
+    } //EnumerateMakernotes
+
+    void EnumerateGPSTags( __int64 IFDOffset, __int64 headerBase, bool littleEndian )
+    {
+        if ( littleEndian )
+            EnumerateGPSTags<true>( IFDOffset, headerBase );
+        else
+            EnumerateGPSTags<false>( IFDOffset, headerBase );
+    } //EnumerateGPSTags
     
     int ParseOldJpg( bool embedded = false, DWORD startingOffset = 0 )
     {
@@ -2072,16 +2491,16 @@ private:
 
                 if ( embedded )
                 {
-                    g_Embedded_Image_Width = record.width;
-                    g_Embedded_Image_Height = record.height;
+                    md.Embedded_Image_Width = record.width;
+                    md.Embedded_Image_Height = record.height;
                 }
                 else
                 {
-                    if ( record.width > g_ImageWidth )
-                        g_ImageWidth = record.width;
+                    if ( record.width > md.ImageWidth )
+                        md.ImageWidth = record.width;
 
-                    if ( record.height > g_ImageHeight )
-                        g_ImageHeight = record.height;
+                    if ( record.height > md.ImageHeight )
+                        md.ImageHeight = record.height;
                 }
             }
             else if ( MARKER_SOS == record.segment )
@@ -2100,16 +2519,16 @@ private:
 
                     exifOffset = offset + 8;
                 }
-                else if ( !_stricmp( app1Header, "http" ) )
+                else if ( !_stricmp( app1Header, "http" ) && Wants( ImageMetadata::FieldRating ) )
                 {
                     // there will be a null-terminated header string then another string with xmp data
     
-                    unique_ptr<char> bytes( new char[ data_length + 1 ] );
-                    GetBytes( (__int64) offset + 4, bytes.get(), data_length );
-                    bytes.get()[ data_length ] = 0;
-                    size_t headerlen = strlen( bytes.get() );
+                    unique_ptr<char> bytes;
+                    const char * pcData = GetXMPBytes( (__int64) offset + 4, data_length, bytes );
+                    size_t headerlen = strnlen( pcData, data_length );
     
-                    EnumerateXMPData( bytes.get() + headerlen + 1, ( offset + 4 + headerlen + 1 ) );
+                    if ( headerlen < data_length )
+                        EnumerateXMPData( pcData + headerlen + 1, data_length - headerlen - 1, ( offset + 4 + headerlen + 1 ) );
                 }
             }
     
@@ -2180,7 +2599,7 @@ private:
     {
         RIFFChunk chunk;
         __int64 offset = 12;
-        __int64 length = g_pStream->Length();
+        __int64 length = pStream->Length();
     
         while ( offset < length )
         {
@@ -2195,27 +2614,27 @@ private:
                 memcpy( &height, vp8x.heightm1, 3 );
                 width++;
                 height++;
-                g_ImageWidth = width;
-                g_ImageHeight = height;
+                md.ImageWidth = width;
+                md.ImageHeight = height;
             }
             else if ( !strncmp( & chunk.CC[0], "VP8 ", 4 ) )
             {
                 struct WebPVP8 vp8;
                 GetBytes( offset + 8, &vp8, sizeof( vp8 ) );
-                g_ImageWidth = vp8.width;
-                g_ImageHeight = vp8.height;
+                md.ImageWidth = vp8.width;
+                md.ImageHeight = vp8.height;
             }
             else if ( !strncmp( & chunk.CC[0], "VP8L ", 4 ) )
             {
                 struct WebPVP8L vp8l;
                 GetBytes( offset + 8, &vp8l, sizeof( vp8l ) );
-                g_ImageWidth = 1 + ( vp8l.metadata & 0x3fff );
-                g_ImageHeight = 1 + ( ( vp8l.metadata >> 14 ) & 0x3fff );
+                md.ImageWidth = 1 + ( vp8l.metadata & 0x3fff );
+                md.ImageHeight = 1 + ( ( vp8l.metadata >> 14 ) & 0x3fff );
             }
             else if ( !strncmp( & chunk.CC[0], "EXIF", 4 ) )
             {
-                g_WebP_Exif_Offset = offset + 8;
-                g_WebP_Exif_Length = chunk.size;
+                md.WebP_Exif_Offset = offset + 8;
+                md.WebP_Exif_Length = chunk.size;
             }
             else if ( !strncmp( & chunk.CC[0], "ANIM", 4 ) )
             {
@@ -2265,9 +2684,9 @@ private:
     
         do
         {
-            bool seekOK = g_pStream->Seek( offset );
+            bool seekOK = pStream->Seek( offset );
     
-            if ( !seekOK || g_pStream->AtEOF() )
+            if ( !seekOK || pStream->AtEOF() )
                 return;
 
             SLenType lenType;
@@ -2293,13 +2712,13 @@ private:
             {
                 if ( embedded )
                 {
-                    g_Embedded_Image_Width = GetDWORD( (__int64) offset + 8, false );
-                    g_Embedded_Image_Height = GetDWORD( (__int64) offset + 12, false );
+                    md.Embedded_Image_Width = GetDWORD( (__int64) offset + 8, false );
+                    md.Embedded_Image_Height = GetDWORD( (__int64) offset + 12, false );
                 }
                 else
                 {
-                    g_ImageWidth = GetDWORD( (__int64) offset + 8, false );
-                    g_ImageHeight = GetDWORD( (__int64) offset + 12, false );
+                    md.ImageWidth = GetDWORD( (__int64) offset + 8, false );
+                    md.ImageHeight = GetDWORD( (__int64) offset + 12, false );
                 }
 
                 // BUGMAGNET: ALERT
@@ -2316,9 +2735,9 @@ private:
     
     void ParseBMP( bool embedded = false )
     {
-        __int64 len = g_pStream->Length();
+        __int64 len = pStream->Length();
 
-        if ( len < ( sizeof BITMAPFILEHEADER + sizeof BITMAPINFOHEADER ) )
+        if ( len < ( sizeof( BITMAPFILEHEADER ) + sizeof( BITMAPINFOHEADER ) ) )
             return;
 
         BITMAPFILEHEADER bfh;
@@ -2331,13 +2750,13 @@ private:
 
         if ( embedded )
         {
-            g_Embedded_Image_Width = bih.bV5Width;
-            g_Embedded_Image_Height = bih.bV5Height;
+            md.Embedded_Image_Width = bih.bV5Width;
+            md.Embedded_Image_Height = bih.bV5Height;
         }
         else
         {
-            g_ImageWidth = bih.bV5Width;
-            g_ImageHeight = bih.bV5Height;
+            md.ImageWidth = bih.bV5Width;
+            md.ImageHeight = bih.bV5Height;
         }
     } //ParseBMP
 
@@ -2377,15 +2796,15 @@ private:
     {
         #pragma pack(push, 1)
     
-        __int64 len = g_pStream->Length();
+        __int64 len = pStream->Length();
         if ( len < 128 )
             return;
     
         struct ID3v2Header
         {
             char id[ 3 ];
-            byte ver[ 2 ];
-            byte flags;
+            BYTE ver[ 2 ];
+            BYTE flags;
             DWORD size;
         };
     
@@ -2415,7 +2834,7 @@ private:
         struct ID3v22FrameHeader
         {
             char id[3];
-            byte size[3];
+            BYTE size[3];
         };
     
         while ( frameOffset < ( start.size + firstFrameOffset ) )
@@ -2486,11 +2905,11 @@ private:
                 // Every MP3 in my collection had far less than 100 bytes of data prior to the image itself.
                 // I'm using 200 in case there are really odd MP3s out there
 
-                byte apicdata[ 200 ];
+                BYTE apicdata[ 200 ];
                 GetBytes( o, &apicdata, sizeof apicdata );
 
                 int datao = 0;
-                byte encoding = apicdata[ datao++ ];
+                BYTE encoding = apicdata[ datao++ ];
     
                 if ( 0 != encoding && 1 != encoding && 3 != encoding )
                 {
@@ -2556,7 +2975,7 @@ private:
                    return;
                }
 
-                byte pictureType = apicdata[ datao++ ];
+                BYTE pictureType = apicdata[ datao++ ];
     
                 i = 0;
                 bool foundEndOfString = false;
@@ -2616,7 +3035,7 @@ private:
     
                     // Sometimes there are multiple embedded images. Use the first with a reasonable size.
     
-                    if ( 0 == g_Embedded_Image_Offset && 0 == g_Embedded_Image_Length )
+                    if ( 0 == md.Embedded_Image_Offset && 0 == md.Embedded_Image_Length )
                     {
                         if ( imageSize > 1000 )
                         {
@@ -2624,8 +3043,9 @@ private:
     
                             if ( isAnImage )
                             {
-                                g_Embedded_Image_Offset = o;
-                                g_Embedded_Image_Length = imageSize;
+                                md.Embedded_Image_Offset = o;
+                                md.Embedded_Image_Length = imageSize;
+                                AddEmbeddedImage( o, imageSize );
 
                                 // Return from here; no need to continue iterating MP3 tags
 
@@ -2651,7 +3071,7 @@ private:
     
             frameOffset += ( frameHeaderSize + frameHeader.size );
     
-            if ( frameOffset >= g_pStream->Length() )
+            if ( frameOffset >= pStream->Length() )
             {
                 tracer.Trace( "invalid MP3 frame offset is beyond the end of the file %#I64x\n", frameOffset );
                 break;
@@ -2682,15 +3102,154 @@ private:
         return pwcPath + len;
     } //FindExtension
 
-    void EnumerateImageData( HANDLE hFile, const WCHAR * pwc )
+    void SetFormat( int f )
     {
-        g_pStream = new CStream( hFile );
-        unique_ptr<CStream> stream( g_pStream );
-    
-        if ( !g_pStream->Ok() )
+        // the outer file decides; an embedded JPG in a RAW or MP3 file doesn't change it
+
+        if ( FormatUnknown == fileFormat )
+            fileFormat = f;
+    } //SetFormat
+
+    void AddEmbeddedImage( __int64 offset, __int64 length )
+    {
+        // Called for every candidate, including ones smaller than what's in md.Embedded_Image_*.
+        // They're measured at the end of the parse.
+
+        if ( !recordPreviews || offset <= 0 || length <= 0 )
+            return;
+
+        for ( int i = 0; i < md.Embedded_Image_Count; i++ )
         {
-            g_pStream = NULL;
+            ImageMetadata::EmbeddedImage & ei = md.Embedded_Images[ i ];
+
+            if ( offset == ei.offset )
+            {
+                ei.length = __max( ei.length, length );
+                return;
+            }
+        }
+
+        if ( md.Embedded_Image_Count >= ImageMetadata::MaxEmbeddedImages )
             return;
+
+        ImageMetadata::EmbeddedImage & ei = md.Embedded_Images[ md.Embedded_Image_Count++ ];
+        ei.offset = offset;
+        ei.length = length;
+        ei.width = 0;
+        ei.height = 0;
+        ei.codec = ImageMetadata::EmbeddedCodecUnknown;
+    } //AddEmbeddedImage
+
+    void SetTIFFFormat( WCHAR const * pwcExt )
+    {
+        // CR2, NEF, ARW, DNG, and many other RAW formats are TIFF files underneath
+
+        if ( !_wcsicmp( pwcExt, L".cr2" ) )
+            SetFormat( FormatCR2 );
+        else if ( !_wcsicmp( pwcExt, L".nef" ) )
+            SetFormat( FormatNEF );
+        else if ( !_wcsicmp( pwcExt, L".arw" ) )
+            SetFormat( FormatARW );
+        else if ( !_wcsicmp( pwcExt, L".dng" ) )
+            SetFormat( FormatDNG );
+        else
+            SetFormat( FormatTIFF );
+    } //SetTIFFFormat
+
+public:
+    static const int FormatUnknown = 0;
+    static const int FormatJPG = 1;
+    static const int FormatTIFF = 2;   // TIFF and TIFF-based RAW formats not listed separately
+    static const int FormatCR2 = 3;
+    static const int FormatCR3 = 4;
+    static const int FormatNEF = 5;
+    static const int FormatARW = 6;
+    static const int FormatDNG = 7;
+    static const int FormatORF = 8;
+    static const int FormatRW2 = 9;
+    static const int FormatRAF = 10;
+    static const int FormatPNG = 11;
+    static const int FormatBMP = 12;
+    static const int FormatWebP = 13;
+    static const int FormatHEIC = 14;
+    static const int FormatFLAC = 15;
+    static const int FormatMP3 = 16;
+    static const int FormatCount = 17;
+
+    static const char * FormatName( int f )
+    {
+        static const char * names[ FormatCount ] = { "unknown", "JPG", "TIFF", "CR2", "CR3", "NEF", "ARW", "DNG", "ORF", "RW2",
+                                                     "RAF", "PNG", "BMP", "WebP", "HEIC", "FLAC", "MP3" };
+
+        return ( f >= 0 && f < FormatCount ) ? names[ f ] : names[ FormatUnknown ];
+    } //FormatName
+
+    CImageParser( ImageMetadata & metadata, const WCHAR * pwcFile, bool mapFile = false, DWORD fieldMask = ImageMetadata::FieldAll ) :
+        md( metadata ), pStream( NULL ), pwcPath( pwcFile ), mapFiles( mapFile ), fields( fieldMask ), fileFormat( FormatUnknown ), recordPreviews( true ),
+        pSeed( NULL ), seedBytes( 0 ), seedEndsFile( false ), seedFile( CStream::InvalidHandle() )
+    {
+        memset( &stats, 0, sizeof stats );
+    }
+
+    // Bytes from the start of the file that were already read, e.g. by CHeaderPrefetch, and the file they were
+    // read from if it's still open, so the parse doesn't open it again. Both must stay valid until EnumerateImageData returns.
+
+    void SeedHeader( const BYTE * pData, ULONG bytes, bool endsFile, CStream::FileHandle file = CStream::InvalidHandle() )
+    {
+        pSeed = pData;
+        seedBytes = bytes;
+        seedEndsFile = endsFile;
+        seedFile = file;
+    } //SeedHeader
+
+    const StreamStats & Stats() { return stats; }
+    int Format() { return fileFormat; }
+
+    int MeasureEmbeddedImage( const WCHAR * pwc, __int64 offset, __int64 length, unique_ptr<CStream> & stream )
+    {
+        // Set md.Embedded_Image_Width and Height from the image's header and return its EmbeddedCodec* value
+
+        CStream * embeddedImage = PrepareStream( new CStream( pwc, offset, length ) );
+        unsigned long long head = 0;
+        embeddedImage->Read( &head, sizeof head );
+        stream.reset( embeddedImage );
+        pStream = embeddedImage;
+
+        // At this point, we just want the width and height of the embedded JPG/PNG
+
+        if ( IsPerhapsJPG( head ) )
+        {
+            ParseOldJpg( true );
+            return ImageMetadata::EmbeddedCodecJPG;
+        }
+
+        if ( IsPerhapsPNG( head ) )
+        {
+            ParsePNG( true );
+            return ImageMetadata::EmbeddedCodecPNG;
+        }
+
+        if ( IsPerhapsBMP( head ) )
+        {
+            ParseBMP( true );
+            return ImageMetadata::EmbeddedCodecBMP;
+        }
+
+        tracer.Trace( "skipping embedded image with unexpected header %#llx in %ws\n", head, pwc );
+        return ImageMetadata::EmbeddedCodecUnknown;
+    } //MeasureEmbeddedImage
+
+    // Returns false if the file can't be opened. Files that open but can't be parsed just leave md mostly empty.
+
+    bool EnumerateImageData( const WCHAR * pwc )
+    {
+        pStream = PrepareStream( ( CStream::InvalidHandle() != seedFile ) ? new CStream( seedFile ) : new CStream( pwc ) );
+        unique_ptr<CStream> stream( pStream );
+    
+        if ( !pStream->Ok() )
+        {
+            pStream = NULL;
+            return false;
         }
 
         bool isOuterFileJPG = false;
@@ -2700,99 +3259,105 @@ private:
         if ( !_wcsicmp( pwcExt, L".heic" ) ||          // Apple iOS photos
                   !_wcsicmp( pwcExt, L".hif" ) )            // Canon HEIF photos
         {
-            // enumeration of the heif file is just to find the EXIF data offset, reflected in the g_Heif_Exif_* variables
+            // enumeration of the heif file is just to find the EXIF data offset, reflected in the md.Heif_Exif_* variables
     
-            EnumerateHeif( g_pStream );
+            SetFormat( FormatHEIC );
+            EnumerateHeif( pStream );
     
-            if ( 0 == g_Heif_Exif_Offset )
+            if ( 0 == md.Heif_Exif_Offset )
             {
-                g_pStream = NULL;
-                return;
+                pStream = NULL;
+                return true;
             }
     
-            DWORD o = GetDWORD( g_Heif_Exif_Offset, false );
+            DWORD o = GetDWORD( md.Heif_Exif_Offset, false );
     
-            heifOffsetBase = o + g_Heif_Exif_Offset + 4;
-            bool seekOK = g_pStream->Seek( heifOffsetBase );
+            heifOffsetBase = o + md.Heif_Exif_Offset + 4;
+            bool seekOK = pStream->Seek( heifOffsetBase );
 
             if ( !seekOK )
             {
                 tracer.Trace( "heif offset base looks wrong\n" );
-                g_pStream = NULL;
-                return;
+                pStream = NULL;
+                return true;
             }
         }
         else if ( !_wcsicmp( pwcExt, L".cr3" ) )        // Canon's newer RAW format
         {
-            // enumeration of the heif file is just to find the EXIF data offset, reflected in the g_Canon_CR3_* variables
+            // enumeration of the heif file is just to find the EXIF data offset, reflected in the md.Canon_CR3_* variables
             // Heif and CR3 use ISO Base Media File Format ISO/IEC 14496-12
     
-            EnumerateHeif( g_pStream );
+            SetFormat( FormatCR3 );
+            EnumerateHeif( pStream );
     
-            if ( 0 == g_Canon_CR3_Exif_IFD0 )
+            if ( 0 == md.Canon_CR3_Exif_IFD0 )
             {
-                g_pStream = NULL;
-                return;
+                pStream = NULL;
+                return true;
             }
     
-            heifOffsetBase = g_Canon_CR3_Exif_IFD0;
-            bool seekOK = g_pStream->Seek( heifOffsetBase );
+            heifOffsetBase = md.Canon_CR3_Exif_IFD0;
+            bool seekOK = pStream->Seek( heifOffsetBase );
 
             if ( !seekOK )
             {
                 tracer.Trace( "heif-CR3 offset base looks wrong\n" );
-                g_pStream = NULL;
-                return;
+                pStream = NULL;
+                return true;
             }
         }
     
         DWORD header = 0;
-        ULONG bytesread = g_pStream->Read( &header, sizeof header );
+        ULONG bytesread = pStream->Read( &header, sizeof header );
         if ( 0 == bytesread )
         {
             tracer.Trace( "can't read from the file\n" );
-            g_pStream = NULL;
-            return;
+            pStream = NULL;
+            return true;
         }
     
         bool parsingEmbeddedImage = false;
 
         if ( 0x43614c66 == header )
         {
+            SetFormat( FormatFLAC );
             EnumerateFlac();
 
-            if ( 0 != g_Embedded_Image_Offset && 0 != g_Embedded_Image_Length )
+            if ( 0 != md.Embedded_Image_Offset && 0 != md.Embedded_Image_Length )
             {
-                CStream * embeddedImage = new CStream( pwc, g_Embedded_Image_Offset, g_Embedded_Image_Length );
+                CStream * embeddedImage = PrepareStream( new CStream( pwc, md.Embedded_Image_Offset, md.Embedded_Image_Length ) );
     
                 embeddedImage->Read( &header, sizeof header );
                 stream.reset( embeddedImage );
-                g_pStream = embeddedImage;
+                pStream = embeddedImage;
                 parsingEmbeddedImage = true; 
+                recordPreviews = false;
             }
             else
             {
-                g_pStream = NULL;
-                return;
+                pStream = NULL;
+                return true;
             }
         }
         else if ( 0x03334449 == header || 0x02334449 == header || 0x04334449 == header || 0x90fbff == ( header & 0xffffff ) )
         {
+            SetFormat( FormatMP3 );
             ParseMP3();
     
-            if ( 0 != g_Embedded_Image_Offset && 0 != g_Embedded_Image_Length )
+            if ( 0 != md.Embedded_Image_Offset && 0 != md.Embedded_Image_Length )
             {
-                CStream * embeddedImage = new CStream( pwc, g_Embedded_Image_Offset, g_Embedded_Image_Length );
+                CStream * embeddedImage = PrepareStream( new CStream( pwc, md.Embedded_Image_Offset, md.Embedded_Image_Length ) );
     
                 embeddedImage->Read( &header, sizeof header );
                 stream.reset( embeddedImage );
-                g_pStream = embeddedImage;
+                pStream = embeddedImage;
                 parsingEmbeddedImage = true; 
+                recordPreviews = false;
             }
             else
             {
-                g_pStream = NULL;
-                return;
+                pStream = NULL;
+                return true;
             }
         }
     
@@ -2806,8 +3371,8 @@ private:
              ( 0x4d42     != ( header & 0xffff ) ) &&   // BMP
              ( 0x46464952 != header ) )                 // RIFF WebP
         {
-            g_pStream = NULL;
-            return;
+            pStream = NULL;
+            return true;
         }
     
         bool littleEndian = true;
@@ -2820,15 +3385,16 @@ private:
             DWORD format = GetDWORD( 8, true );
             if ( 0x50424557 != format ) // WEBP
             {
-                g_pStream = NULL;
-                return;
+                pStream = NULL;
+                return true;
             }
 
+            SetFormat( FormatWebP );
             EnumerateWebP();
-            if ( 0 == g_WebP_Exif_Offset )
-                return;
+            if ( 0 == md.WebP_Exif_Offset )
+                return true;
 
-            headerBase = g_WebP_Exif_Offset + 6; // headerBase should point at the first endian byte (e.g. 0x49)
+            headerBase = md.WebP_Exif_Offset + 6; // headerBase should point at the first endian byte (e.g. 0x49)
             startingOffset = headerBase + 4; // the first dword to read with the idf offset is 4 beyond that
         }
         else if ( 0x474e5089 == header ) // PNG
@@ -2837,20 +3403,22 @@ private:
     
             if ( 0x0d0a1a0a != nextFour )
             {
-                g_pStream = NULL;
-                return;
+                pStream = NULL;
+                return true;
             }
     
+            SetFormat( FormatPNG );
             ParsePNG();
 
-            g_pStream = NULL;
-            return;
+            pStream = NULL;
+            return true;
         }
         else if ( 0x4d42 == ( header & 0xffff ) )
         {
+            SetFormat( FormatBMP );
             ParseBMP();
-            g_pStream = NULL;
-            return;
+            pStream = NULL;
+            return true;
         }
         else if ( 0xd8ff == ( header & 0xffff ) ) 
         {
@@ -2859,12 +3427,14 @@ private:
             if ( !parsingEmbeddedImage )
                 isOuterFileJPG = true;
 
+            SetFormat( FormatJPG );
+
             int exifMaybe = ParseOldJpg();
 
             if ( 0 == exifMaybe )
             {
-                g_pStream = NULL;
-                return;
+                pStream = NULL;
+                return true;
             }
     
             int saveMaybe = exifMaybe;
@@ -2896,18 +3466,21 @@ private:
             // RAF files aren't like TIFF files. They have their own format which isn't documented and this app can't parse.
             // But RAF files have an embedded JPG with full properties, so show those.
             // https://libopenraw.freedesktop.org/formats/raf/
+
             // Also, the rating in the xmp data of the embedded JPG is what Lightroom uses when importing a RAF file.
             // Any rating stored elsewhere in native RAF format is ignored by this code since Lightroom honors the
             // more simple and documented version.
     
+            SetFormat( FormatRAF );
+
             DWORD jpgOffset = GetDWORD( 84, false );
             DWORD jpgLength = GetDWORD( 88, false );
             DWORD jpgSig = GetDWORD( jpgOffset, true );
     
             if ( 0xd8ff != ( jpgSig & 0xffff ) )
             {
-                g_pStream = NULL;
-                return;
+                pStream = NULL;
+                return true;
             }
     
             int exifMaybe = ParseOldJpg( false, jpgOffset );
@@ -2916,16 +3489,17 @@ private:
     
             if ( 0x002a4949 != exifSig )
             {
-                g_pStream = NULL;
-                return;
+                pStream = NULL;
+                return true;
             }
     
             header = exifSig;
             headerBase = jpgOffset + exifHeaderOffset;
             startingOffset = headerBase + 4;
     
-            g_Embedded_Image_Offset = jpgOffset;
-            g_Embedded_Image_Length = jpgLength;
+            md.Embedded_Image_Offset = jpgOffset;
+            md.Embedded_Image_Length = jpgLength;
+            AddEmbeddedImage( jpgOffset, jpgLength );
             parsingEmbeddedImage = true;
         }
         else if ( 0x2a004d4d == header )
@@ -2949,6 +3523,13 @@ private:
             }
         }
         
+        if ( 0x4f524949 == header )
+            SetFormat( FormatORF );
+        else if ( 0x00554949 == header )
+            SetFormat( FormatRW2 );
+        else
+            SetTIFFFormat( pwcExt );
+
         if ( 0x4d4d == ( header & 0xffff ) ) // NEF
             littleEndian = false;
     
@@ -2956,16 +3537,18 @@ private:
     
         EnumerateIFD0( IFDOffset, headerBase, littleEndian, pwcExt );
     
-        if ( ( 0 != g_Embedded_Image_Offset ) && ( 0 != g_Embedded_Image_Length ) && !_wcsicmp( pwcExt, L".rw2" )  )
+        if ( ( 0 != md.Embedded_Image_Offset ) && ( 0 != md.Embedded_Image_Length ) && !_wcsicmp( pwcExt, L".rw2" ) &&
+             Wants( ImageMetadata::FieldCamera | ImageMetadata::FieldLens ) )
         {
             // Panasonic raw files sometimes have embedded JPGs with metadata not in the actual RW2 file.
             // Specifically, Serial Number, Lens Model, and Lens Serial Number can only be retrieved in this way.
     
-            g_pStream = new CStream( pwc, g_Embedded_Image_Offset, g_Embedded_Image_Length );
-            stream.reset( g_pStream );
+            pStream = PrepareStream( new CStream( pwc, md.Embedded_Image_Offset, md.Embedded_Image_Length ) );
+            stream.reset( pStream );
+            recordPreviews = false;
     
-            if ( !g_pStream->Ok() )
-                return;
+            if ( !pStream->Ok() )
+                return true;
     
             int exifMaybe = ParseOldJpg( true );
             if ( 0 != exifMaybe )
@@ -3000,64 +3583,100 @@ private:
             }
         }
 
-        if ( 0 != g_Canon_CR3_Exif_Exif_IFD )
+        if ( 0 != md.Canon_CR3_Exif_Exif_IFD && !Resolved() )
         {
-            WORD endian = GetWORD( g_Canon_CR3_Exif_Exif_IFD, littleEndian );
+            WORD endian = GetWORD( md.Canon_CR3_Exif_Exif_IFD, littleEndian );
     
-            EnumerateExifTags( 8, g_Canon_CR3_Exif_Exif_IFD, ( 0x4949 == endian ) );
+            EnumerateExifTags( 8, md.Canon_CR3_Exif_Exif_IFD, ( 0x4949 == endian ) );
         }
     
-        if ( 0 != g_Canon_CR3_Exif_Makernotes_IFD )
+        if ( 0 != md.Canon_CR3_Exif_Makernotes_IFD && WantsMakernotes() )
         {
-            WORD endian = GetWORD( g_Canon_CR3_Exif_Makernotes_IFD, littleEndian );
+            WORD endian = GetWORD( md.Canon_CR3_Exif_Makernotes_IFD, littleEndian );
     
-            EnumerateMakernotes( 8, g_Canon_CR3_Exif_Makernotes_IFD, ( 0x4949 == endian ) );
+            EnumerateMakernotes( 8, md.Canon_CR3_Exif_Makernotes_IFD, ( 0x4949 == endian ) );
         }
     
-        if ( 0 != g_Canon_CR3_Exif_GPS_IFD  )
+        if ( 0 != md.Canon_CR3_Exif_GPS_IFD && Wants( ImageMetadata::FieldGPS ) )
         {
-            WORD endian = GetWORD( g_Canon_CR3_Exif_GPS_IFD, littleEndian );
+            WORD endian = GetWORD( md.Canon_CR3_Exif_GPS_IFD, littleEndian );
     
-            EnumerateGPSTags( 8, g_Canon_CR3_Exif_GPS_IFD, ( 0x4949 == endian ) );
+            EnumerateGPSTags( 8, md.Canon_CR3_Exif_GPS_IFD, ( 0x4949 == endian ) );
         }
 
         // If there is an embedded file, load and treat it as if it's the main image.
         // Sometimes JPGs have embedded smaller JPGs. Ignore them.
 
-        if ( !isOuterFileJPG && 0 != g_Embedded_Image_Offset && 0 != g_Embedded_Image_Length )
+        if ( !isOuterFileJPG && 0 != md.Embedded_Image_Offset && 0 != md.Embedded_Image_Length && Wants( ImageMetadata::FieldEmbeddedImage ) )
         {
+            recordPreviews = true;
+            AddEmbeddedImage( md.Embedded_Image_Offset, md.Embedded_Image_Length );
+
             if ( parsingEmbeddedImage )
             {
-                g_Embedded_Image_Width = g_ImageWidth;
-                g_Embedded_Image_Height = g_ImageHeight;
+                md.Embedded_Image_Width = md.ImageWidth;
+                md.Embedded_Image_Height = md.ImageHeight;
+
+                for ( int i = 0; i < md.Embedded_Image_Count; i++ )
+                {
+                    ImageMetadata::EmbeddedImage & ei = md.Embedded_Images[ i ];
+
+                    if ( md.Embedded_Image_Offset == ei.offset )
+                    {
+                        ei.width = md.ImageWidth;
+                        ei.height = md.ImageHeight;
+                        ei.codec = ImageMetadata::EmbeddedCodecJPG;
+                    }
+                }
             }
             else
             {
-                CStream * embeddedImage = new CStream( pwc, g_Embedded_Image_Offset, g_Embedded_Image_Length );
-                unsigned long long head;
-                embeddedImage->Read( &head, sizeof head );
-                stream.reset( embeddedImage );
-                g_pStream = embeddedImage;
+                // Measure the chosen image as before, XMP and all, then just the dimensions of the others
 
-                // At this point, we just want the width and height of the embedded JPG/PNG
+                int codec = MeasureEmbeddedImage( pwc, md.Embedded_Image_Offset, md.Embedded_Image_Length, stream );
+                int width = md.Embedded_Image_Width;
+                int height = md.Embedded_Image_Height;
+                DWORD savedFields = fields;
+                fields = ImageMetadata::FieldEmbeddedImage;
 
-                if ( IsPerhapsJPG( head ) )
-                    ParseOldJpg( true );
-                else if ( IsPerhapsPNG( head ) )
-                    ParsePNG( true );
-                else if ( IsPerhapsBMP( head ) )
-                    ParseBMP( true );
-                else
-                    tracer.Trace( "skipping embedded image with unexpected header %#llx in %ws\n", head, pwc );
+                for ( int i = 0; i < md.Embedded_Image_Count; i++ )
+                {
+                    ImageMetadata::EmbeddedImage & ei = md.Embedded_Images[ i ];
+
+                    if ( md.Embedded_Image_Offset == ei.offset )
+                    {
+                        ei.width = width;
+                        ei.height = height;
+                        ei.codec = codec;
+                    }
+                    else
+                    {
+                        md.Embedded_Image_Width = 0;
+                        md.Embedded_Image_Height = 0;
+                        ei.codec = MeasureEmbeddedImage( pwc, ei.offset, ei.length, stream );
+                        ei.width = md.Embedded_Image_Width;
+                        ei.height = md.Embedded_Image_Height;
+                    }
+                }
+
+                fields = savedFields;
+                md.Embedded_Image_Width = width;
+                md.Embedded_Image_Height = height;
 
                 //tracer.Trace( "embedded width %d, embedded height %d, full width %d, full height %d\n",
-                //              g_Embedded_Image_Width, g_Embedded_Image_Height, g_ImageWidth, g_ImageHeight );
+                //              md.Embedded_Image_Width, md.Embedded_Image_Height, md.ImageWidth, md.ImageHeight );
             }
         }
 
-        g_pStream = NULL;
+        pStream = NULL;
+        return true;
     } //EnumerateImageData
     
+}; //CImageParser
+
+class CImageData
+{
+private:
     const char * ExifExposureMode( DWORD x )
     {
         if ( 0 == x )
@@ -3094,121 +3713,197 @@ private:
         return "unknown";
     } //ExifExposureProgram
     
-    void InitializeGlobals()
-    {
-        g_pStream = NULL;
-        g_Heif_Exif_ItemID = 0xffffffff;
-        g_Heif_Exif_Offset = 0;
-        g_Heif_Exif_Length = 0;
-        g_Canon_CR3_Exif_IFD0 = 0;
-        g_Canon_CR3_Exif_Exif_IFD = 0;
-        g_Canon_CR3_Exif_Makernotes_IFD = 0;
-        g_Canon_CR3_Exif_GPS_IFD = 0;
-        g_Canon_CR3_Embedded_JPG_Length = 0;
-    
-        g_Embedded_Image_Offset = 0;
-        g_Embedded_Image_Length = 0;
-        g_Embedded_Image_Width = 0;
-        g_Embedded_Image_Height = 0;
-
-        g_Orientation_Value = -1;
-        g_Orientation_Offset = 0;
-        g_Orientation_Type = 0;
-        g_Orientation_Value2 = -1;
-        g_Orientation_Offset2 = 0;
-        g_Orientation_Type2 = 0;
-        g_Orientation_LittleEndian = false;
-    
-        g_acDateTimeOriginal[ 0 ] = 0;
-        g_acDateTime[ 0 ] = 0;
-        g_ImageWidth = -1;
-        g_ImageHeight = -1;
-        g_ISO = -1;
-        g_ExposureNum = -1;
-        g_ExposureDen = -1;
-        g_FNumberNum = -1;
-        g_FNumberDen = -1;
-        g_ApertureNum = -1;
-        g_ApertureDen = -1;
-        g_ExposureProgram = -1;
-        g_ExposureMode = -1;
-        g_FocalLengthNum = -1;
-        g_FocalLengthDen = -1;
-        g_FocalLengthIn35mmFilm = -1;
-        g_ComputedSensorWidth = -1;
-        g_ComputedSensorHeight = -1;
-        g_Longitude = InvalidCoordinate;
-        g_Latitude = InvalidCoordinate;
-        g_acLensMake[ 0 ] = 0;
-        g_acLensModel[ 0 ] = 0;
-        g_acLensSerialNumber[ 0 ] = 0;
-        g_acMake[ 0 ] = 0;
-        g_acModel[ 0 ] = 0;
-        g_acSerialNumber[ 0 ] = 0;
-        g_holdsAdobeEditsInXMP = false;
-        g_RatingInXMP_Offset = 0; // offset of 1 ascii character in the range of 0-5.
-        g_RatingInXMP = 0;        // integer 0..5 only valid if g_RatingInXMP_Offset isn't 0
-    } //InitializeGlobals
-    
-    void UpdateCache( const WCHAR * pwcPath )
-    {
-        // protect against multiple threads updating Image Data at the same time.
-        // note that this doesn't help if they are opening different files since the globals will be trashed.
-        // apps that need that protection should have separate objects or their own mutex.
+    // One parsed file. Entries are keyed by path and the file's last-write time, so files changed by
+    // other apps miss and are parsed again.
 
-        lock_guard<mutex> lock( g_mtx );
+    struct CachedMetadata
+    {
+        wstring path;
+        ULONGLONG lastWrite;
+        DWORD fields;           // ImageMetadata::Field* bits parsed into md
+        ULONGLONG lastUse;
+        ImageMetadata md;
+    };
+
+    static const size_t MetadataCacheEntries = 32;  // enough for back and forth navigation around the current file
 
-        bool cached = false;
-        HANDLE hFile = INVALID_HANDLE_VALUE;
+    std::mutex g_mtx;
+    vector<CachedMetadata> g_cache; // Only touched while holding g_mtx.
+    ULONGLONG g_cacheClock;
+    bool g_mapFiles;    // parse through memory-mapped views rather than cached reads
+
+    struct FormatIO
+    {
+        ULONGLONG files;
+        StreamStats io;
+    };
+
+    std::mutex g_ioMtx;
+    FormatIO g_io[ CImageParser::FormatCount ]; // Only touched while holding g_ioMtx.
+
+    void RecordIO( int format, const StreamStats & stats )
+    {
+        // Every parse lands here, including ones that failed, since their reads cost the same
+
+        if ( format < 0 || format >= CImageParser::FormatCount )
+            format = CImageParser::FormatUnknown;
 
-#if HANDLE_FILE_CHANGES
-        FILETIME ftCreate, ftAccess, ftWrite;
+        lock_guard<mutex> lock( g_ioMtx );
+
+        g_io[ format ].files++;
+        g_io[ format ].io.Add( stats );
+    } //RecordIO
+
+public:
+    static ULONGLONG LastWriteTime( const WCHAR * pwcPath )
+    {
+        // Read from the directory entry; the file itself isn't opened. 0 if the file can't be found.
+        // Public so callers caching anything else derived from a file can use the same staleness check.
+
+#ifdef _WIN32
+        WIN32_FILE_ATTRIBUTE_DATA data;
+        if ( !GetFileAttributesEx( pwcPath, GetFileExInfoStandard, &data ) )
+            return 0;
+
+        ULARGE_INTEGER uli;
+        uli.LowPart = data.ftLastWriteTime.dwLowDateTime;
+        uli.HighPart = data.ftLastWriteTime.dwHighDateTime;
+        return uli.QuadPart;
+#else
+        char acPath[ MAX_PATH + 1 ];
+        size_t converted = wcstombs( acPath, pwcPath, sizeof( acPath ) );
+        struct stat st;
+
+        if ( (size_t) -1 == converted || converted >= sizeof( acPath ) || 0 != stat( acPath, &st ) )
+            return 0;
+
+        return ( (ULONGLONG) st.st_mtim.tv_sec * 1000000000ull ) + (ULONGLONG) st.st_mtim.tv_nsec;
 #endif
-    
-        if ( !_wcsicmp( pwcPath, g_awcPath ) )
+    } //LastWriteTime
+
+private:
+
+    CachedMetadata * FindCached( const WCHAR * pwcPath )
+    {
+        // g_mtx must be held
+
+        for ( size_t i = 0; i < g_cache.size(); i++ )
+            if ( !_wcsicmp( pwcPath, g_cache[ i ].path.c_str() ) )
+                return & g_cache[ i ];
+
+        return NULL;
+    } //FindCached
+
+    void UpdateCache( const WCHAR * pwcPath, ImageMetadata & md, DWORD fields = ImageMetadata::FieldAll )
+    {
+        // g_mtx protects just the cached records. Parsing happens outside the lock so threads looking
+        // at different files don't serialize behind each other, and each caller gets its own copy of the record.
+
+        ULONGLONG lastWrite = LastWriteTime( pwcPath );
+
         {
-#if HANDLE_FILE_CHANGES
-            hFile = CreateFile( pwcPath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL );
-    
-            if ( INVALID_HANDLE_VALUE == hFile )
+            lock_guard<mutex> lock( g_mtx );
+
+            CachedMetadata * pEntry = FindCached( pwcPath );
+
+            if ( NULL != pEntry && lastWrite == pEntry->lastWrite )
             {
-                InitializeGlobals();
-                return;
+                if ( fields == ( fields & pEntry->fields ) )
+                {
+                    pEntry->lastUse = ++g_cacheClock;
+                    md = pEntry->md;
+                    return;
+                }
+
+                // the same file was parsed for other fields; parse for both so neither caller misses next time
+
+                fields |= pEntry->fields;
             }
-    
-            FILETIME ftCreate, ftAccess, ftWrite;
-            GetFileTime( hFile, &ftCreate, &ftAccess, &ftWrite );
-    
-            if ( !memcmp( &ftWrite, &g_ftWrite, sizeof ftWrite ) )
-#endif
-                cached = true;
         }
-    
-        if ( !cached )
+
+        if ( !ParseMetadata( pwcPath, md, NULL, fields ) )
+            return;
+
+        lock_guard<mutex> lock( g_mtx );
+
+        // another thread may have added this path while the lock was released
+
+        CachedMetadata * pEntry = FindCached( pwcPath );
+
+        if ( NULL == pEntry )
         {
-            InitializeGlobals();
-    
-            if ( INVALID_HANDLE_VALUE == hFile )
-                hFile = CreateFile( pwcPath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL );
-    
-            if ( INVALID_HANDLE_VALUE != hFile )
+            if ( g_cache.size() < MetadataCacheEntries )
+            {
+                g_cache.emplace_back();
+                pEntry = & g_cache.back();
+            }
+            else
             {
-                wcscpy_s( g_awcPath, _countof( g_awcPath ), pwcPath );
+                pEntry = & g_cache[ 0 ];
 
-#if HANDLE_FILE_CHANGES
-                FILETIME ftCreate, ftAccess, ftWrite;
-                GetFileTime( hFile, &ftCreate, &ftAccess, &g_ftWrite );
-#endif
-    
-                EnumerateImageData( hFile, pwcPath );
+                for ( size_t i = 1; i < g_cache.size(); i++ )
+                    if ( g_cache[ i ].lastUse < pEntry->lastUse )
+                        pEntry = & g_cache[ i ];
             }
+
+            pEntry->path = pwcPath;
         }
-    
-        if ( INVALID_HANDLE_VALUE != hFile )
-            CloseHandle( hFile );
 
-        //tracer.Trace( "metadata cached: %d for file %ws\n", cached, pwcPath );
+        pEntry->lastWrite = lastWrite;
+        pEntry->fields = fields;
+        pEntry->lastUse = ++g_cacheClock;
+        pEntry->md = md;
+
+        //tracer.Trace( "metadata cached for file %ws\n", pwcPath );
     } //UpdateCache
+
+    void InvalidateCache( const WCHAR * pwcPath )
+    {
+        lock_guard<mutex> lock( g_mtx );
+
+        CachedMetadata * pEntry = FindCached( pwcPath );
+
+        if ( NULL != pEntry )
+        {
+            pEntry->path.clear();
+            pEntry->lastUse = 0;
+        }
+    } //InvalidateCache
+
+    // After PV writes a file it knows exactly what changed, so the cached record is patched and stamped with
+    // the file's new last-write time rather than dropped and parsed again. Call these after the file is closed.
+
+    void UpdateCachedRating( const WCHAR * pwcPath, char rating )
+    {
+        ULONGLONG lastWrite = LastWriteTime( pwcPath );
+        lock_guard<mutex> lock( g_mtx );
+
+        CachedMetadata * pEntry = FindCached( pwcPath );
+
+        if ( NULL != pEntry )
+        {
+            pEntry->md.RatingInXMP = rating;
+            pEntry->lastWrite = lastWrite;
+        }
+    } //UpdateCachedRating
+
+    void UpdateCachedOrientation( const WCHAR * pwcPath, int orientation, bool updatedSecond )
+    {
+        ULONGLONG lastWrite = LastWriteTime( pwcPath );
+        lock_guard<mutex> lock( g_mtx );
+
+        CachedMetadata * pEntry = FindCached( pwcPath );
+
+        if ( NULL != pEntry )
+        {
+            pEntry->md.Orientation_Value = orientation;
+
+            if ( updatedSecond )
+                pEntry->md.Orientation_Value2 = orientation;
+
+            pEntry->lastWrite = lastWrite;
+        }
+    } //UpdateCachedOrientation
     
     bool SubstantiallyDifferentResolution( int a, int b )
     {
@@ -3243,24 +3938,23 @@ private:
         return ( DBL_MAX != x && 0.0 != x );
     } //validFLVal
     
-    double GetComputedCropFactor()
+    double GetComputedCropFactor( const ImageMetadata & md )
     {
         double diagonalFF = sqrt( sqr( 36.0 ) + sqr( 24.0 ) );
     
-        if ( -1 != g_ComputedSensorWidth && 0 != g_ComputedSensorWidth && -1 != g_ComputedSensorHeight && 0 != g_ComputedSensorHeight )
+        if ( -1 != md.ComputedSensorWidth && 0 != md.ComputedSensorWidth && -1 != md.ComputedSensorHeight && 0 != md.ComputedSensorHeight )
         {
-            double diagonal = sqrt( sqr( g_ComputedSensorWidth ) + sqr( g_ComputedSensorHeight ) );
+            double diagonal = sqrt( sqr( md.ComputedSensorWidth ) + sqr( md.ComputedSensorHeight ) );
             return diagonalFF / diagonal;
         }
     
         return DBL_MAX;
     } //GetComputedCropFactor
 
-    const char * FindAspectRatio( int w, int h )
+    const char * FindAspectRatio( int w, int h, char * acAspect, int aspectLen )
     {
         // find the closest matching whole integer aspect ratio 1x20 to 20x1
 
-        static char acAspect[ 20 ];
         acAspect[ 0 ] = 0;
 
         if ( 0 == w || 0 == h )
@@ -3290,41 +3984,128 @@ private:
         }
 
         if ( bestdiff < 0.01 )
-            sprintf_s( acAspect, _countof( acAspect ), " (%dx%d)", bestw, besth );
+            sprintf_s( acAspect, aspectLen, " (%dx%d)", bestw, besth );
 
         return acAspect;
     } //FindAspectRatio
     
 public:
 
+    bool ParseMetadata( const WCHAR * pwcPath, ImageMetadata & md, StreamStats * pStats = NULL, DWORD fields = ImageMetadata::FieldAll )
+    {
+        // Parse the file into md without touching the cache or any other state in this object,
+        // so it's safe to call from any number of threads at once. pStats optionally gets the I/O counts.
+        // fields is a mask of ImageMetadata::Field* values; asking for less reads less of the file.
+
+        md.Initialize();
+
+        CImageParser parser( md, pwcPath, g_mapFiles, fields );
+        bool ok = parser.EnumerateImageData( pwcPath );
+        const StreamStats & stats = parser.Stats();
+        RecordIO( parser.Format(), stats );
+
+        if ( !ok )
+            return false;
+
+        tracer.Trace( "parse made %llu opens, %llu reads with %llu ReadFile and %llu SetFilePointerEx calls (%llu reads saved) in %.3f ms: %ws\n",
+                      stats.opens, stats.reads, stats.fileReads, stats.fileSeeks, stats.ReadsSaved(), (double) stats.ioNanoseconds / 1000000.0, pwcPath );
+
+        if ( NULL != pStats )
+            *pStats = stats;
+
+        return true;
+    } //ParseMetadata
+
+    // Parse many files, opening them and reading their headers ahead of the parsers with up to depth reads in flight
+    // rather than one open and read per parsing thread. That pays off where each open is slow, as on network shares.
+    // onParsed( index, ok, md, stats ) is called on the parsing threads as each file finishes, roughly in order.
+    // threads == 0 means one per core. Returns the number of files parsed.
+
+    template <class T> size_t ParseMetadataBatch( const WCHAR * const * ppwcPaths, size_t count, T onParsed,
+                                                   DWORD fields = ImageMetadata::FieldAll, unsigned threads = 0, unsigned depth = 32 )
+    {
+        if ( 0 == threads )
+            threads = __max( 1u, thread::hardware_concurrency() );
+
+        threads = (unsigned) __min( (size_t) threads, __max( (size_t) 1, count ) );
+
+        // parsers wait on headers in order, so the read-ahead window must cover every parser
+
+        CHeaderPrefetch prefetch( ppwcPaths, count, __max( depth, threads ) );
+        std::atomic<size_t> next( 0 );
+        std::atomic<size_t> parsed( 0 );
+
+        auto worker = [&] ()
+        {
+            for ( size_t i = next++; i < count; i = next++ )
+            {
+                const BYTE * pHeader = NULL;
+                bool endsFile = false;
+                CStream::FileHandle file;
+                ULONG headerBytes = prefetch.Wait( i, &pHeader, endsFile, file );
+
+                ImageMetadata md;
+                CImageParser parser( md, ppwcPaths[ i ], g_mapFiles, fields );
+                parser.SeedHeader( pHeader, headerBytes, endsFile, file );
+                bool ok = parser.EnumerateImageData( ppwcPaths[ i ] );
+                prefetch.Release( i );
+                RecordIO( parser.Format(), parser.Stats() );
+
+                if ( ok )
+                    parsed++;
+
+                onParsed( i, ok, md, parser.Stats() );
+            }
+        };
+
+        vector<thread> pool;
+        for ( unsigned t = 1; t < threads; t++ )
+            pool.push_back( thread( worker ) );
+
+        worker();
+
+        for ( size_t t = 0; t < pool.size(); t++ )
+            pool[ t ].join();
+
+        return parsed;
+    } //ParseMetadataBatch
+
     double FindFocalLength( const WCHAR * pwcPath, double &focalLength, int & flIn35mmFilm, double &flGuess, double &flComputed, char * pcModel, int modelLen )
     {
-        UpdateCache( pwcPath );
+        ImageMetadata md;
+        UpdateCache( pwcPath, md );
+
+        return FindFocalLength( md, focalLength, flIn35mmFilm, flGuess, flComputed, pcModel, modelLen );
+    } //FindFocalLength
+
+    // The same, for metadata the caller already parsed with ParseMetadata
 
+    double FindFocalLength( const ImageMetadata & md, double &focalLength, int & flIn35mmFilm, double &flGuess, double &flComputed, char * pcModel, int modelLen )
+    {
         double flBestGuess = 0.0;
         focalLength = 0.0;
         flIn35mmFilm = 0;
         flGuess = 0.0;
         flComputed = 0.0;
         flBestGuess = 0.0;
-        strcpy_s( pcModel, modelLen, g_acModel );
+        strcpy_s( pcModel, modelLen, md.acModel );
 
-        double cropGuess = g_factor.GetCropFactor( g_acModel );
-        double cropComputed = GetComputedCropFactor();
-        bool validFL = validFLVal( g_FocalLengthNum ) && validFLVal( g_FocalLengthDen );
+        double cropGuess = CCropFactor::GetCropFactor( md.acModel );
+        double cropComputed = GetComputedCropFactor( md );
+        bool validFL = validFLVal( md.FocalLengthNum ) && validFLVal( md.FocalLengthDen );
         bool validCropGuess = validFLVal( cropGuess );
         bool validCropComputed = validFLVal( cropComputed );
-        bool valid35mmFilm = validFLVal( g_FocalLengthIn35mmFilm );
+        bool valid35mmFilm = validFLVal( md.FocalLengthIn35mmFilm );
 
         if ( valid35mmFilm )
         {
-            flIn35mmFilm = g_FocalLengthIn35mmFilm;
+            flIn35mmFilm = md.FocalLengthIn35mmFilm;
             flBestGuess = flIn35mmFilm;
         }
 
         if ( validFL )
         {
-            focalLength = (double) g_FocalLengthNum / (double) g_FocalLengthDen;
+            focalLength = (double) md.FocalLengthNum / (double) md.FocalLengthDen;
 
             if ( 0.0 == flBestGuess )
                 flBestGuess = focalLength;
@@ -3351,21 +4132,27 @@ public:
 
     bool FindFNumber( const WCHAR * pwcPath, double * pFNumber )
     {
-        UpdateCache( pwcPath );
+        ImageMetadata md;
+        UpdateCache( pwcPath, md );
+
+        return FindFNumber( md, pFNumber );
+    } //FindFNumber
 
+    bool FindFNumber( const ImageMetadata & md, double * pFNumber )
+    {
         bool found = false;
     
-        if ( -1 != g_FNumberNum && -1 != g_FNumberDen && 0 != g_FNumberDen )
+        if ( -1 != md.FNumberNum && -1 != md.FNumberDen && 0 != md.FNumberDen )
         {
-            *pFNumber = (double) g_FNumberNum / (double) g_FNumberDen;
+            *pFNumber = (double) md.FNumberNum / (double) md.FNumberDen;
             found = true;
         }
-        else if ( -1 != g_ApertureNum && -1 != g_ApertureDen && 0 != g_ApertureDen )
+        else if ( -1 != md.ApertureNum && -1 != md.ApertureDen && 0 != md.ApertureDen )
         {
             // Compute f number from aperture. The Leica M11 Monochrom's EXIF data has Aperture and not FNumber
             // That camera guesses the Aperture based on the light meter and exposure.
 
-            double aperture = (double) g_ApertureNum / (double) g_ApertureDen;
+            double aperture = (double) md.ApertureNum / (double) md.ApertureDen;
             *pFNumber = pow( sqrt( 2.0 ), aperture );
             found = true;
         }
@@ -3375,14 +4162,15 @@ public:
 
     bool FindDateTime( const WCHAR * pwcPath, char * pcDateTime, int buflen )
     {
-        UpdateCache( pwcPath );
+        ImageMetadata md;
+        UpdateCache( pwcPath, md, ImageMetadata::FieldCaptureTime );
     
         char * p = NULL;
     
-        if ( 0 != g_acDateTimeOriginal[ 0 ] )
-            p = g_acDateTimeOriginal;
-        else if ( 0 != g_acDateTime[ 0 ] )
-            p = g_acDateTime;
+        if ( 0 != md.acDateTimeOriginal[ 0 ] )
+            p = md.acDateTimeOriginal;
+        else if ( 0 != md.acDateTime[ 0 ] )
+            p = md.acDateTime;
         else
         {
             if ( buflen > 0 )
@@ -3404,26 +4192,28 @@ public:
 
     bool GetInterestingMetadata( const WCHAR * pwcPath, char * pc, int buflen, int previewWidth, int previewHeight )
     {
-        UpdateCache( pwcPath );
+        ImageMetadata md;
+        UpdateCache( pwcPath, md );
     
         *pc = 0;
         char * current = pc;
         char * past = pc + buflen;
+        char acAspect[ 20 ];
     
-        if ( 0 != g_acDateTimeOriginal[ 0 ] )
-            current += sprintf_s( current, past - current, "%s\n", g_acDateTimeOriginal );
-        else if ( 0 != g_acDateTime[ 0 ] )
-            current += sprintf_s( current, past - current, "%s\n", g_acDateTime );
+        if ( 0 != md.acDateTimeOriginal[ 0 ] )
+            current += sprintf_s( current, past - current, "%s\n", md.acDateTimeOriginal );
+        else if ( 0 != md.acDateTime[ 0 ] )
+            current += sprintf_s( current, past - current, "%s\n", md.acDateTime );
 
-        if ( ( -1 != g_ImageWidth ) && ( -1 != g_ImageHeight ) )
+        if ( ( -1 != md.ImageWidth ) && ( -1 != md.ImageHeight ) )
         {
-            int w = g_ImageWidth;
-            int h = g_ImageHeight;
+            int w = md.ImageWidth;
+            int h = md.ImageHeight;
     
-            if ( g_Orientation_Value >= 5 && g_Orientation_Value <= 8 )
+            if ( md.Orientation_Value >= 5 && md.Orientation_Value <= 8 )
             {
-                w = g_ImageHeight;
-                h = g_ImageWidth;
+                w = md.ImageHeight;
+                h = md.ImageWidth;
             }
     
             if ( SubstantiallyDifferentResolution( w, previewWidth ) )
@@ -3431,37 +4221,37 @@ public:
             else
                 current += sprintf_s( current, past - current, "%d x %d", w, h );
 
-            current += sprintf_s( current, past - current, "%s\n", FindAspectRatio( w, h ) );
+            current += sprintf_s( current, past - current, "%s\n", FindAspectRatio( w, h, acAspect, _countof( acAspect ) ) );
         }
         else
-            current += sprintf_s( current, past - current, "%d x %d%s\n", previewWidth, previewHeight, FindAspectRatio( previewWidth, previewHeight ) ); // BMP, PNG, and any other non-supported formats
+            current += sprintf_s( current, past - current, "%d x %d%s\n", previewWidth, previewHeight, FindAspectRatio( previewWidth, previewHeight, acAspect, _countof( acAspect ) ) ); // BMP, PNG, and any other non-supported formats
     
-        if ( -1 != g_ISO )
-            current += sprintf_s( current, past - current, "ISO %d\n", g_ISO );
+        if ( -1 != md.ISO )
+            current += sprintf_s( current, past - current, "ISO %d\n", md.ISO );
     
-        if ( -1 != g_ExposureNum )
+        if ( -1 != md.ExposureNum )
         {
-            if ( 0 != g_ExposureNum && 1 != g_ExposureNum )
+            if ( 0 != md.ExposureNum && 1 != md.ExposureNum )
             {
-                g_ExposureDen = (int) round( (double) g_ExposureDen / (double) g_ExposureNum );
-                g_ExposureNum = 1;
+                md.ExposureDen = (int) round( (double) md.ExposureDen / (double) md.ExposureNum );
+                md.ExposureNum = 1;
             }
     
-            if ( 0 == g_ExposureDen || 1 == g_ExposureDen )
-                current += sprintf_s( current, past - current, "%d sec\n", g_ExposureNum );
+            if ( 0 == md.ExposureDen || 1 == md.ExposureDen )
+                current += sprintf_s( current, past - current, "%d sec\n", md.ExposureNum );
             else
-                current += sprintf_s( current, past - current, "%d/%d sec\n", g_ExposureNum, g_ExposureDen );
+                current += sprintf_s( current, past - current, "%d/%d sec\n", md.ExposureNum, md.ExposureDen );
         }
     
-        if ( -1 != g_FNumberNum && -1 != g_FNumberDen && 0 != g_FNumberDen )
+        if ( -1 != md.FNumberNum && -1 != md.FNumberDen && 0 != md.FNumberDen )
         {
-            current += sprintf_s( current, past - current, "f / %.1lf\n", (double) g_FNumberNum / (double) g_FNumberDen );
+            current += sprintf_s( current, past - current, "f / %.1lf\n", (double) md.FNumberNum / (double) md.FNumberDen );
         }
-        else if ( -1 != g_ApertureNum && -1 != g_ApertureDen && 0 != g_ApertureDen )
+        else if ( -1 != md.ApertureNum && -1 != md.ApertureDen && 0 != md.ApertureDen )
         {
             // compute f number from aperture. The Leica M11 Monochrom's EXIF data has Aperture and not FNumber
 
-            double aperture = (double) g_ApertureNum / (double) g_ApertureDen;
+            double aperture = (double) md.ApertureNum / (double) md.ApertureDen;
             double fnumber = pow( sqrt( 2.0 ), aperture );
             current += sprintf_s( current, past - current, "f / %.1lf\n", fnumber );
         }
@@ -3469,26 +4259,26 @@ public:
         // Try to find both the focal length and effective focal length (if it's different / not full frame)
     
         {
-            double cropGuess = g_factor.GetCropFactor( g_acModel );
-            double cropComputed = GetComputedCropFactor();
-            bool validFL = validFLVal( g_FocalLengthNum ) && validFLVal( g_FocalLengthDen );
+            double cropGuess = CCropFactor::GetCropFactor( md.acModel );
+            double cropComputed = GetComputedCropFactor( md );
+            bool validFL = validFLVal( md.FocalLengthNum ) && validFLVal( md.FocalLengthDen );
             bool validCropGuess = validFLVal( cropGuess );
             bool validCropComputed = validFLVal( cropComputed );
-            bool valid35mmFilm = validFLVal( g_FocalLengthIn35mmFilm );
+            bool valid35mmFilm = validFLVal( md.FocalLengthIn35mmFilm );
         
             //tracer.Trace( "cropGuess %lf, cropComputed %lf\n", cropGuess, cropComputed );
         
             if ( validFL )
             {
-                double focalLength = (double) g_FocalLengthNum / (double) g_FocalLengthDen;
+                double focalLength = (double) md.FocalLengthNum / (double) md.FocalLengthDen;
         
                 if ( valid35mmFilm )
                 {
-                    double fl = (double) g_FocalLengthIn35mmFilm;
+                    double fl = (double) md.FocalLengthIn35mmFilm;
                     if ( SameFocalLength( fl, focalLength ) )
                         current += sprintf_s( current, past - current, "%.1lfmm\n", focalLength );
                     else
-                        current += sprintf_s( current, past - current, "%.1fmm (%dmm equivalent)\n", focalLength, g_FocalLengthIn35mmFilm );
+                        current += sprintf_s( current, past - current, "%.1fmm (%dmm equivalent)\n", focalLength, md.FocalLengthIn35mmFilm );
                 }
                 else if ( validCropGuess )
                 {
@@ -3510,28 +4300,28 @@ public:
                     current += sprintf_s( current, past - current, "%.1lfmm\n", focalLength );
             }
             else if ( valid35mmFilm )
-                current += sprintf_s( current, past - current, " %dmm equivalent\n", g_FocalLengthIn35mmFilm );
+                current += sprintf_s( current, past - current, " %dmm equivalent\n", md.FocalLengthIn35mmFilm );
         }
     
-        if ( -1 != g_ExposureProgram )
-            current += sprintf_s( current, past - current, "%s\n", ExifExposureProgram( g_ExposureProgram ) );
-        else if ( -1 != g_ExposureMode )
-            current += sprintf_s( current, past - current, "%s\n", ExifExposureMode( g_ExposureMode ) );
+        if ( -1 != md.ExposureProgram )
+            current += sprintf_s( current, past - current, "%s\n", ExifExposureProgram( md.ExposureProgram ) );
+        else if ( -1 != md.ExposureMode )
+            current += sprintf_s( current, past - current, "%s\n", ExifExposureMode( md.ExposureMode ) );
     
-        if ( 0 != g_acMake[0] || 0 != g_acModel[ 0 ] )
-            current += sprintf_s( current, past - current, "%s%s%s\n", g_acMake, ( 0 == g_acMake[0] ) ? "" : " ", g_acModel );
+        if ( 0 != md.acMake[0] || 0 != md.acModel[ 0 ] )
+            current += sprintf_s( current, past - current, "%s%s%s\n", md.acMake, ( 0 == md.acMake[0] ) ? "" : " ", md.acModel );
     
-        if ( 0 != g_acLensMake[0] || 0 != g_acLensModel[ 0 ] )
-            current += sprintf_s( current, past - current, "%s%s%s\n", g_acLensMake, ( 0 == g_acLensMake[0] ) ? "" : " ", g_acLensModel );
+        if ( 0 != md.acLensMake[0] || 0 != md.acLensModel[ 0 ] )
+            current += sprintf_s( current, past - current, "%s%s%s\n", md.acLensMake, ( 0 == md.acLensMake[0] ) ? "" : " ", md.acLensModel );
     
-        if ( ( InvalidCoordinate != fabs( g_Latitude ) && InvalidCoordinate != fabs( g_Longitude ) ) )
-            current += sprintf_s( current, past - current, "%.7lf, %.7lf\n", g_Latitude, g_Longitude );
+        if ( ( ImageMetadata::InvalidCoordinate != fabs( md.Latitude ) && ImageMetadata::InvalidCoordinate != fabs( md.Longitude ) ) )
+            current += sprintf_s( current, past - current, "%.7lf, %.7lf\n", md.Latitude, md.Longitude );
     
-    //    if ( -1 != g_ComputedSensorWidth && -1 != g_ComputedSensorHeight )
-    //        current += sprintf_s( current, past - current, "sensor %dx%dmm\n", g_ComputedSensorWidth, g_ComputedSensorHeight );
+    //    if ( -1 != md.ComputedSensorWidth && -1 != md.ComputedSensorHeight )
+    //        current += sprintf_s( current, past - current, "sensor %dx%dmm\n", md.ComputedSensorWidth, md.ComputedSensorHeight );
 
-        if ( 0 != g_RatingInXMP_Offset )
-            current += sprintf_s( current, past - current, "rating: %d\n", g_RatingInXMP );
+        if ( 0 != md.RatingInXMP_Offset )
+            current += sprintf_s( current, past - current, "rating: %d\n", md.RatingInXMP );
 
         // remove the trailing newline
     
@@ -3543,16 +4333,17 @@ public:
     
     bool GetCameraInfo( const WCHAR * pwcPath, char * pcMake, int makeLen, char * pcModel, int modelLen )
     {
-        UpdateCache( pwcPath );
+        ImageMetadata md;
+        UpdateCache( pwcPath, md, ImageMetadata::FieldCamera );
     
         *pcMake = 0;
         *pcModel = 0;
     
-        if ( 0 != g_acMake[0] )
-            strcpy_s( pcMake, makeLen, g_acMake );
+        if ( 0 != md.acMake[0] )
+            strcpy_s( pcMake, makeLen, md.acMake );
     
-        if ( 0 != g_acModel[0] )
-            strcpy_s( pcModel, modelLen, g_acModel );
+        if ( 0 != md.acModel[0] )
+            strcpy_s( pcModel, modelLen, md.acModel );
     
         return ( 0 != *pcMake || 0 != *pcModel );
     } //GetCameraInfo
@@ -3560,7 +4351,8 @@ public:
     bool GetSerialNumbers( const WCHAR * pwcPath, char * pcMake, int makeLen, char * pcModel, int modelLen, char * pcSerialNumber, int serialNumberLen,
                            char * pcLensMake, int lensMakeLen, char * pcLensModel, int lensModelLen, char * pcLensSerialNumber, int lensSerialNumberLen )
     {
-        UpdateCache( pwcPath );
+        ImageMetadata md;
+        UpdateCache( pwcPath, md, ImageMetadata::FieldCamera | ImageMetadata::FieldLens );
 
         *pcMake = 0;
         *pcModel = 0;
@@ -3569,57 +4361,94 @@ public:
         *pcLensModel = 0;
         *pcLensSerialNumber = 0;
 
-        if ( 0 != g_acMake[0] )
-            strcpy_s( pcMake, makeLen, g_acMake );
+        if ( 0 != md.acMake[0] )
+            strcpy_s( pcMake, makeLen, md.acMake );
     
-        if ( 0 != g_acModel[0] )
-            strcpy_s( pcModel, modelLen, g_acModel );
+        if ( 0 != md.acModel[0] )
+            strcpy_s( pcModel, modelLen, md.acModel );
     
-        if ( 0 != g_acSerialNumber[0] )
-            strcpy_s( pcSerialNumber, serialNumberLen, g_acSerialNumber );
+        if ( 0 != md.acSerialNumber[0] )
+            strcpy_s( pcSerialNumber, serialNumberLen, md.acSerialNumber );
     
-        if ( 0 != g_acLensMake[0] )
-            strcpy_s( pcLensMake, lensMakeLen, g_acLensMake );
+        if ( 0 != md.acLensMake[0] )
+            strcpy_s( pcLensMake, lensMakeLen, md.acLensMake );
     
-        if ( 0 != g_acLensModel[0] )
-            strcpy_s( pcLensModel, lensModelLen, g_acLensModel );
+        if ( 0 != md.acLensModel[0] )
+            strcpy_s( pcLensModel, lensModelLen, md.acLensModel );
     
-        if ( 0 != g_acLensSerialNumber[0] )
-            strcpy_s( pcLensSerialNumber, lensSerialNumberLen, g_acLensSerialNumber );
+        if ( 0 != md.acLensSerialNumber[0] )
+            strcpy_s( pcLensSerialNumber, lensSerialNumberLen, md.acLensSerialNumber );
     
         return ( 0 != *pcSerialNumber || 0 != *pcLensSerialNumber );
     } //GetSerialNumbers
     
     bool FindEmbeddedImage( const WCHAR * pwcPath, long long * pOffset, long long * pLength, int * orientationValue,
-                            int * pWidth, int * pHeight, int * pFullWidth, int * pFullHeight )
+                            int * pWidth, int * pHeight, int * pFullWidth, int * pFullHeight,
+                            int targetWidth = 0, int targetHeight = 0 )
     {
-        UpdateCache( pwcPath );
+        // The viewer calls this first for each file it shows, so parse everything once and let the calls for
+        // the other details hit the cache. With a target size, return the smallest embedded image that covers
+        // it rather than the largest.
+
+        ImageMetadata md;
+        UpdateCache( pwcPath, md );
     
         // Note that the embedded image has no orientation/rotate value. Use orientation from the outer RAW file
     
-        *pOffset = g_Embedded_Image_Offset;
-        *pLength = g_Embedded_Image_Length;
-        *orientationValue = g_Orientation_Value;
-        *pWidth = g_Embedded_Image_Width;
-        *pHeight = g_Embedded_Image_Height;
-        *pFullWidth = g_ImageWidth;
-        *pFullHeight = g_ImageHeight;
+        *pOffset = md.Embedded_Image_Offset;
+        *pLength = md.Embedded_Image_Length;
+        *orientationValue = md.Orientation_Value;
+        *pWidth = md.Embedded_Image_Width;
+        *pHeight = md.Embedded_Image_Height;
+
+        if ( targetWidth > 0 && targetHeight > 0 )
+        {
+            int i = ImageMetadata::SelectEmbeddedImage( md.Embedded_Images, md.Embedded_Image_Count, targetWidth, targetHeight );
+
+            if ( -1 != i )
+            {
+                const ImageMetadata::EmbeddedImage & ei = md.Embedded_Images[ i ];
+                *pOffset = ei.offset;
+                *pLength = ei.length;
+                *pWidth = ei.width;
+                *pHeight = ei.height;
+            }
+        }
+
+        *pFullWidth = md.ImageWidth;
+        *pFullHeight = md.ImageHeight;
     
-        if ( ( 0 == g_Embedded_Image_Offset ) || ( 0 == g_Embedded_Image_Length ) )
+        if ( ( 0 == md.Embedded_Image_Offset ) || ( 0 == md.Embedded_Image_Length ) )
             return false;
     
         return true;
     } //FindEmbeddedJPG
+
+    int GetEmbeddedImages( const WCHAR * pwcPath, ImageMetadata::EmbeddedImage * pImages, int maxImages )
+    {
+        // Copy out every embedded image in the file, up to maxImages, and return how many were copied
+
+        ImageMetadata md;
+        UpdateCache( pwcPath, md, ImageMetadata::FieldEmbeddedImage );
+
+        int count = __min( maxImages, md.Embedded_Image_Count );
+
+        for ( int i = 0; i < count; i++ )
+            pImages[ i ] = md.Embedded_Images[ i ];
+
+        return count;
+    } //GetEmbeddedImages
     
     bool GetGPSLocation( const WCHAR * pwcPath, double * pLatitude, double * pLongitude )
     {
-        UpdateCache( pwcPath );
+        ImageMetadata md;
+        UpdateCache( pwcPath, md, ImageMetadata::FieldGPS );
     
-        if ( ( InvalidCoordinate == fabs( g_Latitude ) && InvalidCoordinate == fabs( g_Longitude ) ) )
+        if ( ( ImageMetadata::InvalidCoordinate == fabs( md.Latitude ) && ImageMetadata::InvalidCoordinate == fabs( md.Longitude ) ) )
             return false;
     
-        *pLatitude = g_Latitude;
-        *pLongitude = g_Longitude;
+        *pLatitude = md.Latitude;
+        *pLongitude = md.Longitude;
     
         return true;
     } //GetGPSLocation
@@ -3628,9 +4457,10 @@ public:
     {
         *orientation = 1; // default
 
-        UpdateCache( pwcPath );
+        ImageMetadata md;
+        UpdateCache( pwcPath, md, ImageMetadata::FieldOrientation );
 
-        if ( -1 == g_Orientation_Value )
+        if ( -1 == md.Orientation_Value )
         {
             tracer.Trace( "orientation value is -1, so assuming it isn't set in the file, so can't rotate because there is nothing to update\n" );
             return false;
@@ -3641,32 +4471,37 @@ public:
 
     bool HoldsAdobeEditsInXMP( const WCHAR * pwcPath )
     {
-        UpdateCache( pwcPath );
+        ImageMetadata md;
+        UpdateCache( pwcPath, md, ImageMetadata::FieldRating );
 
-        return g_holdsAdobeEditsInXMP;
+        return md.holdsAdobeEditsInXMP;
     } //HoldsAdobeEditsInXMP
 
     bool GetRating( const WCHAR * pwcPath, char & rating )
     {
-        UpdateCache( pwcPath );
+        ImageMetadata md;
+        UpdateCache( pwcPath, md, ImageMetadata::FieldRating );
 
-        if ( 0 == g_RatingInXMP_Offset )
+        if ( 0 == md.RatingInXMP_Offset )
         {
             //tracer.Trace( "file has no rating field\n" );
             return false;
         }
 
-        rating = g_RatingInXMP;
+        rating = md.RatingInXMP;
         return true;
     } //GetRating
 
+#ifdef _WIN32 // the writers below patch files in place with Win32 file APIs
+
     bool ToggleRating( const WCHAR * pwcPath )
     {
         // If the file can hold a rating, increment it by 1. If it's already 5, set it to 0.
 
-        UpdateCache( pwcPath );
+        ImageMetadata md;
+        UpdateCache( pwcPath, md, ImageMetadata::FieldRating );
 
-        if ( 0 == g_RatingInXMP_Offset )
+        if ( 0 == md.RatingInXMP_Offset )
         {
             tracer.Trace( "file has no rating field, so it can't be updated\n" );
             return false;
@@ -3674,8 +4509,8 @@ public:
 
         char newRating = 0;
 
-        if ( ( g_RatingInXMP >= 0 ) && ( g_RatingInXMP <= 4 ) )
-            newRating = 1 + g_RatingInXMP;
+        if ( ( md.RatingInXMP >= 0 ) && ( md.RatingInXMP <= 4 ) )
+            newRating = 1 + md.RatingInXMP;
         else
             newRating = 0;
 
@@ -3687,7 +4522,7 @@ public:
         }
 
         LARGE_INTEGER li;
-        li.QuadPart = g_RatingInXMP_Offset;
+        li.QuadPart = md.RatingInXMP_Offset;
         bool ok = SetFilePointerEx( hFile, li, NULL, FILE_BEGIN );
 
         if ( ok )
@@ -3697,10 +4532,7 @@ public:
             ok = WriteFile( hFile, &rating, sizeof rating, &written, NULL );
 
             if ( ok )
-            {
-                tracer.Trace( "updated rating at offset %lld to %c\n", g_RatingInXMP_Offset, rating );
-                g_RatingInXMP = newRating;
-            }
+                tracer.Trace( "updated rating at offset %lld to %c\n", md.RatingInXMP_Offset, rating );
             else
                 tracer.Trace( "can't write new rating to file, error %d\n", GetLastError() );
         }
@@ -3710,6 +4542,12 @@ public:
         }
 
         CloseHandle( hFile );
+
+        if ( ok )
+            UpdateCachedRating( pwcPath, newRating );
+        else
+            InvalidateCache( pwcPath );
+
         return ok;
     } //ToggleRating
 
@@ -3720,9 +4558,10 @@ public:
         if ( rating < 0 || rating > 5 )
             return false;
 
-        UpdateCache( pwcPath );
+        ImageMetadata md;
+        UpdateCache( pwcPath, md, ImageMetadata::FieldRating );
 
-        if ( 0 == g_RatingInXMP_Offset )
+        if ( 0 == md.RatingInXMP_Offset )
         {
             tracer.Trace( "file has no rating field, so it can't be updated\n" );
             return false;
@@ -3736,7 +4575,7 @@ public:
         }
 
         LARGE_INTEGER li;
-        li.QuadPart = g_RatingInXMP_Offset;
+        li.QuadPart = md.RatingInXMP_Offset;
         bool ok = SetFilePointerEx( hFile, li, NULL, FILE_BEGIN );
 
         if ( ok )
@@ -3746,10 +4585,7 @@ public:
             ok = WriteFile( hFile, &charRating, sizeof charRating, &written, NULL );
 
             if ( ok )
-            {
-                tracer.Trace( "updated rating at offset %lld to %c\n", g_RatingInXMP_Offset, charRating );
-                g_RatingInXMP = rating;
-            }
+                tracer.Trace( "updated rating at offset %lld to %c\n", md.RatingInXMP_Offset, charRating );
             else
                 tracer.Trace( "can't write new rating to file, error %d\n", GetLastError() );
         }
@@ -3759,40 +4595,47 @@ public:
         }
 
         CloseHandle( hFile );
+
+        if ( ok )
+            UpdateCachedRating( pwcPath, rating );
+        else
+            InvalidateCache( pwcPath );
+
         return ok;
     } //SetRating
 
     bool RotateImage( const WCHAR * pwcPath, bool rotateRight )
     {
-        UpdateCache( pwcPath );
+        ImageMetadata md;
+        UpdateCache( pwcPath, md, ImageMetadata::FieldOrientation );
 
-        if ( -1 == g_Orientation_Value )
+        if ( -1 == md.Orientation_Value )
         {
             tracer.Trace( "orientation value is -1, so assuming it isn't set in the file, so can't rotate because there is nothing to update\n" );
             return false;
         }
 
-        if ( g_Orientation_Value > 8 || g_Orientation_Value < 1 )
+        if ( md.Orientation_Value > 8 || md.Orientation_Value < 1 )
         {
-            tracer.Trace( "overriding illegal orientation value %d with a default of 1 == horizontal (normal)\n", g_Orientation_Value );
-            g_Orientation_Value = 1;
+            tracer.Trace( "overriding illegal orientation value %d with a default of 1 == horizontal (normal)\n", md.Orientation_Value );
+            md.Orientation_Value = 1;
         }
 
-        if ( 1 != g_Orientation_Value && 6 != g_Orientation_Value && 3 != g_Orientation_Value && 8 != g_Orientation_Value )
+        if ( 1 != md.Orientation_Value && 6 != md.Orientation_Value && 3 != md.Orientation_Value && 8 != md.Orientation_Value )
         {
-            tracer.Trace( "orientation vaue isn't 1, 6, 3, or 8, so rotate can't be performed: %d\n", g_Orientation_Value );
+            tracer.Trace( "orientation vaue isn't 1, 6, 3, or 8, so rotate can't be performed: %d\n", md.Orientation_Value );
             return false;
         }
 
-        if ( 0 == g_Orientation_Offset )
+        if ( 0 == md.Orientation_Offset )
         {
             tracer.Trace( "orientation offset is 0, which can't be correct\n" );
             return false;
         }
 
-        if ( 3 != g_Orientation_Type )
+        if ( 3 != md.Orientation_Type )
         {
-            tracer.Trace( "orientation data type isn't 3 (short) as expected: %d\n", g_Orientation_Type );
+            tracer.Trace( "orientation data type isn't 3 (short) as expected: %d\n", md.Orientation_Type );
             return false;
         }
 
@@ -3805,7 +4648,7 @@ public:
         }
 
         // 1 --> 6 --> 3 --> 8 --> 1 ...
-        WORD o = (WORD) g_Orientation_Value;
+        WORD o = (WORD) md.Orientation_Value;
 
         if ( rotateRight )
         {
@@ -3830,21 +4673,19 @@ public:
                 o = 1;
         }
 
-        tracer.Trace( "updating orientation value %d with %d at file offset %lld\n", g_Orientation_Value, o, g_Orientation_Offset );
+        tracer.Trace( "updating orientation value %d with %d at file offset %lld\n", md.Orientation_Value, o, md.Orientation_Offset );
 
         LARGE_INTEGER li;
-        li.QuadPart = g_Orientation_Offset;
+        li.QuadPart = md.Orientation_Offset;
         bool ok = SetFilePointerEx( hFile, li, NULL, FILE_BEGIN );
 
         if ( ok )
         {
             DWORD written = 0;
-            WORD oToWrite = g_Orientation_LittleEndian ? o : _byteswap_ushort( o );
+            WORD oToWrite = md.Orientation_LittleEndian ? o : _byteswap_ushort( o );
             ok = WriteFile( hFile, &oToWrite, sizeof oToWrite, &written, NULL );
 
-            if ( ok )
-                g_Orientation_Value = o;
-            else
+            if ( !ok )
                 tracer.Trace( "can't write orientation to file, error %d\n", GetLastError() );
         }
         else
@@ -3856,15 +4697,18 @@ public:
         // in IFD0 and IFD1 (the second record of IFD0). Update both.
         // Different apps look at different values, so the behavior is otherwise unpredictable.
 
-        if ( -1 != g_Orientation_Value2 && 0 != g_Orientation_Offset2 )
+        bool firstOk = ok;
+        bool updateSecond = ( -1 != md.Orientation_Value2 && 0 != md.Orientation_Offset2 );
+
+        if ( updateSecond )
         {
-            li.QuadPart = g_Orientation_Offset2;
+            li.QuadPart = md.Orientation_Offset2;
             ok = SetFilePointerEx( hFile, li, NULL, FILE_BEGIN );
 
             if ( ok )
             {
                 DWORD written = 0;
-                WORD oToWrite = g_Orientation_LittleEndian ? o : _byteswap_ushort( o );
+                WORD oToWrite = md.Orientation_LittleEndian ? o : _byteswap_ushort( o );
                 ok = WriteFile( hFile, &oToWrite, sizeof oToWrite, &written, NULL );
 
                 if ( !ok )
@@ -3878,21 +4722,71 @@ public:
 
         CloseHandle( hFile );
 
+        if ( firstOk && ok )
+            UpdateCachedOrientation( pwcPath, o, updateSecond );
+        else
+            InvalidateCache( pwcPath );
+
         return ok;
     } //RotateImage
 
+#endif // _WIN32
+
     void PurgeCache()
     {
-        InitializeGlobals();
-        g_awcPath[ 0 ] = 0;
+        lock_guard<mutex> lock( g_mtx );
+
+        g_cache.clear();
     }
     
-    CImageData()
+    CImageData() : g_cacheClock( 0 ), g_mapFiles( false )
     {
-        InitializeGlobals();
+        g_cache.reserve( MetadataCacheEntries );
+        memset( g_io, 0, sizeof g_io );
     }
 
+    // I/O totals for every parse since this object was created, broken out by the file's detected format.
+    // Formats are 0 .. IOFormatCount() - 1.
+
+    int IOFormatCount() { return CImageParser::FormatCount; }
+
+    const char * IOFormatName( int format ) { return CImageParser::FormatName( format ); }
+
+    bool GetIOStats( int format, ULONGLONG & files, StreamStats & stats )
+    {
+        if ( format < 0 || format >= CImageParser::FormatCount )
+            return false;
+
+        lock_guard<mutex> lock( g_ioMtx );
+
+        files = g_io[ format ].files;
+        stats = g_io[ format ].io;
+        return true;
+    } //GetIOStats
+
+    void TraceIOStats()
+    {
+        lock_guard<mutex> lock( g_ioMtx );
+
+        for ( int f = 0; f < CImageParser::FormatCount; f++ )
+        {
+            const FormatIO & fio = g_io[ f ];
+            if ( 0 == fio.files )
+                continue;
+
+            tracer.Trace( "metadata i/o %-7s %llu files, %llu opens, %llu reads, %llu ReadFile, %llu SetFilePointerEx, %llu bytes, %.3f ms\n",
+                          CImageParser::FormatName( f ), fio.files, fio.io.opens, fio.io.reads, fio.io.fileReads,
+                          fio.io.fileSeeks, fio.io.fileBytes, (double) fio.io.ioNanoseconds / 1000000.0 );
+        }
+    } //TraceIOStats
+
+    // Mapping wins when many small reads hit local files. Streams that can't be mapped (network shares,
+    // empty files) still use the read cache. Call before parsing starts; it isn't synchronized.
+
+    void UseMappedFiles( bool mapFiles ) { g_mapFiles = mapFiles; }
+
     ~CImageData()
     {
+        TraceIOStats();
     }
 };
@@ -76,6 +76,16 @@ class CStringArray
 
             elements.push_back( p );
         }
+
+        // Take ownership of strings allocated with new WCHAR[], appending them all under one lock. items is left empty.
+
+        void Adopt( vector<WCHAR *> & items )
+        {
+            lock_guard<mutex> lock( mtx );
+
+            elements.insert( elements.end(), items.begin(), items.end() );
+            items.clear();
+        } //Adopt
 }; //CStringArray
 
 
@@ -3,14 +3,17 @@ del pv.obj
 del pv.res
 del pv.exe
 del pv.pdb
+del pvmd.exe
+del pvmd.pdb
 @echo on
 
 REM to build without LibRaw:
 rc pv.rc
 cl /nologo pv.cxx /I.\ /MT /Ox /Qpar /O2 /Oi /Ob2 /EHac /Zi /Gy /DNDEBUG /D_AMD64_ /link pv.res /OPT:REF /subsystem:windows
 
-REM to build with LibRaw:
+REM to build with LibRaw (and zlib, which LibRaw uses too, for the parallel TIFF rewriter that compresses exports):
 REM rc /DPV_USE_LIBRAW pv.rc
-REM cl /nologo pv.cxx /DPV_USE_LIBRAW /I.\ /MT /Ox /Qpar /O2 /Oi /Ob2 /EHac /Zi /Gy /DNDEBUG /D_AMD64_ /link pv.res /OPT:REF /subsystem:windows
-
+REM cl /nologo pv.cxx /DPV_USE_LIBRAW /DPV_USE_ZLIB /I.\ /MT /Ox /Qpar /O2 /Oi /Ob2 /EHac /Zi /Gy /DNDEBUG /D_AMD64_ /link pv.res /OPT:REF /subsystem:windows
 
+REM headless batch metadata extractor (also builds on Linux with m.sh):
+cl /nologo pvmd.cxx /I.\ /MT /Ox /Qpar /O2 /Oi /Ob2 /EHac /Zi /Gy /DNDEBUG /D_AMD64_ /link /OPT:REF
@@ -21,6 +21,8 @@
 #include <math.h>
 #include <ppl.h>
 #include <mutex>
+#include <atomic>
+#include <thread>
 #include <assert.h>
 
 #include <chrono>
@@ -32,10 +34,15 @@ using namespace std::chrono;
 #include <djlres.hxx>
 #include <djl_pa.hxx>
 #include <djlenum.hxx>
+#include <djl_watch.hxx>
 #include <djlistream.hxx>
 #include <djl_strm.hxx>
 #include <djlimagedata.hxx>
 #include <djl_rotate.hxx>
+#include <djl_decodeahead.hxx>
+#include <djl_decodesize.hxx>
+#include <djl_resample.hxx>
+#include <djl_orient.hxx>
 #include <djltimed.hxx>
 #include <djl_tz.hxx>
 
@@ -79,11 +86,22 @@ CDJLTrace tracer;
 #define REGISTRY_SORT_ASCENDING L"SortAscending"
 #define REGISTRY_SHOW_METADATA L"ShowMetadata"
 #define REGISTRY_IN_F11_FULLSCREEN L"InF11FullScreen"
+#define REGISTRY_DECODE_TO_FIT L"DecodeToFit"
+#define REGISTRY_LIBRAW_DISK_CACHE L"LibRawDiskCache"
 
 typedef enum PVZoomLevel { zl_ZoomFullImage, zl_Zoom1, zl_Zoom2, zl_Zoom4, zl_Zoom8 } PVZoomLevel;
 typedef enum PVProcessRAW { pr_Always, pr_Sometimes, pr_Never } PVProcessRAW;
 typedef enum PVSortImagesBy { si_Capture, si_Creation, si_LastWrite, si_Path } PVSortImagesBy;
 typedef enum PVMoveDirection { md_Previous, md_Stay, md_Next } PVMoveDirection;
+typedef enum PVLoadMode { lm_Progressive, lm_Complete, lm_FullResolution } PVLoadMode;
+
+const int TIMER_UPGRADE_ID = 2;     // finishes loading an image shown from its thumbnail once input has stopped
+const int TIMER_MERGE_ID = 3;       // merges images found by the background enumeration, at most a few times a second
+
+const UINT WM_PV_IMAGES_FOUND = WM_APP + 1;     // the enumeration thread added paths to g_pFoundImages
+const UINT WM_PV_ENUMERATION_DONE = WM_APP + 2; // the enumeration thread has finished
+const UINT WM_PV_FOLDER_CHANGED = WM_APP + 3;   // the folder watcher added to g_folderChanges
+const UINT WM_PV_CAPTURE_TIMES = WM_APP + 4;    // the capture-time thread has finished with g_pCaptureTimes
 
 ComPtr<ID2D1DeviceContext> g_target;
 ComPtr<IDXGISwapChain1> g_swapChain;
@@ -96,8 +114,11 @@ ComPtr<IDWriteTextFormat> g_dwriteTextFormat;
 
 CPathArray * g_pImageArray = NULL;
 CImageData * g_pImageData = 0;
+class CWICDecoder * g_pWICDecoder = NULL;
+CDecodeAhead * g_pDecodeAhead = NULL;
 
 size_t g_currentBitmapIndex = 0;
+PVMoveDirection g_lastMove = md_Next;
 const int g_validDelays[] = { 0, 1, 5, 15, 30, 60, 600 };
 int g_photoDelay = g_validDelays[ 2 ];
 char g_acImageMetadata[ 1024 ];
@@ -107,6 +128,10 @@ bool g_inF11FullScreen = false;
 PVProcessRAW g_ProcessRAW = pr_Sometimes;
 PVSortImagesBy g_SortImagesBy = si_LastWrite;
 bool g_SortImagesAscending = true;
+bool g_decodeToFit = true;          // let codecs decode at the smallest size that covers the monitor
+bool g_libRawDiskCache = true;      // keep images LibRaw processed on disk as well as in memory
+bool g_currentIsReduced = false;    // the image shown isn't the largest available, so zooming needs a new decode
+bool g_currentIsThumbnail = false;  // only the thumbnail is shown; the full image hasn't been decoded yet
 
 long long timeMetadata = 0;
 long long timePaint = 0;
@@ -116,6 +141,41 @@ long long timeSwapChain = 0;
 long long timeD2DB = 0;
 long long timeLibRaw = 0;
 
+// From navigating to an image until its first pixels are shown and until its full-quality pixels are ready.
+// They're the same unless a thumbnail was shown first.
+
+long long timeFirstPixels = 0;
+long long timeFullQuality = 0;
+long long imagesFirstPixels = 0;
+long long imagesFullQuality = 0;
+long long imagesShownFromThumbnail = 0;
+high_resolution_clock::time_point g_navigationStart;
+
+// The folder is enumerated on another thread into g_pFoundImages, and the UI thread merges those paths into
+// g_pImageArray in sorted order. Only the UI thread touches g_pImageArray.
+
+CPathArray * g_pFoundImages = NULL;
+std::atomic<bool> g_foundPosted( false );   // a WM_PV_IMAGES_FOUND is in the queue
+bool g_mergePending = false;                // TIMER_MERGE_ID is set
+const WCHAR * g_pwcShownEarly = NULL;       // the starting photo, added before the enumeration found it
+high_resolution_clock::time_point g_enumerationStart;
+bool g_enumerationDone = false;
+WCHAR ** g_pwcExtensions = NULL;            // the extensions being shown
+int g_cExtensions = 0;
+
+// Changes other apps make to the folder tree once it's enumerated, e.g. a tethered camera or a card import.
+// The watcher starts before the enumeration so nothing is missed, and changes are applied once it's done.
+
+std::mutex g_folderChangesMutex;
+vector<CFolderChange> g_folderChanges;
+std::atomic<bool> g_changesPosted( false ); // a WM_PV_FOLDER_CHANGED is in the queue
+
+// With a capture sort, parsing for capture times once the enumeration is done can take minutes on a big or remote
+// folder. It runs on another thread over a copy of the list, and the UI thread applies the times and sorts.
+
+CPathArray * g_pCaptureTimes = NULL;
+std::thread g_captureThread;
+
 class CCursor
 {
     private:
@@ -317,6 +377,20 @@ void LoadRegistryParams()
     ok = CDJLRegistry::readStringFromRegistry( HKEY_CURRENT_USER, REGISTRY_APP_NAME, REGISTRY_IN_F11_FULLSCREEN, awcBuffer, sizeof( awcBuffer ) );
     if ( ok )
         g_inF11FullScreen = ( !_wcsicmp( awcBuffer, L"Yes" ) );
+
+    awcBuffer[ 0 ] = 0;
+    ok = CDJLRegistry::readStringFromRegistry( HKEY_CURRENT_USER, REGISTRY_APP_NAME, REGISTRY_DECODE_TO_FIT, awcBuffer, sizeof( awcBuffer ) );
+    if ( ok )
+        g_decodeToFit = ( !_wcsicmp( awcBuffer, L"Yes" ) );
+
+    awcBuffer[ 0 ] = 0;
+    ok = CDJLRegistry::readStringFromRegistry( HKEY_CURRENT_USER, REGISTRY_APP_NAME, REGISTRY_LIBRAW_DISK_CACHE, awcBuffer, sizeof( awcBuffer ) );
+    if ( ok )
+        g_libRawDiskCache = ( !_wcsicmp( awcBuffer, L"Yes" ) );
+
+#ifdef PV_USE_LIBRAW
+    CLibRaw::UseDiskCache( g_libRawDiskCache );
+#endif // PV_USE_LIBRAW
 } //LoadRegistryParams
 
 void NavigateToStartingPhoto( WCHAR * pwcStartingPhoto )
@@ -469,6 +543,142 @@ static void AdjustSizeToFit( UINT wImg, UINT hImg, int targetW, int targetH, UIN
     }
 } //AdjustSizeToFit
 
+// A 32bpp IWICBitmapSource with an Exif orientation applied as its pixels are copied. Nothing is decoded until
+// D2D or a decode-ahead thread copies the pixels, and then straight into their buffer, reading the source in strips
+// of rows so a sideways image never needs a second full-size copy. Unlike WIC's flip rotator this handles the
+// mirrored orientations 2, 4, 5, and 7.
+
+// Answered only by COrientedSource's QueryInterface, so code holding an IWICBitmapSource can tell if it's one.
+// WIC's own objects have no RTTI, so dynamic_cast can't be used on them.
+
+// {6B1F2E0A-4C3D-4E8B-9A57-2D0C8F31B6E4}
+static const IID IID_PVOrientedSource = { 0x6b1f2e0a, 0x4c3d, 0x4e8b, { 0x9a, 0x57, 0x2d, 0x0c, 0x8f, 0x31, 0xb6, 0xe4 } };
+
+class COrientedSource : public IWICBitmapSource
+{
+    private:
+        long refcount;
+        ComPtr<IWICBitmapSource> source;
+        int orientation;
+        UINT width;             // of the source, before orientation
+        UINT height;
+
+        static const size_t StripBytes = 8 * 1024 * 1024;
+
+    public:
+        COrientedSource( IWICBitmapSource * pSource, int o ) :
+            refcount( 1 ),
+            source( pSource ),
+            orientation( o ),
+            width( 0 ),
+            height( 0 )
+        {
+            source->GetSize( &width, &height );
+        }
+
+        IWICBitmapSource * Source() { return source.Get(); }
+        int Orientation() { return orientation; }
+
+        ULONG STDMETHODCALLTYPE AddRef()
+        {
+            return InterlockedIncrement( &refcount );
+        }
+
+        HRESULT STDMETHODCALLTYPE QueryInterface( REFIID riid, void **ppvObject )
+        {
+            if ( riid == __uuidof(IUnknown) || riid == __uuidof(IWICBitmapSource) )
+            {
+                *ppvObject = static_cast<IWICBitmapSource *>(this);
+                AddRef();
+                return S_OK;
+            }
+
+            if ( riid == IID_PVOrientedSource )
+            {
+                *ppvObject = this;
+                AddRef();
+                return S_OK;
+            }
+
+            *ppvObject = NULL;
+            return E_NOINTERFACE;
+        }
+
+        ULONG STDMETHODCALLTYPE Release()
+        {
+            long l = InterlockedDecrement( &refcount );
+            if ( 0 == l )
+                delete this;
+
+            return l;
+        }
+
+        HRESULT STDMETHODCALLTYPE GetSize( UINT *puiWidth, UINT *puiHeight )
+        {
+            int w, h;
+            COrientPixels::OrientedSize( width, height, orientation, w, h );
+            *puiWidth = w;
+            *puiHeight = h;
+            return S_OK;
+        }
+
+        HRESULT STDMETHODCALLTYPE GetPixelFormat( WICPixelFormatGUID *pPixelFormat ) { return source->GetPixelFormat( pPixelFormat ); }
+        HRESULT STDMETHODCALLTYPE CopyPalette( IWICPalette *pIPalette ) { return source->CopyPalette( pIPalette ); }
+
+        HRESULT STDMETHODCALLTYPE GetResolution( double *pDpiX, double *pDpiY )
+        {
+            HRESULT hr = source->GetResolution( pDpiX, pDpiY );
+            if ( SUCCEEDED( hr ) && orientation >= 5 && orientation <= 8 )
+                swap( *pDpiX, *pDpiY );
+
+            return hr;
+        }
+
+        HRESULT STDMETHODCALLTYPE CopyPixels( const WICRect *prc, UINT cbStride, UINT cbBufferSize, BYTE *pbBuffer )
+        {
+            int w, h;
+            COrientPixels::OrientedSize( width, height, orientation, w, h );
+            WICRect rect = { 0, 0, w, h };
+            if ( NULL != prc )
+                rect = *prc;
+
+            if ( NULL == pbBuffer || rect.X < 0 || rect.Y < 0 || rect.Width <= 0 || rect.Height <= 0 || rect.X + rect.Width > w || rect.Y + rect.Height > h )
+                return E_INVALIDARG;
+
+            if ( (ULONGLONG) cbStride * ( rect.Height - 1 ) + (ULONGLONG) rect.Width * 4 > cbBufferSize )
+                return WINCODEC_ERR_INSUFFICIENTBUFFER;
+
+            HRESULT hr = S_OK;
+            int stripRows = (int) __max( (size_t) 16, StripBytes / ( (size_t) width * 4 ) );
+
+            bool ok = COrientPixels::ApplyRect( width, height, 4, orientation, rect.X, rect.Y, rect.Width, rect.Height, pbBuffer, cbStride, stripRows,
+                                                [&] ( int x, int y, int sw, int sh, uint8_t * strip, size_t stripStride )
+                                                {
+                                                    WICRect r = { x, y, sw, sh };
+                                                    hr = source->CopyPixels( &r, (UINT) stripStride, (UINT) ( stripStride * sh ), strip );
+                                                    return SUCCEEDED( hr );
+                                                } );
+
+            if ( !ok && SUCCEEDED( hr ) )
+                hr = E_OUTOFMEMORY;
+
+            return hr;
+        }
+}; //COrientedSource
+
+HRESULT OrientForDisplay( ComPtr<IWICBitmapSource> & source, int orientation )
+{
+    // source is 32bppPBGRA. The orientation is applied when its pixels are copied.
+
+    ComPtr<IWICBitmapSource> oriented;
+    oriented.Attach( new COrientedSource( source.Get(), orientation ) );
+    tracer.Trace( "orienting wic bitmap source for exif orientation %d\n", orientation );
+
+    source.Reset();
+    source.Attach( oriented.Detach() );
+    return S_OK;
+} //OrientForDisplay
+
 HRESULT CreateTargetAndD2DBitmap( HWND hwnd )
 {
     HRESULT hr = S_OK;
@@ -516,7 +726,25 @@ HRESULT CreateTargetAndD2DBitmap( HWND hwnd )
 
         UINT w, h;
         AdjustSizeToFit( width, height, rectDesk.right - rectDesk.left, rectDesk.bottom - rectDesk.top, w, h );
-        
+
+        // Scale an oriented source before it's oriented, so the scaler reads the decoder in bands of rows rather
+        // than the columns a sideways image is made of
+
+        ComPtr<IWICBitmapSource> toScale( g_BitmapSource );
+        int orientation = 1;
+        ComPtr<COrientedSource> oriented;
+        COrientedSource * pOriented = NULL;
+
+        if ( SUCCEEDED( g_BitmapSource->QueryInterface( IID_PVOrientedSource, (void **) &pOriented ) ) )
+        {
+            oriented.Attach( pOriented );
+            toScale = pOriented->Source();
+            orientation = pOriented->Orientation();
+
+            if ( orientation >= 5 && orientation <= 8 )
+                swap( w, h );
+        }
+
         ComPtr<IWICBitmapScaler> scaler;
         hr = g_IWICFactory->CreateBitmapScaler( scaler.GetAddressOf() );
         if ( FAILED( hr ) )
@@ -525,7 +753,7 @@ HRESULT CreateTargetAndD2DBitmap( HWND hwnd )
             return hr;
         }
         
-        hr = scaler->Initialize( g_BitmapSource.Get(), w, h, WICBitmapInterpolationModeHighQualityCubic );
+        hr = scaler->Initialize( toScale.Get(), w, h, WICBitmapInterpolationModeHighQualityCubic );
         if ( FAILED( hr ) )
         {
             tracer.Trace( "can't initialize bitmap scaler to downres image: %#x\n", hr );
@@ -555,6 +783,9 @@ HRESULT CreateTargetAndD2DBitmap( HWND hwnd )
             return hr;
         }
 
+        if ( oriented )
+            OrientForDisplay( scaledSource, orientation );
+
         g_BitmapSource.Reset();
         g_BitmapSource.Attach( scaledSource.Detach() );
         
@@ -571,11 +802,114 @@ HRESULT CreateTargetAndD2DBitmap( HWND hwnd )
     return hr;
 } //CreateTargetAndD2DBitmap
 
-HRESULT LoadCurrentFileD2D( HWND hwnd, const WCHAR * pwcPath, IStream * pStream, int * pwidth, int * pheight, int orientation, bool useLibRaw )
+HRESULT ConvertForDisplay( ComPtr<IWICBitmapSource> & source, int orientation )
+{
+    // Convert source to the pixel format D2D draws and apply the Exif orientation, if any.
+    // This runs on the UI thread and on the decode-ahead threads; the WIC factory is free-threaded.
+
+    ComPtr<IWICFormatConverter> formatConverter;
+    HRESULT hr = g_IWICFactory->CreateFormatConverter( formatConverter.GetAddressOf() );
+
+    if ( SUCCEEDED( hr ) )
+    {
+        hr = formatConverter->Initialize( source.Get(), GUID_WICPixelFormat32bppPBGRA, WICBitmapDitherTypeNone, NULL, 0.f, WICBitmapPaletteTypeCustom );
+        if ( SUCCEEDED( hr ) )
+        {
+            source.Reset();
+            source.Attach( formatConverter.Detach() );
+        }
+    }
+
+    if ( SUCCEEDED( hr ) && ( orientation >= 2 ) && ( orientation <= 8 ) )
+        hr = OrientForDisplay( source, orientation );
+
+    return hr;
+} //ConvertForDisplay
+
+HRESULT DecodeReduced( ComPtr<IWICBitmapSource> & source, int targetWidth, int targetHeight, int orientation, bool & reduced )
+{
+    // When the image will be shown fit to the target, have the codec decode fewer pixels if that still covers it.
+    // This needs IWICBitmapSourceTransform; the JPEG codec implements it by scaling 1/2, 1/4, or 1/8 in the DCT,
+    // which skips most of the work of a full decode. Otherwise source is left as is and decoded at full size.
+
+    reduced = false;
+
+    if ( targetWidth <= 0 || targetHeight <= 0 )
+        return S_OK;
+
+    // The orientation is applied after decoding, so sideways images must cover the target turned sideways
+
+    if ( orientation >= 5 && orientation <= 8 )
+        swap( targetWidth, targetHeight );
+
+    UINT width = 0, height = 0;
+    HRESULT hr = source->GetSize( &width, &height );
+    if ( FAILED( hr ) )
+        return hr;
+
+    UINT divisor = CDecodeSize::Divisor( width, height, targetWidth, targetHeight );
+    if ( 1 == divisor )
+        return S_OK;
+
+    ComPtr<IWICBitmapSourceTransform> transform;
+    if ( FAILED( source.As( &transform ) ) )
+        return S_OK;
+
+    UINT w = CDecodeSize::Reduce( width, divisor );
+    UINT h = CDecodeSize::Reduce( height, divisor );
+    hr = transform->GetClosestSize( &w, &h );
+    if ( FAILED( hr ) || ( w == width && h == height ) || !CDecodeSize::Covers( width, height, w, h, targetWidth, targetHeight ) )
+        return S_OK;
+
+    WICPixelFormatGUID format = GUID_WICPixelFormat32bppPBGRA;
+    hr = transform->GetClosestPixelFormat( &format );
+
+    ComPtr<IWICBitmap> bitmap;
+    if ( SUCCEEDED( hr ) )
+        hr = g_IWICFactory->CreateBitmap( w, h, format, WICBitmapCacheOnLoad, bitmap.GetAddressOf() );
+
+    if ( SUCCEEDED( hr ) )
+    {
+        WICRect rect = { 0, 0, (INT) w, (INT) h };
+        ComPtr<IWICBitmapLock> lock;
+        hr = bitmap->Lock( &rect, WICBitmapLockWrite, lock.GetAddressOf() );
+
+        UINT stride = 0, size = 0;
+        BYTE * pb = NULL;
+
+        if ( SUCCEEDED( hr ) )
+            hr = lock->GetStride( &stride );
+
+        if ( SUCCEEDED( hr ) )
+            hr = lock->GetDataPointer( &size, &pb );
+
+        if ( SUCCEEDED( hr ) )
+            hr = transform->CopyPixels( NULL, w, h, &format, WICBitmapTransformRotate0, stride, size, pb );
+    }
+
+    if ( FAILED( hr ) )
+    {
+        tracer.Trace( "can't decode %d x %d image at %d x %d, error %#x; decoding full size\n", width, height, w, h, hr );
+        return S_OK;
+    }
+
+    tracer.Trace( "  decoded %d x %d image at %d x %d for target %d x %d\n", width, height, w, h, targetWidth, targetHeight );
+
+    source.Reset();
+    source.Attach( bitmap.Detach() );
+    reduced = true;
+
+    return S_OK;
+} //DecodeReduced
+
+HRESULT LoadCurrentFileD2D( HWND hwnd, const WCHAR * pwcPath, IStream * pStream, int * pwidth, int * pheight, int orientation, bool useLibRaw,
+                            int targetWidth = 0, int targetHeight = 0, bool * pReduced = NULL )
 {
     g_BitmapSource.Reset();
     g_D2DBitmap.Reset();
     HRESULT hr = S_OK;
+    bool reduced = false;
+    UINT fullWidth = 0, fullHeight = 0;
 
     ComPtr<IWICBitmapSource> bitmapSource;
 
@@ -589,7 +923,14 @@ HRESULT LoadCurrentFileD2D( HWND hwnd, const WCHAR * pwcPath, IStream * pStream,
         CLibRaw libraw;
         int colors = 0;
         int bpc = 8; // use 16 when hdr display support is added
-        unique_ptr<byte> pb( libraw.ProcessRaw( pwcPath, bpc, *pwidth, *pheight, colors ) );
+
+        // When the image is shown fit to the target LibRaw makes a half-size or quickly interpolated preview.
+        // Zooming in reloads at full resolution with no target, which gets full quality.
+
+        bool preview = false;
+        int rawWidth = 0, rawHeight = 0;
+        high_resolution_clock::time_point tLibRaw = high_resolution_clock::now();
+        unique_ptr<byte> pb( libraw.ProcessRaw( pwcPath, bpc, *pwidth, *pheight, colors, targetWidth, targetHeight, &preview, &rawWidth, &rawHeight ) );
 
         if ( 0 == pb.get() )
         {
@@ -597,6 +938,41 @@ HRESULT LoadCurrentFileD2D( HWND hwnd, const WCHAR * pwcPath, IStream * pStream,
             return E_FAIL;
         }
 
+        long long libRawTime = duration_cast<std::chrono::nanoseconds>( high_resolution_clock::now() - tLibRaw ).count();
+        tracer.Trace( "  libraw made %s %d x %d image in %lld ms for %ws\n", preview ? "preview" : "full-quality", *pwidth, *pheight,
+                      libRawTime / CTimed::NanoPerMilli(), pwcPath );
+
+        if ( preview )
+        {
+            fullWidth = rawWidth;
+            fullHeight = rawHeight;
+            reduced = true;
+        }
+
+        // When the image is shown fit to the target, shrink what LibRaw made to the size it's drawn at so D2D
+        // doesn't get the full image. LibRaw has already applied the orientation, so the target isn't turned.
+
+        if ( targetWidth > 0 && targetHeight > 0 && 8 == bpc && 3 == colors && ( *pwidth > targetWidth || *pheight > targetHeight ) )
+        {
+            UINT w, h;
+            AdjustSizeToFit( *pwidth, *pheight, targetWidth, targetHeight, w, h );
+            unique_ptr<byte> pbFit( new byte[ (size_t) w * h * 3 ] );
+
+            if ( CResample::Resample( pb.get(), *pwidth, *pheight, (size_t) *pwidth * 3, pbFit.get(), w, h, (size_t) w * 3, 3 ) )
+            {
+                tracer.Trace( "  resampled %d x %d libraw image to %d x %d for target %d x %d\n", *pwidth, *pheight, w, h, targetWidth, targetHeight );
+                if ( !preview )
+                {
+                    fullWidth = *pwidth;
+                    fullHeight = *pheight;
+                }
+                *pwidth = w;
+                *pheight = h;
+                pb.reset( pbFit.release() );
+                reduced = true;
+            }
+        }
+
         UINT stride = ( *pwidth ) * colors * ( bpc / 8 );
         UINT bytes = stride * ( *pheight );
         ComPtr<IWICBitmap> bitmap;
@@ -657,87 +1033,442 @@ HRESULT LoadCurrentFileD2D( HWND hwnd, const WCHAR * pwcPath, IStream * pStream,
         {
             g_BitmapSource.Reset();
             bitmapSource.Attach( frame.Detach() );
+            hr = bitmapSource->GetSize( &fullWidth, &fullHeight );
         }
+
+        if ( SUCCEEDED( hr ) )
+            hr = DecodeReduced( bitmapSource, targetWidth, targetHeight, orientation, reduced );
     }
 
-    ComPtr<IWICFormatConverter> formatConverter;
+    // LibRaw rotates the image appropriately when creating a buffer, so there is no need to do it again.
+    // But images loaded via WIC don't automatically rotate.
+
+    if ( SUCCEEDED( hr ) )
+        hr = ConvertForDisplay( bitmapSource, useLibRaw ? 0 : orientation );
+
+    if ( SUCCEEDED( hr ) )
+    {
+        g_BitmapSource.Reset();
+        g_BitmapSource.Attach( bitmapSource.Detach() );
+    }
+
+    if ( SUCCEEDED( hr ) )
+        hr = g_BitmapSource->GetSize( (UINT *) pwidth, (UINT *) pheight );
+
+    if ( SUCCEEDED( hr ) && reduced )
+    {
+        // Report the size of the image, not of the reduced decode, turned the same way. LibRaw already turned it.
+
+        bool sideways = !useLibRaw && ( orientation >= 5 && orientation <= 8 );
+        *pwidth = sideways ? fullHeight : fullWidth;
+        *pheight = sideways ? fullWidth : fullHeight;
+    }
+
+    if ( NULL != pReduced )
+        *pReduced = reduced;
+
+    if ( SUCCEEDED( hr ) )
+        hr = CreateTargetAndD2DBitmap( hwnd );
+
+    if ( FAILED( hr ) )
+    {
+        g_BitmapSource.Reset();
+        g_D2DBitmap.Reset();
+    }
+
+    //tracer.Trace( "hr from LoadCurrentFileD2D: %#x\n", hr );
+
+    return hr;
+} //LoadCurrentFileD2D
+
+struct PVImageSource
+{
+    bool foundEmbedding;            // the file has an embedded JPG/PNG
+    bool isRaw;
+    bool isFlacOrMP3;
+    bool useLibRaw;                 // decode the RAW data rather than the embedded image
+    long long embeddedOffset;       // the embedded image to decode, if any
+    long long embeddedLength;
+    int embeddedWidth;
+    int embeddedHeight;
+    int fullWidth;
+    int fullHeight;
+    int orientation;
+    bool reduced;                   // a larger embedded image than the one chosen is available
+};
+
+void ChooseImageSource( const WCHAR * pwcFile, int monitorWidth, int monitorHeight, PVImageSource & src )
+{
+    // Decide how pwcFile should be decoded. This is shared by the UI thread and the decode-ahead threads so
+    // both pick the same pixels for a given file.
+
+    // Metadata is cached by path and last-write time, so revisiting a recent file doesn't parse it again
+    // and files changed by other apps are still noticed.
+
+    // First try to find an embedded JPG/PNG rather than having WIC do so. This is because WIC's codecs are buggy and
+    // resource leaking. This won't work for iPhone .heic files and primitives like .jpg, .png, etc. That's OK.
+    // Always call this even for files like JPG in order to get the orientation and cache other metadata
+
+    src.embeddedOffset = 0;
+    src.embeddedLength = 0;
+    src.orientation = -1;
+    src.embeddedWidth = 0;
+    src.embeddedHeight = 0;
+    src.fullWidth = 0;
+    src.fullHeight = 0;
+    src.reduced = false;
+
+    src.foundEmbedding = g_pImageData->FindEmbeddedImage( pwcFile, & src.embeddedOffset, & src.embeddedLength, & src.orientation,
+                                                          & src.embeddedWidth, & src.embeddedHeight, & src.fullWidth, & src.fullHeight );
+
+    // If the embedded JPG is large enough, use it. For some cameras, it's not. For those use LibRaw to process the RAW image.
+
+    src.isRaw = IsInExtensionList( pwcFile, (WCHAR **) RawFileExtensions, _countof( RawFileExtensions ) );
+    src.useLibRaw = false;
+
+    if ( ( pr_Always == g_ProcessRAW ) && src.isRaw )
+        src.useLibRaw = true;
+    else if ( pr_Never == g_ProcessRAW )
+        src.useLibRaw = false;
+    else if ( src.foundEmbedding )
+        src.useLibRaw = ( src.fullWidth > ( 3 * src.embeddedWidth ) ) && src.isRaw;
+
+    if ( src.isRaw && !src.foundEmbedding )
+        src.useLibRaw = true;
+
+    src.isFlacOrMP3 = IsFlacOrMP3( pwcFile );
+    if ( src.isFlacOrMP3 )
+        src.useLibRaw = false;
+
+#ifndef PV_USE_LIBRAW
+    src.useLibRaw = false;
+#endif // PV_USE_LIBRAW
+
+    tracer.Trace( "  find embedded image result %d, %lld, %lld, orientation %d useLibRaw %d for %ws\n", src.foundEmbedding,
+                  src.embeddedOffset, src.embeddedLength, src.orientation, src.useLibRaw, pwcFile );
+
+    if ( src.foundEmbedding && !src.useLibRaw && src.isRaw && monitorWidth > 0 && monitorHeight > 0 )
+    {
+        // The largest preview decided whether LibRaw is needed. Decode the smallest one that still covers the
+        // monitor; many RAW files carry a full-size JPG that's several times the work of a medium preview.
+
+        long long largestOffset = src.embeddedOffset;
+        g_pImageData->FindEmbeddedImage( pwcFile, & src.embeddedOffset, & src.embeddedLength, & src.orientation,
+                                         & src.embeddedWidth, & src.embeddedHeight, & src.fullWidth, & src.fullHeight,
+                                         monitorWidth, monitorHeight );
+        src.reduced = ( largestOffset != src.embeddedOffset );
+        tracer.Trace( "  using embedded image %lld, %lld, %d x %d for monitor %d x %d\n", src.embeddedOffset, src.embeddedLength,
+                      src.embeddedWidth, src.embeddedHeight, monitorWidth, monitorHeight );
+    }
+} //ChooseImageSource
+
+class CWICDecoder : public CImageDecoder
+{
+    private:
+        std::atomic<int> monitorWidth;
+        std::atomic<int> monitorHeight;
+
+    public:
+        CWICDecoder() : monitorWidth( 0 ), monitorHeight( 0 ) {}
+
+        void SetMonitorSize( int width, int height )
+        {
+            monitorWidth = width;
+            monitorHeight = height;
+        } //SetMonitorSize
+
+        void ThreadStart() { CoInitializeEx( NULL, COINIT_MULTITHREADED ); }
+        void ThreadEnd() { CoUninitialize(); }
+
+        bool Decode( const WCHAR * pwcPath, CDecodedImage & image )
+        {
+            // Produce the same pixels LoadCurrentFileD2D would. LibRaw is too slow and memory-hungry to run
+            // speculatively, so those files are left for the UI thread.
+
+            ULONGLONG stamp = CImageData::LastWriteTime( pwcPath );
+
+            PVImageSource src;
+            ChooseImageSource( pwcPath, monitorWidth, monitorHeight, src );
+
+            if ( src.useLibRaw || src.isFlacOrMP3 )
+                return false;
+
+            ComPtr<IWICBitmapDecoder> decoder;
+            HRESULT hr = S_OK;
+
+            if ( src.foundEmbedding && src.isRaw )
+            {
+                CIStream * pStream = new CIStream( pwcPath, src.embeddedOffset, src.embeddedLength );
+
+                // The ComPtr constructor that takes an object does an AddRef(), and this leads to leaks. Avoid that.
+
+                ComPtr<IStream> stream;
+                stream.Attach( pStream );
+
+                if ( !pStream->Ok() )
+                    return false;
+
+                hr = g_IWICFactory->CreateDecoderFromStream( stream.Get(), NULL, WICDecodeMetadataCacheOnDemand, decoder.GetAddressOf() );
+            }
+            else
+                hr = g_IWICFactory->CreateDecoderFromFilename( pwcPath, NULL, GENERIC_READ, WICDecodeMetadataCacheOnDemand, decoder.GetAddressOf() );
+
+            ComPtr<IWICBitmapFrameDecode> frame;
+            if ( SUCCEEDED( hr ) )
+                hr = decoder->GetFrame( 0, frame.GetAddressOf() );
+
+            ComPtr<IWICBitmapSource> source;
+            UINT fullWidth = 0, fullHeight = 0;
+            bool reduced = false;
+
+            if ( SUCCEEDED( hr ) )
+            {
+                source.Attach( frame.Detach() );
+                hr = source->GetSize( &fullWidth, &fullHeight );
+            }
+
+            if ( SUCCEEDED( hr ) && g_decodeToFit )
+                hr = DecodeReduced( source, monitorWidth, monitorHeight, src.orientation, reduced );
+
+            if ( SUCCEEDED( hr ) )
+                hr = ConvertForDisplay( source, src.orientation );
+
+            UINT width = 0, height = 0;
+            if ( SUCCEEDED( hr ) )
+                hr = source->GetSize( &width, &height );
+
+            if ( SUCCEEDED( hr ) )
+            {
+                bool sideways = ( src.orientation >= 5 && src.orientation <= 8 );
+                image.width = width;
+                image.height = height;
+                image.fullWidth = sideways ? fullHeight : fullWidth;
+                image.fullHeight = sideways ? fullWidth : fullHeight;
+                image.reduced = reduced || src.reduced;
+                image.stride = width * 4;
+                image.stamp = stamp;
+                image.pixels.reset( new ( std::nothrow ) BYTE[ image.Bytes() ] );
+
+                if ( !image.pixels )
+                    hr = E_OUTOFMEMORY;
+            }
+
+            if ( SUCCEEDED( hr ) )
+                hr = source->CopyPixels( NULL, image.stride, (UINT) image.Bytes(), image.pixels.get() );
+
+            if ( FAILED( hr ) )
+            {
+                tracer.Trace( "  decode ahead failed with error %#x for %ws\n", hr, pwcPath );
+                return false;
+            }
+
+            return true;
+        } //Decode
+}; //CWICDecoder
+
+static bool GetMonitorSize( HWND hwnd, int & width, int & height )
+{
+    MONITORINFO mi;
+    mi.cbSize = sizeof mi;
+    if ( !GetMonitorInfo( MonitorFromWindow( hwnd, MONITOR_DEFAULTTONEAREST ), &mi ) )
+        return false;
+
+    width = mi.rcMonitor.right - mi.rcMonitor.left;
+    height = mi.rcMonitor.bottom - mi.rcMonitor.top;
+    return true;
+} //GetMonitorSize
+
+static bool LoadDecodedImage( HWND hwnd, CDecodedImage & image )
+{
+    // Show pixels decoded ahead of time. CreateBitmapFromMemory copies them, so the cache keeps its copy.
+
+    g_BitmapSource.Reset();
+    g_D2DBitmap.Reset();
+
+    ComPtr<IWICBitmap> bitmap;
+    HRESULT hr = g_IWICFactory->CreateBitmapFromMemory( image.width, image.height, GUID_WICPixelFormat32bppPBGRA, image.stride,
+                                                        (UINT) image.Bytes(), image.pixels.get(), bitmap.GetAddressOf() );
     if ( SUCCEEDED( hr ) )
-        hr = g_IWICFactory->CreateFormatConverter( formatConverter.GetAddressOf() );
+    {
+        g_BitmapSource.Attach( bitmap.Detach() );
+        hr = CreateTargetAndD2DBitmap( hwnd );
+    }
+
+    if ( FAILED( hr ) )
+    {
+        tracer.Trace( "  can't use the image decoded ahead, error %#x\n", hr );
+        g_BitmapSource.Reset();
+        g_D2DBitmap.Reset();
+        return false;
+    }
+
+    return true;
+} //LoadDecodedImage
+
+static void ScheduleDecodeAhead()
+{
+    if ( NULL == g_pDecodeAhead || 0 == g_pImageArray->Count() )
+        return;
+
+    int direction = ( md_Previous == g_lastMove ) ? CDecodeAhead::DirectionPrevious : CDecodeAhead::DirectionNext;
+    g_pDecodeAhead->Schedule( g_currentBitmapIndex, g_pImageArray->Count(), direction, [] ( size_t i ) { return g_pImageArray->Get( i ); } );
+} //ScheduleDecodeAhead
+
+static void ClearDecodeAhead()
+{
+    // Call before a file is rewritten or deleted, or before a setting the decoders read changes. Once this returns no
+    // decode is running until the next ScheduleDecodeAhead. Decoded images are found by path, so reordering,
+    // adding, or removing paths doesn't need this.
+
+    if ( NULL != g_pDecodeAhead )
+        g_pDecodeAhead->Clear();
+} //ClearDecodeAhead
+
+static void SetTitle( HWND hwnd, const WCHAR * pwcFile )
+{
+    unique_ptr<WCHAR> titleResource( new WCHAR[ 100 ] );
+    int ret = LoadStringW( NULL, ID_PV_STRING_TITLE, titleResource.get(), 100 );
+    if ( 0 == ret )
+        titleResource.get()[0] = 0;
+
+    const int maxTitleLen = MAX_PATH + 100;
+    unique_ptr<WCHAR> winTitle( new WCHAR[ maxTitleLen ] );
+
+    int len = swprintf_s( winTitle.get(), maxTitleLen, titleResource.get(), g_currentBitmapIndex + 1, g_pImageArray->Count(), pwcFile );
+    if ( -1 != len )
+        SetWindowText( hwnd, winTitle.get() );
+} //SetTitle
+
+static void SetTitleAndMetadata( HWND hwnd, const WCHAR * pwcFile, int width, int height )
+{
+    CTimed timedInterestingMetadata( timeMetadata );
+    g_acImageMetadata[ 0 ] = 0;
+    g_awcImageMetadata[ 0 ] = 0;
+    bool ok = g_pImageData->GetInterestingMetadata( pwcFile, g_acImageMetadata, _countof( g_acImageMetadata ), width, height );
+    if ( ok )
+    {
+        size_t cConverted = 0;
+        mbstowcs_s( &cConverted, g_awcImageMetadata, _countof( g_awcImageMetadata ), g_acImageMetadata, 1 + strlen( g_acImageMetadata ) );
+    }
+
+    SetTitle( hwnd, pwcFile );
+} //SetTitleAndMetadata
+
+static bool LoadThumbnail( HWND hwnd, const WCHAR * pwcFile, const PVImageSource & src )
+{
+    // Put something much quicker to decode than the full image in g_BitmapSource and g_D2DBitmap: the smallest
+    // embedded preview in a RAW file, or the thumbnail the codec finds (the Exif IFD1 JPG for JPG files).
+    // Returns false if there's nothing smaller than what the full decode would use.
+
+    if ( src.isFlacOrMP3 )
+        return false;
+
+    ComPtr<IWICBitmapDecoder> decoder;
+    HRESULT hr = S_OK;
+
+    if ( src.isRaw )
+    {
+        if ( !src.foundEmbedding )
+            return false;
+
+        long long offset = 0, length = 0;
+        int orientation = 0, width = 0, height = 0, fullWidth = 0, fullHeight = 0;
+        g_pImageData->FindEmbeddedImage( pwcFile, &offset, &length, &orientation, &width, &height, &fullWidth, &fullHeight, 1, 1 );
+
+        // Unless LibRaw is about to run, it's only worth it if the preview is much smaller than the image being decoded
+
+        bool muchSmaller = ( 4 * (long long) width * height <= (long long) src.embeddedWidth * src.embeddedHeight );
+
+        if ( 0 == offset || ( !src.useLibRaw && ( offset == src.embeddedOffset || !muchSmaller ) ) )
+            return false;
+
+        CIStream * pStream = new CIStream( pwcFile, offset, length );
+
+        // The ComPtr constructor that takes an object does an AddRef(), and this leads to leaks. Avoid that.
+
+        ComPtr<IStream> stream;
+        stream.Attach( pStream );
+
+        if ( !pStream->Ok() )
+            return false;
+
+        hr = g_IWICFactory->CreateDecoderFromStream( stream.Get(), NULL, WICDecodeMetadataCacheOnDemand, decoder.GetAddressOf() );
+    }
+    else if ( !src.useLibRaw )
+        hr = g_IWICFactory->CreateDecoderFromFilename( pwcFile, NULL, GENERIC_READ, WICDecodeMetadataCacheOnDemand, decoder.GetAddressOf() );
+    else
+        return false;
 
+    ComPtr<IWICBitmapFrameDecode> frame;
     if ( SUCCEEDED( hr ) )
-    {
-        hr = formatConverter->Initialize( bitmapSource.Get(), GUID_WICPixelFormat32bppPBGRA, WICBitmapDitherTypeNone, NULL, 0.f, WICBitmapPaletteTypeCustom );
-        if ( SUCCEEDED( hr ) )
-        {
-            g_BitmapSource.Reset();
-            g_BitmapSource.Attach( formatConverter.Detach() );
-        }
-    }
+        hr = decoder->GetFrame( 0, frame.GetAddressOf() );
 
-    // LibRaw rotates the image appropriately when creating a buffer, so there is no need to do it again.
-    // But images loaded via WIC don't automatically rotate.
+    // Embedded previews are decoded whole; they're small. Otherwise ask the codec for its thumbnail.
 
-    if ( SUCCEEDED( hr ) && ( orientation >= 3 ) && ( orientation <= 8 ) && !useLibRaw )
+    ComPtr<IWICBitmapSource> source;
+    if ( SUCCEEDED( hr ) )
     {
-        ComPtr<IWICBitmapFlipRotator> rotator;
-        hr = g_IWICFactory->CreateBitmapFlipRotator( rotator.GetAddressOf() );
-        if ( SUCCEEDED( hr ) )
-        {
-            WICBitmapTransformOptions wbto = WICBitmapTransformRotate0;
-    
-            if ( orientation == 3 || orientation == 4 )
-                wbto = WICBitmapTransformRotate180;
-            else if ( orientation == 5 || orientation == 6 )
-                wbto = WICBitmapTransformRotate90;
-            else if ( orientation == 7 || orientation == 8 )
-                wbto = WICBitmapTransformRotate270;
-        
-            //if ( val == 2 || val == 4 || val == 5 || val == 7 )
-            //    rot = (RotateFlipType) ( (int) rot | (int) RotateNoneFlipX );
-
-            if ( WICBitmapTransformRotate0 != wbto )
-            {
-                hr = rotator->Initialize( g_BitmapSource.Get(), wbto );
-                tracer.Trace( "rotated wic bitmap exif orientation %d, wic transform %d, hr %#x\n", orientation, wbto, hr );
-    
-                if ( SUCCEEDED( hr ) )
-                {
-                    g_BitmapSource.Reset();
-                    g_BitmapSource.Attach( rotator.Detach() );
-                }
-            }
-        }
+        if ( src.isRaw )
+            source.Attach( frame.Detach() );
+        else
+            hr = frame->GetThumbnail( source.GetAddressOf() );
     }
 
     if ( SUCCEEDED( hr ) )
-        hr = g_BitmapSource->GetSize( (UINT *) pwidth, (UINT *) pheight );
+        hr = ConvertForDisplay( source, src.orientation );
 
     if ( SUCCEEDED( hr ) )
+    {
+        g_BitmapSource.Reset();
+        g_D2DBitmap.Reset();
+        g_BitmapSource.Attach( source.Detach() );
         hr = CreateTargetAndD2DBitmap( hwnd );
+    }
 
     if ( FAILED( hr ) )
     {
+        // WINCODEC_ERR_CODECNOTHUMBNAIL is common
+
         g_BitmapSource.Reset();
         g_D2DBitmap.Reset();
+        return false;
     }
 
-    //tracer.Trace( "hr from LoadCurrentFileD2D: %#x\n", hr );
-
-    return hr;
-} //LoadCurrentFileD2D
+    return true;
+} //LoadThumbnail
 
-bool LoadCurrentFileUsingD2D( HWND hwnd )
+static void RecordFullQuality( const WCHAR * pwcFile, bool fromThumbnail )
 {
-    unique_ptr<WCHAR> titleResource( new WCHAR[ 100 ] );
-    int ret = LoadStringW( NULL, ID_PV_STRING_TITLE, titleResource.get(), 100 );
-    if ( 0 == ret )
-        titleResource.get()[0] = 0;
+    long long fullQuality = duration_cast<std::chrono::nanoseconds>( high_resolution_clock::now() - g_navigationStart ).count();
 
-    const int maxTitleLen = MAX_PATH + 100;
-    unique_ptr<WCHAR> winTitle( new WCHAR[ maxTitleLen ] );
+    timeFullQuality += fullQuality;
+    imagesFullQuality++;
+
+    if ( !fromThumbnail )
+    {
+        timeFirstPixels += fullQuality;
+        imagesFirstPixels++;
+        tracer.Trace( "  first pixels and full quality after %lld ms for %ws\n", fullQuality / CTimed::NanoPerMilli(), pwcFile );
+    }
+    else
+        tracer.Trace( "  full quality after %lld ms for %ws\n", fullQuality / CTimed::NanoPerMilli(), pwcFile );
+} //RecordFullQuality
+
+bool LoadCurrentFileUsingD2D( HWND hwnd, PVLoadMode mode = lm_Progressive )
+{
+    // lm_Progressive may show a thumbnail before the full image when the full image isn't decoded yet.
+    // lm_Complete goes straight to the full image, and lm_FullResolution decodes the largest version available for zooming in.
 
     if ( 0 == g_pImageArray->Count() )
     {
+        unique_ptr<WCHAR> titleResource( new WCHAR[ 100 ] );
+        int ret = LoadStringW( NULL, ID_PV_STRING_TITLE, titleResource.get(), 100 );
+        if ( 0 == ret )
+            titleResource.get()[0] = 0;
+
+        const int maxTitleLen = MAX_PATH + 100;
+        unique_ptr<WCHAR> winTitle( new WCHAR[ maxTitleLen ] );
+
         int len = swprintf_s( winTitle.get(), maxTitleLen, titleResource.get(), 0, 0, L"" );
         if ( -1 != len )
             SetWindowText( hwnd, winTitle.get() );
@@ -745,61 +1476,95 @@ bool LoadCurrentFileUsingD2D( HWND hwnd )
         return true;
     }
 
+    // Replacing a thumbnail finishes the load that started when the user navigated here
+
+    bool fromThumbnail = ( lm_Complete == mode && g_currentIsThumbnail );
+    bool timed = ( lm_Progressive == mode || fromThumbnail );
+    g_currentIsThumbnail = false;
+
+    if ( lm_Progressive == mode )
+        g_navigationStart = high_resolution_clock::now();
+
     CCursor hourglass( LoadCursor( NULL, IDC_WAIT ) );
     int availableWidth = 0;
     int availableHeight = 0;
     const WCHAR * pwcFile = g_pImageArray->Get( g_currentBitmapIndex );
+    bool fullResolution = ( lm_FullResolution == mode );
 
-    g_pImageData->PurgeCache();
+    // Without a monitor size everything is decoded at full size
 
-    // First try to find an embedded JPG/PNG rather than having WIC do so. This is because WIC's codecs are buggy and
-    // resource leaking. This won't work for iPhone .heic files and primitives like .jpg, .png, etc. That's OK.
-    // Always call this even for files like JPG in order to get the orientation and cache other metadata
+    int monitorWidth = 0;
+    int monitorHeight = 0;
+    if ( !fullResolution )
+        GetMonitorSize( hwnd, monitorWidth, monitorHeight );
 
-    long long llEmbeddedOffset = 0;
-    long long llEmbeddedLength = 0;
-    int orientationValue = -1;
-    int embeddedWidth = 0;
-    int embeddedHeight = 0;
-    int fullWidth = 0;
-    int fullHeight = 0;
+    // If this image was decoded ahead of time it only needs to be uploaded. The cache checks the file
+    // hasn't been written since it was decoded.
 
-    CTimed timedMetadata( timeMetadata );
+    bool loaded = false;
+    bool reduced = false;
 
-    bool foundEmbedding = g_pImageData->FindEmbeddedImage( pwcFile, & llEmbeddedOffset, & llEmbeddedLength, & orientationValue,
-                                                           & embeddedWidth, & embeddedHeight, & fullWidth, & fullHeight );
-    timedMetadata.Complete();
+    if ( NULL != g_pDecodeAhead && !fullResolution )
+    {
+        g_pWICDecoder->SetMonitorSize( monitorWidth, monitorHeight );
+        shared_ptr<CDecodedImage> decoded = g_pDecodeAhead->Take( pwcFile, CImageData::LastWriteTime( pwcFile ) );
 
-    // If the embedded JPG is large enough, use it. For some cameras, it's not. For those use LibRaw to process the RAW image.
+        if ( decoded && LoadDecodedImage( hwnd, *decoded ) )
+        {
+            tracer.Trace( "  using image decoded ahead for %ws\n", pwcFile );
+            availableWidth = decoded->fullWidth;
+            availableHeight = decoded->fullHeight;
+            reduced = decoded->reduced;
+            loaded = true;
+        }
+    }
 
-    bool isRaw = IsInExtensionList( pwcFile, (WCHAR **) RawFileExtensions, _countof( RawFileExtensions ) );
-    bool useLibRaw = false;
+    PVImageSource src;
 
-    if ( ( pr_Always == g_ProcessRAW ) && isRaw )
-        useLibRaw = true;
-    else if ( pr_Never == g_ProcessRAW )
-        useLibRaw = false;
-    else if ( foundEmbedding )
-        useLibRaw = ( fullWidth > ( 3 * embeddedWidth ) ) && isRaw;
+    CTimed timedMetadata( timeMetadata );
+    if ( !loaded )
+        ChooseImageSource( pwcFile, monitorWidth, monitorHeight, src );
+    timedMetadata.Complete();
+
+    // Paint a thumbnail right away, then decode the full image. If the user has already pressed another key
+    // (holding an arrow key to skim through a folder, say) leave the thumbnail up and finish once input stops.
 
-    if ( isRaw && !foundEmbedding )
-        useLibRaw = true;
+    if ( !loaded && lm_Progressive == mode && LoadThumbnail( hwnd, pwcFile, src ) )
+    {
+        SetTitleAndMetadata( hwnd, pwcFile, src.fullWidth, src.fullHeight );
+        InvalidateRect( hwnd, NULL, TRUE );
+        UpdateWindow( hwnd );
 
-    bool isFlacOrMP3 = IsFlacOrMP3( pwcFile );
-    if ( isFlacOrMP3 )
-        useLibRaw = false;
+        long long firstPixels = duration_cast<std::chrono::nanoseconds>( high_resolution_clock::now() - g_navigationStart ).count();
+        timeFirstPixels += firstPixels;
+        imagesFirstPixels++;
+        imagesShownFromThumbnail++;
+        tracer.Trace( "  first pixels from thumbnail after %lld ms for %ws\n", firstPixels / CTimed::NanoPerMilli(), pwcFile );
 
-#ifndef PV_USE_LIBRAW
-    useLibRaw = false;
-#endif // PV_USE_LIBRAW
+        fromThumbnail = true;
+        g_currentIsReduced = true;
+        g_currentIsThumbnail = true;
 
-    tracer.Trace( "  find embedded image result %d, %lld, %lld, orientation %d useLibRaw %d for %ws\n", foundEmbedding, llEmbeddedOffset, llEmbeddedLength, orientationValue, useLibRaw, pwcFile );
+        MSG msg;
+        if ( PeekMessage( &msg, hwnd, WM_KEYDOWN, WM_KEYDOWN, PM_NOREMOVE ) )
+        {
+            SetTimer( hwnd, TIMER_UPGRADE_ID, 0, NULL );
+            ScheduleDecodeAhead();
+            return true;
+        }
+
+        g_currentIsThumbnail = false;
+    }
 
     CTimed timedLoad( timeLoad );
 
-    if ( foundEmbedding && !useLibRaw && isRaw )
+    if ( loaded )
+    {
+        // already in g_BitmapSource and g_D2DBitmap
+    }
+    else if ( src.foundEmbedding && !src.useLibRaw && src.isRaw )
     {
-        CIStream * pStream = new CIStream( pwcFile, llEmbeddedOffset, llEmbeddedLength );
+        CIStream * pStream = new CIStream( pwcFile, src.embeddedOffset, src.embeddedLength );
         if ( !pStream->Ok() )
         {
             tracer.Trace( "can't open IStream for embedded image\n" );
@@ -811,7 +1576,10 @@ bool LoadCurrentFileUsingD2D( HWND hwnd )
         ComPtr<IStream> stream;
         stream.Attach( pStream );
 
-        HRESULT hr = LoadCurrentFileD2D( hwnd, NULL, stream.Get(), &availableWidth, &availableHeight, orientationValue, false );
+        int targetWidth = g_decodeToFit ? monitorWidth : 0;
+        int targetHeight = g_decodeToFit ? monitorHeight : 0;
+        HRESULT hr = LoadCurrentFileD2D( hwnd, NULL, stream.Get(), &availableWidth, &availableHeight, src.orientation, false,
+                                         targetWidth, targetHeight, &reduced );
         if ( FAILED( hr ) )
         {
             tracer.Trace( "  failed error %#x to load embedded image for %ws\n", hr, pwcFile );
@@ -821,9 +1589,12 @@ bool LoadCurrentFileUsingD2D( HWND hwnd )
         stream.Reset();
         //tracer.Trace( "  loaded embedded image for %ws\n", pwcFile );
     }
-    else if ( !isFlacOrMP3 )
+    else if ( !src.isFlacOrMP3 )
     {
-        HRESULT hr = LoadCurrentFileD2D( hwnd, pwcFile, NULL, &availableWidth, &availableHeight, orientationValue, useLibRaw );
+        int targetWidth = g_decodeToFit ? monitorWidth : 0;
+        int targetHeight = g_decodeToFit ? monitorHeight : 0;
+        HRESULT hr = LoadCurrentFileD2D( hwnd, pwcFile, NULL, &availableWidth, &availableHeight, src.orientation, src.useLibRaw,
+                                         targetWidth, targetHeight, &reduced );
         if ( FAILED( hr ) )
         {
             tracer.Trace( "  LoadCurrentFileD2D failed with error %#x, can't load file %ws\n", hr, pwcFile );
@@ -840,19 +1611,13 @@ bool LoadCurrentFileUsingD2D( HWND hwnd )
 
     timedLoad.Complete();
 
-    CTimed timedInterestingMetadata( timeMetadata );
-    g_acImageMetadata[ 0 ] = 0;
-    g_awcImageMetadata[ 0 ] = 0;
-    bool ok = g_pImageData->GetInterestingMetadata( pwcFile, g_acImageMetadata, _countof( g_acImageMetadata ), availableWidth, availableHeight );
-    if ( ok )
-    {
-        size_t cConverted = 0;
-        mbstowcs_s( &cConverted, g_awcImageMetadata, _countof( g_awcImageMetadata ), g_acImageMetadata, 1 + strlen( g_acImageMetadata ) );
-    }
+    g_currentIsReduced = reduced || ( !loaded && src.reduced );
 
-    int len = swprintf_s( winTitle.get(), maxTitleLen, titleResource.get(), g_currentBitmapIndex + 1, g_pImageArray->Count(), pwcFile );
-    if ( -1 != len )
-        SetWindowText( hwnd, winTitle.get() );
+    if ( timed )
+        RecordFullQuality( pwcFile, fromThumbnail );
+
+    SetTitleAndMetadata( hwnd, pwcFile, availableWidth, availableHeight );
+    ScheduleDecodeAhead();
 
     return true;
 } //LoadCurrentFileUsingD2D
@@ -864,6 +1629,9 @@ bool LoadNextImageInternal( HWND hwnd, PVMoveDirection md )
     if ( 0 == g_pImageArray->Count() )
         return true;
 
+    if ( md_Stay != md )
+        g_lastMove = md;
+
     if ( md_Next == md )
     {
         g_currentBitmapIndex++;
@@ -1097,6 +1865,7 @@ extern "C" INT_PTR WINAPI HelpDialogProc( HWND hdlg, UINT message, WPARAM wParam
                                      "notes:\n"
                                      "\t- All image files below the given folder are enumerated.\n"
                                      "\t- Entering slideshow for 1st time randomizes image order.\n"
+                                     "\t- Images are decoded at screen size until zoomed. Registry DecodeToFit=No disables this.\n"
                                      "\t- iPhone .heic photos require a free Microsoft Store codec.\n"
                                      "\t- WIC leaks handles for .heic photos.\n"
                                      "\t- WIC crashes for DNGs created by Lightroom's \"enhance.\"\n"
@@ -1299,6 +2068,193 @@ void SortImages()
         g_pImageArray->SortOnCapture( g_SortImagesAscending );
 } //SortImages
 
+static void TraceTimeToFirstImage()
+{
+    long long ms = duration_cast<std::chrono::milliseconds>( high_resolution_clock::now() - g_enumerationStart ).count();
+    tracer.Trace( "time to first image: %lld ms, %zu files found so far\n", ms, g_pImageArray->Count() );
+} //TraceTimeToFirstImage
+
+// Move paths found by the enumeration thread into g_pImageArray. The image being shown stays current even
+// though its index may change, so navigation continues from where the user is.
+
+static void MergeFoundImages( HWND hwnd )
+{
+    size_t before = g_pImageArray->Count();
+    const WCHAR * pwcCurrent = ( 0 == before ) ? NULL : g_pImageArray->Get( g_currentBitmapIndex );
+
+    if ( g_pImageArray->Merge( *g_pFoundImages, g_pwcShownEarly ) )
+        g_pwcShownEarly = NULL;
+
+    if ( g_pImageArray->Count() == before )
+        return;
+
+    if ( NULL == pwcCurrent )
+    {
+        // Nothing has been shown yet; show the first image found
+
+        g_currentBitmapIndex = 0;
+        LoadNextImage( hwnd, md_Stay );
+        InvalidateRect( hwnd, NULL, TRUE );
+        TraceTimeToFirstImage();
+        return;
+    }
+
+    g_currentBitmapIndex = g_pImageArray->IndexOf( pwcCurrent );
+    SetTitle( hwnd, pwcCurrent );
+    ScheduleDecodeAhead();
+} //MergeFoundImages
+
+static void LoadCaptureTimesInBackground( HWND hwnd )
+{
+    if ( g_captureThread.joinable() )
+        return;
+
+    g_pCaptureTimes = new CPathArray();
+    g_pImageArray->CopyForCaptureTimes( *g_pCaptureTimes );
+
+    g_captureThread = std::thread( [hwnd] ()
+    {
+        g_pCaptureTimes->LoadCaptureTimes();
+        g_pCaptureTimes->SortOnPath();
+        PostMessage( hwnd, WM_PV_CAPTURE_TIMES, 0, 0 );
+    } );
+} //LoadCaptureTimesInBackground
+
+static void AddChangedFile( const WCHAR * pwcPath )
+{
+    if ( !IsInExtensionList( pwcPath, g_pwcExtensions, g_cExtensions ) )
+        return;
+
+    WIN32_FILE_ATTRIBUTE_DATA fad;
+    if ( !GetFileAttributesEx( pwcPath, GetFileExInfoStandard, &fad ) || 0 != ( fad.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY ) )
+        return;
+
+    ULARGE_INTEGER size;
+    size.LowPart = fad.nFileSizeLow;
+    size.HighPart = fad.nFileSizeHigh;
+    g_pImageArray->Insert( pwcPath, fad.ftCreationTime, fad.ftLastWriteTime, size.QuadPart );
+} //AddChangedFile
+
+static void AddChangedFolder( const WCHAR * pwcFolder )
+{
+    // A folder that's moved in arrives as one change, so find what's in it
+
+    CPathArray found;
+    CEnumFolder enumFolder( true, &found, g_pwcExtensions, g_cExtensions );
+    enumFolder.Enumerate( pwcFolder, L"*" );
+
+    for ( size_t i = 0; i < found.Count(); i++ )
+    {
+        FILETIME ftCreation, ftLastWrite;
+        ULONGLONG fileSize;
+        found.GetFileInfo( i, ftCreation, ftLastWrite, fileSize );
+        g_pImageArray->Insert( found.Get( i ), ftCreation, ftLastWrite, fileSize );
+    }
+} //AddChangedFolder
+
+// Apply folder changes to g_pImageArray in place; each is a search and an insert or removal, not a new
+// enumeration. The image being shown stays current, even if it's renamed, and if it was removed the one after
+// it is shown.
+
+static void ApplyFolderChanges( HWND hwnd )
+{
+    vector<CFolderChange> changes;
+
+    {
+        lock_guard<mutex> lock( g_folderChangesMutex );
+        changes.swap( g_folderChanges );
+    }
+
+    if ( 0 == changes.size() )
+        return;
+
+    size_t before = g_pImageArray->Count();
+    const WCHAR * pwcCurrent = ( 0 == before ) ? NULL : g_pImageArray->Get( g_currentBitmapIndex );
+    bool currentRemoved = false;
+
+    for ( size_t c = 0; c < changes.size(); c++ )
+    {
+        const CFolderChange & change = changes[ c ];
+
+        if ( CFolderChange::Overflow == change.action )
+        {
+            tracer.Trace( "folder changes were lost; files added or removed meanwhile won't show until pv restarts\n" );
+            continue;
+        }
+
+        const WCHAR * pwcGone = ( CFolderChange::Removed == change.action ) ? change.path.c_str() :
+                                ( CFolderChange::Renamed == change.action ) ? change.oldPath.c_str() : NULL;
+        std::wstring renamedCurrent;
+
+        if ( NULL != pwcGone )
+        {
+            if ( NULL != pwcCurrent && CPathArray::IsSameOrUnder( pwcCurrent, pwcGone ) )
+            {
+                // A rename of the file or a folder above it keeps the image, so it's followed to its new path
+
+                if ( CFolderChange::Renamed == change.action )
+                    renamedCurrent = change.path + ( pwcCurrent + change.oldPath.length() );
+
+                g_currentBitmapIndex = g_pImageArray->IndexOf( pwcCurrent );
+                pwcCurrent = NULL;
+                currentRemoved = true;
+            }
+
+            g_pImageArray->Remove( pwcGone );
+        }
+
+        if ( CFolderChange::Removed != change.action )
+        {
+            if ( !change.isFolder )
+                AddChangedFile( change.path.c_str() );
+            else if ( CFolderChange::Modified != change.action )
+                AddChangedFolder( change.path.c_str() );
+        }
+
+        // It's only gone if it was renamed to something that isn't shown, like another extension
+
+        if ( !renamedCurrent.empty() )
+        {
+            size_t renamed = g_pImageArray->Find( renamedCurrent.c_str() );
+
+            if ( renamed < g_pImageArray->Count() )
+            {
+                g_currentBitmapIndex = renamed;
+                pwcCurrent = g_pImageArray->Get( renamed );
+                currentRemoved = false;
+            }
+        }
+    }
+
+    tracer.Trace( "applied %zu folder changes, %zu files before and %zu after\n", changes.size(), before, g_pImageArray->Count() );
+
+    if ( NULL != pwcCurrent )
+    {
+        g_currentBitmapIndex = g_pImageArray->IndexOf( pwcCurrent );
+        SetTitle( hwnd, pwcCurrent );
+        ScheduleDecodeAhead();
+        return;
+    }
+
+    if ( !currentRemoved && 0 == g_pImageArray->Count() )
+        return;
+
+    // The image shown is gone, or there was nothing to show before
+
+    g_BitmapSource.Reset();
+    g_D2DBitmap.Reset();
+
+    if ( g_currentBitmapIndex >= g_pImageArray->Count() )
+        g_currentBitmapIndex = 0;
+
+    if ( 0 == g_pImageArray->Count() )
+        LoadCurrentFileUsingD2D( hwnd );
+    else
+        LoadNextImage( hwnd, md_Stay );
+
+    InvalidateRect( hwnd, NULL, TRUE );
+} //ApplyFolderChanges
+
 // Each monitor on which the window resides results in a call (not all monitors).
 // Use the last one called (which is fine).
 
@@ -1338,6 +2294,7 @@ void DeleteCommand( HWND hwnd )
 
         g_BitmapSource.Reset();
         g_D2DBitmap.Reset();
+        ClearDecodeAhead();
 
         BOOL deleteWorked = DeleteFile( g_pImageArray->Get( g_currentBitmapIndex ) );
         if ( deleteWorked )
@@ -1420,6 +2377,7 @@ void RatingCommand( HWND hwnd, char r = 0 )
 
         g_BitmapSource.Reset();
         g_D2DBitmap.Reset();
+        ClearDecodeAhead();
 
         if ( 0 == r )
         {
@@ -1439,7 +2397,7 @@ void RatingCommand( HWND hwnd, char r = 0 )
 
         // load the current file again
 
-        LoadCurrentFileUsingD2D( hwnd );
+        LoadCurrentFileUsingD2D( hwnd, lm_Complete );
         InvalidateRect( hwnd, NULL, TRUE );
     }
 } //RatingCommand
@@ -1520,8 +2478,12 @@ LRESULT CALLBACK WindowProc( HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam
             {
                 int processingIndex = (int) wParam - ID_PV_RAW_ALWAYS;
                 //tracer.Trace( "changing processraw from %d to %d\n", g_ProcessRAW, processingIndex );
+
+                // The decode-ahead threads read g_ProcessRAW, so stop them before it changes
+
+                ClearDecodeAhead();
                 g_ProcessRAW = (PVProcessRAW) processingIndex;
-                LoadCurrentFileUsingD2D( hwnd );
+                LoadCurrentFileUsingD2D( hwnd, lm_Complete );
                 InvalidateRect( hwnd, NULL, TRUE );
             }
             else if ( ( ID_PV_SORT_ASCENDING == wParam ) || ( wParam >= ID_PV_SORT_CAPTURE && wParam <= ID_PV_SORT_PATH ) )
@@ -1540,7 +2502,7 @@ LRESULT CALLBACK WindowProc( HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam
                     SortImages();
 
                     NavigateToStartingPhoto( awcCurrent );
-                    LoadCurrentFileUsingD2D( hwnd );
+                    LoadCurrentFileUsingD2D( hwnd, lm_Complete );
                     InvalidateRect( hwnd, NULL, TRUE );
                 }
             }
@@ -1614,6 +2576,102 @@ LRESULT CALLBACK WindowProc( HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam
                 LoadNextImage( hwnd, md_Next );
                 InvalidateRect( hwnd, NULL, TRUE );
             }
+            else if ( TIMER_UPGRADE_ID == wParam )
+            {
+                // Timer messages come after input, so there's been a pause in navigation. Replace the thumbnail.
+
+                KillTimer( hwnd, TIMER_UPGRADE_ID );
+
+                if ( g_currentIsThumbnail )
+                {
+                    LoadCurrentFileUsingD2D( hwnd, lm_Complete );
+                    InvalidateRect( hwnd, NULL, TRUE );
+                }
+            }
+            else if ( TIMER_MERGE_ID == wParam )
+            {
+                KillTimer( hwnd, TIMER_MERGE_ID );
+                g_mergePending = false;
+                MergeFoundImages( hwnd );
+            }
+
+            return 0;
+        }
+
+        case WM_PV_IMAGES_FOUND:
+        {
+            // Merge right away until there's something to show. After that, batch merges so a big drive with
+            // many folders doesn't spend its time re-merging the list, and navigation stays responsive.
+
+            g_foundPosted = false;
+
+            if ( 0 == g_pImageArray->Count() )
+                MergeFoundImages( hwnd );
+            else if ( !g_mergePending )
+            {
+                SetTimer( hwnd, TIMER_MERGE_ID, 250, NULL );
+                g_mergePending = true;
+            }
+
+            return 0;
+        }
+
+        case WM_PV_ENUMERATION_DONE:
+        {
+            if ( g_mergePending )
+            {
+                KillTimer( hwnd, TIMER_MERGE_ID );
+                g_mergePending = false;
+            }
+
+            MergeFoundImages( hwnd );
+            g_enumerationDone = true;
+
+            // Capture times are only known once files are parsed, so that sort is finished when they're loaded
+
+            if ( g_pImageArray->CaptureSortPending() )
+                LoadCaptureTimesInBackground( hwnd );
+
+            long long ms = duration_cast<std::chrono::milliseconds>( high_resolution_clock::now() - g_enumerationStart ).count();
+            size_t bytes = g_pImageArray->BytesUsed();
+            tracer.Trace( "time to complete list: %lld ms, %zu files, %zu bytes of list, %zu per path\n", ms, g_pImageArray->Count(),
+                          bytes, bytes / __max( (size_t) 1, g_pImageArray->Count() ) );
+
+            ApplyFolderChanges( hwnd );
+            return 0;
+        }
+
+        case WM_PV_CAPTURE_TIMES:
+        {
+            g_captureThread.join();
+
+            // Skip the times if another sort was chosen meanwhile or the capture sort was already done from the menu
+
+            if ( g_pImageArray->CaptureSortPending() && g_pImageArray->ApplyCaptureTimes( *g_pCaptureTimes ) )
+            {
+                WCHAR awcCurrent[ MAX_PATH ] = { 0 };
+                if ( 0 != g_pImageArray->Count() )
+                    wcscpy_s( awcCurrent, _countof( awcCurrent ), g_pImageArray->Get( g_currentBitmapIndex ) );
+
+                SortImages();
+                NavigateToStartingPhoto( awcCurrent );
+                ScheduleDecodeAhead();
+
+                if ( 0 != g_pImageArray->Count() )
+                    SetTitle( hwnd, g_pImageArray->Get( g_currentBitmapIndex ) );
+            }
+
+            delete g_pCaptureTimes;
+            g_pCaptureTimes = NULL;
+            return 0;
+        }
+
+        case WM_PV_FOLDER_CHANGED:
+        {
+            g_changesPosted = false;
+
+            if ( g_enumerationDone )
+                ApplyFolderChanges( hwnd );
 
             return 0;
         }
@@ -1654,6 +2712,7 @@ LRESULT CALLBACK WindowProc( HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam
     
                     g_BitmapSource.Reset();
                     g_D2DBitmap.Reset();
+                    ClearDecodeAhead();
 
                     bool ok = CImageRotation::Rotate90ViaExifOrBits( g_IWICFactory.Get(), g_pImageArray->Get( g_currentBitmapIndex ), false, 'r' == wParam, true );
 
@@ -1667,7 +2726,7 @@ LRESULT CALLBACK WindowProc( HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam
 
                     // regardless of whether the rotate succeeded, reload the file since it was closed above
     
-                    LoadCurrentFileUsingD2D( hwnd );
+                    LoadCurrentFileUsingD2D( hwnd, lm_Complete );
                     InvalidateRect( hwnd, NULL, TRUE );
                 }
             }
@@ -1788,6 +2847,11 @@ LRESULT CALLBACK WindowProc( HWND hwnd, UINT uMsg, WPARAM wParam, LPARAM lParam
             mouseX = GET_X_LPARAM( lParam );
             mouseY = GET_Y_LPARAM( lParam );
 
+            // The image was decoded no larger than needed to fit the monitor. Showing it 1:1 or larger needs all of it.
+
+            if ( g_currentIsReduced && ( 0 != g_pImageArray->Count() ) )
+                LoadCurrentFileUsingD2D( hwnd, lm_FullResolution );
+
             SetCapture( hwnd );
             SetCursor( LoadCursor( NULL, IDC_HAND ) );
 
@@ -2107,19 +3171,29 @@ int WINAPI wWinMain( _In_ HINSTANCE hInstance, _In_opt_ HINSTANCE hPrevInstance,
         return 0;
     }
 
+    // Decode the neighbors of the current image in the background. Keep at most 1/8 of RAM, up to 1GB, of decoded pixels.
+
+    MEMORYSTATUSEX memStatus;
+    memStatus.dwLength = sizeof memStatus;
+    ULONGLONG decodeBudget = 256 * 1024 * 1024;
+    if ( GlobalMemoryStatusEx( &memStatus ) )
+        decodeBudget = __min( memStatus.ullTotalPhys / 8, 1024ull * 1024 * 1024 );
+
+    g_pWICDecoder = new CWICDecoder();
+    g_pDecodeAhead = new CDecodeAhead( *g_pWICDecoder, (size_t) decodeBudget );
+
     g_dwriteTextFormat->SetTextAlignment( DWRITE_TEXT_ALIGNMENT::DWRITE_TEXT_ALIGNMENT_TRAILING );
     g_dwriteTextFormat->SetParagraphAlignment( DWRITE_PARAGRAPH_ALIGNMENT::DWRITE_PARAGRAPH_ALIGNMENT_FAR );
 
-    // Searching for all photos might take a long time. It's not a design pattern for the app to handle this case well.
+    // Searching for all photos might take a long time.
     // Loading the 114,559 image files on my C:\ takes 2.4 seconds. The drive has 944,094 files total.
     // Loading the 389,076 image files on my D:\ takes 0.4 seconds. The drive has 693,053 files total.
     // Y:\ is the same as D:\ but it's a spinning drive. It took 0.7 seconds.
     // Loading the 59,465 files over a 100Mbps network takes 3.2 seconds. The share is all photos.
-    // These times are acceptable given that most use cases will have far fewer files.
-    // This won't work well for network and spinning drives with lots of content. Make the enumeration async if needed.
+    // So the enumeration runs on another thread and the list fills in while the user looks at the first image.
+    // A starting photo given on the command line is shown before the enumeration has found anything.
 
-    long long timeFinding = 0;
-    CTimed timedFinding( timeFinding );
+    g_enumerationStart = high_resolution_clock::now();
 
     WCHAR ** pwcExtensions = (WCHAR **) imageExtensions;
     int cExtensions = _countof( imageExtensions );
@@ -2130,17 +3204,56 @@ int WINAPI wWinMain( _In_ HINSTANCE hInstance, _In_opt_ HINSTANCE hPrevInstance,
         cExtensions = 1;
     }
 
-    CEnumFolder enumFolder( true, g_pImageArray, pwcExtensions, cExtensions );
-    enumFolder.Enumerate( awcPhotoPath, L"*" );
-    SortImages();
+    g_pwcExtensions = pwcExtensions;
+    g_cExtensions = cExtensions;
+
+    CFolderWatch folderWatch;
+    folderWatch.Start( awcPhotoPath, [hwnd] ( const CFolderChange & change )
+    {
+        {
+            lock_guard<mutex> lock( g_folderChangesMutex );
+            g_folderChanges.push_back( change );
+        }
+
+        if ( !g_changesPosted.exchange( true ) )
+            PostMessage( hwnd, WM_PV_FOLDER_CHANGED, 0, 0 );
+    } );
+
+    g_pImageArray->UseMetadataIndex( awcPhotoPath );
+    SortImages(); // nothing to sort yet, but merges keep this order
+
+    if ( 0 != awcStartingPhoto[ 0 ] && IsInExtensionList( awcStartingPhoto, pwcExtensions, cExtensions ) )
+    {
+        WIN32_FILE_ATTRIBUTE_DATA fad;
+        if ( GetFileAttributesEx( awcStartingPhoto, GetFileExInfoStandard, &fad ) )
+        {
+            ULARGE_INTEGER size;
+            size.LowPart = fad.nFileSizeLow;
+            size.HighPart = fad.nFileSizeHigh;
+            g_pImageArray->Add( awcStartingPhoto, fad.ftCreationTime, fad.ftLastWriteTime, size.QuadPart );
+            g_pwcShownEarly = awcStartingPhoto;
+        }
+    }
 
-    timedFinding.Complete();
-    tracer.Trace( "time finding %d files: %lld\n", g_pImageArray->Count(), timeFinding );
+    g_pFoundImages = new CPathArray();
+    CEnumFolder enumFolder( true, g_pFoundImages, pwcExtensions, cExtensions );
+    enumFolder.SetFolderCallback( [hwnd] ()
+    {
+        if ( !g_foundPosted.exchange( true ) )
+            PostMessage( hwnd, WM_PV_IMAGES_FOUND, 0, 0 );
+    } );
 
-    if ( 0 != awcStartingPhoto[ 0 ] )
-        NavigateToStartingPhoto( awcStartingPhoto );
+    std::thread enumThread( [&enumFolder, hwnd] ()
+    {
+        enumFolder.Enumerate( awcPhotoPath, L"*" );
+        PostMessage( hwnd, WM_PV_ENUMERATION_DONE, 0, 0 );
+    } );
 
-    LoadNextImage( hwnd, md_Stay );
+    if ( 0 != g_pImageArray->Count() )
+    {
+        LoadNextImage( hwnd, md_Stay );
+        TraceTimeToFirstImage();
+    }
 
     ShowWindow( hwnd, placementFound ? wp.showCmd : nCmdShow );
 
@@ -2156,6 +3269,33 @@ int WINAPI wWinMain( _In_ HINSTANCE hInstance, _In_opt_ HINSTANCE hPrevInstance,
         DispatchMessage( &msg );
     }
 
+    if ( 0 != imagesFirstPixels && 0 != imagesFullQuality )
+        tracer.Trace( "%lld images shown, %lld with a thumbnail first, %lld at full quality. average ms to first pixels %lld, to full quality %lld\n",
+                      imagesFirstPixels, imagesShownFromThumbnail, imagesFullQuality, timeFirstPixels / imagesFirstPixels / CTimed::NanoPerMilli(),
+                      timeFullQuality / imagesFullQuality / CTimed::NanoPerMilli() );
+
+    folderWatch.Stop();
+    enumFolder.Cancel();
+    enumThread.join();
+    delete g_pFoundImages;
+    g_pFoundImages = NULL;
+
+    if ( g_captureThread.joinable() )
+    {
+        g_pCaptureTimes->CancelCaptureTimes();
+        g_captureThread.join();
+    }
+
+    delete g_pCaptureTimes;
+    g_pCaptureTimes = NULL;
+
+    // The decode-ahead threads use the metadata cache and WIC factory, so stop them first
+
+    delete g_pDecodeAhead;
+    g_pDecodeAhead = NULL;
+    delete g_pWICDecoder;
+    g_pWICDecoder = NULL;
+
     delete g_pImageArray;
     g_pImageArray = NULL;
     delete g_pImageData;
@@ -0,0 +1,1452 @@
+//
+// PV Metadata
+// David Lee
+//
+// Usage:   pvmd [folder] [-a] [-c] [-d] [-e:EXT] [-f:FIELDS] [-j:n] [-k] [-m] [-o] [-r] [-s] [-t] [-w] [-z] (default is current directory)
+//
+// Walks a folder tree and writes one JSON line (or CSV row) per image to stdout with the metadata PV's parser
+// extracts. It has no UI, so it builds and runs on Linux as well as Windows. Throughput is reported on stderr.
+//
+
+#ifdef _WIN32
+#ifndef UNICODE
+#define UNICODE
+#endif
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <locale.h>
+#include <math.h>
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <djltrace.hxx>
+#include <djlenum.hxx>
+#include <djlimagedata.hxx>
+#include <djl_resample.hxx>
+#include <djl_orient.hxx>
+#include <djl_decodeahead.hxx>
+#include <djl_decodesize.hxx>
+
+#ifdef PV_USE_ZLIB
+#include <djl_tiffrw.hxx>
+#endif
+
+#ifdef _WIN32
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+using namespace std;
+using namespace std::chrono;
+
+CDJLTrace tracer;
+
+const WCHAR * imageExtensions[] =
+{
+    L"3fr",
+    L"arw",
+    L"bmp",
+    L"cr2",
+    L"cr3",
+    L"dng",
+    L"flac",
+    L"gif",
+    L"heic",
+    L"hif",
+    L"jfif",
+    L"jpeg",
+    L"jpg",
+    L"mp3",
+    L"nef",
+    L"orf",
+    L"png",
+    L"raf",
+    L"rw2",
+    L"tif",
+    L"tiff",
+    L"webp",
+};
+
+void Usage()
+{
+    printf( "usage: pvmd [folder] [-a] [-c] [-d] [-e:EXT] [-f:FIELDS] [-j:n] [-k] [-m] [-o] [-r] [-s] [-t] [-w] [-z]\n" );
+    printf( "  writes the metadata of every image under folder to stdout, one JSON object per line\n" );
+    printf( "  arguments:  folder     root of the tree to walk (default is current path)\n" );
+    printf( "              -a         read the headers of many files at once ahead of the parsers\n" );
+    printf( "              -c         write CSV with a header row instead of JSON lines\n" );
+    printf( "              -d         only simulate navigating with decode-ahead and a stub decoder, and report the hit rate\n" );
+    printf( "              -e:EXT     only include files with this extension. e.g. -e:cr3\n" );
+    printf( "              -f:FIELDS  only parse for these comma-separated fields (default all). e.g. -f:capture,rating\n" );
+    printf( "                         capture, orientation, rating, camera, lens, exposure, gps, dimensions, embedded, all\n" );
+    printf( "              -j:n       parse with n worker threads (default is one per core)\n" );
+    printf( "              -k         only run self-checks of the image-selection policies; exit code 1 if any fail\n" );
+    printf( "              -m         read files through memory mappings rather than cached reads\n" );
+    printf( "              -o         only time the orientation code on synthetic images against a per-pixel loop\n" );
+    printf( "              -r         only time the image resampler on synthetic images against its scalar code\n" );
+    printf( "              -s         only time rotating a 1 GB synthetic image in strips through a scratch file, against all at once\n" );
+    printf( "              -t         debug tracing to pvmd.log. t=append T=overwrite\n" );
+    printf( "              -w         only walk the tree, and time it against a simple recursive walk\n" );
+#ifdef PV_USE_ZLIB
+    printf( "              -z         only time recompressing a synthetic 60 MP 16-bit TIFF against single-threaded zlib\n" );
+#endif
+    exit( 1 );
+} //Usage
+
+static bool ParseFields( const WCHAR * pwcFields, DWORD & fields )
+{
+    // Map names like "capture,rating" to ImageMetadata::Field* bits, so the bytes read per file can be compared per mask
+
+    static const struct { const WCHAR * pwcName; DWORD field; } names[] =
+    {
+        { L"capture", ImageMetadata::FieldCaptureTime },
+        { L"orientation", ImageMetadata::FieldOrientation },
+        { L"rating", ImageMetadata::FieldRating },
+        { L"camera", ImageMetadata::FieldCamera },
+        { L"lens", ImageMetadata::FieldLens },
+        { L"exposure", ImageMetadata::FieldExposure },
+        { L"gps", ImageMetadata::FieldGPS },
+        { L"dimensions", ImageMetadata::FieldDimensions },
+        { L"embedded", ImageMetadata::FieldEmbeddedImage },
+        { L"all", ImageMetadata::FieldAll },
+    };
+
+    fields = 0;
+
+    while ( 0 != *pwcFields )
+    {
+        const WCHAR * pwcEnd = wcschr( pwcFields, L',' );
+        size_t len = ( NULL == pwcEnd ) ? wcslen( pwcFields ) : ( pwcEnd - pwcFields );
+        bool found = false;
+
+        for ( size_t i = 0; i < _countof( names ); i++ )
+        {
+            if ( len == wcslen( names[ i ].pwcName ) && !_wcsnicmp( pwcFields, names[ i ].pwcName, len ) )
+            {
+                fields |= names[ i ].field;
+                found = true;
+                break;
+            }
+        }
+
+        if ( !found )
+            return false;
+
+        pwcFields += len;
+        if ( L',' == *pwcFields )
+            pwcFields++;
+    }
+
+    return ( 0 != fields );
+} //ParseFields
+
+static void AppendUtf8( string & out, const WCHAR * pwc )
+{
+    // WCHAR is UTF-16 on Windows and UTF-32 elsewhere
+
+    while ( 0 != *pwc )
+    {
+        ULONG c = (ULONG) *pwc++;
+
+        if ( c >= 0xd800 && c <= 0xdbff && *pwc >= 0xdc00 && *pwc <= 0xdfff )
+            c = 0x10000 + ( ( c - 0xd800 ) << 10 ) + ( (ULONG) *pwc++ - 0xdc00 );
+
+        if ( c < 0x80 )
+            out += (char) c;
+        else if ( c < 0x800 )
+        {
+            out += (char) ( 0xc0 | ( c >> 6 ) );
+            out += (char) ( 0x80 | ( c & 0x3f ) );
+        }
+        else if ( c < 0x10000 )
+        {
+            out += (char) ( 0xe0 | ( c >> 12 ) );
+            out += (char) ( 0x80 | ( ( c >> 6 ) & 0x3f ) );
+            out += (char) ( 0x80 | ( c & 0x3f ) );
+        }
+        else
+        {
+            out += (char) ( 0xf0 | ( c >> 18 ) );
+            out += (char) ( 0x80 | ( ( c >> 12 ) & 0x3f ) );
+            out += (char) ( 0x80 | ( ( c >> 6 ) & 0x3f ) );
+            out += (char) ( 0x80 | ( c & 0x3f ) );
+        }
+    }
+} //AppendUtf8
+
+class CRecordWriter
+{
+    public:
+        enum Format { fmt_JSON, fmt_CSV, fmt_CSVHeader };
+
+    private:
+        Format format;
+        string line;
+        bool first;
+
+        bool Field( const char * name )
+        {
+            // returns true if the caller should append the value
+
+            if ( !first )
+                line += ',';
+            first = false;
+
+            if ( fmt_CSVHeader == format )
+            {
+                line += name;
+                return false;
+            }
+
+            if ( fmt_JSON == format )
+            {
+                line += '"';
+                line += name;
+                line += "\":";
+            }
+
+            return true;
+        } //Field
+
+        void Quoted( const string & value )
+        {
+            if ( fmt_JSON == format )
+            {
+                line += '"';
+
+                for ( size_t i = 0; i < value.length(); i++ )
+                {
+                    unsigned char c = (unsigned char) value[ i ];
+
+                    if ( '"' == c || '\\' == c )
+                    {
+                        line += '\\';
+                        line += (char) c;
+                    }
+                    else if ( c < ' ' )
+                    {
+                        char ac[ 8 ];
+                        snprintf( ac, sizeof( ac ), "\\u%04x", c );
+                        line += ac;
+                    }
+                    else
+                        line += (char) c;
+                }
+
+                line += '"';
+            }
+            else
+            {
+                bool quote = ( string::npos != value.find_first_of( ",\"\r\n" ) );
+
+                if ( quote )
+                    line += '"';
+
+                for ( size_t i = 0; i < value.length(); i++ )
+                {
+                    if ( '"' == value[ i ] )
+                        line += '"';
+                    line += value[ i ];
+                }
+
+                if ( quote )
+                    line += '"';
+            }
+        } //Quoted
+
+    public:
+        CRecordWriter( Format f ) : format( f ), first( true ) {}
+
+        void Begin()
+        {
+            line.clear();
+            first = true;
+
+            if ( fmt_JSON == format )
+                line += '{';
+        } //Begin
+
+        const string & End()
+        {
+            if ( fmt_JSON == format )
+                line += '}';
+
+            line += '\n';
+            return line;
+        } //End
+
+        void Null( const char * name )
+        {
+            if ( Field( name ) && fmt_JSON == format )
+                line += "null";
+        } //Null
+
+        void Path( const char * name, const WCHAR * pwc )
+        {
+            if ( Field( name ) )
+            {
+                string utf8;
+                AppendUtf8( utf8, pwc );
+                Quoted( utf8 );
+            }
+        } //Path
+
+        void Text( const char * name, const char * pc )
+        {
+            if ( 0 == *pc )
+            {
+                Null( name );
+                return;
+            }
+
+            if ( Field( name ) )
+            {
+                // EXIF strings are supposed to be ASCII. Treat anything else as Latin-1 so the output stays valid UTF-8
+
+                string utf8;
+                for ( const unsigned char * p = (const unsigned char *) pc; *p; p++ )
+                {
+                    if ( *p < 0x80 )
+                        utf8 += (char) *p;
+                    else
+                    {
+                        utf8 += (char) ( 0xc0 | ( *p >> 6 ) );
+                        utf8 += (char) ( 0x80 | ( *p & 0x3f ) );
+                    }
+                }
+
+                Quoted( utf8 );
+            }
+        } //Text
+
+        void Integer( const char * name, long long value, bool valid = true )
+        {
+            if ( !valid )
+            {
+                Null( name );
+                return;
+            }
+
+            if ( Field( name ) )
+                line += to_string( value );
+        } //Integer
+
+        void Double( const char * name, double value, int decimals, bool valid = true )
+        {
+            if ( !valid || !isfinite( value ) )
+            {
+                Null( name );
+                return;
+            }
+
+            if ( Field( name ) )
+            {
+                char ac[ 64 ];
+                snprintf( ac, sizeof( ac ), "%.*lf", decimals, value );
+                line += ac;
+            }
+        } //Double
+}; //CRecordWriter
+
+static void WriteRecord( CRecordWriter & writer, CImageData & imageData, const WCHAR * pwcPath, const ImageMetadata & md, const StreamStats & stats )
+{
+    writer.Begin();
+    writer.Path( "path", pwcPath );
+
+    // 2005:02:17 21:21:31 becomes 2005-02-17T21:21:31. It's local time; EXIF rarely records the zone.
+
+    const char * pcCapture = md.CaptureDateTime();
+    if ( 19 == strlen( pcCapture ) )
+    {
+        char acISO[ 20 ];
+        strcpy_s( acISO, _countof( acISO ), pcCapture );
+        acISO[ 4 ] = '-';
+        acISO[ 7 ] = '-';
+        acISO[ 10 ] = 'T';
+        writer.Text( "capture_time", acISO );
+    }
+    else
+        writer.Text( "capture_time", pcCapture );
+
+    writer.Text( "make", md.acMake );
+    writer.Text( "model", md.acModel );
+    writer.Text( "lens_make", md.acLensMake );
+    writer.Text( "lens_model", md.acLensModel );
+    writer.Integer( "width", md.ImageWidth, md.ImageWidth > 0 );
+    writer.Integer( "height", md.ImageHeight, md.ImageHeight > 0 );
+    writer.Integer( "orientation", md.Orientation_Value, md.Orientation_Value >= 1 && md.Orientation_Value <= 8 );
+
+    double focalLength, flGuess, flComputed;
+    int flIn35mmFilm;
+    char acModel[ 100 ];
+    double flBest = imageData.FindFocalLength( md, focalLength, flIn35mmFilm, flGuess, flComputed, acModel, _countof( acModel ) );
+    bool validFocalLength = ( focalLength > 0.0 );
+    bool validBest = ( flBest > 0.0 );
+    writer.Double( "focal_length", focalLength, 1, validFocalLength );
+    writer.Double( "focal_length_35mm", flBest, 1, validBest );
+    writer.Double( "crop_factor", validFocalLength ? ( flBest / focalLength ) : 0.0, 2, validFocalLength && validBest );
+
+    if ( md.ExposureNum > 0 && md.ExposureDen > 0 )
+    {
+        char acExposure[ 40 ];
+        if ( 1 == md.ExposureNum || md.ExposureNum < md.ExposureDen )
+            snprintf( acExposure, sizeof( acExposure ), "%d/%d", md.ExposureNum, md.ExposureDen );
+        else
+            snprintf( acExposure, sizeof( acExposure ), "%g", (double) md.ExposureNum / (double) md.ExposureDen );
+        writer.Text( "exposure_time", acExposure );
+    }
+    else
+        writer.Null( "exposure_time" );
+
+    double fNumber = 0.0;
+    bool validFNumber = imageData.FindFNumber( md, &fNumber );
+    writer.Double( "f_number", fNumber, 1, validFNumber );
+    writer.Integer( "iso", md.ISO, md.ISO > 0 );
+    writer.Integer( "exposure_program", md.ExposureProgram, md.ExposureProgram >= 0 );
+    writer.Integer( "exposure_mode", md.ExposureMode, md.ExposureMode >= 0 );
+
+    bool validGPS = ( ImageMetadata::InvalidCoordinate != md.Latitude && ImageMetadata::InvalidCoordinate != md.Longitude );
+    writer.Double( "latitude", md.Latitude, 7, validGPS );
+    writer.Double( "longitude", md.Longitude, 7, validGPS );
+    writer.Integer( "rating", md.RatingInXMP, 0 != md.RatingInXMP_Offset );
+
+    bool validPreview = ( 0 != md.Embedded_Image_Offset && 0 != md.Embedded_Image_Length );
+    writer.Integer( "preview_offset", md.Embedded_Image_Offset, validPreview );
+    writer.Integer( "preview_length", md.Embedded_Image_Length, validPreview );
+    writer.Integer( "preview_width", md.Embedded_Image_Width, validPreview && md.Embedded_Image_Width > 0 );
+    writer.Integer( "preview_height", md.Embedded_Image_Height, validPreview && md.Embedded_Image_Height > 0 );
+    writer.Integer( "bytes_read", (long long) stats.fileBytes );
+} //WriteRecord
+
+static bool FullPath( const WCHAR * pwcInput, WCHAR * pwcOut, size_t cwcOut )
+{
+#ifdef _WIN32
+    return ( NULL != _wfullpath( pwcOut, pwcInput, cwcOut ) );
+#else
+    char acInput[ MAX_PATH ];
+    char acFull[ PATH_MAX ];
+    size_t len = wcstombs( acInput, pwcInput, sizeof( acInput ) );
+    if ( (size_t) -1 == len || len >= sizeof( acInput ) || NULL == realpath( acInput, acFull ) )
+        return false;
+
+    return ( (size_t) -1 != mbstowcs( pwcOut, acFull, cwcOut ) );
+#endif
+} //FullPath
+
+#ifndef _WIN32
+
+// The walk CEnumFolder replaced: one thread, readdir, and a full path for every folder and stat. -w times it
+// against CEnumFolder. The extension list is sorted and lowercase.
+
+static void SimpleWalk( const string & folder, WCHAR ** pwcExtensions, int cExtensions, size_t & found )
+{
+    DIR * pdir = opendir( folder.c_str() );
+    if ( NULL == pdir )
+        return;
+
+    struct dirent * pent;
+    while ( NULL != ( pent = readdir( pdir ) ) )
+    {
+        if ( !strcmp( pent->d_name, "." ) || !strcmp( pent->d_name, ".." ) )
+            continue;
+
+        string path = folder + "/" + pent->d_name;
+        struct stat st;
+        if ( 0 != stat( path.c_str(), &st ) )
+            continue;
+
+        if ( S_ISDIR( st.st_mode ) )
+            SimpleWalk( path, pwcExtensions, cExtensions, found );
+        else if ( S_ISREG( st.st_mode ) )
+        {
+            WCHAR awcName[ MAX_PATH ];
+            if ( (size_t) -1 == mbstowcs( awcName, pent->d_name, _countof( awcName ) ) )
+                continue;
+
+            const WCHAR * pext = wcsrchr( awcName, L'.' );
+            if ( NULL == pext )
+                continue;
+
+            for ( int i = 0; i < cExtensions; i++ )
+            {
+                if ( !_wcsicmp( pext + 1, pwcExtensions[ i ] ) )
+                {
+                    found++;
+                    break;
+                }
+            }
+        }
+    }
+
+    closedir( pdir );
+} //SimpleWalk
+
+#endif
+
+// -r times CResample shrinking synthetic camera-sized images to screen and export sizes, with its scalar code on
+// one thread, its SIMD code on one thread, and its SIMD code on n threads. Rates are source megapixels per second.
+
+static void TimeResampler( unsigned int workers )
+{
+    struct { const char * name; int srcWidth, srcHeight, dstWidth, dstHeight; } sizes[] =
+    {
+        { "24 -> 4 MP", 6000, 4000, 2449, 1633 },
+        { "60 -> 8 MP", 9504, 6336, 3470, 2313 },
+    };
+
+    CResample::Code best = CResample::BestCode();
+
+    for ( size_t s = 0; s < _countof( sizes ); s++ )
+    {
+        for ( int bpp = 3; bpp <= 4; bpp++ )
+        {
+            int sw = sizes[ s ].srcWidth, sh = sizes[ s ].srcHeight, dw = sizes[ s ].dstWidth, dh = sizes[ s ].dstHeight;
+            size_t srcStride = (size_t) sw * bpp, dstStride = (size_t) dw * bpp;
+            vector<uint8_t> src( srcStride * sh );
+
+            for ( int y = 0; y < sh; y++ )
+                for ( size_t x = 0; x < srcStride; x++ )
+                    src[ y * srcStride + x ] = (uint8_t) ( ( x * 7 + y * 3 ) ^ ( ( x * y ) >> 5 ) );
+
+            vector<uint8_t> reference( dstStride * dh ), dst( dstStride * dh );
+            double megapixels = (double) sw * sh / 1000000.0;
+
+            for ( int k = CResample::Cubic; k <= CResample::Lanczos3; k++ )
+            {
+                CResample::Kernel kernel = (CResample::Kernel) k;
+                struct { CResample::Code code; unsigned int threads; vector<uint8_t> * out; } runs[] =
+                {
+                    { CResample::Scalar, 1, &reference },
+                    { best, 1, &dst },
+                    { best, workers, &dst },
+                };
+
+                fprintf( stderr, "%s, %dbpp, %-8s", sizes[ s ].name, bpp * 8, ( CResample::Cubic == kernel ) ? "cubic" : "lanczos3" );
+
+                for ( size_t r = 0; r < _countof( runs ); r++ )
+                {
+                    high_resolution_clock::time_point t = high_resolution_clock::now();
+                    CResample::Resample( src.data(), sw, sh, srcStride, runs[ r ].out->data(), dw, dh, dstStride, bpp, kernel, runs[ r ].threads, runs[ r ].code );
+                    double seconds = duration_cast<std::chrono::nanoseconds>( high_resolution_clock::now() - t ).count() / 1000000000.0;
+                    fprintf( stderr, "  %s x%u %7.1lf MP/s", CResample::CodeName( runs[ r ].code ), runs[ r ].threads, megapixels / seconds );
+                }
+
+                int maxDifference = 0;
+                for ( size_t i = 0; i < dst.size(); i++ )
+                    maxDifference = __max( maxDifference, abs( (int) dst[ i ] - (int) reference[ i ] ) );
+
+                fprintf( stderr, "  max difference %d\n", maxDifference );
+            }
+        }
+    }
+} //TimeResampler
+
+// -o times COrientPixels turning a synthetic 24 MP image for each Exif orientation and pixel size, against a
+// per-pixel loop, then tiled on one thread, then tiled on n threads, then read in 256-row strips as pv reads from
+// a decoder, then in place where the shape allows.
+// Rates are megapixels per second.
+
+static void TimeOrientation( unsigned int workers )
+{
+    const int width = 6000, height = 4000;
+    const int bpps[] = { 1, 3, 4, 6, 8 };
+    double megapixels = (double) width * height / 1000000.0;
+
+    for ( size_t b = 0; b < _countof( bpps ); b++ )
+    {
+        int bpp = bpps[ b ];
+        size_t stride = (size_t) width * bpp;
+        vector<uint8_t> src( stride * height );
+
+        for ( size_t i = 0; i < src.size(); i++ )
+            src[ i ] = (uint8_t) ( ( i * 7 ) ^ ( i >> 11 ) );
+
+        vector<uint8_t> reference( src.size() ), dst( src.size() ), inPlace( src.size() );
+
+        for ( int orientation = 2; orientation <= 8; orientation++ )
+        {
+            int outWidth, outHeight;
+            COrientPixels::OrientedSize( width, height, orientation, outWidth, outHeight );
+            size_t dstStride = (size_t) outWidth * bpp;
+
+            fprintf( stderr, "%2dbpp, orientation %d", bpp * 8, orientation );
+
+            struct { const char * name; unsigned int threads; } runs[] = { { "loop", 1 }, { "tiled", 1 }, { "tiled", workers } };
+
+            for ( size_t r = 0; r < _countof( runs ); r++ )
+            {
+                high_resolution_clock::time_point t = high_resolution_clock::now();
+
+                if ( 0 == r )
+                    COrientPixels::Reference( src.data(), width, height, stride, reference.data(), dstStride, bpp, orientation );
+                else
+                    COrientPixels::Apply( src.data(), width, height, stride, dst.data(), dstStride, bpp, orientation, runs[ r ].threads );
+
+                double seconds = duration_cast<std::chrono::nanoseconds>( high_resolution_clock::now() - t ).count() / 1000000000.0;
+                fprintf( stderr, "  %s x%u %7.1lf MP/s", runs[ r ].name, runs[ r ].threads, megapixels / seconds );
+            }
+
+            bool same = ( 0 == memcmp( dst.data(), reference.data(), dst.size() ) );
+
+            {
+                auto read = [&] ( int x, int y, int w, int h, uint8_t * strip, size_t stripStride )
+                {
+                    for ( int r = 0; r < h; r++ )
+                        memcpy( strip + r * stripStride, src.data() + ( y + r ) * stride + x * bpp, (size_t) w * bpp );
+
+                    return true;
+                };
+
+                memset( dst.data(), 0, dst.size() );
+                high_resolution_clock::time_point t = high_resolution_clock::now();
+                COrientPixels::ApplyRect( width, height, bpp, orientation, 0, 0, outWidth, outHeight, dst.data(), dstStride, 256, read, workers );
+                double seconds = duration_cast<std::chrono::nanoseconds>( high_resolution_clock::now() - t ).count() / 1000000000.0;
+                fprintf( stderr, "  strips x%u %7.1lf MP/s", workers, megapixels / seconds );
+                same = same && ( 0 == memcmp( dst.data(), reference.data(), dst.size() ) );
+            }
+
+            if ( COrientPixels::CanApplyInPlace( width, height, orientation ) )
+            {
+                memcpy( inPlace.data(), src.data(), src.size() );
+                high_resolution_clock::time_point t = high_resolution_clock::now();
+                COrientPixels::ApplyInPlace( inPlace.data(), width, height, stride, bpp, orientation, workers );
+                double seconds = duration_cast<std::chrono::nanoseconds>( high_resolution_clock::now() - t ).count() / 1000000000.0;
+                fprintf( stderr, "  in place x%u %7.1lf MP/s", workers, megapixels / seconds );
+                same = same && ( 0 == memcmp( inPlace.data(), reference.data(), inPlace.size() ) );
+            }
+
+            fprintf( stderr, "  %s\n", same ? "matches" : "MISMATCH" );
+        }
+    }
+} //TimeOrientation
+
+// -k checks pure policy code against fixed cases and prints each case that fails. Returns the failure count.
+
+static int CheckEmbeddedSelection()
+{
+    typedef ImageMetadata::EmbeddedImage EI;
+    const int jpg = ImageMetadata::EmbeddedCodecJPG, png = ImageMetadata::EmbeddedCodecPNG, unknown = ImageMetadata::EmbeddedCodecUnknown;
+
+    // A typical RAW: thumbnail, medium preview, full-size JPG
+    EI raw[] = { { 1000, 10000, 160, 120, jpg }, { 20000, 300000, 1620, 1080, jpg }, { 400000, 4000000, 6000, 4000, jpg } };
+    // The same, found in a different order and with the medium preview stored portrait
+    EI shuffled[] = { { 400000, 4000000, 6000, 4000, jpg }, { 1000, 10000, 160, 120, png }, { 20000, 300000, 1080, 1620, jpg } };
+    // Entries that couldn't be measured or decoded are never picked, even when they're the largest
+    EI unmeasured[] = { { 1000, 10000, 0, 0, jpg }, { 2000, 10000, 9000, 6000, unknown }, { 3000, 10000, 640, 480, jpg } };
+    EI nothing[] = { { 1000, 10000, 0, 0, jpg }, { 2000, 10000, 640, 480, unknown } };
+    EI ties[] = { { 1000, 10000, 1920, 1080, jpg }, { 2000, 10000, 1080, 1920, jpg }, { 3000, 10000, 1920, 1080, jpg } };
+
+    struct { const char * name; const EI * images; int count; int targetWidth, targetHeight; int expected; } cases[] =
+    {
+        { "no images",                    raw, 0, 1920, 1080, -1 },
+        { "4K monitor needs full size",   raw, 3, 3840, 2160, 2 },
+        { "1080p is wider than medium",   raw, 3, 1920, 1080, 2 },
+        { "medium covers 1600 x 900",     raw, 3, 1600, 900, 1 },
+        { "medium covers 720p",           raw, 3, 1280, 720, 1 },
+        { "thumbnail covers itself",      raw, 3, 160, 120, 0 },
+        { "portrait target",              raw, 3, 1080, 1620, 1 },
+        { "no target takes the smallest", raw, 3, 0, 0, 0 },
+        { "none covers; largest",         raw, 3, 8000, 6000, 2 },
+        { "order found doesn't matter",   shuffled, 3, 1280, 720, 2 },
+        { "rotated preview covers",       shuffled, 3, 1600, 900, 2 },
+        { "png thumbnail",                shuffled, 3, 100, 100, 1 },
+        { "unmeasured are skipped",       unmeasured, 3, 3840, 2160, 2 },
+        { "nothing usable",               nothing, 2, 640, 480, -1 },
+        { "ties go to the earlier",       ties, 3, 1920, 1080, 0 },
+        { "ties go to the earlier, tall", ties, 3, 1080, 1920, 0 },
+    };
+
+    int failures = 0;
+
+    for ( size_t c = 0; c < _countof( cases ); c++ )
+    {
+        int selected = ImageMetadata::SelectEmbeddedImage( cases[ c ].images, cases[ c ].count, cases[ c ].targetWidth, cases[ c ].targetHeight );
+
+        if ( selected != cases[ c ].expected )
+        {
+            fprintf( stderr, "  FAILED embedded selection '%s': target %d x %d picked %d, expected %d\n", cases[ c ].name,
+                     cases[ c ].targetWidth, cases[ c ].targetHeight, selected, cases[ c ].expected );
+            failures++;
+        }
+    }
+
+    fprintf( stderr, "embedded image selection: %zu cases, %d failed\n", _countof( cases ), failures );
+    return failures;
+} //CheckEmbeddedSelection
+
+static int CheckDecodeSize()
+{
+    int failures = 0;
+
+    struct { unsigned int width, height, targetWidth, targetHeight, maxDivisor, expected; } cases[] =
+    {
+        { 6000, 4000, 1920, 1080, 8, 2 },       // drawn 1620 x 1080; 1/4 is 1500 x 1000
+        { 6000, 4000, 3840, 2160, 8, 1 },       // drawn 3240 x 2160; 1/2 is 3000 x 2000
+        { 6000, 4000, 1280, 720, 8, 4 },        // drawn 1080 x 720; 1/8 is 750 x 500
+        { 4000, 6000, 1920, 1080, 8, 4 },       // portrait: drawn 720 x 1080
+        { 24000, 16000, 1920, 1080, 8, 8 },     // limited by maxDivisor
+        { 24000, 16000, 1920, 1080, 2, 2 },
+        { 800, 600, 1920, 1080, 8, 1 },         // smaller than the target, so never reduced
+        { 6000, 4000, 0, 0, 8, 1 },             // no target
+        { 6000, 4000, 1920, 0, 8, 1 },
+        { 0, 0, 1920, 1080, 8, 1 },
+    };
+
+    for ( size_t c = 0; c < _countof( cases ); c++ )
+    {
+        unsigned int d = CDecodeSize::Divisor( cases[ c ].width, cases[ c ].height, cases[ c ].targetWidth, cases[ c ].targetHeight, cases[ c ].maxDivisor );
+
+        if ( d != cases[ c ].expected )
+        {
+            fprintf( stderr, "  FAILED decode size: %u x %u for %u x %u picked 1/%u, expected 1/%u\n", cases[ c ].width, cases[ c ].height,
+                     cases[ c ].targetWidth, cases[ c ].targetHeight, d, cases[ c ].expected );
+            failures++;
+        }
+    }
+
+    if ( 501 != CDecodeSize::Reduce( 4001, 8 ) || 500 != CDecodeSize::Reduce( 4000, 8 ) || 1 != CDecodeSize::Reduce( 1, 8 ) )
+    {
+        fprintf( stderr, "  FAILED decode size: Reduce doesn't round partial blocks up\n" );
+        failures++;
+    }
+
+    // Every size from 1 to 3000 on each side against a few targets. The drawn size is computed here separately
+    // from CDecodeSize as the image scaled by min( tw / w, th / h, 1 ), kept as the fraction num / den. The chosen
+    // reduction must cover it, and the next larger reduction must not, unless it's past maxDivisor.
+
+    const unsigned int targets[][ 2 ] = { { 1920, 1080 }, { 3840, 2160 }, { 1024, 1366 } };
+    const unsigned int maxSide = 3000;
+    unsigned long long checked = 0;
+    int bruteFailures = 0;
+
+    for ( size_t t = 0; t < _countof( targets ); t++ )
+    {
+        unsigned long long tw = targets[ t ][ 0 ], th = targets[ t ][ 1 ];
+
+        for ( unsigned int w = 1; w <= maxSide; w++ )
+        {
+            for ( unsigned int h = 1; h <= maxSide; h++ )
+            {
+                unsigned long long num = 1, den = 1;
+
+                if ( tw * h <= th * w )
+                {
+                    if ( tw < w )
+                    {
+                        num = tw;
+                        den = w;
+                    }
+                }
+                else if ( th < h )
+                {
+                    num = th;
+                    den = h;
+                }
+
+                auto covers = [&] ( unsigned int divisor )
+                {
+                    return ( (unsigned long long) CDecodeSize::Reduce( w, divisor ) * den >= (unsigned long long) w * num ) &&
+                           ( (unsigned long long) CDecodeSize::Reduce( h, divisor ) * den >= (unsigned long long) h * num );
+                };
+
+                unsigned int d = CDecodeSize::Divisor( w, h, (unsigned int) tw, (unsigned int) th );
+                bool ok = ( 1 == d || 2 == d || 4 == d || 8 == d ) && covers( d ) && ( 8 == d || !covers( 2 * d ) );
+                checked++;
+
+                if ( !ok && bruteFailures++ < 10 )
+                    fprintf( stderr, "  FAILED decode size: %u x %u for %llu x %llu picked 1/%u\n", w, h, tw, th, d );
+            }
+        }
+    }
+
+    failures += bruteFailures;
+    fprintf( stderr, "decode size: %zu fixed cases and %llu sizes, %d failed\n", _countof( cases ) + 1, checked, failures );
+    return failures;
+} //CheckDecodeSize
+
+// Every rectangle of a few small images, for each orientation and several strip heights, oriented with ApplyRect
+// from reads of the source, must match that part of the whole image oriented by the reference loop.
+
+static int CheckOrientRect()
+{
+    const int sizes[][ 2 ] = { { 1, 1 }, { 5, 3 }, { 4, 7 }, { 9, 9 } };
+    const int stripRows[] = { 1, 2, 1000 };
+    const int bpps[] = { 1, 4 };
+    unsigned long long checked = 0;
+    int failures = 0;
+
+    for ( size_t z = 0; z < _countof( sizes ); z++ )
+    {
+        int width = sizes[ z ][ 0 ], height = sizes[ z ][ 1 ];
+
+        for ( size_t b = 0; b < _countof( bpps ); b++ )
+        {
+            int bpp = bpps[ b ];
+            size_t stride = (size_t) width * bpp;
+            vector<uint8_t> src( stride * height );
+
+            for ( size_t i = 0; i < src.size(); i++ )
+                src[ i ] = (uint8_t) ( i * 13 + 1 );
+
+            for ( int orientation = 1; orientation <= 8; orientation++ )
+            {
+                int outWidth, outHeight;
+                COrientPixels::OrientedSize( width, height, orientation, outWidth, outHeight );
+                size_t outStride = (size_t) outWidth * bpp;
+                vector<uint8_t> reference( outStride * outHeight );
+                COrientPixels::Reference( src.data(), width, height, stride, reference.data(), outStride, bpp, orientation );
+
+                auto read = [&] ( int x, int y, int w, int h, uint8_t * strip, size_t stripStride )
+                {
+                    if ( x < 0 || y < 0 || w <= 0 || h <= 0 || x + w > width || y + h > height )
+                        return false;
+
+                    for ( int r = 0; r < h; r++ )
+                        memcpy( strip + r * stripStride, src.data() + ( y + r ) * stride + x * bpp, (size_t) w * bpp );
+
+                    return true;
+                };
+
+                for ( int y = 0; y < outHeight; y++ )
+                for ( int x = 0; x < outWidth; x++ )
+                for ( int h = 1; y + h <= outHeight; h++ )
+                for ( int w = 1; x + w <= outWidth; w++ )
+                for ( size_t s = 0; s < _countof( stripRows ); s++ )
+                {
+                    size_t dstStride = (size_t) w * bpp + 3;
+                    vector<uint8_t> dst( dstStride * h, 0 );
+                    bool ok = COrientPixels::ApplyRect( width, height, bpp, orientation, x, y, w, h, dst.data(), dstStride, stripRows[ s ], read, 1 );
+
+                    for ( int r = 0; ok && r < h; r++ )
+                        ok = ( 0 == memcmp( dst.data() + r * dstStride, reference.data() + ( y + r ) * outStride + x * bpp, (size_t) w * bpp ) );
+
+                    checked++;
+
+                    if ( !ok && failures++ < 10 )
+                        fprintf( stderr, "  FAILED orient rect: %d x %d %dbpp orientation %d, rect %d, %d, %d x %d, strips of %d rows\n",
+                                 width, height, bpp * 8, orientation, x, y, w, h, stripRows[ s ] );
+                }
+            }
+        }
+    }
+
+    fprintf( stderr, "orient rect: %llu rectangles, %d failed\n", checked, failures );
+    return failures;
+} //CheckOrientRect
+
+static int SelfCheck()
+{
+    int failures = CheckEmbeddedSelection();
+    failures += CheckDecodeSize();
+    failures += CheckOrientRect();
+
+    fprintf( stderr, "%s\n", ( 0 == failures ) ? "all self-checks passed" : "SELF-CHECKS FAILED" );
+    return ( 0 == failures ) ? 0 : 1;
+} //SelfCheck
+
+// -d drives CDecodeAhead through simulated triage sessions with a decoder that sleeps rather than decodes, and
+// reports how often the image navigated to was already decoded. On a miss the session waits for a decode, as pv's
+// UI thread would. One session inserts paths into the list as it goes, shifting indexes as enumeration and
+// folder changes do.
+
+class CStubDecoder : public CImageDecoder
+{
+    private:
+        int decodeMilliseconds;
+
+    public:
+        CStubDecoder( int ms ) : decodeMilliseconds( ms ) {}
+
+        bool Decode( const WCHAR *, CDecodedImage & image )
+        {
+            this_thread::sleep_for( milliseconds( decodeMilliseconds ) );
+
+            image.width = image.fullWidth = 1024;
+            image.height = image.fullHeight = 683;
+            image.stride = image.width * 4;
+            image.stamp = 1;
+            image.pixels.reset( new BYTE[ image.Bytes() ] );
+            return true;
+        } //Decode
+}; //CStubDecoder
+
+static void TimeDecodeAhead( unsigned int workers )
+{
+    const int decodeMs = 20, dwellMs = 25, steps = 60;
+
+    struct { const char * name; int backEvery; int jumpEvery; int insertEvery; } sessions[] =
+    {
+        { "forward", 0, 0, 0 },
+        { "forward, back every 5th", 5, 0, 0 },
+        { "forward, jump every 10th", 0, 10, 0 },
+        { "forward while paths are inserted", 0, 0, 1 },
+        { "mixed, with inserts", 5, 10, 2 },
+    };
+
+    CStubDecoder decoder( decodeMs );
+
+    for ( size_t s = 0; s < _countof( sessions ); s++ )
+    {
+        vector<wstring> paths;
+        for ( int i = 0; i < 200; i++ )
+            paths.push_back( L"img" + to_wstring( i ) + L".jpg" );
+
+        CDecodeAhead decodeAhead( decoder, 64 * 1024 * 1024, 3, __max( 1u, __min( workers, 2u ) ) );
+        size_t current = 0;
+        int direction = CDecodeAhead::DirectionNext;
+        int added = 0;
+
+        for ( int step = 1; step <= steps; step++ )
+        {
+            if ( !decodeAhead.Take( paths[ current ].c_str(), 1 ) )
+                this_thread::sleep_for( milliseconds( decodeMs ) );
+
+            decodeAhead.Schedule( current, paths.size(), direction, [&] ( size_t i ) { return paths[ i ].c_str(); } );
+            this_thread::sleep_for( milliseconds( dwellMs ) );
+
+            if ( 0 != sessions[ s ].insertEvery && 0 == ( step % sessions[ s ].insertEvery ) )
+            {
+                size_t at = ( (size_t) step * 7919 ) % ( paths.size() + 1 );
+                paths.insert( paths.begin() + at, L"new" + to_wstring( added++ ) + L".jpg" );
+                if ( at <= current )
+                    current++;
+            }
+
+            if ( 0 != sessions[ s ].jumpEvery && 0 == ( step % sessions[ s ].jumpEvery ) )
+            {
+                current = ( current + paths.size() / 3 ) % paths.size();
+                direction = CDecodeAhead::DirectionNext;
+            }
+            else if ( 0 != sessions[ s ].backEvery && 0 == ( step % sessions[ s ].backEvery ) )
+            {
+                current = ( current + paths.size() - 1 ) % paths.size();
+                direction = CDecodeAhead::DirectionPrevious;
+            }
+            else
+            {
+                current = ( current + 1 ) % paths.size();
+                direction = CDecodeAhead::DirectionNext;
+            }
+        }
+
+        ULONGLONG hits, misses, decoded, wasted;
+        decodeAhead.GetStats( hits, misses, decoded, wasted );
+        fprintf( stderr, "%-34s %3llu hits, %3llu misses, %5.1lf%% hit rate, %3llu decoded, %3llu wasted\n",
+                 sessions[ s ].name, hits, misses, decodeAhead.HitRate(), decoded, wasted );
+    }
+} //TimeDecodeAhead
+
+static unsigned long long PeakMemory()
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters = { sizeof( counters ) };
+    if ( GetProcessMemoryInfo( GetCurrentProcess(), &counters, sizeof( counters ) ) )
+        return counters.PeakWorkingSetSize;
+    return 0;
+#else
+    struct rusage usage;
+    if ( 0 == getrusage( RUSAGE_SELF, &usage ) )
+        return (unsigned long long) usage.ru_maxrss * 1024;
+    return 0;
+#endif
+} //PeakMemory
+
+// -s turns a 1 GB 32bpp image 90 degrees clockwise from one temporary file to another, first with COrientStream
+// and a 64 MB budget, then all at once in memory, the way a whole-bitmap decode and encode would. Peak memory only
+// grows, so the streamed rotation goes first. The files stand in for a decoder and an encoder.
+
+static void TimeStreamedRotation( unsigned int workers )
+{
+    const int width = 16384, height = 16384, bpp = 4, orientation = 6;
+    const size_t budget = 64 * 1024 * 1024;
+    size_t stride = (size_t) width * bpp;
+    double megabytes = (double) stride * height / ( 1024.0 * 1024.0 );
+
+    FILE * source = tmpfile();
+    if ( NULL == source )
+    {
+        fprintf( stderr, "can't create a temporary file\n" );
+        return;
+    }
+
+    vector<uint8_t> row( stride );
+    for ( int y = 0; y < height; y++ )
+    {
+        for ( size_t x = 0; x < stride; x++ )
+            row[ x ] = (uint8_t) ( ( x * 7 + y * 3 ) ^ ( x >> 9 ) );
+        fwrite( row.data(), 1, stride, source );
+    }
+    vector<uint8_t>().swap( row );
+
+    fflush( source );
+    fprintf( stderr, "%d x %d, %dbpp, %.0lf MB, starting peak memory %.1lf MB\n", width, height, bpp * 8, megabytes, PeakMemory() / ( 1024.0 * 1024.0 ) );
+
+    auto readSource = [&] ( int y, int rows, uint8_t * pixels, size_t pixelStride )
+    {
+#ifdef _WIN32
+        _fseeki64( source, (long long) y * stride, SEEK_SET );
+#else
+        fseeko( source, (off_t) y * stride, SEEK_SET );
+#endif
+        for ( int r = 0; r < rows; r++ )
+            if ( stride != fread( pixels + r * pixelStride, 1, stride, source ) )
+                return false;
+
+        return true;
+    };
+
+    for ( int pass = 0; pass < 2; pass++ )
+    {
+        FILE * output = tmpfile();
+        FILE * scratch = ( 0 == pass ) ? tmpfile() : NULL;
+        size_t passBudget = ( 0 == pass ) ? budget : (size_t) -1;
+
+        auto writeOutput = [&] ( int rows, const uint8_t * pixels, size_t pixelStride )
+        {
+            return ( (size_t) rows * pixelStride == fwrite( pixels, 1, (size_t) rows * pixelStride, output ) );
+        };
+
+        high_resolution_clock::time_point t = high_resolution_clock::now();
+        bool ok = ( NULL != output ) && COrientStream::Apply( width, height, bpp, orientation, passBudget, scratch, readSource, writeOutput, workers );
+        if ( NULL != output )
+            fflush( output );
+        double seconds = duration_cast<std::chrono::nanoseconds>( high_resolution_clock::now() - t ).count() / 1000000000.0;
+
+        fprintf( stderr, "%-22s %s  %6.2lf seconds  %7.1lf MB/s  peak memory %7.1lf MB\n", ( 0 == pass ) ? "streamed, 64 MB budget" : "all at once",
+                 ok ? "ok    " : "FAILED", seconds, megabytes / seconds, PeakMemory() / ( 1024.0 * 1024.0 ) );
+
+        if ( NULL != scratch )
+            fclose( scratch );
+        if ( NULL != output )
+            fclose( output );
+    }
+
+    fclose( source );
+} //TimeStreamedRotation
+
+#ifdef PV_USE_ZLIB
+
+// Writes an uncompressed little-endian 16-bit RGB TIFF like a LibRaw export: sensor-like smooth content with noise in
+// the low bits, so compression ratios are in the range real photos get rather than that of flat or random data.
+
+static bool WriteTestTiff( FILE * fp, int width, int height )
+{
+    const int rowsPerStrip = 16;
+    int strips = ( height + rowsPerStrip - 1 ) / rowsPerStrip;
+    size_t rowBytes = (size_t) width * 6;
+    vector<uint8_t> row( rowBytes );
+    uint32_t seed = 12345;
+    uint8_t header[ 8 ] = { 'I', 'I', 42, 0, 0, 0, 0, 0 };
+    fwrite( header, 1, sizeof( header ), fp );
+
+    for ( int y = 0; y < height; y++ )
+    {
+        for ( int x = 0; x < width; x++ )
+        {
+            for ( int c = 0; c < 3; c++ )
+            {
+                seed = seed * 1103515245 + 12345;
+                double smooth = 0.5 + 0.25 * sin( x / ( 300.0 + c * 40 ) ) * cos( y / 211.0 ) + 0.2 * sin( ( x + y ) / 977.0 );
+                int v = (int) ( smooth * 16383 ) + (int) ( ( seed >> 16 ) & 63 ) - 32;
+                v = __max( 0, __min( 65535, v ) );
+                row[ x * 6 + c * 2 ] = (uint8_t) v;
+                row[ x * 6 + c * 2 + 1 ] = (uint8_t) ( v >> 8 );
+            }
+        }
+
+        if ( rowBytes != fwrite( row.data(), 1, rowBytes, fp ) )
+            return false;
+    }
+
+    // the IFD and its arrays follow the pixels
+
+    uint32_t arrays = (uint32_t) ( 8 + rowBytes * height );
+    uint32_t bitsOffset = arrays, offsetsOffset = arrays + 6, countsOffset = offsetsOffset + 4 * strips;
+    uint32_t ifdOffset = countsOffset + 4 * strips;
+    vector<uint8_t> tail;
+    auto put16 = [&] ( uint32_t v ) { tail.push_back( (uint8_t) v ); tail.push_back( (uint8_t) ( v >> 8 ) ); };
+    auto put32 = [&] ( uint32_t v ) { put16( v & 0xffff ); put16( v >> 16 ); };
+    auto entry = [&] ( uint32_t tag, uint32_t type, uint32_t count, uint32_t value ) { put16( tag ); put16( type ); put32( count ); put32( value ); };
+
+    put16( 16 ); put16( 16 ); put16( 16 );
+    for ( int s = 0; s < strips; s++ )
+        put32( (uint32_t) ( 8 + rowBytes * rowsPerStrip * s ) );
+    for ( int s = 0; s < strips; s++ )
+        put32( (uint32_t) ( rowBytes * __min( rowsPerStrip, height - s * rowsPerStrip ) ) );
+
+    put16( 10 );
+    entry( 256, 4, 1, width );
+    entry( 257, 4, 1, height );
+    entry( 258, 3, 3, bitsOffset );
+    entry( 259, 3, 1, 1 );
+    entry( 262, 3, 1, 2 );
+    entry( 273, 4, strips, offsetsOffset );
+    entry( 277, 3, 1, 3 );
+    entry( 278, 4, 1, rowsPerStrip );
+    entry( 279, 4, strips, countsOffset );
+    entry( 284, 3, 1, 1 );
+    put32( 0 );
+
+    if ( tail.size() != fwrite( tail.data(), 1, tail.size(), fp ) )
+        return false;
+
+    fseek( fp, 4, SEEK_SET );
+    uint8_t first[ 4 ] = { (uint8_t) ifdOffset, (uint8_t) ( ifdOffset >> 8 ), (uint8_t) ( ifdOffset >> 16 ), (uint8_t) ( ifdOffset >> 24 ) };
+    fwrite( first, 1, sizeof( first ), fp );
+    return ( 0 == fflush( fp ) );
+} //WriteTestTiff
+
+// -z recompresses a synthetic 60 MP 16-bit RGB TIFF with CTiffRewriter. The baseline is Deflate at zlib's default
+// level with no predictor on one thread, which is single-threaded zlib over the pixels like WIC's TIFF encoder.
+// Rates are uncompressed MB/s. The LZW level is unused.
+
+static void TimeTiffRewriter( unsigned int workers )
+{
+    const int width = 9504, height = 6336;
+    FILE * source = tmpfile();
+
+    if ( NULL == source || !WriteTestTiff( source, width, height ) )
+    {
+        fprintf( stderr, "can't write the test tiff\n" );
+        return;
+    }
+
+    fprintf( stderr, "%d x %d, 48bpp, %.0lf MB of pixels\n", width, height, (double) width * height * 6 / ( 1024.0 * 1024.0 ) );
+
+    struct { const char * name; int compression; bool predictor; int level; unsigned int threads; } runs[] =
+    {
+        { "zlib, no predictor", CTiffRewriter::CompressionDeflate, false, Z_DEFAULT_COMPRESSION, 1 },
+        { "deflate + predictor", CTiffRewriter::CompressionDeflate, true, Z_DEFAULT_COMPRESSION, 1 },
+        { "deflate + predictor", CTiffRewriter::CompressionDeflate, true, Z_BEST_SPEED, 1 },
+        { "deflate + predictor", CTiffRewriter::CompressionDeflate, true, Z_BEST_SPEED, workers },
+        { "lzw + predictor", CTiffRewriter::CompressionLZW, true, 0, 1 },
+        { "lzw + predictor", CTiffRewriter::CompressionLZW, true, 0, workers },
+    };
+
+    for ( size_t r = 0; r < _countof( runs ); r++ )
+    {
+        FILE * output = tmpfile();
+        CTiffRewriter rewriter;
+        high_resolution_clock::time_point t = high_resolution_clock::now();
+        bool ok = ( NULL != output ) && rewriter.Rewrite( source, output, runs[ r ].compression, runs[ r ].threads, runs[ r ].predictor, runs[ r ].level );
+        double seconds = duration_cast<std::chrono::nanoseconds>( high_resolution_clock::now() - t ).count() / 1000000000.0;
+        const CTiffRewriter::Stats & stats = rewriter.GetStats();
+
+        if ( ok )
+            fprintf( stderr, "%-20s level %2d x%-2u %6.2lf seconds  %7.1lf MB/s  ratio %.2lf\n", runs[ r ].name, runs[ r ].level, runs[ r ].threads, seconds,
+                     stats.pixelBytes / ( 1024.0 * 1024.0 ) / seconds, (double) stats.pixelBytes / (double) __max( 1ull, stats.dataBytes ) );
+        else
+            fprintf( stderr, "%-20s level %2d x%-2u failed: %s\n", runs[ r ].name, runs[ r ].level, runs[ r ].threads, rewriter.Error() );
+
+        if ( NULL != output )
+            fclose( output );
+    }
+
+    fclose( source );
+} //TimeTiffRewriter
+
+#endif // PV_USE_ZLIB
+
+#ifdef _WIN32
+int wmain( int argc, WCHAR * argv[] )
+#else
+int main( int argc, char * argv[] )
+#endif
+{
+    setlocale( LC_ALL, "" ); // so Linux paths convert between multibyte and wide characters
+
+    static WCHAR awcInput[ MAX_PATH ] = { 0 };
+    static WCHAR awcRoot[ MAX_PATH + 2 ] = { 0 };
+    static WCHAR awcExtension[ 100 ] = { 0 };
+
+    bool enableTracer = false;
+    bool emptyTracerFile = false;
+    bool csv = false;
+    bool mapFiles = false;
+    bool batch = false;
+    bool walkOnly = false;
+    bool resampleOnly = false;
+    bool orientOnly = false;
+    bool streamOnly = false;
+    bool tiffOnly = false;
+    bool checkOnly = false;
+    bool decodeAheadOnly = false;
+    DWORD fields = ImageMetadata::FieldAll;
+    unsigned int workers = thread::hardware_concurrency();
+
+    for ( int i = 1; i < argc; i++ )
+    {
+#ifdef _WIN32
+        const WCHAR * pwcArg = argv[ i ];
+#else
+        WCHAR awcArg[ MAX_PATH ];
+        if ( (size_t) -1 == mbstowcs( awcArg, argv[ i ], _countof( awcArg ) ) )
+            Usage();
+        awcArg[ _countof( awcArg ) - 1 ] = 0;
+        const WCHAR * pwcArg = awcArg;
+#endif
+        WCHAR a0 = pwcArg[ 0 ];
+
+        if ( L'-' == a0 )
+        {
+            WCHAR a1 = towlower( pwcArg[ 1 ] );
+
+            if ( 't' == pwcArg[ 1 ] )
+                enableTracer = true;
+            else if ( 'T' == pwcArg[ 1 ] )
+            {
+                enableTracer = true;
+                emptyTracerFile = true;
+            }
+            else if ( 'a' == a1 )
+                batch = true;
+            else if ( 'c' == a1 )
+                csv = true;
+            else if ( 'd' == a1 )
+                decodeAheadOnly = true;
+            else if ( 'k' == a1 )
+                checkOnly = true;
+            else if ( 'm' == a1 )
+                mapFiles = true;
+            else if ( 'o' == a1 )
+                orientOnly = true;
+            else if ( 'r' == a1 )
+                resampleOnly = true;
+            else if ( 's' == a1 )
+                streamOnly = true;
+            else if ( 'w' == a1 )
+                walkOnly = true;
+#ifdef PV_USE_ZLIB
+            else if ( 'z' == a1 )
+                tiffOnly = true;
+#endif
+            else if ( 'f' == a1 && ':' == pwcArg[ 2 ] )
+            {
+                if ( !ParseFields( pwcArg + 3, fields ) )
+                    Usage();
+            }
+            else if ( 'j' == a1 && ':' == pwcArg[ 2 ] )
+                workers = (unsigned int) wcstoul( pwcArg + 3, NULL, 10 );
+            else if ( 'e' == a1 && ':' == pwcArg[ 2 ] && ( wcslen( pwcArg + 3 ) < ( _countof( awcExtension ) - 1 ) ) )
+            {
+                wcscpy_s( awcExtension, _countof( awcExtension ), pwcArg + 3 );
+                for ( WCHAR * p = awcExtension; *p; p++ )
+                    *p = towlower( *p );
+            }
+            else
+                Usage();
+        }
+        else
+        {
+            if ( wcslen( pwcArg ) >= _countof( awcInput ) )
+                Usage();
+
+            wcscpy_s( awcInput, _countof( awcInput ), pwcArg );
+        }
+    }
+
+    tracer.Enable( enableTracer, L"pvmd.log", emptyTracerFile );
+
+    if ( checkOnly )
+        return SelfCheck();
+
+    if ( decodeAheadOnly )
+    {
+        TimeDecodeAhead( __max( 1u, workers ) );
+        return 0;
+    }
+
+    if ( resampleOnly )
+    {
+        TimeResampler( __max( 1u, workers ) );
+        return 0;
+    }
+
+    if ( orientOnly )
+    {
+        TimeOrientation( __max( 1u, workers ) );
+        return 0;
+    }
+
+    if ( streamOnly )
+    {
+        TimeStreamedRotation( __max( 1u, workers ) );
+        return 0;
+    }
+
+#ifdef PV_USE_ZLIB
+    if ( tiffOnly )
+    {
+        TimeTiffRewriter( __max( 1u, workers ) );
+        return 0;
+    }
+#endif
+
+    if ( 0 == awcInput[ 0 ] )
+        wcscpy_s( awcInput, _countof( awcInput ), L"." );
+
+    if ( !FullPath( awcInput, awcRoot, _countof( awcRoot ) ) )
+    {
+        fprintf( stderr, "can't resolve the path of the folder\n" );
+        Usage();
+    }
+
+    if ( 0 == workers )
+        workers = 1;
+
+    high_resolution_clock::time_point tStart = high_resolution_clock::now();
+
+    WCHAR ** pwcExtensions = (WCHAR **) imageExtensions;
+    int cExtensions = _countof( imageExtensions );
+    WCHAR * pwcExtension = awcExtension;
+    if ( 0 != awcExtension[ 0 ] )
+    {
+        pwcExtensions = &pwcExtension;
+        cExtensions = 1;
+    }
+
+    CStringArray paths;
+    CEnumFolder enumFolder( true, &paths, pwcExtensions, cExtensions );
+    enumFolder.Enumerate( awcRoot, L"*" );
+
+    high_resolution_clock::time_point tEnumerated = high_resolution_clock::now();
+
+    if ( walkOnly )
+    {
+        double walkSeconds = duration_cast<std::chrono::nanoseconds>( tEnumerated - tStart ).count() / 1000000000.0;
+        fprintf( stderr, "found %zu files in %.3lf seconds\n", paths.Count(), walkSeconds );
+
+#ifndef _WIN32
+        char acRoot[ MAX_PATH ];
+        if ( (size_t) -1 != wcstombs( acRoot, awcRoot, sizeof( acRoot ) ) )
+        {
+            size_t simpleFound = 0;
+            SimpleWalk( acRoot, pwcExtensions, cExtensions, simpleFound );
+            double simpleSeconds = duration_cast<std::chrono::nanoseconds>( high_resolution_clock::now() - tEnumerated ).count() / 1000000000.0;
+            fprintf( stderr, "a simple recursive walk found %zu files in %.3lf seconds\n", simpleFound, simpleSeconds );
+        }
+#endif
+
+        return 0;
+    }
+
+    CImageData imageData;
+    imageData.UseMappedFiles( mapFiles );
+
+    if ( csv )
+    {
+        CRecordWriter header( CRecordWriter::fmt_CSVHeader );
+        ImageMetadata md;
+        StreamStats stats = {};
+        WriteRecord( header, imageData, L"", md, stats );
+        fputs( header.End().c_str(), stdout );
+    }
+
+    // Each record is written as soon as its file is parsed, so output streams in completion order and
+    // memory doesn't grow with the size of the tree.
+
+    std::atomic<size_t> failures( 0 );
+    std::mutex outputMutex;
+    StreamStats totals = {};
+
+    auto record = [&] ( const WCHAR * pwcPath, bool ok, const ImageMetadata & md, const StreamStats & stats )
+    {
+        if ( !ok )
+        {
+            failures++;
+            tracer.Trace( "unable to open %ws\n", pwcPath );
+            return;
+        }
+
+        CRecordWriter writer( csv ? CRecordWriter::fmt_CSV : CRecordWriter::fmt_JSON );
+        WriteRecord( writer, imageData, pwcPath, md, stats );
+        const string & line = writer.End();
+
+        lock_guard<mutex> lock( outputMutex );
+        totals.Add( stats );
+        fwrite( line.data(), 1, line.length(), stdout );
+    };
+
+    if ( batch )
+    {
+        // Headers are read for many files at once ahead of the parsers. Bytes from the read-ahead
+        // aren't in the per-file counts; only what each parse read beyond them is.
+
+        vector<const WCHAR *> pathPointers( paths.Count() );
+        for ( size_t i = 0; i < paths.Count(); i++ )
+            pathPointers[ i ] = paths[ i ];
+
+        imageData.ParseMetadataBatch( pathPointers.data(), pathPointers.size(),
+                                      [&] ( size_t i, bool ok, ImageMetadata & md, const StreamStats & stats )
+                                      { record( pathPointers[ i ], ok, md, stats ); },
+                                      fields, workers );
+    }
+    else
+    {
+        // A fixed pool of workers pulls the next path and parses it with synchronous reads
+
+        std::atomic<size_t> next( 0 );
+
+        auto worker = [&] ()
+        {
+            for ( size_t i = next++; i < paths.Count(); i = next++ )
+            {
+                const WCHAR * pwcPath = paths[ i ];
+                ImageMetadata md;
+                StreamStats stats = {};
+
+                bool ok = imageData.ParseMetadata( pwcPath, md, &stats, fields );
+                record( pwcPath, ok, md, stats );
+            }
+        };
+
+        vector<thread> threads;
+        for ( unsigned int w = 1; w < workers; w++ )
+            threads.push_back( thread( worker ) );
+
+        worker();
+
+        for ( size_t t = 0; t < threads.size(); t++ )
+            threads[ t ].join();
+    }
+
+    fflush( stdout );
+
+    high_resolution_clock::time_point tEnd = high_resolution_clock::now();
+
+    size_t parsed = paths.Count() - failures;
+    double enumerateSeconds = duration_cast<std::chrono::nanoseconds>( tEnumerated - tStart ).count() / 1000000000.0;
+    double parseSeconds = duration_cast<std::chrono::nanoseconds>( tEnd - tEnumerated ).count() / 1000000000.0;
+    double perFile = ( 0 == parsed ) ? 0.0 : 1.0 / (double) parsed;
+
+    fprintf( stderr, "found %zu files in %.3lf seconds, parsed %zu in %.3lf seconds with %u workers%s: %.0lf files/sec\n",
+             paths.Count(), enumerateSeconds, parsed, parseSeconds, workers, batch ? " and header read-ahead" : "", ( parseSeconds > 0.0 ) ? parsed / parseSeconds : 0.0 );
+    fprintf( stderr, "per file with field mask %#x: %.0lf bytes read, %.1lf file reads, %.1lf seeks, %.1lf parser reads\n",
+             fields, totals.fileBytes * perFile, totals.fileReads * perFile, totals.fileSeeks * perFile, totals.reads * perFile );
+
+    // imageData counts failed parses too, broken out by the format each file turned out to be
+
+    for ( int f = 0; f < imageData.IOFormatCount(); f++ )
+    {
+        ULONGLONG formatFiles = 0;
+        StreamStats formatStats = {};
+
+        if ( imageData.GetIOStats( f, formatFiles, formatStats ) && ( 0 != formatFiles ) )
+            fprintf( stderr, "  %-7s %8llu files: %.0lf bytes, %.1lf file reads, %.1lf seeks, %.3lf ms of i/o per file\n",
+                     imageData.IOFormatName( f ), formatFiles, (double) formatStats.fileBytes / formatFiles,
+                     (double) formatStats.fileReads / formatFiles, (double) formatStats.fileSeeks / formatFiles,
+                     (double) formatStats.ioNanoseconds / 1000000.0 / formatFiles );
+    }
+
+    if ( 0 != failures )
+        fprintf( stderr, "%zu files couldn't be opened\n", (size_t) failures );
+
+    return 0;
+} //main